@@ -1,9 +1,60 @@
 #!/bin/bash
 
 OPT="-O2"
+# USDT probes when the systemtap SDT header is there
+SDT=""
+[ -f /usr/include/sys/sdt.h ] && SDT="-DHAVE_SYS_SDT_H"
 
-cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimageutil.c.o -MF nvimageutil.c.o.d -o nvimageutil.c.o -c nvimageutil.c
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimageutil.c.o -MF nvimageutil.c.o.d -o nvimageutil.c.o -c nvimageutil.c
 
-cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ gstnvimagesrc.c.o -MF gstnvimagesrc.c.o.d -o gstnvimagesrc.c.o -c gstnvimagesrc.c
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagequeue.c.o -MF nvimagequeue.c.o.d -o nvimagequeue.c.o -c nvimagequeue.c
 
-cc  -o libgstnvimagesrc.so gstnvimagesrc.c.o nvimageutil.c.o -Wl,--as-needed -Wl,--no-undefined -shared -fPIC -Wl,--start-group -Wl,-soname,libgstnvimagesrc.so -Wl,-Bsymbolic-functions /opt/gstreamer/lib/x86_64-linux-gnu/libgstbase-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstreamer-1.0.so /usr/lib/x86_64-linux-gnu/libgobject-2.0.so /usr/lib/x86_64-linux-gnu/libglib-2.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstvideo-1.0.so /usr/lib/x86_64-linux-gnu/libX11.so -lnvcuvid -lnvidia-encode -lnvidia-fbc -lGL -lpthread -Wl,--end-group
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagememory.c.o -MF nvimagememory.c.o.d -o nvimagememory.c.o -c nvimagememory.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagepool.c.o -MF nvimagepool.c.o.d -o nvimagepool.c.o -c nvimagepool.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagepacer.c.o -MF nvimagepacer.c.o.d -o nvimagepacer.c.o -c nvimagepacer.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagebwe.c.o -MF nvimagebwe.c.o.d -o nvimagebwe.c.o -c nvimagebwe.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimageshed.c.o -MF nvimageshed.c.o.d -o nvimageshed.c.o -c nvimageshed.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimageh264.c.o -MF nvimageh264.c.o.d -o nvimageh264.c.o -c nvimageh264.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagecpu.c.o -MF nvimagecpu.c.o.d -o nvimagecpu.c.o -c nvimagecpu.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagestats.c.o -MF nvimagestats.c.o.d -o nvimagestats.c.o -c nvimagestats.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagetrace.c.o -MF nvimagetrace.c.o.d -o nvimagetrace.c.o -c nvimagetrace.c
+
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ gstnvimagesrc.c.o -MF gstnvimagesrc.c.o.d -o gstnvimagesrc.c.o -c gstnvimagesrc.c
+
+cc  -o libgstnvimagesrc.so gstnvimagesrc.c.o nvimageutil.c.o nvimagequeue.c.o nvimagememory.c.o nvimagepool.c.o nvimagepacer.c.o nvimagebwe.c.o nvimageshed.c.o nvimageh264.c.o nvimagecpu.c.o nvimagestats.c.o nvimagetrace.c.o -Wl,--as-needed -Wl,--no-undefined -shared -fPIC -Wl,--start-group -Wl,-soname,libgstnvimagesrc.so -Wl,-Bsymbolic-functions /opt/gstreamer/lib/x86_64-linux-gnu/libgstbase-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstreamer-1.0.so /usr/lib/x86_64-linux-gnu/libgobject-2.0.so /usr/lib/x86_64-linux-gnu/libglib-2.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstvideo-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstgl-1.0.so /usr/lib/x86_64-linux-gnu/libX11.so -lXext -lXfixes -lXdamage -lx264 -lGL -ldl -lpthread -Wl,--end-group
+
+# "./build.sh stub" also builds stand-ins for the NvFBC and NVENC libraries,
+# run with LD_LIBRARY_PATH=$PWD/stub and NVIMAGE_STUB, see nvimagestub.c
+if [ "$1" = "stub" ] || [ "$1" = "check" ]; then
+mkdir -p stub
+cc -I. -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -Wall $OPT -g -fvisibility=hidden -fPIC -shared -Wl,-soname,libnvidia-fbc.so.1 -o stub/libnvidia-fbc.so.1 nvimagestub.c /usr/lib/x86_64-linux-gnu/libglib-2.0.so -lGL
+ln -sf libnvidia-fbc.so.1 stub/libnvidia-encode.so.1
+fi
+
+# "./build.sh bench" also builds nvimagebench, which prints the throughput
+# and latency percentiles of every stage as JSON, see nvimagebench.c
+if [ "$1" = "bench" ]; then
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fvisibility=hidden -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -fPIC -pthread -DHAVE_CONFIG_H -MD -MQ nvimagebench.c.o -MF nvimagebench.c.o.d -o nvimagebench.c.o -c nvimagebench.c
+cc  -o nvimagebench nvimagebench.c.o gstnvimagesrc.c.o nvimageutil.c.o nvimagequeue.c.o nvimagememory.c.o nvimagepool.c.o nvimagepacer.c.o nvimagebwe.c.o nvimageshed.c.o nvimageh264.c.o nvimagecpu.c.o nvimagestats.c.o nvimagetrace.c.o -Wl,--as-needed -Wl,--no-undefined -Wl,--start-group -Wl,-Bsymbolic-functions /opt/gstreamer/lib/x86_64-linux-gnu/libgstbase-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstreamer-1.0.so /usr/lib/x86_64-linux-gnu/libgobject-2.0.so /usr/lib/x86_64-linux-gnu/libglib-2.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstvideo-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstgl-1.0.so /usr/lib/x86_64-linux-gnu/libX11.so -lXext -lXfixes -lXdamage -lx264 -lGL -ldl -lpthread -Wl,--end-group
+fi
+
+# "./build.sh check" also builds the tests in tests/ and runs them against
+# the stub, on the X server of DISPLAY (Xvfb will do)
+if [ "$1" = "check" ]; then
+for t in nvimagesrc nvimagepacer; do
+cc -I. -I/src/gstreamer/subprojects/gst-plugins-base/gst-libs -I/opt/gstreamer/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -fdiagnostics-color=always -D_FILE_OFFSET_BITS=64 -Wall -Winvalid-pch $OPT $SDT -g -fno-strict-aliasing -DG_DISABLE_DEPRECATED -Wmissing-declarations -Wredundant-decls -Wwrite-strings -Winit-self -Wmissing-include-dirs -Wno-multichar -Wvla -Wpointer-arith -Wmissing-prototypes -Wdeclaration-after-statement -Wold-style-definition -Waggregate-return -pthread -DHAVE_CONFIG_H -o tests/$t tests/$t.c gstnvimagesrc.c.o nvimageutil.c.o nvimagequeue.c.o nvimagememory.c.o nvimagepool.c.o nvimagepacer.c.o nvimagebwe.c.o nvimageshed.c.o nvimageh264.c.o nvimagecpu.c.o nvimagestats.c.o nvimagetrace.c.o -Wl,--as-needed -Wl,--no-undefined -Wl,--start-group /opt/gstreamer/lib/x86_64-linux-gnu/libgstcheck-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstbase-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstreamer-1.0.so /usr/lib/x86_64-linux-gnu/libgobject-2.0.so /usr/lib/x86_64-linux-gnu/libglib-2.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstvideo-1.0.so /opt/gstreamer/lib/x86_64-linux-gnu/libgstgl-1.0.so /usr/lib/x86_64-linux-gnu/libX11.so -lXext -lXfixes -lXdamage -lx264 -lGL -ldl -lpthread -Wl,--end-group || exit 1
+done
+status=0
+for t in nvimagesrc nvimagepacer; do
+LD_LIBRARY_PATH=$PWD/stub tests/$t || status=1
+done
+exit $status
+fi
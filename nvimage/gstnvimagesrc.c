@@ -49,18 +49,43 @@
 
 #include <gst/gst.h>
 #include <gst/video/video.h>
+#include <gst/gl/gl.h>
 
 GST_DEBUG_CATEGORY_STATIC (gst_debug_nvimage_src);
 #define GST_CAT_DEFAULT gst_debug_nvimage_src
 
+/* what NvFBC converts to in system memory */
+#define NVIMAGE_RAW_FORMATS "NV12, BGRA, RGBA, Y444"
+
 static GstStaticPadTemplate t =
 GST_STATIC_PAD_TEMPLATE ("src", GST_PAD_SRC, GST_PAD_ALWAYS,
     GST_STATIC_CAPS ("video/x-h264, "
         "framerate = (fraction) [ 0, MAX ], "
         "width = (int) [ 145, 4096 ], " "height = (int) [ 49, 4095 ], "
 	"stream-format = (string) byte-stream, "
-	"alignment = (string) au, "
-	"profile = (string) { main, high, high-4:4:4, baseline }"));
+	"alignment = (string) { au, nal }, "
+	"profile = (string) { main, high, high-4:4:4, baseline }; "
+        "video/x-h265, "
+        "framerate = (fraction) [ 0, MAX ], "
+        "width = (int) [ 145, 4096 ], " "height = (int) [ 49, 4095 ], "
+	"stream-format = (string) byte-stream, "
+	"alignment = (string) { au, nal }, "
+	"profile = (string) main; "
+        "video/x-av1, "
+        "framerate = (fraction) [ 0, MAX ], "
+        "width = (int) [ 145, 4096 ], " "height = (int) [ 49, 4095 ], "
+	"stream-format = (string) obu-stream, "
+	"alignment = (string) tu, "
+	"profile = (string) main; "
+        "video/x-raw(" GST_CAPS_FEATURE_MEMORY_GL_MEMORY "), "
+        "format = (string) RGBA, "
+        "texture-target = (string) 2D, "
+        "framerate = (fraction) [ 0, MAX ], "
+        "width = (int) [ 1, 4096 ], " "height = (int) [ 1, 4096 ]; "
+        "video/x-raw, "
+        "format = (string) { " NVIMAGE_RAW_FORMATS " }, "
+        "framerate = (fraction) [ 0, MAX ], "
+        "width = (int) [ 1, 4096 ], " "height = (int) [ 1, 4096 ]"));
 
 enum
 {
@@ -69,8 +94,111 @@ enum
         PROP_SHOW_POINTER,
         PROP_BITRATE,
         PROP_FPS,
+        PROP_MAX_FRAMES_IN_FLIGHT,
+        PROP_QUEUE_SIZE,
+        PROP_QUEUE_POLICY,
+        PROP_ZERO_COPY_BUFFERS,
+        PROP_ALLOCATIONS,
+        PROP_KEYFRAME_MIN_INTERVAL,
+        PROP_PACING,
+        PROP_FRAMES_LATE,
+        PROP_FRAMES_DROPPED,
+        PROP_FRAMES_DUPLICATED,
+        PROP_SKIP_UNCHANGED,
+        PROP_HEARTBEAT,
+        PROP_FRAMES_SKIPPED,
+        PROP_REPEAT_UNCHANGED,
+        PROP_STARTX,
+        PROP_STARTY,
+        PROP_ENDX,
+        PROP_ENDY,
+        PROP_XID,
+        PROP_XNAME,
+        PROP_MONITOR,
+        PROP_CAPTURE_GROUP,
+        PROP_BACKEND,
+        PROP_STATS,
+        PROP_STATS_INTERVAL,
+        PROP_CONGESTION_CONTROL,
+        PROP_MIN_BITRATE,
+        PROP_MAX_BITRATE,
+        PROP_BITRATE_RAMP_UP,
+        PROP_BITRATE_RAMP_DOWN,
+        PROP_LOAD_SHEDDING,
+        PROP_LOAD_HIGH,
+        PROP_LOAD_LOW,
+        PROP_SLICES,
 };
 
+#define GST_TYPE_NVIMAGE_SRC_QUEUE_POLICY (gst_nvimage_src_queue_policy_get_type ())
+static GType
+gst_nvimage_src_queue_policy_get_type (void)
+{
+        static GType policy_type = 0;
+        static const GEnumValue policies[] = {
+                {GST_NVIMAGE_QUEUE_BLOCK, "Wait for downstream to catch up", "block"},
+                {GST_NVIMAGE_QUEUE_DROP_OLDEST, "Drop the oldest queued frame", "drop-oldest"},
+                {0, NULL, NULL},
+        };
+
+        if (!policy_type) {
+                policy_type = g_enum_register_static ("GstNVimageSrcQueuePolicy", policies);
+        }
+        return policy_type;
+}
+
+#define GST_TYPE_NVIMAGE_SRC_PACING (gst_nvimage_src_pacing_get_type ())
+static GType
+gst_nvimage_src_pacing_get_type (void)
+{
+        static GType pacing_type = 0;
+        static const GEnumValue pacings[] = {
+                {GST_NVIMAGE_PACING_DROP, "Skip the frames that were missed", "drop"},
+                {GST_NVIMAGE_PACING_DUPLICATE, "Catch up on missed frames without waiting", "duplicate"},
+                {0, NULL, NULL},
+        };
+
+        if (!pacing_type) {
+                pacing_type = g_enum_register_static ("GstNVimageSrcPacing", pacings);
+        }
+        return pacing_type;
+}
+
+#define GST_TYPE_NVIMAGE_SRC_CONGESTION_CONTROL (gst_nvimage_src_congestion_control_get_type ())
+static GType
+gst_nvimage_src_congestion_control_get_type (void)
+{
+        static GType congestion_control_type = 0;
+        static const GEnumValue algorithms[] = {
+                {GST_NVIMAGE_CONGESTION_NONE, "Encode at the bitrate property", "none"},
+                {GST_NVIMAGE_CONGESTION_GCC, "Google Congestion Control on TWCC feedback and QoS", "gcc"},
+                {0, NULL, NULL},
+        };
+
+        if (!congestion_control_type) {
+                congestion_control_type = g_enum_register_static ("GstNVimageSrcCongestionControl", algorithms);
+        }
+        return congestion_control_type;
+}
+
+#define GST_TYPE_NVIMAGE_SRC_BACKEND (gst_nvimage_src_backend_get_type ())
+static GType
+gst_nvimage_src_backend_get_type (void)
+{
+        static GType backend_type = 0;
+        static const GEnumValue backends[] = {
+                {GST_NVIMAGE_BACKEND_AUTO, "NvFBC and NVENC, the CPU when they are not available", "auto"},
+                {GST_NVIMAGE_BACKEND_NVFBC, "NvFBC capture and NVENC encode", "nvfbc"},
+                {GST_NVIMAGE_BACKEND_CPU, "XShm capture and x264 encode", "cpu"},
+                {0, NULL, NULL},
+        };
+
+        if (!backend_type) {
+                backend_type = g_enum_register_static ("GstNVimageSrcBackend", backends);
+        }
+        return backend_type;
+}
+
 #define gst_nvimage_src_parent_class parent_class
 G_DEFINE_TYPE (GstNVimageSrc, gst_nvimage_src, GST_TYPE_PUSH_SRC);
 
@@ -79,13 +207,73 @@ static GstCaps *gst_nvimage_src_fixate (GstBaseSrc * bsrc, GstCaps * caps);
 static gboolean
 gst_nvimage_src_open_display (GstNVimageSrc * s, const gchar * name)
 {
+        NVFBC_BOX region = { 0, 0, 0, 0 };
+        Window xid;
+        gchar *xname, *monitor, *group;
+        GstNVimageBackendType backend;
+
         g_return_val_if_fail (GST_IS_NVIMAGE_SRC (s), FALSE);
 
-        if (s->xcontext != NULL)
+        if (s->xcontext != NULL || s->rendition != NULL)
                 return TRUE;
 
-        s->xcontext = nvimageutil_xcontext_get_r (GST_ELEMENT (s), name);
+        GST_OBJECT_LOCK (s);
+        group = g_strdup (s->capture_group);
+        region.x = s->x;
+        region.y = s->y;
+        if (s->endx > s->x)
+                region.w = s->endx - s->x + 1;
+        else if (s->endx)
+                GST_WARNING_OBJECT (s, "endx %u left of startx %u, capturing to the screen edge", s->endx, s->x);
+        if (s->endy > s->y)
+                region.h = s->endy - s->y + 1;
+        else if (s->endy)
+                GST_WARNING_OBJECT (s, "endy %u above starty %u, capturing to the screen edge", s->endy, s->y);
+        GST_OBJECT_UNLOCK (s);
+
+        /* Another element already captures for the group, just encode its
+           grabs. Renditions take the grab as is, at the size of the
+           leader: a region of another size cannot be encoded. */
+        if (group) {
+                s->rendition = nvimageutil_group_join (group, s->bitrate, MAX (s->queue_size, 2),
+                                                       &s->width, &s->height, &s->codec);
+                if (s->rendition && ((region.w && region.w != s->width) ||
+                                     (region.h && region.h != s->height))) {
+                        GST_ELEMENT_ERROR (s, RESOURCE, SETTINGS,
+                                           ("Capture group %s encodes at %dx%d, cannot scale to %ux%u",
+                                            group, s->width, s->height, region.w ? region.w : s->width,
+                                            region.h ? region.h : s->height),
+                                           ("members of a capture group only differ in bitrate"));
+                        nvimageutil_group_leave (s->rendition);
+                        s->rendition = NULL;
+                        g_free (group);
+                        return FALSE;
+                }
+                if (s->rendition) {
+                        GST_INFO_OBJECT (s, "Joined capture group %s, %dx%d", group, s->width, s->height);
+                        g_free (group);
+                        return TRUE;
+                }
+        }
+
+        GST_OBJECT_LOCK (s);
+        xid = s->xid;
+        xname = g_strdup (s->xname);
+        monitor = g_strdup (s->monitor);
+        backend = s->backend;
+        GST_OBJECT_UNLOCK (s);
+
+        /* windows are found in screen coordinates */
+        if (monitor && (xid || xname)) {
+                GST_WARNING_OBJECT (s, "Capturing a window, ignoring monitor %s", monitor);
+                g_clear_pointer (&monitor, g_free);
+        }
+
+        s->xcontext = nvimageutil_xcontext_get_r (GST_ELEMENT (s), name, &region, xid, xname, monitor, backend);
+        g_free (xname);
+        g_free (monitor);
         if (s->xcontext == NULL) {
+                g_free (group);
                 GST_ELEMENT_ERROR (s, RESOURCE, OPEN_READ,
                                    ("Could not open X display for reading"),
                                    ("NULL returned from getting xcontext"));
@@ -94,6 +282,11 @@ gst_nvimage_src_open_display (GstNVimageSrc * s, const gchar * name)
         s->width = s->xcontext->width;
         s->height = s->xcontext->height;
 
+        if (group && !nvimageutil_group_lead (s->xcontext, group))
+                GST_WARNING_OBJECT (s, "Cannot lead capture group %s, started meanwhile or no NVENC, "
+                                    "capturing on our own", group);
+        g_free (group);
+
         if (s->xcontext == NULL)
                 return FALSE;
 
@@ -105,8 +298,19 @@ gst_nvimage_src_start (GstBaseSrc * basesrc)
 {
         GstNVimageSrc *s = GST_NVIMAGE_SRC (basesrc);
 
-        s->last_frame_no = -1;
+        gst_nvimage_pacer_reset (&s->pacer);
+        gst_nvimage_bwe_reset (&s->bwe);
+        gst_nvimage_shed_reset (&s->shed);
         s->frame = 0;
+        s->flowing = FALSE;
+        gst_clear_event (&s->deferred);
+        s->pushed = 0;
+        s->last_stats = g_get_monotonic_time ();
+        s->last_keyframe = GST_CLOCK_TIME_NONE;
+        s->keyframe_announce = FALSE;
+        s->last_pts = GST_CLOCK_TIME_NONE;
+        s->latency = GST_CLOCK_TIME_NONE;
+        s->reported_latency = GST_CLOCK_TIME_NONE;
         return gst_nvimage_src_open_display (s, s->display_name);
 }
 
@@ -116,8 +320,71 @@ gst_nvimage_src_stop (GstBaseSrc * basesrc)
         GstNVimageSrc *src = GST_NVIMAGE_SRC (basesrc);
 
         src->frame = 0;
-        nvimageutil_xcontext_clear_r (src->xcontext);
-        src->xcontext = NULL;
+        src->flowing = FALSE;
+        gst_clear_event (&src->deferred);
+        src->producing = FALSE;
+        if (src->rendition) {
+                nvimageutil_group_leave (src->rendition);
+                src->rendition = NULL;
+        }
+        if (src->xcontext) {
+                nvimageutil_xcontext_clear_r (src->xcontext);
+                src->xcontext = NULL;
+        }
+        gst_clear_object (&src->gl_context);
+        gst_clear_object (&src->other_context);
+        gst_clear_object (&src->gl_display);
+        return TRUE;
+}
+
+static void
+gst_nvimage_src_set_context (GstElement * element, GstContext * context)
+{
+        GstNVimageSrc *src = GST_NVIMAGE_SRC (element);
+
+        gst_gl_handle_set_context (element, context, &src->gl_display, &src->other_context);
+
+        GST_ELEMENT_CLASS (parent_class)->set_context (element, context);
+}
+
+/* Creates the GstGL context GL frames are copied in. It shares the textures
+   of the capture's GLX context, downstream gets it with the context query. */
+static gboolean
+gst_nvimage_src_ensure_gl_context (GstNVimageSrc * src)
+{
+        GstGLContext *capture;
+        GError *error = NULL;
+        gboolean ret;
+
+        if (src->gl_context)
+                return TRUE;
+
+        if (!gst_gl_ensure_element_data (src, &src->gl_display, &src->other_context))
+                return FALSE;
+
+        capture = gst_gl_context_new_wrapped (src->gl_display, (guintptr) src->xcontext->glxctx,
+                                              GST_GL_PLATFORM_GLX, GST_GL_API_OPENGL);
+        if (capture == NULL) {
+                GST_ELEMENT_ERROR (src, RESOURCE, NOT_FOUND,
+                                   ("Could not wrap the GLX context of the capture"), (NULL));
+                return FALSE;
+        }
+
+        GST_OBJECT_LOCK (src->gl_display);
+        ret = gst_gl_display_create_context (src->gl_display, capture, &src->gl_context, &error) &&
+              gst_gl_display_add_context (src->gl_display, src->gl_context);
+        GST_OBJECT_UNLOCK (src->gl_display);
+        gst_object_unref (capture);
+
+        if (!ret) {
+                GST_ELEMENT_ERROR (src, RESOURCE, NOT_FOUND,
+                                   ("Could not create a GL context sharing the capture"),
+                                   ("%s", error ? error->message : "unknown error"));
+                g_clear_error (&error);
+                gst_clear_object (&src->gl_context);
+                return FALSE;
+        }
+
         return TRUE;
 }
 
@@ -127,29 +394,349 @@ gst_nvimage_src_unlock (GstBaseSrc * basesrc)
         GstNVimageSrc *src = GST_NVIMAGE_SRC (basesrc);
 
         /* Awaken the create() func if it's waiting on the clock */
-        GST_OBJECT_LOCK (src);
-        if (src->clock_id) {
-                GST_DEBUG_OBJECT (src, "Waking up waiting clock");
-                gst_clock_id_unschedule (src->clock_id);
+        GST_DEBUG_OBJECT (src, "Waking up waiting clock");
+        gst_nvimage_pacer_set_flushing (&src->pacer, TRUE);
+
+        /* and the one waiting for the producer */
+        if (src->xcontext)
+                nvimageutil_producer_set_flushing (src->xcontext, TRUE);
+        if (src->rendition)
+                nvimageutil_rendition_set_flushing (src->rendition, TRUE);
+
+        return TRUE;
+}
+
+static gboolean
+gst_nvimage_src_unlock_stop (GstBaseSrc * basesrc)
+{
+        GstNVimageSrc *src = GST_NVIMAGE_SRC (basesrc);
+
+        gst_nvimage_pacer_set_flushing (&src->pacer, FALSE);
+        if (src->xcontext)
+                nvimageutil_producer_set_flushing (src->xcontext, FALSE);
+        if (src->rendition)
+                nvimageutil_rendition_set_flushing (src->rendition, FALSE);
+
+        /* After a flush basesrc sends a new segment with the next buffer.
+           Going back to PLAYING ends up here as well, which only holds the
+           events back until the next buffer. */
+        src->flowing = FALSE;
+        gst_clear_event (&src->deferred);
+
+        return TRUE;
+}
+
+/* Sends a serialized event downstream. Until a buffer went out after the
+   start or a flush, there is no segment for it to follow: a gap is dropped,
+   the buffer starts the stream anyway, anything else waits for the buffer. */
+static void
+gst_nvimage_src_push_event (GstNVimageSrc * s, GstEvent * event)
+{
+        if (s->flowing) {
+                gst_pad_push_event (GST_BASE_SRC_PAD (s), event);
+        } else if (GST_EVENT_TYPE (event) == GST_EVENT_GAP) {
+                GST_LOG_OBJECT (s, "No segment yet, dropping %" GST_PTR_FORMAT, event);
+                gst_event_unref (event);
+        } else {
+                GST_LOG_OBJECT (s, "No segment yet, deferring %" GST_PTR_FORMAT, event);
+                gst_clear_event (&s->deferred);
+                s->deferred = event;
         }
+}
+
+/* Folds the capture to output delay of a frame into the measured latency.
+   The pipeline is asked to query it again when it outgrew what was
+   reported, or became clearly smaller. */
+static void
+gst_nvimage_src_update_latency (GstNVimageSrc * src, GstClockTime sample)
+{
+        gboolean changed;
+
+        GST_OBJECT_LOCK (src);
+        if (GST_CLOCK_TIME_IS_VALID (src->latency))
+                src->latency = (src->latency * 7 + sample) / 8;
+        else
+                src->latency = sample;
+
+        changed = GST_CLOCK_TIME_IS_VALID (src->reported_latency) &&
+                (src->latency > src->reported_latency + 2 * GST_MSECOND ||
+                 src->latency * 4 < src->reported_latency * 3);
+        if (changed)
+                src->reported_latency = GST_CLOCK_TIME_NONE;
         GST_OBJECT_UNLOCK (src);
 
-        return TRUE;
+        if (changed) {
+                GST_DEBUG_OBJECT (src, "latency changed to %" GST_TIME_FORMAT, GST_TIME_ARGS (src->latency));
+                gst_element_post_message (GST_ELEMENT_CAST (src),
+                                gst_message_new_latency (GST_OBJECT_CAST (src)));
+        }
+}
+
+static gboolean
+gst_nvimage_src_query (GstBaseSrc * bsrc, GstQuery * query)
+{
+        GstNVimageSrc *src = GST_NVIMAGE_SRC (bsrc);
+        GstClockTime frame, min_latency, max_latency;
+
+        switch (GST_QUERY_TYPE (query)) {
+                case GST_QUERY_LATENCY:
+                        GST_OBJECT_LOCK (src);
+                        if (src->fps_n <= 0 || src->fps_d <= 0) {
+                                GST_OBJECT_UNLOCK (src);
+                                return FALSE;
+                        }
+                        frame = gst_util_uint64_scale_int (GST_SECOND, src->fps_d, src->fps_n);
+                        /* Until a frame went out, assume a frame each for
+                           capture and encode */
+                        min_latency = GST_CLOCK_TIME_IS_VALID (src->latency) ? src->latency : 2 * frame;
+                        src->reported_latency = min_latency;
+                        /* the producer queue may hold that many more */
+                        max_latency = min_latency + src->queue_size * frame;
+                        GST_OBJECT_UNLOCK (src);
+
+                        GST_DEBUG_OBJECT (src, "latency min %" GST_TIME_FORMAT " max %" GST_TIME_FORMAT,
+                                          GST_TIME_ARGS (min_latency), GST_TIME_ARGS (max_latency));
+                        gst_query_set_latency (query, TRUE, min_latency, max_latency);
+                        return TRUE;
+                case GST_QUERY_CONTEXT:
+                        /* downstream GL elements share our context */
+                        if (gst_gl_handle_context_query (GST_ELEMENT (src), query, src->gl_display,
+                                                         src->gl_context, src->other_context))
+                                return TRUE;
+                        return GST_BASE_SRC_CLASS (parent_class)->query (bsrc, query);
+                default:
+                        return GST_BASE_SRC_CLASS (parent_class)->query (bsrc, query);
+        }
+}
+
+/* Called with the object lock. Returns the keyframe flags for a picture
+   captured at @running_time, consuming the pending request once it is due
+   and the rate limit allows it. */
+static gint
+gst_nvimage_src_take_keyframe (GstNVimageSrc * src, GstClockTime running_time)
+{
+        gint flags;
+
+        if (!src->keyframe)
+                return 0;
+
+        if (GST_CLOCK_TIME_IS_VALID (src->keyframe_running_time) &&
+            running_time < src->keyframe_running_time)
+                return 0;
+
+        if (GST_CLOCK_TIME_IS_VALID (src->last_keyframe) &&
+            running_time < src->last_keyframe + src->keyframe_min_interval * GST_MSECOND)
+                return 0;
+
+        flags = NVIMAGE_KEYFRAME_FORCE;
+        if (src->keyframe_all_headers)
+                flags |= NVIMAGE_KEYFRAME_HEADERS;
+
+        src->keyframe_announce = TRUE;
+        src->announce_running_time = running_time;
+        src->announce_all_headers = src->keyframe_all_headers;
+        src->announce_count = src->keyframe_count;
+
+        src->keyframe = FALSE;
+        src->keyframe_running_time = GST_CLOCK_TIME_NONE;
+        src->keyframe_all_headers = FALSE;
+        src->last_keyframe = running_time;
+
+        return flags;
+}
+
+/* The stats of our capture context, with the counters of the pacer */
+static GstStructure *
+gst_nvimage_src_stats (GstNVimageSrc * src)
+{
+        GstStructure *stats;
+        guint late, dropped, duplicated;
+        guint received_rate, overuses;
+        gdouble loss;
+
+        if (src->xcontext == NULL)
+                return NULL;
+
+        stats = gst_nvimage_stats_to_structure (nvimageutil_get_stats (src->xcontext), "nvimagesrc-stats");
+        gst_nvimage_pacer_get_stats (&src->pacer, &late, &dropped, &duplicated);
+        gst_structure_set (stats,
+                           "frames-skipped", G_TYPE_UINT, nvimageutil_get_skipped (src->xcontext),
+                           "frames-late", G_TYPE_UINT, late,
+                           "frames-dropped", G_TYPE_UINT, dropped,
+                           "frames-duplicated", G_TYPE_UINT, duplicated, NULL);
+
+        if (src->congestion_control != GST_NVIMAGE_CONGESTION_NONE) {
+                gst_nvimage_bwe_get_stats (&src->bwe, &received_rate, &loss, &overuses);
+                gst_structure_set (stats,
+                                   "target-bitrate", G_TYPE_UINT, gst_nvimage_bwe_get_bitrate (&src->bwe),
+                                   "received-bitrate", G_TYPE_UINT, received_rate,
+                                   "packet-loss", G_TYPE_DOUBLE, loss,
+                                   "congestion-events", G_TYPE_UINT, overuses, NULL);
+        }
+
+        if (src->load_shedding)
+                gst_structure_set (stats,
+                                   "load", G_TYPE_DOUBLE, src->shed.load,
+                                   "shed-level", G_TYPE_UINT, (guint) g_atomic_int_get (&src->shed.level), NULL);
+
+        return stats;
+}
+
+/* A picture on its way downstream, whole or a slice at a time */
+typedef struct {
+        GstNVimageSrc *src;
+        /* the pipeline and monotonic clocks sampled together */
+        GstClockTime base_time;
+        GstClockTime pts;
+        gint64 now_us;
+        GstClockTime dur;
+        /* the timestamp of the picture, once its first slice got one */
+        GstClockTime ts;
+        /* slices of the first picture since the start or a flush, they go
+           out after the segment */
+        GstBufferList *pending;
+} GstNVimageSrcPicture;
+
+/* Announces what comes with the first buffer of a picture: new caps when
+   the session was rebuilt for another size or codec, and the answer to a
+   forced keyframe */
+static GstFlowReturn
+gst_nvimage_src_announce (GstNVimageSrc * s, GstBuffer * image)
+{
+        GstMetaNVimage *meta;
+
+        /* A followed window changed size, or the leader of our group changed
+           codecs: the session was rebuilt and this IDR is the first picture
+           of the new stream, announce it first */
+        meta = GST_META_NVIMAGE_GET (image);
+        if (meta && meta->width && (meta->width != s->width || meta->height != s->height ||
+                                    (s->rendition && meta->codec != s->codec))) {
+                GST_INFO_OBJECT (s, "Capture changed from %dx%d to %dx%d, renegotiating",
+                                 s->width, s->height, meta->width, meta->height);
+                GST_OBJECT_LOCK (s);
+                s->width = meta->width;
+                s->height = meta->height;
+                if (s->rendition)
+                        s->codec = meta->codec;
+                GST_OBJECT_UNLOCK (s);
+                if (!gst_base_src_negotiate (GST_BASE_SRC (s)))
+                        return GST_FLOW_NOT_NEGOTIATED;
+        }
+
+        /* The first IDR after a forced one was requested is the answer,
+           whether it came from the request or the GOP */
+        if (s->keyframe_announce && !GST_BUFFER_FLAG_IS_SET (image, GST_BUFFER_FLAG_DELTA_UNIT)) {
+                s->keyframe_announce = FALSE;
+                GST_LOG_OBJECT (s, "Forced keyframe out, running time %" GST_TIME_FORMAT,
+                                GST_TIME_ARGS (s->announce_running_time));
+                gst_nvimage_src_push_event (s,
+                                gst_video_event_new_downstream_force_key_unit (GST_CLOCK_TIME_NONE,
+                                                GST_CLOCK_TIME_NONE, s->announce_running_time,
+                                                s->announce_all_headers, s->announce_count));
+        }
+
+        return GST_FLOW_OK;
+}
+
+/* Timestamps a picture, or a slice of it, with when it was captured */
+static void
+gst_nvimage_src_stamp (GstNVimageSrcPicture * picture, GstBuffer * buffer)
+{
+        GstNVimageSrc *s = picture->src;
+        GstMetaNVimage *meta;
+        GstClockTimeDiff capture_ts;
+        gint64 capture_us;
+
+        if (!GST_CLOCK_TIME_IS_VALID (picture->ts)) {
+                /* The frame is as old on the pipeline clock as it is on the
+                   monotonic clock its capture time was mapped to, both were
+                   sampled together */
+                meta = GST_META_NVIMAGE_GET (buffer);
+                capture_us = meta && meta->capture_time ? meta->capture_time : picture->now_us;
+                capture_ts = GST_CLOCK_DIFF (picture->base_time, picture->pts) -
+                             (picture->now_us - capture_us) * GST_USECOND;
+                if (capture_ts < 0)
+                        capture_ts = 0;
+                /* keep timestamps strictly increasing across clock jitter */
+                if (GST_CLOCK_TIME_IS_VALID (s->last_pts) && (GstClockTime) capture_ts <= s->last_pts)
+                        capture_ts = s->last_pts + 1;
+                s->last_pts = picture->ts = capture_ts;
+        }
+
+        /* no B-frames, decode order is presentation order */
+        GST_BUFFER_PTS (buffer) = picture->ts;
+        GST_BUFFER_DTS (buffer) = picture->ts;
+        GST_BUFFER_DURATION (buffer) = picture->dur;
+}
+
+/* Sends a slice of the picture being read back ahead of the rest */
+static GstFlowReturn
+gst_nvimage_src_push_slice (GstBuffer * slice, gpointer user_data)
+{
+        GstNVimageSrcPicture *picture = user_data;
+        GstNVimageSrc *s = picture->src;
+        GstFlowReturn ret;
+
+        if (!GST_CLOCK_TIME_IS_VALID (picture->ts)) {
+                ret = gst_nvimage_src_announce (s, slice);
+                if (ret != GST_FLOW_OK) {
+                        gst_buffer_unref (slice);
+                        return ret;
+                }
+        }
+        gst_nvimage_src_stamp (picture, slice);
+
+        /* basesrc sends the segment ahead of the first buffer it pushes
+           after the start or a flush */
+        if (!s->flowing) {
+                if (picture->pending == NULL)
+                        picture->pending = gst_buffer_list_new ();
+                gst_buffer_list_add (picture->pending, slice);
+                return GST_FLOW_OK;
+        }
+
+        GST_LOG_OBJECT (s, "Sending slice of %" G_GSIZE_FORMAT " bytes", gst_buffer_get_size (slice));
+        return gst_pad_push (GST_BASE_SRC_PAD (s), slice);
 }
 
 static GstFlowReturn
 gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
 {
         GstNVimageSrc *s = GST_NVIMAGE_SRC (bs);
-        GstBuffer *image;
+        GstBuffer *image = NULL;
         GstClockTime base_time;
         GstClockTime next_capture_ts, pts;
         GstClockTime dur;
+        GstMetaNVimage *meta;
+        GstVideoMeta *vmeta;
+        GstClock *clock;
+        GstClockReturn cret;
+        GstNVimagePacingPolicy pacing;
+        GstStructure *shed;
+        gboolean load_shedding, paced;
+        guint load_high, load_low, bitrate;
+        gint fps_n, fps_d, pace_n, pace_d;
         gint64 next_frame_no;
+        gint64 now_us, capture_us;
 	gint32 _keyframe;
+        GstNVimageParams params;
+        GstNVimageStats *stats;
+        GstNVimageSrcPicture picture;
+        GstFlowReturn ret;
 
         GST_DEBUG_OBJECT (s, "Nvimage src create");
 
+        /* we are called again once downstream is done with the last buffer */
+        stats = s->xcontext ? nvimageutil_get_stats (s->xcontext) : NULL;
+        gst_nvimage_stats_since (stats, GST_NVIMAGE_STAGE_PUSH, s->pushed);
+        s->pushed = 0;
+
+        /* held back for the segment, which went out with the last buffer */
+        if (s->flowing && s->deferred) {
+                gst_pad_push_event (GST_BASE_SRC_PAD (s), s->deferred);
+                s->deferred = NULL;
+        }
+
         if (s->fps_n <= 0 || s->fps_d <= 0) {
                 GST_DEBUG_OBJECT (s, "Flow not negotiated, fps == 0");
                 return GST_FLOW_NOT_NEGOTIATED;     /* FPS must be > 0 */
@@ -157,6 +744,9 @@ gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
 
         // Removed sleep(2) delay to improve responsiveness
 
+        gst_base_src_negotiate (GST_BASE_SRC (s));
+
+again:
         /* Now, we might need to wait for the next multiple of the fps
          * before capturing */
 
@@ -168,54 +758,214 @@ gst_nvimage_src_create (GstPushSrc * bs, GstBuffer ** buf)
                 return GST_FLOW_ERROR;
         }
 
+        clock = gst_object_ref (GST_ELEMENT_CLOCK (s));
         base_time = GST_ELEMENT_CAST (s)->base_time;
-        pts = next_capture_ts = gst_clock_get_time (GST_ELEMENT_CLOCK (s));
+        fps_n = s->fps_n;
+        fps_d = s->fps_d;
+        pacing = s->pacing;
+        load_shedding = s->load_shedding;
+        load_high = s->load_high;
+        load_low = s->load_low;
+        GST_OBJECT_UNLOCK (s);
+
+        /* a shed framerate paces the frames as well */
+        pace_n = fps_n;
+        pace_d = fps_d;
+        if (load_shedding)
+                gst_nvimage_shed_framerate (&s->shed, &pace_n, &pace_d);
+
+        /* Only a grab of our own is paced: the producer and the leader of
+           the group grab on their own schedule, what they queued is taken
+           right away */
+        paced = s->rendition == NULL && s->queue_size == 0;
+        next_frame_no = 0;
+        if (paced) {
+                cret = gst_nvimage_pacer_wait (&s->pacer, clock, base_time, pace_n, pace_d, pacing,
+                                               &next_frame_no);
+                if (cret == GST_CLOCK_UNSCHEDULED) {
+                        GST_DEBUG_OBJECT (s, "Wait for the next frame unscheduled, flushing");
+                        gst_object_unref (clock);
+                        return GST_FLOW_FLUSHING;
+                }
+        }
+
+        pts = next_capture_ts = gst_clock_get_time (clock);
+        now_us = g_get_monotonic_time ();
         next_capture_ts -= base_time;
+        gst_object_unref (clock);
 
-        /* DISABLED forced GStreamer waiting - let NvFBC work at maximum speed */
-        next_frame_no = s->last_frame_no + 1;
-        
-        /* EXPERIMENTAL: Remove forced duration - let NvFBC manage timing itself */
-        dur = GST_CLOCK_TIME_NONE; // gst_util_uint64_scale_int (GST_SECOND, s->fps_d, s->fps_n);
-        s->last_frame_no = next_frame_no;
-        GST_OBJECT_UNLOCK (s);
+        dur = gst_util_uint64_scale_int (GST_SECOND, pace_d, pace_n);
 
-	_keyframe = s->keyframe;
+        /* Snapshot the settings in one go, so a framerate or bitrate set
+           from another thread never reaches the encoder half-applied */
+        GST_OBJECT_LOCK (s);
+        _keyframe = gst_nvimage_src_take_keyframe (s, next_capture_ts);
+        params.fps_n = s->fps_n;
+        params.fps_d = s->fps_d;
+        params.bitrate = s->congestion_control != GST_NVIMAGE_CONGESTION_NONE ?
+                         gst_nvimage_bwe_get_bitrate (&s->bwe) : s->bitrate;
+        params.scale = 100;
+        params.show_pointer = s->show_pointer;
+        params.forcekeyframe = _keyframe;
+        params.max_frames_in_flight = s->max_frames_in_flight;
+        params.zero_copy_buffers = s->zero_copy_buffers;
+        params.skip_unchanged = s->skip_unchanged;
+        params.heartbeat = s->heartbeat;
+        params.repeat_unchanged = s->repeat_unchanged;
+        params.codec = s->codec;
+        params.format = s->format;
+        params.gl_context = s->gl_context;
+        params.slices = s->nal ? s->slices : 0;
+        GST_OBJECT_UNLOCK (s);
 
-        gst_base_src_negotiate (GST_BASE_SRC (s));
+        bitrate = params.bitrate;
+        if (load_shedding)
+                gst_nvimage_shed_apply (&s->shed, &params);
+
+        picture.src = s;
+        picture.base_time = base_time;
+        picture.pts = pts;
+        picture.now_us = now_us;
+        picture.dur = dur;
+        picture.ts = GST_CLOCK_TIME_NONE;
+        picture.pending = NULL;
+
+        if (s->rendition) {
+                /* The leader of the group grabs, we only get our encode */
+                nvimageutil_rendition_set_params (s->rendition, &params);
+
+                ret = nvimageutil_rendition_pop (s->rendition, &image);
+                if (ret == GST_FLOW_ERROR)
+                        GST_ELEMENT_ERROR (s, RESOURCE, FAILED,
+                                           ("Capture group %s stopped encoding for us", s->capture_group), (NULL));
+                if (ret != GST_FLOW_OK)
+                        return ret;
+        } else if (s->queue_size > 0) {
+                /* The worker produces on its own, just hand it the current
+                   settings and take whatever it encoded */
+                nvimageutil_producer_set_params (s->xcontext, &params);
+
+                if (!s->producing) {
+                        if (!nvimageutil_producer_start_r (s->xcontext, GST_ELEMENT (s),
+                                                s->queue_size, s->queue_policy))
+                                return GST_FLOW_ERROR;
+                        s->producing = TRUE;
+                }
 
-        image = gst_nvimageutil_nvimage_new_r(s->xcontext, GST_ELEMENT(s), 
-                                            s->fps_n, s->fps_d, s->bitrate, s->show_pointer, _keyframe, 
-                                            next_frame_no, next_capture_ts);
+                ret = nvimageutil_producer_pop (s->xcontext, &image);
+                if (ret != GST_FLOW_OK)
+                        return ret;
+
+                /* still queued from before downstream switched codecs
+                   or raw formats */
+                meta = GST_META_NVIMAGE_GET (image);
+                vmeta = gst_buffer_get_video_meta (image);
+                if ((meta && meta->codec != params.codec) ||
+                    (vmeta && vmeta->format != params.format)) {
+                        gst_buffer_unref (image);
+                        goto again;
+                }
+        } else {
+                ret = gst_nvimageutil_nvimage_new_r(s->xcontext, GST_ELEMENT(s), &params,
+                                                    next_frame_no, next_capture_ts,
+                                                    gst_nvimage_src_push_slice, &picture, &image);
+
+                if (ret == NVIMAGE_FLOW_UNCHANGED) {
+                        /* Nothing was encoded for this slot; tell downstream
+                           the stream goes on without data and wait for the
+                           next one, the first change is encoded right away */
+                        if (GST_CLOCK_TIME_IS_VALID (s->last_pts) && next_capture_ts <= s->last_pts)
+                                next_capture_ts = s->last_pts + 1;
+                        s->last_pts = next_capture_ts;
+                        GST_LOG_OBJECT (s, "Screen unchanged, gap at %" GST_TIME_FORMAT,
+                                        GST_TIME_ARGS (next_capture_ts));
+                        gst_nvimage_src_push_event (s, gst_event_new_gap (next_capture_ts, dur));
+                        goto again;
+                }
+                if (ret != GST_FLOW_OK) {
+                        /* or downstream refused a slice */
+                        if (picture.pending)
+                                gst_buffer_list_unref (picture.pending);
+                        return ret;
+                }
+        }
 
-        if(_keyframe) {
-                s->keyframe = 0;
+        /* The first slice of a sliced picture announced it already */
+        if (!GST_CLOCK_TIME_IS_VALID (picture.ts)) {
+                ret = gst_nvimage_src_announce (s, image);
+                if (ret != GST_FLOW_OK) {
+                        gst_buffer_unref (image);
+                        return ret;
+                }
         }
 
-        if (!image)
-                return GST_FLOW_ERROR;
+        meta = GST_META_NVIMAGE_GET (image);
+        if (paced)
+                gst_nvimage_pacer_frame_done (&s->pacer, meta && meta->repeated);
+        capture_us = meta && meta->capture_time ? meta->capture_time : now_us;
+        gst_nvimage_src_stamp (&picture, image);
+
+        gst_nvimage_src_update_latency (s, (g_get_monotonic_time () - capture_us) * GST_USECOND);
 
-        *buf = image;
-        GST_BUFFER_DTS (*buf) = GST_CLOCK_TIME_NONE; //pts+s->last_frame_no;
-        // EXPERIMENTAL: Remove forced timestamps - let NvFBC control
-        GST_BUFFER_PTS (*buf) = GST_CLOCK_TIME_NONE; // next_capture_ts; 
-        GST_BUFFER_DURATION (*buf) = dur;
+        /* the last slice ends the picture */
+        if (params.slices)
+                GST_BUFFER_FLAG_SET (image, GST_VIDEO_BUFFER_FLAG_MARKER);
+
+        if (picture.pending) {
+                gst_buffer_list_add (picture.pending, image);
+                gst_base_src_submit_buffer_list (GST_BASE_SRC (s), picture.pending);
+                *buf = NULL;
+        } else {
+                *buf = image;
+        }
 
         GST_DEBUG_OBJECT (s, "Sending frame time %"
-                        GST_TIME_FORMAT " duration %ld next frame = %" G_GINT64_FORMAT " prev = %"
-                        G_GINT64_FORMAT, GST_TIME_ARGS(pts+s->last_frame_no), dur, next_frame_no, s->last_frame_no);
+                        GST_TIME_FORMAT " duration %" GST_TIME_FORMAT " next frame = %" G_GINT64_FORMAT,
+                        GST_TIME_ARGS (picture.ts), GST_TIME_ARGS (dur), next_frame_no);
 
+        NVIMAGE_TRACE (GST_ELEMENT (s), GST_NVIMAGE_TRACE_PUSH, push, s->frame, picture.ts);
         s->frame++;
+        s->flowing = TRUE;
+
+        if (s->stats_interval && s->xcontext &&
+            now_us - s->last_stats >= (gint64) s->stats_interval * 1000) {
+                s->last_stats = now_us;
+                gst_element_post_message (GST_ELEMENT (s),
+                                          gst_message_new_element (GST_OBJECT (s), gst_nvimage_src_stats (s)));
+        }
+
+        /* Only the leader of a capture group has a capture thread to watch */
+        if (load_shedding && stats &&
+            gst_nvimage_shed_update (&s->shed, stats, pace_n, pace_d, s->producing, load_high, load_low, now_us)) {
+                shed = gst_nvimage_shed_to_structure (&s->shed, "nvimagesrc-load-shedding", fps_n, fps_d, bitrate);
+                GST_INFO_OBJECT (s, "Capture at %.0f%% of the frame interval, shedding: %" GST_PTR_FORMAT,
+                                 s->shed.load, shed);
+                gst_element_post_message (GST_ELEMENT (s), gst_message_new_element (GST_OBJECT (s), shed));
+                /* the caps follow the framerate, as they follow the size */
+                gst_pad_mark_reconfigure (GST_BASE_SRC_PAD (s));
+        }
+
+        s->pushed = gst_nvimage_stats_now (stats);
 
         return GST_FLOW_OK;
 }
 
+/* Hands the bitrate settings to the estimator, with the object lock held */
+static void
+gst_nvimage_src_configure_bwe (GstNVimageSrc * src)
+{
+        gst_nvimage_bwe_configure (&src->bwe, src->congestion_control, src->bitrate, src->min_bitrate,
+                                   src->max_bitrate ? src->max_bitrate : G_MAXUINT,
+                                   src->bitrate_ramp_up, src->bitrate_ramp_down);
+}
+
 static void
 gst_nvimage_src_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec)
 {
         GstNVimageSrc *src = GST_NVIMAGE_SRC (object);
         gdouble fps;
 
+        GST_OBJECT_LOCK (src);
         switch (prop_id) {
                 case PROP_DISPLAY_NAME:
                         g_free (src->display_name);
@@ -226,24 +976,119 @@ gst_nvimage_src_set_property (GObject * object, guint prop_id, const GValue * va
                         break;
                 case PROP_BITRATE:
                         src->bitrate = g_value_get_uint (value);
+                        gst_nvimage_src_configure_bwe (src);
                         break;
                 case PROP_FPS:
                         fps = g_value_get_double(value);
-                        // Simple and accurate FPS handling without unnecessary multiplications
-                        src->fps_n = (guint)(fps + 0.5);  // Round to nearest integer
-                        src->fps_d = 1;
+                        /* keep fractional rates such as 59.94 exact */
+                        gst_util_double_to_fraction (fps, &src->fps_n, &src->fps_d);
+                        break;
+                case PROP_MAX_FRAMES_IN_FLIGHT:
+                        src->max_frames_in_flight = g_value_get_uint (value);
+                        break;
+                case PROP_QUEUE_SIZE:
+                        src->queue_size = g_value_get_uint (value);
+                        break;
+                case PROP_QUEUE_POLICY:
+                        src->queue_policy = g_value_get_enum (value);
+                        break;
+                case PROP_ZERO_COPY_BUFFERS:
+                        src->zero_copy_buffers = g_value_get_uint (value);
+                        break;
+                case PROP_KEYFRAME_MIN_INTERVAL:
+                        src->keyframe_min_interval = g_value_get_uint (value);
+                        break;
+                case PROP_PACING:
+                        src->pacing = g_value_get_enum (value);
+                        break;
+                case PROP_SKIP_UNCHANGED:
+                        src->skip_unchanged = g_value_get_boolean (value);
+                        break;
+                case PROP_HEARTBEAT:
+                        src->heartbeat = g_value_get_uint (value);
+                        break;
+                case PROP_REPEAT_UNCHANGED:
+                        src->repeat_unchanged = g_value_get_boolean (value);
+                        break;
+                case PROP_STARTX:
+                        src->x = g_value_get_uint (value);
+                        break;
+                case PROP_STARTY:
+                        src->y = g_value_get_uint (value);
+                        break;
+                case PROP_ENDX:
+                        src->endx = g_value_get_uint (value);
+                        break;
+                case PROP_ENDY:
+                        src->endy = g_value_get_uint (value);
+                        break;
+                case PROP_XID:
+                        src->xid = g_value_get_uint64 (value);
+                        break;
+                case PROP_XNAME:
+                        g_free (src->xname);
+                        src->xname = g_value_dup_string (value);
+                        break;
+                case PROP_MONITOR:
+                        g_free (src->monitor);
+                        src->monitor = g_value_dup_string (value);
+                        break;
+                case PROP_CAPTURE_GROUP:
+                        g_free (src->capture_group);
+                        src->capture_group = g_value_dup_string (value);
+                        break;
+                case PROP_BACKEND:
+                        src->backend = g_value_get_enum (value);
+                        break;
+                case PROP_STATS_INTERVAL:
+                        src->stats_interval = g_value_get_uint (value);
+                        break;
+                case PROP_CONGESTION_CONTROL:
+                        src->congestion_control = g_value_get_enum (value);
+                        gst_nvimage_src_configure_bwe (src);
+                        break;
+                case PROP_MIN_BITRATE:
+                        src->min_bitrate = g_value_get_uint (value);
+                        gst_nvimage_src_configure_bwe (src);
+                        break;
+                case PROP_MAX_BITRATE:
+                        src->max_bitrate = g_value_get_uint (value);
+                        gst_nvimage_src_configure_bwe (src);
+                        break;
+                case PROP_BITRATE_RAMP_UP:
+                        src->bitrate_ramp_up = g_value_get_uint (value);
+                        gst_nvimage_src_configure_bwe (src);
+                        break;
+                case PROP_BITRATE_RAMP_DOWN:
+                        src->bitrate_ramp_down = g_value_get_uint (value);
+                        gst_nvimage_src_configure_bwe (src);
+                        break;
+                case PROP_LOAD_SHEDDING:
+                        src->load_shedding = g_value_get_boolean (value);
+                        break;
+                case PROP_LOAD_HIGH:
+                        src->load_high = g_value_get_uint (value);
+                        break;
+                case PROP_LOAD_LOW:
+                        src->load_low = g_value_get_uint (value);
+                        break;
+                case PROP_SLICES:
+                        src->slices = g_value_get_uint (value);
                         break;
                 default:
                         g_warning("Unknown property %d", prop_id);
                         break;
         }
+        GST_OBJECT_UNLOCK (src);
 }
 
 static void
 gst_nvimage_src_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
 {
         GstNVimageSrc *src = GST_NVIMAGE_SRC (object);
+        guint stat;
 
+        GST_OBJECT_LOCK (src);
         switch (prop_id) {
                 case PROP_DISPLAY_NAME:
                         if (src->xcontext)
@@ -261,10 +1106,116 @@ gst_nvimage_src_get_property (GObject * object, guint prop_id, GValue * value, G
                 case PROP_FPS:
                         g_value_set_double(value, ((double)src->fps_n) / src->fps_d);
                         break;
+                case PROP_MAX_FRAMES_IN_FLIGHT:
+                        g_value_set_uint (value, src->max_frames_in_flight);
+                        break;
+                case PROP_QUEUE_SIZE:
+                        g_value_set_uint (value, src->queue_size);
+                        break;
+                case PROP_QUEUE_POLICY:
+                        g_value_set_enum (value, src->queue_policy);
+                        break;
+                case PROP_ZERO_COPY_BUFFERS:
+                        g_value_set_uint (value, src->zero_copy_buffers);
+                        break;
+                case PROP_ALLOCATIONS:
+                        g_value_set_uint (value, src->xcontext ? nvimageutil_get_allocations (src->xcontext) : 0);
+                        break;
+                case PROP_KEYFRAME_MIN_INTERVAL:
+                        g_value_set_uint (value, src->keyframe_min_interval);
+                        break;
+                case PROP_PACING:
+                        g_value_set_enum (value, src->pacing);
+                        break;
+                case PROP_FRAMES_LATE:
+                        gst_nvimage_pacer_get_stats (&src->pacer, &stat, NULL, NULL);
+                        g_value_set_uint (value, stat);
+                        break;
+                case PROP_FRAMES_DROPPED:
+                        gst_nvimage_pacer_get_stats (&src->pacer, NULL, &stat, NULL);
+                        g_value_set_uint (value, stat);
+                        break;
+                case PROP_FRAMES_DUPLICATED:
+                        gst_nvimage_pacer_get_stats (&src->pacer, NULL, NULL, &stat);
+                        g_value_set_uint (value, stat);
+                        break;
+                case PROP_SKIP_UNCHANGED:
+                        g_value_set_boolean (value, src->skip_unchanged);
+                        break;
+                case PROP_HEARTBEAT:
+                        g_value_set_uint (value, src->heartbeat);
+                        break;
+                case PROP_FRAMES_SKIPPED:
+                        g_value_set_uint (value, src->xcontext ? nvimageutil_get_skipped (src->xcontext) : 0);
+                        break;
+                case PROP_REPEAT_UNCHANGED:
+                        g_value_set_boolean (value, src->repeat_unchanged);
+                        break;
+                case PROP_STARTX:
+                        g_value_set_uint (value, src->x);
+                        break;
+                case PROP_STARTY:
+                        g_value_set_uint (value, src->y);
+                        break;
+                case PROP_ENDX:
+                        g_value_set_uint (value, src->endx);
+                        break;
+                case PROP_ENDY:
+                        g_value_set_uint (value, src->endy);
+                        break;
+                case PROP_XID:
+                        g_value_set_uint64 (value, src->xid);
+                        break;
+                case PROP_XNAME:
+                        g_value_set_string (value, src->xname);
+                        break;
+                case PROP_MONITOR:
+                        g_value_set_string (value, src->monitor);
+                        break;
+                case PROP_CAPTURE_GROUP:
+                        g_value_set_string (value, src->capture_group);
+                        break;
+                case PROP_BACKEND:
+                        g_value_set_enum (value, src->backend);
+                        break;
+                case PROP_STATS:
+                        g_value_take_boxed (value, gst_nvimage_src_stats (src));
+                        break;
+                case PROP_STATS_INTERVAL:
+                        g_value_set_uint (value, src->stats_interval);
+                        break;
+                case PROP_CONGESTION_CONTROL:
+                        g_value_set_enum (value, src->congestion_control);
+                        break;
+                case PROP_MIN_BITRATE:
+                        g_value_set_uint (value, src->min_bitrate);
+                        break;
+                case PROP_MAX_BITRATE:
+                        g_value_set_uint (value, src->max_bitrate);
+                        break;
+                case PROP_BITRATE_RAMP_UP:
+                        g_value_set_uint (value, src->bitrate_ramp_up);
+                        break;
+                case PROP_BITRATE_RAMP_DOWN:
+                        g_value_set_uint (value, src->bitrate_ramp_down);
+                        break;
+                case PROP_LOAD_SHEDDING:
+                        g_value_set_boolean (value, src->load_shedding);
+                        break;
+                case PROP_LOAD_HIGH:
+                        g_value_set_uint (value, src->load_high);
+                        break;
+                case PROP_LOAD_LOW:
+                        g_value_set_uint (value, src->load_low);
+                        break;
+                case PROP_SLICES:
+                        g_value_set_uint (value, src->slices);
+                        break;
                 default:
                         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
                         break;
         }
+        GST_OBJECT_UNLOCK (src);
 }
 
 static void
@@ -278,34 +1229,150 @@ gst_nvimage_src_finalize (GObject * object)
 {
         GstNVimageSrc *src = GST_NVIMAGE_SRC (object);
 
+        if (src->rendition)
+                nvimageutil_group_leave (src->rendition);
         if (src->xcontext)
                 nvimageutil_xcontext_clear_r (src->xcontext);
+        gst_nvimage_pacer_clear (&src->pacer);
+        gst_nvimage_bwe_clear (&src->bwe);
+        g_free (src->xname);
+        g_free (src->monitor);
+        g_free (src->capture_group);
+        gst_clear_object (&src->gl_context);
+        gst_clear_object (&src->other_context);
+        gst_clear_object (&src->gl_display);
 
         G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+/* With @nal, H.264 and H.265 also come a slice per buffer */
+static GstStructure *
+gst_nvimage_src_codec_structure (GstNVimageCodec codec, gint width, gint height, gboolean nal)
+{
+        const gchar *name, *stream_format, *alignment, *profile;
+        GstStructure *structure;
+        GValue alignments = G_VALUE_INIT, value = G_VALUE_INIT;
+
+        switch (codec) {
+                case GST_NVIMAGE_CODEC_H265:
+                        name = "video/x-h265";
+                        stream_format = "byte-stream";
+                        alignment = "au";
+                        profile = "main";
+                        break;
+                case GST_NVIMAGE_CODEC_AV1:
+                        name = "video/x-av1";
+                        stream_format = "obu-stream";
+                        alignment = "tu";
+                        profile = "main";
+                        break;
+                case GST_NVIMAGE_CODEC_H264:
+                default:
+                        name = "video/x-h264";
+                        stream_format = "byte-stream";
+                        alignment = "au";
+                        profile = "high";
+                        break;
+        }
+
+        structure = gst_structure_new (name,
+                "width", G_TYPE_INT, width,
+                "height", G_TYPE_INT, height,
+                "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
+                "stream-format", G_TYPE_STRING, stream_format,
+                "alignment", G_TYPE_STRING, alignment,
+                "profile", G_TYPE_STRING, profile,
+                NULL);
+
+        if (nal && codec != GST_NVIMAGE_CODEC_AV1) {
+                g_value_init (&alignments, GST_TYPE_LIST);
+                g_value_init (&value, G_TYPE_STRING);
+                g_value_set_static_string (&value, "au");
+                gst_value_list_append_value (&alignments, &value);
+                g_value_set_static_string (&value, "nal");
+                gst_value_list_append_value (&alignments, &value);
+                gst_structure_take_value (structure, "alignment", &alignments);
+                g_value_unset (&value);
+        }
+
+        return structure;
+}
+
+static GstStructure *
+gst_nvimage_src_raw_structure (gint width, gint height)
+{
+        GstStructure *structure;
+
+        structure = gst_structure_from_string ("video/x-raw, format = (string) { " NVIMAGE_RAW_FORMATS " }", NULL);
+        gst_structure_set (structure,
+                "width", G_TYPE_INT, width,
+                "height", G_TYPE_INT, height,
+                "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
+                NULL);
+
+        return structure;
+}
+
+static GstStructure *
+gst_nvimage_src_gl_structure (gint width, gint height)
+{
+        return gst_structure_new ("video/x-raw",
+                "format", G_TYPE_STRING, "RGBA",
+                "texture-target", G_TYPE_STRING, "2D",
+                "width", G_TYPE_INT, width,
+                "height", G_TYPE_INT, height,
+                "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
+                NULL);
+}
+
 static GstCaps *
 gst_nvimage_src_get_caps (GstBaseSrc * bs, GstCaps * filter)
 {
         GstNVimageSrc *s = GST_NVIMAGE_SRC (bs);
+        GstNVimageCodec codec;
+        GstCaps *caps;
+        gboolean grouped, nal;
         gint width, height;
+        guint codecs;
 
-        if ((!s->xcontext) || (!gst_nvimage_src_open_display (s, s->display_name)))
+        if ((!s->xcontext && !s->rendition) || (!gst_nvimage_src_open_display (s, s->display_name)))
                 return gst_pad_get_pad_template_caps (GST_BASE_SRC (s)->srcpad);
 
-        width = s->xcontext->width;
-        height = s->xcontext->height;
+        GST_OBJECT_LOCK (s);
+        width = s->width;
+        height = s->height;
+        codec = s->codec;
+        grouped = s->capture_group != NULL;
+        /* slices are handed over with each picture read back for us, the
+           capture thread queues whole ones */
+        nal = s->queue_size == 0;
+        GST_OBJECT_UNLOCK (s);
 
         GST_DEBUG ("width = %d, height=%d", width, height);
 
-        return gst_caps_new_simple ("video/x-h264",
-                "width", G_TYPE_INT, width,
-                "height", G_TYPE_INT, height,
-                "framerate", GST_TYPE_FRACTION_RANGE, 1, G_MAXINT, G_MAXINT, 1,
-                "stream-format", G_TYPE_STRING, "byte-stream",
-                "alignment", G_TYPE_STRING, "au",
-                "profile", G_TYPE_STRING, "high",
-                NULL);
+        /* A member of a capture group encodes with whatever the leader
+           negotiated, anyone else lets downstream pick, H.264 first */
+        if (s->rendition)
+                return gst_caps_new_full (gst_nvimage_src_codec_structure (codec, width, height, FALSE), NULL);
+
+        /* only what the backend the capture opened with produces */
+        codecs = nvimageutil_get_codecs (s->xcontext);
+        nal = nal && nvimageutil_get_slices (s->xcontext);
+
+        caps = gst_caps_new_empty ();
+        for (codec = GST_NVIMAGE_CODEC_H264; codec <= GST_NVIMAGE_CODEC_AV1; codec++) {
+                if (codecs & (1 << codec))
+                        gst_caps_append_structure (caps, gst_nvimage_src_codec_structure (codec, width, height, nal));
+        }
+        /* the members of a group encode from the NV12 textures of the
+           capture, raw and GL captures have none */
+        if (!grouped && (codecs & (1 << GST_NVIMAGE_CODEC_GL)))
+                gst_caps_append_structure_full (caps, gst_nvimage_src_gl_structure (width, height),
+                                                gst_caps_features_new (GST_CAPS_FEATURE_MEMORY_GL_MEMORY, NULL));
+        if (!grouped && (codecs & (1 << GST_NVIMAGE_CODEC_RAW)))
+                gst_caps_append_structure (caps, gst_nvimage_src_raw_structure (width, height));
+
+        return caps;
 }
 
 static gboolean
@@ -313,23 +1380,70 @@ gst_nvimage_src_set_caps (GstBaseSrc * bs, GstCaps * caps)
 {
         GstNVimageSrc *s = GST_NVIMAGE_SRC (bs);
         GstStructure *structure;
+        GstNVimageCodec codec;
+        GstVideoFormat format = GST_VIDEO_FORMAT_NV12;
         const GValue *new_fps;
+        gint caps_fps_n, caps_fps_d, shed_fps_n, shed_fps_d;
+        gboolean nal;
 
         /* If not yet opened, disallow setcaps until later */
-        if (!s->xcontext)
+        if (!s->xcontext && !s->rendition)
                 return FALSE;
 
-        /* The only thing that can change is the framerate downstream wants */
+        /* Downstream picks the framerate and the codec */
         structure = gst_caps_get_structure (caps, 0);
         new_fps = gst_structure_get_value (structure, "framerate");
         if (!new_fps)
                 return FALSE;
 
-        /* Store this FPS for use when generating buffers */
-        s->fps_n = gst_value_get_fraction_numerator (new_fps);
-        s->fps_d = gst_value_get_fraction_denominator (new_fps);
+        if (gst_structure_has_name (structure, "video/x-h265"))
+                codec = GST_NVIMAGE_CODEC_H265;
+        else if (gst_structure_has_name (structure, "video/x-av1"))
+                codec = GST_NVIMAGE_CODEC_AV1;
+        else if (gst_structure_has_name (structure, "video/x-raw") &&
+                 gst_caps_features_contains (gst_caps_get_features (caps, 0), GST_CAPS_FEATURE_MEMORY_GL_MEMORY))
+                codec = GST_NVIMAGE_CODEC_GL;
+        else if (gst_structure_has_name (structure, "video/x-raw"))
+                codec = GST_NVIMAGE_CODEC_RAW;
+        else
+                codec = GST_NVIMAGE_CODEC_H264;
+
+        if (codec == GST_NVIMAGE_CODEC_RAW || codec == GST_NVIMAGE_CODEC_GL) {
+                format = gst_video_format_from_string (gst_structure_get_string (structure, "format"));
+                if (format == GST_VIDEO_FORMAT_UNKNOWN)
+                        return FALSE;
+        }
 
-        GST_DEBUG_OBJECT (s, "peer wants %d/%d fps", s->fps_n, s->fps_d);
+        nal = g_strcmp0 (gst_structure_get_string (structure, "alignment"), "nal") == 0;
+
+        /* before the caps go out, downstream asks for it when they arrive */
+        if (codec == GST_NVIMAGE_CODEC_GL && !gst_nvimage_src_ensure_gl_context (s))
+                return FALSE;
+
+        /* Store this FPS for use when generating buffers, the codec is
+           applied with the next frame's parameters */
+        caps_fps_n = gst_value_get_fraction_numerator (new_fps);
+        caps_fps_d = gst_value_get_fraction_denominator (new_fps);
+        GST_OBJECT_LOCK (s);
+        /* Caps at the framerate load shedding paces at keep the one to
+           come back to */
+        shed_fps_n = s->fps_n;
+        shed_fps_d = s->fps_d;
+        if (s->load_shedding && shed_fps_n > 0 && shed_fps_d > 0)
+                gst_nvimage_shed_framerate (&s->shed, &shed_fps_n, &shed_fps_d);
+        if (caps_fps_n != shed_fps_n || caps_fps_d != shed_fps_d) {
+                s->fps_n = caps_fps_n;
+                s->fps_d = caps_fps_d;
+        }
+        if (!s->rendition) {
+                s->codec = codec;
+                s->format = format;
+                s->nal = nal;
+        }
+        GST_OBJECT_UNLOCK (s);
+
+        GST_DEBUG_OBJECT (s, "peer wants %s at %d/%d fps%s",
+                          gst_structure_get_name (structure), caps_fps_n, caps_fps_d, nal ? ", a slice per buffer" : "");
 
         return TRUE;
 }
@@ -348,12 +1462,18 @@ gst_nvimage_src_fixate (GstBaseSrc * bsrc, GstCaps * caps)
         if (src->fps_n > 0 && src->fps_d > 0) {
                 fps_n = src->fps_n;
                 fps_d = src->fps_d;
+                /* what load shedding paces at, where downstream takes it */
+                if (src->load_shedding)
+                        gst_nvimage_shed_framerate (&src->shed, &fps_n, &fps_d);
         }
 
         for (i = 0; i < gst_caps_get_size (caps); ++i) {
                 structure = gst_caps_get_structure (caps, i);
 
                 gst_structure_fixate_field_nearest_fraction (structure, "framerate", fps_n, fps_d);
+                /* whole pictures, unless downstream asks for slices */
+                if (gst_structure_has_field (structure, "alignment"))
+                        gst_structure_fixate_field_string (structure, "alignment", "au");
         }
         caps = GST_BASE_SRC_CLASS (parent_class)->fixate (bsrc, caps);
 
@@ -361,28 +1481,62 @@ gst_nvimage_src_fixate (GstBaseSrc * bsrc, GstCaps * caps)
 }
 
 static gboolean
-gst_nvimage_src_event (GstBaseSrc * bsrc, GstEvent * event) {
-        if(event) {
-                const GstStructure *s = gst_event_get_structure(event);
-                GstNVimageSrc *nvs = GST_NVIMAGE_SRC (bsrc);
-                if(s && s->name) {
-                        const char *p = g_quark_to_string(s->name);
-                        if(p) {
-				if(strcmp(g_quark_to_string(s->name), "RTPTWCCPackets") == 0) {
-					return TRUE;
-				}
-                                g_warning("got event: %d, subtype: %s", event->type, g_quark_to_string(s->name));
-
-                                if (event->type == GST_EVENT_CUSTOM_UPSTREAM) {
-                                        if (gst_structure_has_name (s, "GstForceKeyUnit") && nvs) {
-                                                g_warning("Forcing keyframe");
-                                                nvs->keyframe = 1;
-                                        }
-                                }
-                        }
+gst_nvimage_src_event (GstBaseSrc * bsrc, GstEvent * event)
+{
+        GstNVimageSrc *src = GST_NVIMAGE_SRC (bsrc);
+        const GstStructure *s;
+        GstClockTime running_time;
+        GstClockTimeDiff diff;
+        GstQOSType type;
+        gdouble proportion;
+        gboolean all_headers;
+        guint count;
+
+        if (gst_video_event_is_force_key_unit (event)) {
+                if (!gst_video_event_parse_upstream_force_key_unit (event, &running_time, &all_headers, &count))
+                        return FALSE;
+
+                GST_LOG_OBJECT (src, "force-key-unit at %" GST_TIME_FORMAT ", all-headers %d, count %u",
+                                GST_TIME_ARGS (running_time), all_headers, count);
+
+                /* Requests pending at the same time only cost one IDR, at the
+                   earliest time any of them asked for */
+                GST_OBJECT_LOCK (src);
+                if (!src->keyframe) {
+                        src->keyframe = TRUE;
+                        src->keyframe_running_time = running_time;
+                        src->keyframe_all_headers = all_headers;
+                } else {
+                        if (!GST_CLOCK_TIME_IS_VALID (running_time) ||
+                            (GST_CLOCK_TIME_IS_VALID (src->keyframe_running_time) &&
+                             running_time < src->keyframe_running_time))
+                                src->keyframe_running_time = running_time;
+                        src->keyframe_all_headers |= all_headers;
                 }
+                src->keyframe_count = count;
+                GST_OBJECT_UNLOCK (src);
+
+                return TRUE;
         }
-        return TRUE;
+
+        /* the feedback of the transport drives the bitrate, the encoder
+           takes a change with the next frame */
+        if (GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+                gst_event_parse_qos (event, &type, &proportion, &diff, NULL);
+                if (gst_nvimage_bwe_qos (&src->bwe, type, proportion, diff))
+                        GST_DEBUG_OBJECT (src, "QoS %f took the bitrate to %u", proportion,
+                                          gst_nvimage_bwe_get_bitrate (&src->bwe));
+        }
+
+        s = gst_event_get_structure (event);
+        if (s && gst_structure_has_name (s, "RTPTWCCPackets")) {
+                if (gst_nvimage_bwe_twcc (&src->bwe, s))
+                        GST_DEBUG_OBJECT (src, "TWCC feedback took the bitrate to %u",
+                                          gst_nvimage_bwe_get_bitrate (&src->bwe));
+                return TRUE;
+        }
+
+        return GST_BASE_SRC_CLASS (parent_class)->event (bsrc, event);
 }
 
 static void
@@ -415,19 +1569,236 @@ gst_nvimage_src_class_init (GstNVimageSrcClass * klass)
                                                 g_param_spec_double ("fps", "fps", "Desired grabbing fps",
                                                 0, 1000, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+        g_object_class_install_property (gc, PROP_MAX_FRAMES_IN_FLIGHT,
+                                                g_param_spec_uint ("max-frames-in-flight", "Max frames in flight",
+                                                "Frames grabbed and encoded ahead of the one being read back "
+                                                "(1 = no pipelining, higher overlaps grab, encode and readback "
+                                                "at the cost of one frame of latency per extra frame)",
+                                                1, NVIMAGE_MAX_FRAMES_IN_FLIGHT, 1,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_QUEUE_SIZE,
+                                                g_param_spec_uint ("queue-size", "Queue size",
+                                                "Frames the capture thread may encode ahead of downstream "
+                                                "(0 = capture synchronously on request)",
+                                                0, 64, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_QUEUE_POLICY,
+                                                g_param_spec_enum ("queue-policy", "Queue policy",
+                                                "What the capture thread does when the queue is full",
+                                                GST_TYPE_NVIMAGE_SRC_QUEUE_POLICY, GST_NVIMAGE_QUEUE_BLOCK,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_ZERO_COPY_BUFFERS,
+                                                g_param_spec_uint ("zero-copy-buffers", "Zero-copy buffers",
+                                                "Encoded frames downstream may hold without them being copied "
+                                                "out of the encoder, further frames are copied (0 = always copy)",
+                                                0, NVIMAGE_MAX_ZERO_COPY_BUFFERS, 4,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_ALLOCATIONS,
+                                                g_param_spec_uint ("allocations", "Allocations",
+                                                "Heap allocations made for output buffers and payloads since "
+                                                "start, stays constant once the pools are warm",
+                                                0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_KEYFRAME_MIN_INTERVAL,
+                                                g_param_spec_uint ("keyframe-min-interval", "Keyframe min interval",
+                                                "Minimum time in ms between forced keyframes, requests arriving "
+                                                "sooner are merged into the next one (0 = no limit)",
+                                                0, G_MAXUINT, 250, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_PACING,
+                                                g_param_spec_enum ("pacing", "Pacing",
+                                                "What to do when frames fall behind the framerate; only the "
+                                                "element's own grabs are paced and counted, not those of "
+                                                "queue-size or of a capture group",
+                                                GST_TYPE_NVIMAGE_SRC_PACING, GST_NVIMAGE_PACING_DROP,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_FRAMES_LATE,
+                                                g_param_spec_uint ("frames-late", "Frames late",
+                                                "Frames produced after their slot had passed",
+                                                0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_FRAMES_DROPPED,
+                                                g_param_spec_uint ("frames-dropped", "Frames dropped",
+                                                "Frame slots skipped because capture fell behind",
+                                                0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_FRAMES_DUPLICATED,
+                                                g_param_spec_uint ("frames-duplicated", "Frames duplicated",
+                                                "Frames encoded from an unchanged screen",
+                                                0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_SKIP_UNCHANGED,
+                                                g_param_spec_boolean ("skip-unchanged", "Skip unchanged",
+                                                "Don't encode frames while the screen does not change, gaps "
+                                                "are signalled downstream instead (variable frame rate)",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_HEARTBEAT,
+                                                g_param_spec_uint ("heartbeat", "Heartbeat",
+                                                "With skip-unchanged, encode a frame anyway when none went out "
+                                                "for this many ms (0 = never)",
+                                                0, G_MAXUINT, 1000, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_FRAMES_SKIPPED,
+                                                g_param_spec_uint ("frames-skipped", "Frames skipped",
+                                                "Frames not encoded because the screen had not changed",
+                                                0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_REPEAT_UNCHANGED,
+                                                g_param_spec_boolean ("repeat-unchanged", "Repeat unchanged",
+                                                "With skip-unchanged, keep the frame rate constant with "
+                                                "synthesized frames repeating the previous one instead of gaps; "
+                                                "the encoder is limited to one reference frame",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_STARTX,
+                                                g_param_spec_uint ("startx", "Start X",
+                                                "X coordinate of the top left corner of the area to capture",
+                                                0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_STARTY,
+                                                g_param_spec_uint ("starty", "Start Y",
+                                                "Y coordinate of the top left corner of the area to capture",
+                                                0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_ENDX,
+                                                g_param_spec_uint ("endx", "End X",
+                                                "X coordinate of the bottom right corner of the area to capture "
+                                                "(0 = right edge of the screen)",
+                                                0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_ENDY,
+                                                g_param_spec_uint ("endy", "End Y",
+                                                "Y coordinate of the bottom right corner of the area to capture "
+                                                "(0 = bottom edge of the screen)",
+                                                0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_XID,
+                                                g_param_spec_uint64 ("xid", "Window XID",
+                                                "Window XID to capture instead of the screen, the capture "
+                                                "follows its moves and resizes (0 = none)",
+                                                0, G_MAXUINT64, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_XNAME,
+                                                g_param_spec_string ("xname", "Window name",
+                                                "Title of the window to capture when no xid is set",
+                                                NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MONITOR,
+                                                g_param_spec_string ("monitor", "Monitor",
+                                                "RandR output to capture instead of the whole screen, by name "
+                                                "(e.g. DP-0) or index; startx/starty/endx/endy are then relative "
+                                                "to it (NULL = whole screen)",
+                                                NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_CAPTURE_GROUP,
+                                                g_param_spec_string ("capture-group", "Capture group",
+                                                "Elements with the same group share one capture: the first to "
+                                                "start grabs, the others encode the same frames at their own "
+                                                "bitrate and at the size of the first, which they cannot scale "
+                                                "(NULL = capture on our own)",
+                                                NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_BACKEND,
+                                                g_param_spec_enum ("backend", "Backend",
+                                                "What captures and encodes; the CPU backend produces H.264 only",
+                                                GST_TYPE_NVIMAGE_SRC_BACKEND, GST_NVIMAGE_BACKEND_AUTO,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_STATS,
+                                                g_param_spec_boxed ("stats", "Statistics",
+                                                "Latency of the grab, map, encode, lock, copy, unmap and push "
+                                                "stages in µs with their histograms, missed and Direct Capture "
+                                                "frames, session recreations and IDRs (NULL in a capture group "
+                                                "we don't lead)",
+                                                GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_STATS_INTERVAL,
+                                                g_param_spec_uint ("stats-interval", "Statistics interval",
+                                                "Post the stats as a \"nvimagesrc-stats\" element message every "
+                                                "this many ms (0 = never)",
+                                                0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_CONGESTION_CONTROL,
+                                                g_param_spec_enum ("congestion-control", "Congestion control",
+                                                "What drives the bitrate: with gcc the bitrate property is where "
+                                                "an estimate from the TWCC feedback of the RTP session and from "
+                                                "QoS events starts, the encoder then follows the estimate",
+                                                GST_TYPE_NVIMAGE_SRC_CONGESTION_CONTROL, GST_NVIMAGE_CONGESTION_NONE,
+                                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MIN_BITRATE,
+                                                g_param_spec_uint ("min-bitrate", "Minimum bitrate",
+                                                "Congestion control never goes below this bitrate",
+                                                0, G_MAXINT, 150000, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_MAX_BITRATE,
+                                                g_param_spec_uint ("max-bitrate", "Maximum bitrate",
+                                                "Congestion control never goes above this bitrate (0 = no limit)",
+                                                0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_BITRATE_RAMP_UP,
+                                                g_param_spec_uint ("bitrate-ramp-up", "Bitrate ramp up",
+                                                "Congestion control raises the bitrate by at most this many "
+                                                "percent per second",
+                                                0, 100, 8, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_BITRATE_RAMP_DOWN,
+                                                g_param_spec_uint ("bitrate-ramp-down", "Bitrate ramp down",
+                                                "Congestion control cuts the bitrate by at most this many "
+                                                "percent at once",
+                                                0, 100, 50, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_LOAD_SHEDDING,
+                                                g_param_spec_boolean ("load-shedding", "Load shedding",
+                                                "Step the framerate, then the capture size, then the bitrate down "
+                                                "while grab and encode take longer than the frame interval allows, "
+                                                "and back up when they catch up; each step is posted as a "
+                                                "\"nvimagesrc-load-shedding\" element message. The caps carry "
+                                                "the shed framerate where downstream takes it, otherwise their "
+                                                "framerate is a maximum",
+                                                FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_LOAD_HIGH,
+                                                g_param_spec_uint ("load-high", "Load high mark",
+                                                "Shed load when grab and encode take more than this many percent "
+                                                "of the frame interval",
+                                                1, 1000, 90, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_LOAD_LOW,
+                                                g_param_spec_uint ("load-low", "Load low mark",
+                                                "Take a step back up after grab and encode stayed under this many "
+                                                "percent of the frame interval for a few seconds",
+                                                0, 1000, 50, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+        g_object_class_install_property (gc, PROP_SLICES,
+                                                g_param_spec_uint ("slices", "Slices",
+                                                "When downstream asks for alignment=nal, cut H.264 and H.265 "
+                                                "pictures into this many slices and push each one as soon as it "
+                                                "is encoded; unchanged frames then leave gaps instead of repeats",
+                                                1, NVIMAGE_MAX_SLICES, 4, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
         gst_element_class_set_static_metadata (ec, "NVimage video source",
                                               "Source/Video",
-                                              "Creates a screenshot video stream to h264",
+                                              "Creates a screenshot video stream to h264, h265, av1, raw video or GL textures",
                                               "Lukas Hejtmanek <xhejtman@gmail.com>");
         gst_element_class_add_static_pad_template (ec, &t);
 
+        ec->set_context = gst_nvimage_src_set_context;
+
         bc->fixate = gst_nvimage_src_fixate;
         bc->get_caps = gst_nvimage_src_get_caps;
         bc->set_caps = gst_nvimage_src_set_caps;
         bc->start = gst_nvimage_src_start;
         bc->stop = gst_nvimage_src_stop;
         bc->unlock = gst_nvimage_src_unlock;
+        bc->unlock_stop = gst_nvimage_src_unlock_stop;
         bc->event = gst_nvimage_src_event;
+        bc->query = gst_nvimage_src_query;
         push_class->create = gst_nvimage_src_create;
 }
 
@@ -439,8 +1810,44 @@ gst_nvimage_src_init (GstNVimageSrc * nvimagesrc)
 
         nvimagesrc->show_pointer = TRUE;
         nvimagesrc->bitrate = 2000000;
+        nvimagesrc->congestion_control = GST_NVIMAGE_CONGESTION_NONE;
+        nvimagesrc->min_bitrate = 150000;
+        nvimagesrc->max_bitrate = 0;
+        nvimagesrc->bitrate_ramp_up = 8;
+        nvimagesrc->bitrate_ramp_down = 50;
+        gst_nvimage_bwe_init (&nvimagesrc->bwe);
+        gst_nvimage_src_configure_bwe (nvimagesrc);
+        nvimagesrc->load_shedding = FALSE;
+        nvimagesrc->load_high = 90;
+        nvimagesrc->load_low = 50;
+        gst_nvimage_shed_reset (&nvimagesrc->shed);
         nvimagesrc->keyframe = TRUE;
+        nvimagesrc->keyframe_running_time = GST_CLOCK_TIME_NONE;
+        nvimagesrc->keyframe_min_interval = 250;
+        nvimagesrc->pacing = GST_NVIMAGE_PACING_DROP;
+        gst_nvimage_pacer_init (&nvimagesrc->pacer);
+        nvimagesrc->last_keyframe = GST_CLOCK_TIME_NONE;
         nvimagesrc->frame = 0;
+        nvimagesrc->max_frames_in_flight = 1;
+        nvimagesrc->queue_size = 0;
+        nvimagesrc->queue_policy = GST_NVIMAGE_QUEUE_BLOCK;
+        nvimagesrc->zero_copy_buffers = 4;
+        nvimagesrc->skip_unchanged = FALSE;
+        nvimagesrc->heartbeat = 1000;
+        nvimagesrc->repeat_unchanged = FALSE;
+        nvimagesrc->nal = FALSE;
+        nvimagesrc->slices = 4;
+        nvimagesrc->format = GST_VIDEO_FORMAT_NV12;
+        nvimagesrc->backend = GST_NVIMAGE_BACKEND_AUTO;
+        nvimagesrc->x = 0;
+        nvimagesrc->y = 0;
+        nvimagesrc->endx = 0;
+        nvimagesrc->endy = 0;
+        nvimagesrc->xid = 0;
+        nvimagesrc->xname = NULL;
+        nvimagesrc->monitor = NULL;
+        nvimagesrc->capture_group = NULL;
+        nvimagesrc->rendition = NULL;
 }
 
 static gboolean
@@ -452,6 +1859,7 @@ plugin_init (GstPlugin * plugin)
                                         "nvimagesrc element debug");
 
         ret = gst_element_register (plugin, "nvimagesrc", GST_RANK_NONE, GST_TYPE_NVIMAGE_SRC);
+        ret &= gst_tracer_register (plugin, "nvimagestages", GST_TYPE_NVIMAGE_TRACER);
 
         return ret;
 }
@@ -22,6 +22,9 @@
 #include <gst/gst.h>
 #include <gst/base/gstpushsrc.h>
 #include "nvimageutil.h"
+#include "nvimagepacer.h"
+#include "nvimagebwe.h"
+#include "nvimageshed.h"
 
 G_BEGIN_DECLS
 
@@ -42,8 +45,32 @@ struct _GstNVimageSrc
 
   /* Information on display */
   GstXContext *xcontext;
-  gint x;
-  gint y;
+  /* elements of the same capture group share the grabs of the first one,
+     the others get their own encode of them in @rendition */
+  gchar *capture_group;
+  GstNVimageRendition *rendition;
+  /* region to capture, inclusive corners; an end of 0 is the screen edge */
+  guint x;
+  guint y;
+  guint endx;
+  guint endy;
+  /* window to capture instead, by id or else by title */
+  guint64 xid;
+  gchar *xname;
+  /* RandR output to capture, the region is then relative to it */
+  gchar *monitor;
+  /* what captures and encodes */
+  GstNVimageBackendType backend;
+  /* what downstream negotiated, for a group member what the leader did */
+  GstNVimageCodec codec;
+  /* pixel format of raw frames */
+  GstVideoFormat format;
+  /* GL frames: @gl_context shares the textures of the capture and is
+     handed to downstream GL elements */
+  GstGLDisplay *gl_display;
+  GstGLContext *other_context;
+  GstGLContext *gl_context;
+  /* size of what is captured */
   gint width;
   gint height;
 
@@ -54,14 +81,82 @@ struct _GstNVimageSrc
   gint fps_d;
 
   /* for framerate sync */
-  GstClockID clock_id;
-  gint64 last_frame_no;
+  GstNVimagePacer pacer;
+  GstNVimagePacingPolicy pacing;
   gint64 frame;
+  /* a buffer went out since the start or the last flush, the segment with
+     it: events can follow */
+  gboolean flowing;
+  /* an event that came up before @flowing, sent after the next buffer */
+  GstEvent *deferred;
 
   gboolean show_pointer;
 
   guint bitrate;
+  /* with congestion control @bitrate is only where the estimate of @bwe
+     starts, it then follows the transport feedback within the bounds */
+  GstNVimageBwe bwe;
+  GstNVimageCongestionControl congestion_control;
+  guint min_bitrate;
+  guint max_bitrate;
+  guint bitrate_ramp_up;
+  guint bitrate_ramp_down;
+
+  /* pending keyframe request, further requests are merged into it */
   gboolean keyframe;
+  GstClockTime keyframe_running_time;
+  gboolean keyframe_all_headers;
+  guint keyframe_count;
+  /* forced keyframes are at least this many ms apart */
+  guint keyframe_min_interval;
+  GstClockTime last_keyframe;
+  /* a forced IDR was submitted, tell downstream when it comes out */
+  gboolean keyframe_announce;
+  GstClockTime announce_running_time;
+  gboolean announce_all_headers;
+  guint announce_count;
+
+  /* step the framerate, capture size and bitrate down while the capture
+     thread takes more than @load_high percent of the frame interval, and
+     back up once it stays under @load_low */
+  gboolean load_shedding;
+  guint load_high;
+  guint load_low;
+  GstNVimageShed shed;
+
+  /* when the last buffer left create, for the push stage of the stats */
+  gint64 pushed;
+  /* stats messages are posted every @stats_interval ms, 0 for none */
+  guint stats_interval;
+  gint64 last_stats;
+
+  /* capture timestamps and measured capture to output delay */
+  GstClockTime last_pts;
+  GstClockTime latency;
+  GstClockTime reported_latency;
+
+  /* pictures kept in flight between grab and readback */
+  guint max_frames_in_flight;
+
+  /* autonomous capture thread, disabled with a queue_size of 0 */
+  guint queue_size;
+  GstNVimageQueuePolicy queue_policy;
+  gboolean producing;
+
+  /* encoded frames handed out without a copy */
+  guint zero_copy_buffers;
+
+  /* leave an unchanged screen unencoded, but not for longer than
+     heartbeat ms */
+  gboolean skip_unchanged;
+  guint heartbeat;
+  /* and fill in with synthesized repeats of the previous frame */
+  gboolean repeat_unchanged;
+
+  /* downstream negotiated alignment=nal: pictures are cut into @slices
+     slices, each pushed as soon as it is read back */
+  gboolean nal;
+  guint slices;
 };
 
 struct _GstNVimageSrcClass
@@ -0,0 +1,259 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Benchmark of the capture and encode pipeline, built by "build.sh bench".
+   It drives gst_nvimageutil_nvimage_new_r() as fast as it answers, then
+   the whole element into a fakesink, and prints the throughput and the
+   latency percentiles of every stage of both runs as one JSON object, for
+   diffing between releases. Without an NVIDIA GPU, run it against the
+   CPU backend or the stub libraries of "build.sh stub". */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gst/gst.h>
+
+#include "gstnvimagesrc.h"
+#include "nvimageutil.h"
+
+/* from GST_PLUGIN_DEFINE in gstnvimagesrc.c */
+const GstPluginDesc *gst_plugin_nvimagesrc_get_desc (void);
+
+static gchar *backend_name = NULL;
+static gchar *display_name = NULL;
+static gchar *caps = NULL;
+static gchar *props = NULL;
+static gchar *output = NULL;
+static gint frames = 600;
+static gint warmup = 60;
+static gint fps = 60;
+static gint bitrate = 8000000;
+
+static GOptionEntry entries[] = {
+        {"backend", 'b', 0, G_OPTION_ARG_STRING, &backend_name, "auto, nvfbc or cpu (auto)", "NAME"},
+        {"display", 'd', 0, G_OPTION_ARG_STRING, &display_name, "X display to capture", "NAME"},
+        {"frames", 'n', 0, G_OPTION_ARG_INT, &frames, "Frames measured in each run (600)", "N"},
+        {"warmup", 'w', 0, G_OPTION_ARG_INT, &warmup, "Frames left out before measuring (60)", "N"},
+        {"fps", 'f', 0, G_OPTION_ARG_INT, &fps, "Framerate the encoder is set up for (60)", "N"},
+        {"bitrate", 'r', 0, G_OPTION_ARG_INT, &bitrate, "Bitrate in bits per second (8000000)", "N"},
+        {"caps", 'c', 0, G_OPTION_ARG_STRING, &caps, "Caps of the element run (video/x-h264)", "CAPS"},
+        {"props", 'p', 0, G_OPTION_ARG_STRING, &props, "More properties of the element, e.g. queue-size=2", "PROPS"},
+        {"output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the results there instead of stdout", "FILE"},
+        {NULL}
+};
+
+static GstNVimageBackendType
+nvimagebench_backend (void)
+{
+        if (g_strcmp0 (backend_name, "nvfbc") == 0)
+                return GST_NVIMAGE_BACKEND_NVFBC;
+        if (g_strcmp0 (backend_name, "cpu") == 0)
+                return GST_NVIMAGE_BACKEND_CPU;
+        return GST_NVIMAGE_BACKEND_AUTO;
+}
+
+/* Produces frames back to back through the capture thread, H.264 with the
+   defaults of the element, every grab encoded */
+static gboolean
+nvimagebench_direct (GString * json)
+{
+        GstXContext      *xcontext;
+        GstNVimageParams params;
+        GstNVimageStats  warm, stats;
+        GstBuffer        *buf;
+        GstFlowReturn    ret;
+        gint64           frame;
+
+        xcontext = nvimageutil_xcontext_get_r (NULL, display_name, NULL, None, NULL, NULL, nvimagebench_backend ());
+        if (xcontext == NULL) {
+                g_printerr ("Cannot open the capture\n");
+                return FALSE;
+        }
+
+        memset (&params, 0, sizeof (params));
+        params.fps_n = fps;
+        params.fps_d = 1;
+        params.bitrate = bitrate;
+        params.scale = 100;
+        params.show_pointer = TRUE;
+        params.max_frames_in_flight = 1;
+        params.zero_copy_buffers = 4;
+        params.codec = GST_NVIMAGE_CODEC_H264;
+        params.format = GST_VIDEO_FORMAT_NV12;
+
+        memset (&warm, 0, sizeof (warm));
+        for (frame = 0; frame < warmup + frames; frame++) {
+                if (frame == warmup)
+                        warm = *nvimageutil_get_stats (xcontext);
+                params.forcekeyframe = frame == 0 ? NVIMAGE_KEYFRAME_FORCE : 0;
+                buf = NULL;
+                ret = gst_nvimageutil_nvimage_new_r (xcontext, NULL, &params, frame,
+                                                     gst_util_uint64_scale_int (frame, GST_SECOND, fps),
+                                                     NULL, NULL, &buf);
+                if (ret != GST_FLOW_OK && ret != NVIMAGE_FLOW_UNCHANGED) {
+                        g_printerr ("Frame %" G_GINT64_FORMAT " failed\n", frame);
+                        nvimageutil_xcontext_clear_r (xcontext);
+                        return FALSE;
+                }
+                if (buf)
+                        gst_buffer_unref (buf);
+        }
+
+        stats = *nvimageutil_get_stats (xcontext);
+        gst_nvimage_stats_subtract (&stats, &warm);
+        g_string_append (json, "\"direct\": ");
+        gst_nvimage_stats_to_json (&stats, json);
+        nvimageutil_xcontext_clear_r (xcontext);
+
+        return TRUE;
+}
+
+typedef struct {
+        GstNVimageSrc   *src;
+        guint64         pushed;
+        GstNVimageStats warm;
+} NVimageBenchRun;
+
+/* Notes the stats at the end of the warm-up, to be left out of the
+   results. The capture thread keeps writing them, with a queue-size even
+   while a buffer is pushed, so they are only read here. */
+static GstPadProbeReturn
+nvimagebench_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+        NVimageBenchRun *run = user_data;
+
+        if (++run->pushed == (guint64) warmup && run->src->xcontext)
+                run->warm = *nvimageutil_get_stats (run->src->xcontext);
+
+        return GST_PAD_PROBE_OK;
+}
+
+/* Runs the element into a fakesink, paced on the clock like in a real
+   pipeline */
+static gboolean
+nvimagebench_element (GString * json)
+{
+        GstElement      *pipeline, *src;
+        GstPad          *pad;
+        GstBus          *bus;
+        GstMessage      *msg;
+        GError          *error = NULL;
+        gchar           *description;
+        NVimageBenchRun run;
+        GstNVimageStats stats;
+        gboolean        ok;
+
+        description = g_strdup_printf ("nvimagesrc name=src backend=%s num-buffers=%d bitrate=%d %s%s %s ! %s,framerate=%d/1 ! fakesink sync=false",
+                                       backend_name ? backend_name : "auto", warmup + frames, bitrate,
+                                       display_name ? "display-name=" : "", display_name ? display_name : "",
+                                       props ? props : "", caps ? caps : "video/x-h264", fps);
+        pipeline = gst_parse_launch (description, &error);
+        g_free (description);
+        if (pipeline == NULL) {
+                g_printerr ("Cannot build the pipeline: %s\n", error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+        memset (&run, 0, sizeof (run));
+        run.src = GST_NVIMAGE_SRC (src);
+        pad = gst_element_get_static_pad (src, "src");
+        gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, nvimagebench_probe, &run, NULL);
+        gst_object_unref (pad);
+
+        gst_element_set_state (pipeline, GST_STATE_PLAYING);
+        bus = gst_element_get_bus (pipeline);
+        msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+        ok = GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS;
+        if (!ok) {
+                gst_message_parse_error (msg, &error, NULL);
+                g_printerr ("Pipeline failed: %s\n", error->message);
+                g_error_free (error);
+        }
+        gst_message_unref (msg);
+        gst_object_unref (bus);
+
+        /* the capture context goes away with the stop */
+        if (ok && GST_NVIMAGE_SRC (src)->xcontext) {
+                stats = *nvimageutil_get_stats (GST_NVIMAGE_SRC (src)->xcontext);
+                gst_nvimage_stats_subtract (&stats, &run.warm);
+                g_string_append (json, ", \"element\": ");
+                gst_nvimage_stats_to_json (&stats, json);
+        }
+
+        gst_element_set_state (pipeline, GST_STATE_NULL);
+        gst_object_unref (src);
+        gst_object_unref (pipeline);
+
+        return ok;
+}
+
+int
+main (int argc, char *argv[])
+{
+        const GstPluginDesc *desc;
+        GOptionContext      *context;
+        GError              *error = NULL;
+        GString             *json;
+        gboolean            ok;
+
+        context = g_option_context_new ("- nvimagesrc benchmark");
+        g_option_context_add_main_entries (context, entries, NULL);
+        g_option_context_add_group (context, gst_init_get_option_group ());
+        if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_printerr ("%s\n", error->message);
+                return 2;
+        }
+        g_option_context_free (context);
+        if (frames <= 0 || warmup < 0 || fps <= 0) {
+                g_printerr ("frames and fps must be positive\n");
+                return 2;
+        }
+
+        /* the element linked in, not whatever the registry has */
+        desc = gst_plugin_nvimagesrc_get_desc ();
+        gst_plugin_register_static (desc->major_version, desc->minor_version, desc->name, desc->description,
+                                    desc->plugin_init, desc->version, desc->license, desc->source,
+                                    desc->package, desc->origin);
+
+        json = g_string_new (NULL);
+        g_string_append_printf (json, "{\"backend\": \"%s\", \"frames\": %d, \"warmup\": %d, \"fps\": %d, \"bitrate\": %d, ",
+                                backend_name ? backend_name : "auto", frames, warmup, fps, bitrate);
+        ok = nvimagebench_direct (json) && nvimagebench_element (json);
+        g_string_append (json, "}\n");
+
+        if (ok) {
+                if (output) {
+                        if (!g_file_set_contents (output, json->str, json->len, &error)) {
+                                g_printerr ("%s\n", error->message);
+                                g_error_free (error);
+                                ok = FALSE;
+                        }
+                } else {
+                        fputs (json->str, stdout);
+                }
+        }
+        g_string_free (json, TRUE);
+
+        return ok ? 0 : 1;
+}
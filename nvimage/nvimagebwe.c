@@ -0,0 +1,493 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimagebwe.h"
+
+/* packets sent this close to the first one of a group belong to it */
+#define NVIMAGE_BWE_BURST (5 * GST_MSECOND)
+/* the delay trend: smoothing of the accumulated delay, gain of the slope */
+#define NVIMAGE_BWE_SMOOTHING 0.9
+#define NVIMAGE_BWE_TREND_GAIN 4.0
+#define NVIMAGE_BWE_MAX_DELTAS 60
+/* the adaptive threshold, in ms */
+#define NVIMAGE_BWE_THRESHOLD 12.5
+#define NVIMAGE_BWE_MIN_THRESHOLD 6.0
+#define NVIMAGE_BWE_MAX_THRESHOLD 600.0
+#define NVIMAGE_BWE_MAX_ADAPT_OFFSET 15.0
+#define NVIMAGE_BWE_K_UP 0.0087
+#define NVIMAGE_BWE_K_DOWN 0.039
+/* how long the trend stays over the threshold before it counts, in ms */
+#define NVIMAGE_BWE_OVERUSE_TIME 10.0
+/* on congestion the estimate drops to this much of what got through */
+#define NVIMAGE_BWE_BETA 0.85
+/* cuts are at least this far apart, so one congestion costs one cut */
+#define NVIMAGE_BWE_DECREASE_INTERVAL (300 * G_TIME_SPAN_MILLISECOND)
+#define NVIMAGE_BWE_QOS_INTERVAL G_TIME_SPAN_SECOND
+/* the received rate is measured over this much arrival time */
+#define NVIMAGE_BWE_RATE_WINDOW (500 * GST_MSECOND)
+/* loss below the first is fine, above the second it cuts the estimate */
+#define NVIMAGE_BWE_LOSS_LOW 0.02
+#define NVIMAGE_BWE_LOSS_HIGH 0.10
+/* the encoder is only reconfigured for changes of 1/20 of the bitrate */
+#define NVIMAGE_BWE_STEP 20
+
+static gdouble
+gst_nvimage_bwe_clamp (GstNVimageBwe * bwe, gdouble bitrate)
+{
+        return CLAMP (bitrate, (gdouble) bwe->min_bitrate, (gdouble) bwe->max_bitrate);
+}
+
+static void
+gst_nvimage_bwe_reset_unlocked (GstNVimageBwe * bwe)
+{
+        bwe->estimate = gst_nvimage_bwe_clamp (bwe, bwe->start_bitrate);
+        bwe->delay_estimate = bwe->estimate;
+        bwe->loss_estimate = bwe->estimate;
+        bwe->bitrate = (guint) bwe->estimate;
+        bwe->last_update = g_get_monotonic_time ();
+        bwe->last_decrease = 0;
+
+        bwe->group_send = GST_CLOCK_TIME_NONE;
+        bwe->group_last_send = GST_CLOCK_TIME_NONE;
+        bwe->group_arrival = GST_CLOCK_TIME_NONE;
+        bwe->prev_send = GST_CLOCK_TIME_NONE;
+        bwe->prev_arrival = GST_CLOCK_TIME_NONE;
+        bwe->first_arrival = GST_CLOCK_TIME_NONE;
+
+        bwe->accumulated_delay = 0;
+        bwe->smoothed_delay = 0;
+        bwe->trend_count = 0;
+        bwe->prev_trend = 0;
+        bwe->threshold = NVIMAGE_BWE_THRESHOLD;
+        bwe->last_threshold = GST_CLOCK_TIME_NONE;
+        bwe->overuse_time = 0;
+        bwe->overuse_count = 0;
+        bwe->usage = GST_NVIMAGE_BANDWIDTH_NORMAL;
+
+        bwe->rate_start = GST_CLOCK_TIME_NONE;
+        bwe->rate_bytes = 0;
+        bwe->received_rate = 0;
+        bwe->loss = 0;
+        bwe->overuses = 0;
+}
+
+void
+gst_nvimage_bwe_init (GstNVimageBwe * bwe)
+{
+        g_mutex_init (&bwe->lock);
+        bwe->algorithm = GST_NVIMAGE_CONGESTION_NONE;
+        bwe->start_bitrate = 2000000;
+        bwe->min_bitrate = 0;
+        bwe->max_bitrate = G_MAXUINT;
+        bwe->ramp_up = 8;
+        bwe->ramp_down = 50;
+        gst_nvimage_bwe_reset_unlocked (bwe);
+}
+
+void
+gst_nvimage_bwe_clear (GstNVimageBwe * bwe)
+{
+        g_mutex_clear (&bwe->lock);
+}
+
+/* Forgets what was learned about the path, the estimate starts over from
+   the start bitrate */
+void
+gst_nvimage_bwe_reset (GstNVimageBwe * bwe)
+{
+        g_mutex_lock (&bwe->lock);
+        gst_nvimage_bwe_reset_unlocked (bwe);
+        g_mutex_unlock (&bwe->lock);
+}
+
+/* A new @start_bitrate is taken as an override by the application, the
+   estimate starts over from it. New bounds apply to the current estimate
+   right away. */
+void
+gst_nvimage_bwe_configure (GstNVimageBwe * bwe, GstNVimageCongestionControl algorithm,
+                           guint start_bitrate, guint min_bitrate, guint max_bitrate,
+                           guint ramp_up, guint ramp_down)
+{
+        gboolean restart;
+
+        g_mutex_lock (&bwe->lock);
+        restart = bwe->algorithm != algorithm || bwe->start_bitrate != start_bitrate;
+
+        bwe->algorithm = algorithm;
+        bwe->start_bitrate = start_bitrate;
+        bwe->min_bitrate = min_bitrate;
+        bwe->max_bitrate = MAX (max_bitrate, min_bitrate);
+        bwe->ramp_up = ramp_up;
+        bwe->ramp_down = MIN (ramp_down, 100);
+
+        if (restart) {
+                gst_nvimage_bwe_reset_unlocked (bwe);
+        } else {
+                bwe->estimate = gst_nvimage_bwe_clamp (bwe, bwe->estimate);
+                bwe->delay_estimate = gst_nvimage_bwe_clamp (bwe, bwe->delay_estimate);
+                bwe->loss_estimate = gst_nvimage_bwe_clamp (bwe, bwe->loss_estimate);
+                bwe->bitrate = (guint) bwe->estimate;
+        }
+        g_mutex_unlock (&bwe->lock);
+}
+
+/* Detects over- and underuse from the slope of the smoothed one way delay,
+   against a threshold that follows the trend so that competing flows and
+   jitter don't starve us */
+static void
+gst_nvimage_bwe_detect (GstNVimageBwe * bwe, gdouble trend, gdouble send_delta, GstClockTime arrival)
+{
+        gdouble abs_trend = ABS (trend);
+        gdouble dt, k;
+
+        if (trend > bwe->threshold) {
+                if (bwe->overuse_count == 0)
+                        bwe->overuse_time = send_delta / 2;
+                else
+                        bwe->overuse_time += send_delta;
+                bwe->overuse_count++;
+
+                if (bwe->overuse_time > NVIMAGE_BWE_OVERUSE_TIME && bwe->overuse_count > 1 &&
+                    trend >= bwe->prev_trend) {
+                        bwe->usage = GST_NVIMAGE_BANDWIDTH_OVERUSE;
+                        bwe->overuse_time = 0;
+                        bwe->overuse_count = 0;
+                }
+        } else if (trend < -bwe->threshold) {
+                bwe->overuse_time = 0;
+                bwe->overuse_count = 0;
+                bwe->usage = GST_NVIMAGE_BANDWIDTH_UNDERUSE;
+        } else {
+                bwe->overuse_time = 0;
+                bwe->overuse_count = 0;
+                bwe->usage = GST_NVIMAGE_BANDWIDTH_NORMAL;
+        }
+        bwe->prev_trend = trend;
+
+        /* spikes far over the threshold don't move it */
+        if (abs_trend <= bwe->threshold + NVIMAGE_BWE_MAX_ADAPT_OFFSET &&
+            GST_CLOCK_TIME_IS_VALID (bwe->last_threshold)) {
+                dt = MIN ((gdouble) (arrival - bwe->last_threshold) / GST_MSECOND, 100.0);
+                k = abs_trend < bwe->threshold ? NVIMAGE_BWE_K_DOWN : NVIMAGE_BWE_K_UP;
+                bwe->threshold += k * (abs_trend - bwe->threshold) * dt;
+                bwe->threshold = CLAMP (bwe->threshold, NVIMAGE_BWE_MIN_THRESHOLD, NVIMAGE_BWE_MAX_THRESHOLD);
+        }
+        bwe->last_threshold = arrival;
+}
+
+/* Adds the delay variation of a group, @delta and @send_delta in ms, and
+   fits a line through the last ones */
+static void
+gst_nvimage_bwe_trendline (GstNVimageBwe * bwe, gdouble delta, gdouble send_delta, GstClockTime arrival)
+{
+        gdouble x_mean = 0, y_mean = 0, num = 0, den = 0, trend;
+        guint i, n;
+
+        if (!GST_CLOCK_TIME_IS_VALID (bwe->first_arrival))
+                bwe->first_arrival = arrival;
+
+        bwe->accumulated_delay += delta;
+        bwe->smoothed_delay = NVIMAGE_BWE_SMOOTHING * bwe->smoothed_delay +
+                              (1 - NVIMAGE_BWE_SMOOTHING) * bwe->accumulated_delay;
+
+        i = bwe->trend_count % NVIMAGE_BWE_TRENDLINE_WINDOW;
+        bwe->trend_x[i] = (gdouble) (arrival - bwe->first_arrival) / GST_MSECOND;
+        bwe->trend_y[i] = bwe->smoothed_delay;
+        bwe->trend_count++;
+
+        n = bwe->trend_count;
+        if (n < NVIMAGE_BWE_TRENDLINE_WINDOW)
+                return;
+        n = NVIMAGE_BWE_TRENDLINE_WINDOW;
+
+        for (i = 0; i < n; i++) {
+                x_mean += bwe->trend_x[i];
+                y_mean += bwe->trend_y[i];
+        }
+        x_mean /= n;
+        y_mean /= n;
+        for (i = 0; i < n; i++) {
+                num += (bwe->trend_x[i] - x_mean) * (bwe->trend_y[i] - y_mean);
+                den += (bwe->trend_x[i] - x_mean) * (bwe->trend_x[i] - x_mean);
+        }
+        if (den == 0)
+                return;
+
+        trend = num / den * MIN (bwe->trend_count, NVIMAGE_BWE_MAX_DELTAS) * NVIMAGE_BWE_TREND_GAIN;
+        gst_nvimage_bwe_detect (bwe, trend, send_delta, arrival);
+}
+
+/* Closes the open group and compares its spacing on arrival with the
+   spacing on sending */
+static void
+gst_nvimage_bwe_group_done (GstNVimageBwe * bwe)
+{
+        gdouble send_delta, arrival_delta;
+
+        if (GST_CLOCK_TIME_IS_VALID (bwe->prev_send) && bwe->group_last_send > bwe->prev_send &&
+            bwe->group_arrival >= bwe->prev_arrival) {
+                send_delta = (gdouble) (bwe->group_last_send - bwe->prev_send) / GST_MSECOND;
+                arrival_delta = (gdouble) (bwe->group_arrival - bwe->prev_arrival) / GST_MSECOND;
+                gst_nvimage_bwe_trendline (bwe, arrival_delta - send_delta, send_delta, bwe->group_arrival);
+        }
+
+        bwe->prev_send = bwe->group_last_send;
+        bwe->prev_arrival = bwe->group_arrival;
+}
+
+static void
+gst_nvimage_bwe_packet (GstNVimageBwe * bwe, GstClockTime send, GstClockTime arrival, guint size)
+{
+        gdouble sample;
+
+        /* what got through */
+        if (!GST_CLOCK_TIME_IS_VALID (bwe->rate_start) || arrival < bwe->rate_start) {
+                bwe->rate_start = arrival;
+                bwe->rate_bytes = 0;
+        }
+        bwe->rate_bytes += size;
+        if (arrival - bwe->rate_start >= NVIMAGE_BWE_RATE_WINDOW) {
+                sample = (gdouble) bwe->rate_bytes * 8 * GST_SECOND / (arrival - bwe->rate_start);
+                bwe->received_rate = bwe->received_rate > 0 ? (bwe->received_rate + sample) / 2 : sample;
+                bwe->rate_start = arrival;
+                bwe->rate_bytes = 0;
+        }
+
+        /* a frame goes out in a burst of packets, the delay is measured
+           between bursts */
+        if (!GST_CLOCK_TIME_IS_VALID (bwe->group_send)) {
+                bwe->group_send = bwe->group_last_send = send;
+                bwe->group_arrival = arrival;
+        } else if (send > bwe->group_send + NVIMAGE_BWE_BURST) {
+                gst_nvimage_bwe_group_done (bwe);
+                bwe->group_send = bwe->group_last_send = send;
+                bwe->group_arrival = arrival;
+        } else if (send >= bwe->group_send) {
+                bwe->group_last_send = MAX (bwe->group_last_send, send);
+                bwe->group_arrival = MAX (bwe->group_arrival, arrival);
+        }
+}
+
+/* Moves the estimate after new feedback and hands it to the encoder when
+   it changed enough. Returns TRUE when the bitrate changed. */
+static gboolean
+gst_nvimage_bwe_update (GstNVimageBwe * bwe)
+{
+        gint64 now = g_get_monotonic_time ();
+        gdouble dt, growth, target;
+        guint bitrate;
+
+        dt = (gdouble) MIN (now - bwe->last_update, G_TIME_SPAN_SECOND) / G_TIME_SPAN_SECOND;
+        growth = 1 + bwe->ramp_up * dt / 100;
+
+        /* delay based: cut to what got through on congestion, grow slowly
+           while the path keeps up, hold while the queues drain */
+        switch (bwe->usage) {
+                case GST_NVIMAGE_BANDWIDTH_OVERUSE:
+                        if (now - bwe->last_decrease >= NVIMAGE_BWE_DECREASE_INTERVAL) {
+                                target = bwe->received_rate > 0 ?
+                                         MIN (bwe->received_rate, bwe->delay_estimate) : bwe->delay_estimate;
+                                bwe->delay_estimate = NVIMAGE_BWE_BETA * target;
+                                bwe->last_decrease = now;
+                                bwe->overuses++;
+                        }
+                        break;
+                case GST_NVIMAGE_BANDWIDTH_UNDERUSE:
+                        break;
+                case GST_NVIMAGE_BANDWIDTH_NORMAL:
+                        /* an idle screen sends little, don't let the
+                           estimate run away from what was tried */
+                        if (bwe->received_rate == 0 || bwe->delay_estimate < 1.5 * bwe->received_rate + 10000)
+                                bwe->delay_estimate *= growth;
+                        break;
+        }
+        bwe->delay_estimate = gst_nvimage_bwe_clamp (bwe, bwe->delay_estimate);
+
+        /* loss based */
+        if (bwe->loss > NVIMAGE_BWE_LOSS_HIGH)
+                bwe->loss_estimate *= 1 - bwe->loss / 2;
+        else if (bwe->loss < NVIMAGE_BWE_LOSS_LOW)
+                bwe->loss_estimate *= growth;
+        bwe->loss_estimate = gst_nvimage_bwe_clamp (bwe, bwe->loss_estimate);
+
+        target = MIN (bwe->delay_estimate, bwe->loss_estimate);
+        target = MIN (target, bwe->estimate * growth);
+        target = MAX (target, bwe->estimate * (100 - bwe->ramp_down) / 100);
+        bwe->estimate = gst_nvimage_bwe_clamp (bwe, target);
+        bwe->last_update = now;
+
+        bitrate = (guint) bwe->estimate;
+        if (bitrate == bwe->bitrate ||
+            (ABS ((gint64) bitrate - (gint64) bwe->bitrate) < bwe->bitrate / NVIMAGE_BWE_STEP &&
+             bitrate != bwe->min_bitrate && bitrate != bwe->max_bitrate))
+                return FALSE;
+
+        g_debug ("Bitrate %u -> %u, received %.0f, loss %.3f, usage %d", bwe->bitrate, bitrate,
+                 bwe->received_rate, bwe->loss, bwe->usage);
+        bwe->bitrate = bitrate;
+        return TRUE;
+}
+
+/* rtpsession hands the packets over in a GValueArray, take the GStreamer
+   list and array types as well */
+static guint
+gst_nvimage_bwe_packets_size (const GValue * packets)
+{
+        GValueArray *array;
+
+        if (GST_VALUE_HOLDS_LIST (packets))
+                return gst_value_list_get_size (packets);
+        if (GST_VALUE_HOLDS_ARRAY (packets))
+                return gst_value_array_get_size (packets);
+        G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+        if (G_VALUE_HOLDS (packets, G_TYPE_VALUE_ARRAY)) {
+                array = g_value_get_boxed (packets);
+                return array ? array->n_values : 0;
+        }
+        G_GNUC_END_IGNORE_DEPRECATIONS
+        return 0;
+}
+
+static const GValue *
+gst_nvimage_bwe_packets_nth (const GValue * packets, guint i)
+{
+        GValueArray *array;
+
+        if (GST_VALUE_HOLDS_LIST (packets))
+                return gst_value_list_get_value (packets, i);
+        if (GST_VALUE_HOLDS_ARRAY (packets))
+                return gst_value_array_get_value (packets, i);
+        array = g_value_get_boxed (packets);
+        return &array->values[i];
+}
+
+/* Feeds the "RTPTWCCPackets" feedback of the RTP session: per packet the
+   send and arrival times, its size and whether it was lost. Returns TRUE
+   when the bitrate changed. */
+gboolean
+gst_nvimage_bwe_twcc (GstNVimageBwe * bwe, const GstStructure * packets)
+{
+        const GValue *list, *value;
+        const GstStructure *packet;
+        GstClockTime send, arrival;
+        gboolean lost, changed;
+        guint i, n, size, nlost = 0, nreceived = 0;
+
+        list = gst_structure_get_value (packets, "packets");
+        if (list == NULL)
+                return FALSE;
+        n = gst_nvimage_bwe_packets_size (list);
+
+        g_mutex_lock (&bwe->lock);
+        if (bwe->algorithm == GST_NVIMAGE_CONGESTION_NONE) {
+                g_mutex_unlock (&bwe->lock);
+                return FALSE;
+        }
+
+        for (i = 0; i < n; i++) {
+                value = gst_nvimage_bwe_packets_nth (list, i);
+                if (!GST_VALUE_HOLDS_STRUCTURE (value))
+                        continue;
+                packet = gst_value_get_structure (value);
+
+                lost = FALSE;
+                gst_structure_get_boolean (packet, "lost", &lost);
+                if (lost) {
+                        nlost++;
+                        continue;
+                }
+
+                if (!gst_structure_get_clock_time (packet, "local-ts", &send) ||
+                    !gst_structure_get_clock_time (packet, "remote-ts", &arrival) ||
+                    !GST_CLOCK_TIME_IS_VALID (send) || !GST_CLOCK_TIME_IS_VALID (arrival))
+                        continue;
+                if (!gst_structure_get_uint (packet, "size", &size))
+                        size = 0;
+
+                nreceived++;
+                gst_nvimage_bwe_packet (bwe, send, arrival, size);
+        }
+
+        if (nlost + nreceived == 0) {
+                g_mutex_unlock (&bwe->lock);
+                return FALSE;
+        }
+        bwe->loss = (gdouble) nlost / (nlost + nreceived);
+
+        changed = gst_nvimage_bwe_update (bwe);
+        g_mutex_unlock (&bwe->lock);
+
+        return changed;
+}
+
+/* Downstream running late on our buffers takes the estimate down in
+   proportion. Returns TRUE when the bitrate changed. */
+gboolean
+gst_nvimage_bwe_qos (GstNVimageBwe * bwe, GstQOSType type, gdouble proportion, GstClockTimeDiff diff)
+{
+        gint64 now = g_get_monotonic_time ();
+        gboolean changed;
+
+        if (type != GST_QOS_TYPE_OVERFLOW || proportion <= 1.0 || diff <= 0)
+                return FALSE;
+
+        g_mutex_lock (&bwe->lock);
+        if (bwe->algorithm == GST_NVIMAGE_CONGESTION_NONE ||
+            now - bwe->last_decrease < NVIMAGE_BWE_QOS_INTERVAL) {
+                g_mutex_unlock (&bwe->lock);
+                return FALSE;
+        }
+
+        bwe->delay_estimate = MIN (bwe->delay_estimate, bwe->estimate / proportion);
+        bwe->last_decrease = now;
+        bwe->overuses++;
+
+        changed = gst_nvimage_bwe_update (bwe);
+        g_mutex_unlock (&bwe->lock);
+
+        return changed;
+}
+
+guint
+gst_nvimage_bwe_get_bitrate (GstNVimageBwe * bwe)
+{
+        guint bitrate;
+
+        g_mutex_lock (&bwe->lock);
+        bitrate = bwe->bitrate;
+        g_mutex_unlock (&bwe->lock);
+
+        return bitrate;
+}
+
+void
+gst_nvimage_bwe_get_stats (GstNVimageBwe * bwe, guint * received_rate, gdouble * loss, guint * overuses)
+{
+        g_mutex_lock (&bwe->lock);
+        if (received_rate)
+                *received_rate = (guint) bwe->received_rate;
+        if (loss)
+                *loss = bwe->loss;
+        if (overuses)
+                *overuses = bwe->overuses;
+        g_mutex_unlock (&bwe->lock);
+}
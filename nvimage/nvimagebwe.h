@@ -0,0 +1,163 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGEBWE_H__
+#define __GST_NVIMAGEBWE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* delay variations kept for the slope of the one way delay */
+#define NVIMAGE_BWE_TRENDLINE_WINDOW 20
+
+/**
+ * GstNVimageCongestionControl:
+ * @GST_NVIMAGE_CONGESTION_NONE: encode at the bitrate property
+ * @GST_NVIMAGE_CONGESTION_GCC: estimate the available bandwidth from the
+ * delay and loss in the transport-wide feedback, and from QoS events,
+ * the way Google Congestion Control does
+ *
+ * What drives the bitrate of the encoder.
+ */
+typedef enum {
+  GST_NVIMAGE_CONGESTION_NONE,
+  GST_NVIMAGE_CONGESTION_GCC,
+} GstNVimageCongestionControl;
+
+/**
+ * GstNVimageBandwidthUsage:
+ * @GST_NVIMAGE_BANDWIDTH_NORMAL: the queues on the path are stable
+ * @GST_NVIMAGE_BANDWIDTH_OVERUSE: the queues on the path are building up
+ * @GST_NVIMAGE_BANDWIDTH_UNDERUSE: the queues on the path are draining
+ *
+ * What the trend of the one way delay says about the path.
+ */
+typedef enum {
+  GST_NVIMAGE_BANDWIDTH_NORMAL,
+  GST_NVIMAGE_BANDWIDTH_OVERUSE,
+  GST_NVIMAGE_BANDWIDTH_UNDERUSE,
+} GstNVimageBandwidthUsage;
+
+typedef struct _GstNVimageBwe GstNVimageBwe;
+
+/**
+ * GstNVimageBwe:
+ * @lock: protects the fields below
+ * @algorithm: what estimates the bandwidth
+ * @start_bitrate: where the estimate starts, in bits per second
+ * @min_bitrate: the estimate never goes below this
+ * @max_bitrate: the estimate never goes above this
+ * @ramp_up: the estimate grows by at most this many percent per second
+ * @ramp_down: the estimate drops by at most this many percent at once
+ * @bitrate: the bitrate handed to the encoder
+ * @estimate: the current estimate, @bitrate follows it in steps
+ * @delay_estimate: what the one way delay allows
+ * @loss_estimate: what the packet loss allows
+ * @last_update: monotonic time of the last change to @estimate, in us
+ * @last_decrease: monotonic time of the last cut, in us
+ * @group_send: send time of the first packet of the open group
+ * @group_last_send: send time of the last packet of the open group
+ * @group_arrival: arrival time of the last packet of the open group
+ * @prev_send: send time of the previous complete group
+ * @prev_arrival: arrival time of the previous complete group
+ * @first_arrival: arrival time the trendline is measured from
+ * @accumulated_delay: sum of the delay variations, in ms
+ * @smoothed_delay: @accumulated_delay smoothed, in ms
+ * @trend_x: arrival times of the last delay variations, in ms
+ * @trend_y: smoothed delays at those times, in ms
+ * @trend_count: delay variations seen, the window holds the last ones
+ * @prev_trend: the previous modified trend
+ * @threshold: the adaptive overuse threshold, in ms
+ * @last_threshold: arrival time of the last threshold update
+ * @overuse_time: how long the trend has been over the threshold, in ms
+ * @overuse_count: consecutive groups over the threshold
+ * @usage: the state of the path
+ * @rate_start: arrival time of the first packet counted in @rate_bytes
+ * @rate_bytes: bytes received since @rate_start
+ * @received_rate: what actually got through lately, in bits per second
+ * @loss: fraction of the packets lost in the last report
+ * @overuses: times the path was found congested
+ *
+ * Estimates the bandwidth towards the receiver from the transport-wide
+ * congestion control feedback of the RTP session and from QoS events, and
+ * derives the bitrate to encode at.
+ */
+struct _GstNVimageBwe {
+  GMutex lock;
+
+  GstNVimageCongestionControl algorithm;
+  guint start_bitrate;
+  guint min_bitrate;
+  guint max_bitrate;
+  guint ramp_up;
+  guint ramp_down;
+
+  guint bitrate;
+  gdouble estimate;
+  gdouble delay_estimate;
+  gdouble loss_estimate;
+  gint64 last_update;
+  gint64 last_decrease;
+
+  GstClockTime group_send;
+  GstClockTime group_last_send;
+  GstClockTime group_arrival;
+  GstClockTime prev_send;
+  GstClockTime prev_arrival;
+  GstClockTime first_arrival;
+
+  gdouble accumulated_delay;
+  gdouble smoothed_delay;
+  gdouble trend_x[NVIMAGE_BWE_TRENDLINE_WINDOW];
+  gdouble trend_y[NVIMAGE_BWE_TRENDLINE_WINDOW];
+  guint trend_count;
+  gdouble prev_trend;
+  gdouble threshold;
+  GstClockTime last_threshold;
+  gdouble overuse_time;
+  guint overuse_count;
+  GstNVimageBandwidthUsage usage;
+
+  GstClockTime rate_start;
+  guint64 rate_bytes;
+  gdouble received_rate;
+  gdouble loss;
+
+  guint overuses;
+};
+
+void gst_nvimage_bwe_init (GstNVimageBwe * bwe);
+void gst_nvimage_bwe_clear (GstNVimageBwe * bwe);
+void gst_nvimage_bwe_reset (GstNVimageBwe * bwe);
+
+void gst_nvimage_bwe_configure (GstNVimageBwe * bwe, GstNVimageCongestionControl algorithm,
+                                guint start_bitrate, guint min_bitrate, guint max_bitrate,
+                                guint ramp_up, guint ramp_down);
+
+gboolean gst_nvimage_bwe_twcc (GstNVimageBwe * bwe, const GstStructure * packets);
+gboolean gst_nvimage_bwe_qos (GstNVimageBwe * bwe, GstQOSType type, gdouble proportion,
+                              GstClockTimeDiff diff);
+
+guint gst_nvimage_bwe_get_bitrate (GstNVimageBwe * bwe);
+void gst_nvimage_bwe_get_stats (GstNVimageBwe * bwe, guint * received_rate, gdouble * loss,
+                                guint * overuses);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGEBWE_H__ */
@@ -0,0 +1,461 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimageutil.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+#include <x264.h>
+
+/**
+ * GstNVimageCpu:
+ * @shminfo: the shared memory segment @image lives in
+ * @image: the XShm image the capture box is read into
+ * @damage: damage of the root window, None without the DAMAGE extension
+ * @box_region: the capture box, damage elsewhere is not a change
+ * @parts: scratch region the damage is taken into
+ * @encoder: the x264 encoder
+ * @param: the settings @encoder was opened with
+ * @picture: the I420 picture the grabs are converted to
+ * @next_grab: when a producing capture thread grabs next, in monotonic µs
+ *
+ * State of the CPU backend of a capture context.
+ */
+typedef struct {
+  XShmSegmentInfo shminfo;
+  XImage *image;
+
+  Damage damage;
+  XserverRegion box_region;
+  XserverRegion parts;
+
+  x264_t *encoder;
+  x264_param_t param;
+  x264_picture_t picture;
+
+  gint64 next_grab;
+} GstNVimageCpu;
+
+/* Whether the capture box was drawn to since the previous call. Without the
+   DAMAGE extension every grab counts as a change. */
+static gboolean
+nvimagecpu_damaged (GstXContext * xcontext, GstNVimageCpu * cpu)
+{
+        XRectangle *rects;
+        gint       n = 0;
+
+        if (cpu->damage == None)
+                return TRUE;
+
+        XDamageSubtract (xcontext->disp, cpu->damage, None, cpu->parts);
+        XFixesIntersectRegion (xcontext->disp, cpu->parts, cpu->parts, cpu->box_region);
+        rects = XFixesFetchRegion (xcontext->disp, cpu->parts, &n);
+        if (rects)
+                XFree (rects);
+
+        return n > 0;
+}
+
+static void
+nvimagecpu_damage_open (GstXContext * xcontext, GstNVimageCpu * cpu)
+{
+        XRectangle box;
+        gint       event_base, error_base;
+
+        if (!XFixesQueryExtension (xcontext->disp, &event_base, &error_base) ||
+            !XDamageQueryExtension (xcontext->disp, &event_base, &error_base)) {
+                g_debug ("No DAMAGE extension, every grab is encoded");
+                return;
+        }
+
+        box.x = xcontext->capture_box.x;
+        box.y = xcontext->capture_box.y;
+        box.width = xcontext->capture_box.w;
+        box.height = xcontext->capture_box.h;
+
+        cpu->damage = XDamageCreate (xcontext->disp, DefaultRootWindow (xcontext->disp), XDamageReportNonEmpty);
+        cpu->box_region = XFixesCreateRegion (xcontext->disp, &box, 1);
+        cpu->parts = XFixesCreateRegion (xcontext->disp, NULL, 0);
+}
+
+static gboolean
+nvimagecpu_shm_open (GstXContext * xcontext, GstNVimageCpu * cpu)
+{
+        Display *disp = xcontext->disp;
+        gint    screen = DefaultScreen (disp);
+
+        if (!XShmQueryExtension (disp)) {
+                g_warning ("Cannot capture on the CPU, no MIT-SHM extension");
+                return FALSE;
+        }
+
+        cpu->shminfo.shmid = -1;
+        cpu->image = XShmCreateImage (disp, DefaultVisual (disp, screen), DefaultDepth (disp, screen), ZPixmap,
+                                      NULL, &cpu->shminfo, xcontext->width, xcontext->height);
+        if (cpu->image == NULL) {
+                g_warning ("Cannot create XShm image");
+                return FALSE;
+        }
+
+        /* the conversion reads B, G, R and a pad byte per pixel */
+        if (cpu->image->bits_per_pixel != 32 || cpu->image->red_mask != 0xff0000 ||
+            cpu->image->green_mask != 0xff00 || cpu->image->blue_mask != 0xff) {
+                g_warning ("Cannot capture a %d bpp screen on the CPU", cpu->image->bits_per_pixel);
+                return FALSE;
+        }
+
+        cpu->shminfo.shmid = shmget (IPC_PRIVATE, cpu->image->bytes_per_line * cpu->image->height,
+                                     IPC_CREAT | 0600);
+        if (cpu->shminfo.shmid < 0) {
+                g_warning ("Cannot create shared memory segment");
+                return FALSE;
+        }
+
+        cpu->shminfo.shmaddr = cpu->image->data = shmat (cpu->shminfo.shmid, NULL, 0);
+        if (cpu->shminfo.shmaddr == (char *) -1) {
+                cpu->shminfo.shmaddr = cpu->image->data = NULL;
+                g_warning ("Cannot attach shared memory segment");
+                return FALSE;
+        }
+        cpu->shminfo.readOnly = False;
+
+        if (!XShmAttach (disp, &cpu->shminfo)) {
+                g_warning ("Cannot attach shared memory segment to the X server");
+                return FALSE;
+        }
+        XSync (disp, False);
+
+        /* gone as soon as both sides detached */
+        shmctl (cpu->shminfo.shmid, IPC_RMID, NULL);
+
+        return TRUE;
+}
+
+static void
+nvimagecpu_encoder_config (GstXContext * xcontext, x264_param_t * param)
+{
+        guint fps = MAX (xcontext->fps_n / MAX (xcontext->fps_d, 1), 1);
+
+        param->i_fps_num = xcontext->fps_n;
+        param->i_fps_den = xcontext->fps_d;
+        param->i_timebase_num = xcontext->fps_d;
+        param->i_timebase_den = xcontext->fps_n;
+        param->rc.i_bitrate = MAX (xcontext->bitrate / 1000, 1);
+        param->rc.i_vbv_max_bitrate = param->rc.i_bitrate;
+        /* about one frame worth of buffering, like the NVENC sessions */
+        param->rc.i_vbv_buffer_size = MAX (param->rc.i_bitrate / fps, 1);
+}
+
+static gboolean
+nvimagecpu_encoder_open (GstXContext * xcontext, GstNVimageCpu * cpu)
+{
+        x264_param_t *param = &cpu->param;
+
+        if (x264_param_default_preset (param, "ultrafast", "zerolatency") < 0) {
+                g_warning ("Cannot set up x264 presets");
+                return FALSE;
+        }
+
+        param->i_log_level = X264_LOG_WARNING;
+        param->i_csp = X264_CSP_I420;
+        param->i_width = xcontext->width;
+        param->i_height = xcontext->height;
+        param->b_vfr_input = 0;
+        param->i_keyint_max = nvimageutil_gop_size (xcontext->fps_n, xcontext->fps_d);
+        param->i_frame_reference = 1;
+        param->rc.i_rc_method = X264_RC_ABR;
+        param->b_repeat_headers = 1;
+        param->b_annexb = 1;
+        nvimagecpu_encoder_config (xcontext, param);
+
+        if (x264_param_apply_profile (param, "high") < 0) {
+                g_warning ("Cannot apply x264 profile");
+                return FALSE;
+        }
+
+        cpu->encoder = x264_encoder_open (param);
+        if (cpu->encoder == NULL) {
+                g_warning ("Cannot open x264 encoder");
+                return FALSE;
+        }
+
+        if (x264_picture_alloc (&cpu->picture, X264_CSP_I420, xcontext->width, xcontext->height) < 0) {
+                x264_encoder_close (cpu->encoder);
+                cpu->encoder = NULL;
+                g_warning ("Cannot allocate x264 picture");
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static gboolean
+nvimagecpu_open (GstXContext * xcontext)
+{
+        GstNVimageCpu *cpu;
+        gint          screen_w = WidthOfScreen (xcontext->screen);
+        gint          screen_h = HeightOfScreen (xcontext->screen);
+
+        if (xcontext->monitor) {
+                g_warning ("Cannot capture monitor %s on the CPU", xcontext->monitor);
+                return FALSE;
+        }
+
+        /* the region clipped to the screen, I420 wants an even size */
+        xcontext->capture_box.x = MIN (xcontext->region.x, screen_w - 2);
+        xcontext->capture_box.y = MIN (xcontext->region.y, screen_h - 2);
+        xcontext->capture_box.w = screen_w - xcontext->capture_box.x;
+        xcontext->capture_box.h = screen_h - xcontext->capture_box.y;
+        if (xcontext->region.w)
+                xcontext->capture_box.w = MIN (xcontext->region.w, xcontext->capture_box.w);
+        if (xcontext->region.h)
+                xcontext->capture_box.h = MIN (xcontext->region.h, xcontext->capture_box.h);
+        xcontext->capture_box.w &= ~1;
+        xcontext->capture_box.h &= ~1;
+
+        xcontext->width = xcontext->capture_box.w;
+        xcontext->height = xcontext->capture_box.h;
+
+        g_debug ("CPU capture box: %ux%u+%u+%u of screen %dx%d",
+                 xcontext->capture_box.w, xcontext->capture_box.h, xcontext->capture_box.x,
+                 xcontext->capture_box.y, screen_w, screen_h);
+
+        cpu = g_new0 (GstNVimageCpu, 1);
+        xcontext->backend_data = cpu;
+
+        if (!nvimagecpu_shm_open (xcontext, cpu) || !nvimagecpu_encoder_open (xcontext, cpu))
+                return FALSE;
+        nvimagecpu_damage_open (xcontext, cpu);
+
+        /* a fresh encoder starts with a picture */
+        xcontext->last_encode = 0;
+        cpu->next_grab = 0;
+
+        return TRUE;
+}
+
+/* BGRx to BT.601 limited range I420, the chroma of each 2x2 block from the
+   average of its pixels */
+static void
+nvimagecpu_convert (const XImage * image, x264_picture_t * picture, gint width, gint height)
+{
+        const guint8 *row0, *row1;
+        guint8       *y0, *y1, *u, *v;
+        gint         x, y, i, r, g, b;
+
+        for (y = 0; y < height; y += 2) {
+                row0 = (const guint8 *) image->data + y * image->bytes_per_line;
+                row1 = row0 + image->bytes_per_line;
+                y0 = picture->img.plane[0] + y * picture->img.i_stride[0];
+                y1 = y0 + picture->img.i_stride[0];
+                u = picture->img.plane[1] + (y / 2) * picture->img.i_stride[1];
+                v = picture->img.plane[2] + (y / 2) * picture->img.i_stride[2];
+
+                for (x = 0; x < width; x += 2) {
+                        const guint8 *p[4] = { row0 + x * 4, row0 + x * 4 + 4, row1 + x * 4, row1 + x * 4 + 4 };
+                        guint8       *out[4] = { y0 + x, y0 + x + 1, y1 + x, y1 + x + 1 };
+
+                        r = g = b = 0;
+                        for (i = 0; i < 4; i++) {
+                                *out[i] = ((66 * p[i][2] + 129 * p[i][1] + 25 * p[i][0] + 128) >> 8) + 16;
+                                b += p[i][0];
+                                g += p[i][1];
+                                r += p[i][2];
+                        }
+                        r /= 4;
+                        g /= 4;
+                        b /= 4;
+                        u[x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                        v[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+                }
+        }
+}
+
+/* Grabs the capture box and encodes it. A capture thread producing on its
+   own is paced here, there is no NvFBC to wait for the next frame. */
+static GstFlowReturn
+nvimagecpu_frame (GstXContext * xcontext, const GstNVimageParams * params, gint64 frame, GstBuffer ** buf)
+{
+        GstNVimageCpu  *cpu = xcontext->backend_data;
+        GstBuffer      *nvimage = NULL;
+        GstMetaNVimage *meta;
+        GstMemory      *mem;
+        XEvent         event;
+        x264_nal_t     *nals;
+        x264_picture_t out;
+        gint           n, size;
+        gint64         now, interval, start;
+        Bool           grabbed;
+
+        if (g_atomic_int_get (&xcontext->producing)) {
+                interval = (G_USEC_PER_SEC * (gint64) xcontext->fps_d) / MAX (xcontext->fps_n, 1);
+                now = g_get_monotonic_time ();
+                if (cpu->next_grab > now)
+                        g_usleep (cpu->next_grab - now);
+                cpu->next_grab = MAX (now, cpu->next_grab) + interval;
+        }
+
+        /* the damage is read back from the server, its events are of no
+           use; a followed window has its events read before */
+        if (xcontext->window == None) {
+                while (XPending (xcontext->disp))
+                        XNextEvent (xcontext->disp, &event);
+        }
+
+        if (!nvimagecpu_damaged (xcontext, cpu) &&
+            nvimageutil_may_skip (xcontext, params, params->forcekeyframe)) {
+                g_atomic_int_inc (&xcontext->skipped);
+                return NVIMAGE_FLOW_UNCHANGED;
+        }
+
+        NVIMAGE_TRACE (xcontext->parent, GST_NVIMAGE_TRACE_GRAB_START, grab_start, frame, 0);
+        start = gst_nvimage_stats_now (xcontext->stats);
+        grabbed = XShmGetImage (xcontext->disp, DefaultRootWindow (xcontext->disp), cpu->image,
+                                xcontext->capture_box.x, xcontext->capture_box.y, AllPlanes);
+        gst_nvimage_stats_since (xcontext->stats, GST_NVIMAGE_STAGE_GRAB, start);
+        NVIMAGE_TRACE (xcontext->parent, GST_NVIMAGE_TRACE_GRAB_END, grab_end, frame, !grabbed);
+        if (!grabbed) {
+                g_warning ("Cannot grab frame with XShm");
+                return GST_FLOW_ERROR;
+        }
+
+        /* the conversion stands for the mapping of the grab to NVENC */
+        start = gst_nvimage_stats_now (xcontext->stats);
+        nvimagecpu_convert (cpu->image, &cpu->picture, xcontext->width, xcontext->height);
+        gst_nvimage_stats_since (xcontext->stats, GST_NVIMAGE_STAGE_MAP, start);
+        cpu->picture.i_type = params->forcekeyframe ? X264_TYPE_IDR : X264_TYPE_AUTO;
+        cpu->picture.i_pts = frame;
+
+        NVIMAGE_TRACE (xcontext->parent, GST_NVIMAGE_TRACE_ENCODE_SUBMIT, encode_submit, frame,
+                       params->forcekeyframe != 0);
+        start = gst_nvimage_stats_now (xcontext->stats);
+        size = x264_encoder_encode (cpu->encoder, &nals, &n, &cpu->picture, &out);
+        gst_nvimage_stats_since (xcontext->stats, GST_NVIMAGE_STAGE_ENCODE, start);
+        NVIMAGE_TRACE (xcontext->parent, GST_NVIMAGE_TRACE_ENCODE_COMPLETE, encode_complete, frame, MAX (size, 0));
+        if (size < 0) {
+                g_warning ("Cannot encode frame with x264");
+                return GST_FLOW_ERROR;
+        }
+        /* zerolatency has no lookahead, but don't count on it */
+        if (size == 0)
+                return NVIMAGE_FLOW_UNCHANGED;
+
+        if (gst_buffer_pool_acquire_buffer (xcontext->pool, &nvimage, NULL) != GST_FLOW_OK) {
+                g_warning ("Cannot acquire buffer from pool");
+                return GST_FLOW_ERROR;
+        }
+
+        /* the NAL units of a picture follow each other in x264's buffer */
+        start = gst_nvimage_stats_now (xcontext->stats);
+        mem = gst_nvimage_pool_copy_payload (GST_NVIMAGE_POOL_CAST (xcontext->pool), nals[0].p_payload, size);
+        gst_nvimage_stats_since (xcontext->stats, GST_NVIMAGE_STAGE_COPY, start);
+        if (out.b_keyframe)
+                xcontext->stats->idrs++;
+
+        meta = GST_META_NVIMAGE_GET (nvimage);
+        meta->offset = 0;
+        meta->size = size;
+        meta->width = xcontext->width;
+        meta->height = xcontext->height;
+        meta->keyframe = out.b_keyframe;
+        meta->capture_time = g_get_monotonic_time ();
+        meta->repeated = FALSE;
+        meta->codec = xcontext->codec;
+
+        gst_buffer_append_memory (nvimage, mem);
+        if (!meta->keyframe)
+                GST_BUFFER_FLAG_SET (nvimage, GST_BUFFER_FLAG_DELTA_UNIT);
+        xcontext->last_encode = g_get_monotonic_time ();
+
+        *buf = nvimage;
+        return GST_FLOW_OK;
+}
+
+/* x264 changes the rate control of a running encoder, not its timing */
+static gboolean
+nvimagecpu_reconfigure (GstXContext * xcontext)
+{
+        GstNVimageCpu *cpu = xcontext->backend_data;
+
+        if (cpu->param.i_fps_num != xcontext->fps_n || cpu->param.i_fps_den != xcontext->fps_d)
+                return FALSE;
+
+        nvimagecpu_encoder_config (xcontext, &cpu->param);
+        if (x264_encoder_reconfig (cpu->encoder, &cpu->param) < 0) {
+                g_warning ("Cannot reconfigure x264, rebuilding the encoder");
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static gboolean
+nvimagecpu_close (GstXContext * xcontext)
+{
+        GstNVimageCpu *cpu = xcontext->backend_data;
+
+        if (cpu == NULL)
+                return TRUE;
+
+        if (cpu->encoder) {
+                x264_picture_clean (&cpu->picture);
+                x264_encoder_close (cpu->encoder);
+        }
+
+        if (cpu->damage != None) {
+                XDamageDestroy (xcontext->disp, cpu->damage);
+                XFixesDestroyRegion (xcontext->disp, cpu->box_region);
+                XFixesDestroyRegion (xcontext->disp, cpu->parts);
+        }
+
+        if (cpu->image) {
+                if (cpu->shminfo.shmaddr) {
+                        XShmDetach (xcontext->disp, &cpu->shminfo);
+                        XSync (xcontext->disp, False);
+                        shmdt (cpu->shminfo.shmaddr);
+                        if (cpu->shminfo.shmid >= 0)
+                                shmctl (cpu->shminfo.shmid, IPC_RMID, NULL);
+                }
+                /* the data is the segment, not for Xlib to free */
+                cpu->image->data = NULL;
+                XDestroyImage (cpu->image);
+        }
+
+        g_free (cpu);
+        xcontext->backend_data = NULL;
+
+        return TRUE;
+}
+
+const GstNVimageBackend gst_nvimage_backend_cpu = {
+        "CPU",
+        1 << GST_NVIMAGE_CODEC_H264,
+        FALSE,
+        nvimagecpu_open,
+        nvimagecpu_frame,
+        nvimagecpu_reconfigure,
+        nvimagecpu_close,
+};
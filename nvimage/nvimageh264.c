@@ -0,0 +1,686 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "nvimageh264.h"
+
+#define NAL_SLICE     1
+#define NAL_SLICE_IDR 5
+#define NAL_SPS       7
+#define NAL_PPS       8
+
+/* Slice header bytes needed to reach pic_order_cnt_lsb */
+#define SLICE_HEADER_PREFIX 32
+
+/* CABAC tables, ITU-T H.264 9.3.3.2.1 and 9.3.3.2.2 */
+static const guint8 range_tab_lps[64][4] = {
+        {128, 176, 208, 240}, {128, 167, 197, 227}, {128, 158, 187, 216}, {123, 150, 178, 205},
+        {116, 142, 169, 195}, {111, 135, 160, 185}, {105, 128, 152, 175}, {100, 122, 144, 166},
+        {95, 116, 137, 158}, {90, 110, 130, 150}, {85, 104, 123, 142}, {81, 99, 117, 135},
+        {77, 94, 111, 128}, {73, 89, 105, 122}, {69, 85, 100, 116}, {66, 80, 95, 110},
+        {62, 76, 90, 104}, {59, 72, 86, 99}, {56, 69, 81, 94}, {53, 65, 77, 89},
+        {51, 62, 73, 85}, {48, 59, 69, 80}, {46, 56, 66, 76}, {43, 53, 63, 72},
+        {41, 50, 59, 69}, {39, 48, 56, 65}, {37, 45, 54, 62}, {35, 43, 51, 59},
+        {33, 41, 48, 56}, {32, 39, 46, 53}, {30, 37, 43, 50}, {29, 35, 41, 48},
+        {27, 33, 39, 45}, {26, 31, 37, 43}, {24, 30, 35, 41}, {23, 28, 33, 39},
+        {22, 27, 32, 37}, {21, 26, 30, 35}, {20, 24, 29, 33}, {19, 23, 27, 31},
+        {18, 22, 26, 30}, {17, 21, 25, 28}, {16, 20, 23, 27}, {15, 19, 22, 25},
+        {14, 18, 21, 24}, {14, 17, 20, 23}, {13, 16, 19, 22}, {12, 15, 18, 21},
+        {12, 14, 17, 20}, {11, 14, 16, 19}, {11, 13, 15, 18}, {10, 12, 15, 17},
+        {10, 12, 14, 16}, {9, 11, 13, 15}, {9, 11, 12, 14}, {8, 10, 12, 14},
+        {8, 9, 11, 13}, {7, 9, 11, 12}, {7, 9, 10, 12}, {7, 8, 10, 11},
+        {6, 8, 9, 11}, {6, 7, 9, 10}, {6, 7, 8, 9}, {2, 2, 2, 2},
+};
+
+static const guint8 trans_idx_lps[64] = {
+        0, 0, 1, 2, 2, 4, 4, 5, 6, 7, 8, 9, 9, 11, 11, 12,
+        13, 13, 15, 15, 16, 16, 18, 18, 19, 19, 21, 21, 22, 22, 23, 24,
+        24, 25, 26, 26, 27, 27, 28, 29, 29, 30, 30, 30, 31, 32, 32, 33,
+        33, 33, 34, 34, 35, 35, 35, 36, 36, 36, 37, 37, 37, 38, 38, 63,
+};
+
+/* mb_skip_flag of P slices, ctxIdx 11 with cabac_init_idc 0 */
+#define SKIP_CTX_M 23
+#define SKIP_CTX_N 33
+
+typedef struct {
+        const guint8 *data;
+        gsize size;
+        gsize pos;
+        gboolean overrun;
+} GstNVimageBitReader;
+
+typedef struct {
+        guint8 *data;
+        gsize size;
+        gsize pos;
+} GstNVimageBitWriter;
+
+typedef struct {
+        GstNVimageBitWriter *writer;
+        guint low;
+        guint range;
+        guint outstanding;
+        gboolean first;
+} GstNVimageCabac;
+
+typedef struct {
+        guint type;
+        guint ref_idc;
+        guint first_mb;
+        guint frame_num;
+        gsize frame_num_pos;
+        guint poc_lsb;
+        gsize poc_pos;
+} GstNVimageSliceHeader;
+
+static guint
+read_bits (GstNVimageBitReader * r, guint n)
+{
+        guint v = 0;
+
+        while (n--) {
+                v <<= 1;
+                if (r->pos >= r->size * 8) {
+                        r->overrun = TRUE;
+                        continue;
+                }
+                v |= (r->data[r->pos >> 3] >> (7 - (r->pos & 7))) & 1;
+                r->pos++;
+        }
+        return v;
+}
+
+static guint
+read_ue (GstNVimageBitReader * r)
+{
+        guint zeros = 0;
+
+        while (!read_bits (r, 1)) {
+                if (r->overrun || ++zeros > 31) {
+                        r->overrun = TRUE;
+                        return 0;
+                }
+        }
+        return (1u << zeros) - 1 + read_bits (r, zeros);
+}
+
+static gint
+read_se (GstNVimageBitReader * r)
+{
+        guint k = read_ue (r);
+
+        return k & 1 ? (gint) ((k + 1) / 2) : -(gint) (k / 2);
+}
+
+static void
+put_bits (GstNVimageBitWriter * w, guint n, guint v)
+{
+        while (n--) {
+                if ((v >> n) & 1 && (w->pos >> 3) < w->size)
+                        w->data[w->pos >> 3] |= 0x80 >> (w->pos & 7);
+                w->pos++;
+        }
+}
+
+static void
+put_ue (GstNVimageBitWriter * w, guint v)
+{
+        guint len = g_bit_storage (v + 1);
+
+        put_bits (w, len - 1, 0);
+        put_bits (w, len, v + 1);
+}
+
+static void
+put_se (GstNVimageBitWriter * w, gint v)
+{
+        put_ue (w, v > 0 ? 2 * v - 1 : -2 * v);
+}
+
+/* Overwrites @n bits at bit @pos of @data with @v */
+static void
+set_bits (guint8 * data, gsize pos, guint n, guint v)
+{
+        while (n--) {
+                if ((v >> n) & 1)
+                        data[pos >> 3] |= 0x80 >> (pos & 7);
+                else
+                        data[pos >> 3] &= ~(0x80 >> (pos & 7));
+                pos++;
+        }
+}
+
+/* Finds the NAL unit following byte @pos of an Annex B stream; its payload
+   is [@start, @end) and @pos moves on to the start code after it */
+static gboolean
+next_nal (const guint8 * data, gsize size, gsize * pos, gsize * start, gsize * end)
+{
+        gsize i = *pos;
+
+        while (i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1))
+                i++;
+        if (i + 3 > size)
+                return FALSE;
+
+        *start = i = i + 3;
+        while (i + 3 <= size && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1))
+                i++;
+        if (i + 3 > size)
+                i = size;
+        *pos = i;
+
+        /* zero bytes in front of the next start code are not payload */
+        while (i > *start && data[i - 1] == 0)
+                i--;
+        *end = i;
+
+        return TRUE;
+}
+
+/* Strips emulation prevention bytes, stops after @max bytes of output */
+static gsize
+nal_unescape (const guint8 * src, gsize len, guint8 * dst, gsize max)
+{
+        gsize i, o = 0;
+        guint zeros = 0;
+
+        for (i = 0; i < len && o < max; i++) {
+                if (zeros >= 2 && src[i] == 3) {
+                        zeros = 0;
+                        continue;
+                }
+                zeros = src[i] == 0 ? zeros + 1 : 0;
+                dst[o++] = src[i];
+        }
+        return o;
+}
+
+/* Adds emulation prevention bytes, @dst must hold @len * 3 / 2 + 1 bytes */
+static gsize
+nal_escape (const guint8 * src, gsize len, guint8 * dst)
+{
+        gsize i, o = 0;
+        guint zeros = 0;
+
+        for (i = 0; i < len; i++) {
+                if (zeros >= 2 && src[i] <= 3) {
+                        dst[o++] = 3;
+                        zeros = 0;
+                }
+                zeros = src[i] == 0 ? zeros + 1 : 0;
+                dst[o++] = src[i];
+        }
+        return o;
+}
+
+static void
+ensure_scratch (guint8 ** buf, gsize * size, gsize need)
+{
+        if (*size >= need)
+                return;
+        *buf = g_realloc (*buf, need);
+        *size = need;
+}
+
+static void
+skip_scaling_list (GstNVimageBitReader * r, guint size)
+{
+        gint last = 8, next = 8;
+
+        for (guint j = 0; j < size; j++) {
+                if (next != 0)
+                        next = (last + read_se (r) + 256) % 256;
+                if (next != 0)
+                        last = next;
+        }
+}
+
+static gboolean
+parse_sps (GstNVimageH264 * h264, const guint8 * rbsp, gsize len)
+{
+        GstNVimageBitReader r = { rbsp, len, 8, FALSE };
+        guint profile, chroma_format_idc = 1, n;
+        gboolean separate_colour_plane = FALSE, frame_mbs_only;
+        guint width, height;
+
+        profile = read_bits (&r, 8);
+        read_bits (&r, 16);     /* constraint flags, level */
+        read_ue (&r);           /* seq_parameter_set_id */
+
+        if (profile == 100 || profile == 110 || profile == 122 || profile == 244 ||
+            profile == 44 || profile == 83 || profile == 86 || profile == 118 ||
+            profile == 128 || profile == 138 || profile == 139 || profile == 134 || profile == 135) {
+                chroma_format_idc = read_ue (&r);
+                if (chroma_format_idc == 3)
+                        separate_colour_plane = read_bits (&r, 1);
+                read_ue (&r);   /* bit_depth_luma_minus8 */
+                read_ue (&r);   /* bit_depth_chroma_minus8 */
+                read_bits (&r, 1);
+                if (read_bits (&r, 1)) {
+                        n = chroma_format_idc != 3 ? 8 : 12;
+                        for (guint i = 0; i < n; i++) {
+                                if (read_bits (&r, 1))
+                                        skip_scaling_list (&r, i < 6 ? 16 : 64);
+                        }
+                }
+        }
+
+        h264->log2_max_frame_num = read_ue (&r) + 4;
+        h264->poc_type = read_ue (&r);
+        h264->log2_max_poc_lsb = 0;
+        h264->delta_poc_always_zero = FALSE;
+        if (h264->poc_type == 0) {
+                h264->log2_max_poc_lsb = read_ue (&r) + 4;
+        } else if (h264->poc_type == 1) {
+                h264->delta_poc_always_zero = read_bits (&r, 1);
+                read_se (&r);
+                read_se (&r);
+                n = read_ue (&r);
+                for (guint i = 0; i < n && !r.overrun; i++)
+                        read_se (&r);
+        }
+
+        read_ue (&r);           /* max_num_ref_frames */
+        read_bits (&r, 1);
+        width = read_ue (&r) + 1;
+        height = read_ue (&r) + 1;
+        frame_mbs_only = read_bits (&r, 1);
+
+        /* fields and separate colour planes change the slice syntax */
+        if (r.overrun || !frame_mbs_only || separate_colour_plane ||
+            h264->log2_max_frame_num > 16 || h264->log2_max_poc_lsb > 16)
+                return FALSE;
+
+        h264->chroma_array_type = chroma_format_idc;
+        h264->mbs = width * height;
+
+        return TRUE;
+}
+
+static gboolean
+parse_pps (GstNVimageH264 * h264, const guint8 * rbsp, gsize len)
+{
+        GstNVimageBitReader r = { rbsp, len, 8, FALSE };
+
+        h264->pps_id = read_ue (&r);
+        read_ue (&r);           /* seq_parameter_set_id */
+        h264->cabac = read_bits (&r, 1);
+        h264->bottom_field_pic_order = read_bits (&r, 1);
+        if (read_ue (&r) != 0)  /* num_slice_groups_minus1 */
+                return FALSE;
+        read_ue (&r);
+        read_ue (&r);
+        h264->weighted_pred = read_bits (&r, 1);
+        read_bits (&r, 2);
+        h264->init_qp = 26 + read_se (&r);
+        read_se (&r);
+        read_se (&r);
+        h264->deblocking_control = read_bits (&r, 1);
+        read_bits (&r, 1);
+        h264->redundant_pic_cnt = read_bits (&r, 1);
+
+        return !r.overrun;
+}
+
+void
+gst_nvimage_h264_init (GstNVimageH264 * h264)
+{
+        memset (h264, 0, sizeof (GstNVimageH264));
+}
+
+void
+gst_nvimage_h264_clear (GstNVimageH264 * h264)
+{
+        g_free (h264->rbsp);
+        g_free (h264->out);
+        gst_nvimage_h264_init (h264);
+}
+
+/* Takes the SPS and PPS the encoder uses from @data, in Annex B format, and
+   forgets about the pictures of the previous ones. Returns whether skipped
+   pictures can be written for this stream. */
+gboolean
+gst_nvimage_h264_set_headers (GstNVimageH264 * h264, const guint8 * data, gsize size)
+{
+        gboolean have_sps = FALSE, have_pps = FALSE;
+        gsize pos = 0, start, end, len;
+
+        h264->valid = FALSE;
+        h264->have_picture = FALSE;
+        h264->ref_idc = 2;
+        h264->poc_step = 2;
+        h264->frame_num_offset = 0;
+        h264->poc_offset = 0;
+
+        ensure_scratch (&h264->rbsp, &h264->rbsp_size, size);
+
+        while (next_nal (data, size, &pos, &start, &end)) {
+                if (start == end)
+                        continue;
+                len = nal_unescape (data + start, end - start, h264->rbsp, h264->rbsp_size);
+                switch (data[start] & 0x1f) {
+                        case NAL_SPS:
+                                have_sps = parse_sps (h264, h264->rbsp, len);
+                                break;
+                        case NAL_PPS:
+                                have_pps = parse_pps (h264, h264->rbsp, len);
+                                break;
+                }
+        }
+
+        h264->valid = have_sps && have_pps;
+        return h264->valid;
+}
+
+static gboolean
+parse_slice_header (GstNVimageH264 * h264, const guint8 * rbsp, gsize len, GstNVimageSliceHeader * sh)
+{
+        GstNVimageBitReader r = { rbsp, len, 8, FALSE };
+
+        sh->ref_idc = (rbsp[0] >> 5) & 3;
+        sh->type = rbsp[0] & 0x1f;
+        sh->first_mb = read_ue (&r);
+        read_ue (&r);           /* slice_type */
+        if (read_ue (&r) != h264->pps_id)
+                return FALSE;
+
+        sh->frame_num_pos = r.pos;
+        sh->frame_num = read_bits (&r, h264->log2_max_frame_num);
+        if (sh->type == NAL_SLICE_IDR)
+                read_ue (&r);   /* idr_pic_id */
+
+        sh->poc_pos = r.pos;
+        sh->poc_lsb = 0;
+        if (h264->poc_type == 0)
+                sh->poc_lsb = read_bits (&r, h264->log2_max_poc_lsb);
+
+        return !r.overrun;
+}
+
+/* Follows the numbering of the encoder's pictures, @sh as the encoder wrote
+   it */
+static void
+track_picture (GstNVimageH264 * h264, const GstNVimageSliceHeader * sh)
+{
+        guint frame_num_mask = (1u << h264->log2_max_frame_num) - 1;
+        guint poc_mask = (1u << h264->log2_max_poc_lsb) - 1;
+        guint step;
+
+        if (sh->type == NAL_SLICE_IDR) {
+                h264->frame_num_offset = 0;
+                h264->poc_offset = 0;
+        } else if (h264->poc_type == 0 && h264->have_picture) {
+                step = (sh->poc_lsb - h264->last_poc_lsb) & poc_mask;
+                if (step > 0 && step <= poc_mask / 2)
+                        h264->poc_step = step;
+        }
+
+        if (sh->ref_idc) {
+                h264->ref_idc = sh->ref_idc;
+                h264->frame_num = (sh->frame_num + h264->frame_num_offset) & frame_num_mask;
+        }
+        h264->last_poc_lsb = sh->poc_lsb;
+        h264->poc_lsb = (sh->poc_lsb + h264->poc_offset) & poc_mask;
+        h264->have_picture = TRUE;
+}
+
+/* To be called on every picture of the encoder, in order. Returns the
+   picture as it must go out: @data when it can go as is, or a rewritten copy
+   in the scratch buffer, valid until the next call, with @size updated. */
+const guint8 *
+gst_nvimage_h264_fixup_picture (GstNVimageH264 * h264, const guint8 * data, gsize * size)
+{
+        GstNVimageSliceHeader sh;
+        guint8 prefix[SLICE_HEADER_PREFIX];
+        gsize pos = 0, start, end, len, last = 0, o = 0;
+        guint frame_num_mask, poc_mask;
+        guint type = 0;
+
+        if (!h264->valid)
+                return data;
+
+        while (next_nal (data, *size, &pos, &start, &end)) {
+                type = start < end ? data[start] & 0x1f : 0;
+                if (type == NAL_SLICE || type == NAL_SLICE_IDR)
+                        break;
+        }
+        if (type != NAL_SLICE && type != NAL_SLICE_IDR)
+                return data;
+
+        len = nal_unescape (data + start, end - start, prefix, sizeof (prefix));
+        if (!parse_slice_header (h264, prefix, len, &sh)) {
+                /* not a picture we understand, no more inserted ones */
+                h264->valid = FALSE;
+                return data;
+        }
+
+        track_picture (h264, &sh);
+
+        if (type == NAL_SLICE_IDR || (h264->frame_num_offset == 0 && h264->poc_offset == 0))
+                return data;
+
+        /* Renumber every slice past the pictures inserted */
+        ensure_scratch (&h264->rbsp, &h264->rbsp_size, *size);
+        ensure_scratch (&h264->out, &h264->out_size, *size + *size / 2 + 1);
+        frame_num_mask = (1u << h264->log2_max_frame_num) - 1;
+        poc_mask = (1u << h264->log2_max_poc_lsb) - 1;
+
+        pos = 0;
+        while (next_nal (data, *size, &pos, &start, &end)) {
+                if (start == end || (data[start] & 0x1f) != NAL_SLICE)
+                        continue;
+
+                len = nal_unescape (data + start, end - start, h264->rbsp, h264->rbsp_size);
+                if (!parse_slice_header (h264, h264->rbsp, len, &sh))
+                        continue;
+
+                set_bits (h264->rbsp, sh.frame_num_pos, h264->log2_max_frame_num,
+                          (sh.frame_num + h264->frame_num_offset) & frame_num_mask);
+                if (h264->poc_type == 0)
+                        set_bits (h264->rbsp, sh.poc_pos, h264->log2_max_poc_lsb,
+                                  (sh.poc_lsb + h264->poc_offset) & poc_mask);
+
+                memcpy (h264->out + o, data + last, start - last);
+                o += start - last;
+                o += nal_escape (h264->rbsp, len, h264->out + o);
+                last = end;
+        }
+        memcpy (h264->out + o, data + last, *size - last);
+        o += *size - last;
+
+        *size = o;
+        return h264->out;
+}
+
+static void
+cabac_put_bit (GstNVimageCabac * c, guint bit)
+{
+        if (c->first)
+                c->first = FALSE;
+        else
+                put_bits (c->writer, 1, bit);
+
+        for (; c->outstanding > 0; c->outstanding--)
+                put_bits (c->writer, 1, 1 - bit);
+}
+
+static void
+cabac_renorm (GstNVimageCabac * c)
+{
+        while (c->range < 256) {
+                if (c->low < 256) {
+                        cabac_put_bit (c, 0);
+                } else if (c->low >= 512) {
+                        c->low -= 512;
+                        cabac_put_bit (c, 1);
+                } else {
+                        c->low -= 256;
+                        c->outstanding++;
+                }
+                c->range <<= 1;
+                c->low <<= 1;
+        }
+}
+
+static void
+cabac_decision (GstNVimageCabac * c, guint8 * state, guint8 * mps, guint bin)
+{
+        guint lps = range_tab_lps[*state][(c->range >> 6) & 3];
+
+        c->range -= lps;
+        if (bin != *mps) {
+                c->low += c->range;
+                c->range = lps;
+                if (*state == 0)
+                        *mps = 1 - *mps;
+                *state = trans_idx_lps[*state];
+        } else if (*state < 62) {
+                (*state)++;
+        }
+        cabac_renorm (c);
+}
+
+static void
+cabac_terminate (GstNVimageCabac * c, guint bin)
+{
+        c->range -= 2;
+        if (!bin) {
+                cabac_renorm (c);
+                return;
+        }
+
+        /* flush, the last bit written is rbsp_stop_one_bit */
+        c->low += c->range;
+        c->range = 2;
+        cabac_renorm (c);
+        cabac_put_bit (c, (c->low >> 9) & 1);
+        put_bits (c->writer, 2, ((c->low >> 7) & 3) | 1);
+}
+
+static void
+write_skip_slice_data (GstNVimageH264 * h264, GstNVimageBitWriter * w, gint qp)
+{
+        GstNVimageCabac c = { w, 0, 510, 0, TRUE };
+        guint8 state, mps;
+        gint pre;
+
+        if (!h264->cabac) {
+                put_ue (w, h264->mbs);  /* mb_skip_run */
+                put_bits (w, 1, 1);
+                return;
+        }
+
+        while (w->pos & 7)
+                put_bits (w, 1, 1);     /* cabac_alignment_one_bit */
+
+        /* All neighbours are skipped, so mb_skip_flag always uses the first
+           of its contexts */
+        pre = CLAMP (((SKIP_CTX_M * CLAMP (qp, 0, 51)) >> 4) + SKIP_CTX_N, 1, 126);
+        state = pre <= 63 ? 63 - pre : pre - 64;
+        mps = pre <= 63 ? 0 : 1;
+
+        for (guint i = 0; i < h264->mbs; i++) {
+                cabac_decision (&c, &state, &mps, 1);
+                cabac_terminate (&c, i == h264->mbs - 1);       /* end_of_slice_flag */
+        }
+}
+
+/* Writes an access unit repeating the previous picture. Returns NULL when
+   the stream does not allow it, the access unit in the scratch buffer
+   otherwise, valid until the next call. */
+const guint8 *
+gst_nvimage_h264_write_skip (GstNVimageH264 * h264, gsize * size)
+{
+        static const guint8 aud[] = { 0, 0, 0, 1, 0x09, 0x30, 0, 0, 0, 1 };
+        GstNVimageBitWriter w;
+        guint frame_num, poc_lsb;
+        gsize need;
+
+        if (!h264->valid || !h264->have_picture)
+                return NULL;
+
+        frame_num = (h264->frame_num + 1) & ((1u << h264->log2_max_frame_num) - 1);
+        poc_lsb = (h264->poc_lsb + h264->poc_step) & ((1u << h264->log2_max_poc_lsb) - 1);
+
+        /* a skipped macroblock costs well below 2 bits */
+        need = 64 + h264->mbs / 4;
+        ensure_scratch (&h264->rbsp, &h264->rbsp_size, need);
+        ensure_scratch (&h264->out, &h264->out_size, sizeof (aud) + need + need / 2 + 1);
+        memset (h264->rbsp, 0, need);
+        w.data = h264->rbsp;
+        w.size = need;
+        w.pos = 0;
+
+        put_bits (&w, 8, (h264->ref_idc << 5) | NAL_SLICE);
+        put_ue (&w, 0);         /* first_mb_in_slice */
+        put_ue (&w, 5);         /* P, all slices */
+        put_ue (&w, h264->pps_id);
+        put_bits (&w, h264->log2_max_frame_num, frame_num);
+        if (h264->poc_type == 0) {
+                put_bits (&w, h264->log2_max_poc_lsb, poc_lsb);
+                if (h264->bottom_field_pic_order)
+                        put_se (&w, 0);
+        } else if (h264->poc_type == 1 && !h264->delta_poc_always_zero) {
+                put_se (&w, 0);
+                if (h264->bottom_field_pic_order)
+                        put_se (&w, 0);
+        }
+        if (h264->redundant_pic_cnt)
+                put_ue (&w, 0);
+        put_bits (&w, 1, 1);    /* num_ref_idx_active_override_flag */
+        put_ue (&w, 0);         /* a single reference */
+        put_bits (&w, 1, 0);    /* ref_pic_list_modification_flag_l0 */
+        if (h264->weighted_pred) {
+                /* default weights */
+                put_ue (&w, 0);
+                if (h264->chroma_array_type)
+                        put_ue (&w, 0);
+                put_bits (&w, 1, 0);
+                if (h264->chroma_array_type)
+                        put_bits (&w, 1, 0);
+        }
+        put_bits (&w, 1, 0);    /* adaptive_ref_pic_marking_mode_flag */
+        if (h264->cabac)
+                put_ue (&w, 0); /* cabac_init_idc */
+        put_se (&w, 0);         /* slice_qp_delta */
+        if (h264->deblocking_control)
+                put_ue (&w, 1); /* nothing to filter */
+
+        write_skip_slice_data (h264, &w, h264->init_qp);
+
+        if (w.pos > need * 8) {
+                h264->valid = FALSE;
+                return NULL;
+        }
+
+        memcpy (h264->out, aud, sizeof (aud));
+        *size = sizeof (aud) + nal_escape (h264->rbsp, (w.pos + 7) / 8, h264->out + sizeof (aud));
+
+        h264->frame_num = frame_num;
+        h264->poc_lsb = poc_lsb;
+        h264->frame_num_offset = (h264->frame_num_offset + 1) & ((1u << h264->log2_max_frame_num) - 1);
+        h264->poc_offset = (h264->poc_offset + h264->poc_step) & ((1u << h264->log2_max_poc_lsb) - 1);
+
+        return h264->out;
+}
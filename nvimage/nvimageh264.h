@@ -0,0 +1,106 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGEH264_H__
+#define __GST_NVIMAGEH264_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstNVimageH264 GstNVimageH264;
+
+/**
+ * GstNVimageH264:
+ * @valid: the stream headers were understood, skipped pictures can be
+ * written once a picture went out
+ * @have_picture: a picture of the encoder was seen since the headers
+ * @log2_max_frame_num: from the SPS
+ * @poc_type: pic_order_cnt_type from the SPS
+ * @log2_max_poc_lsb: from the SPS, for @poc_type 0
+ * @delta_poc_always_zero: from the SPS, for @poc_type 1
+ * @chroma_array_type: ChromaArrayType derived from the SPS
+ * @mbs: macroblocks in a picture
+ * @pps_id: id of the PPS the encoder refers to
+ * @cabac: entropy_coding_mode_flag from the PPS
+ * @bottom_field_pic_order: bottom_field_pic_order_in_frame_present_flag
+ * @weighted_pred: weighted_pred_flag from the PPS
+ * @redundant_pic_cnt: redundant_pic_cnt_present_flag from the PPS
+ * @deblocking_control: deblocking_filter_control_present_flag from the PPS
+ * @init_qp: pic_init_qp from the PPS
+ * @ref_idc: nal_ref_idc of the encoder's reference pictures
+ * @frame_num: frame_num of the last reference picture that went out
+ * @poc_lsb: pic_order_cnt_lsb of the last picture that went out
+ * @poc_step: pic_order_cnt_lsb increment between two pictures
+ * @frame_num_offset: added to the frame_num of the encoder's pictures
+ * @poc_offset: added to the pic_order_cnt_lsb of the encoder's pictures
+ * @last_poc_lsb: pic_order_cnt_lsb of the encoder's last picture as written
+ * by the encoder
+ * @rbsp: scratch for a picture with its emulation prevention removed
+ * @out: scratch for the pictures written or rewritten
+ *
+ * Writes pictures that repeat the previous one as a single slice of
+ * P_Skip macroblocks, without the encoder. They are reference pictures, so
+ * the encoder's following pictures get their frame_num and POC moved on by
+ * the pictures inserted; the offsets fall back to 0 at the next IDR. The
+ * encoder must use a single reference frame, the inserted picture then
+ * stands in for the one it predicts from, which has the same contents.
+ */
+struct _GstNVimageH264 {
+  gboolean valid;
+  gboolean have_picture;
+
+  guint log2_max_frame_num;
+  guint poc_type;
+  guint log2_max_poc_lsb;
+  gboolean delta_poc_always_zero;
+  guint chroma_array_type;
+  guint mbs;
+
+  guint pps_id;
+  gboolean cabac;
+  gboolean bottom_field_pic_order;
+  gboolean weighted_pred;
+  gboolean redundant_pic_cnt;
+  gboolean deblocking_control;
+  gint init_qp;
+
+  guint ref_idc;
+  guint frame_num;
+  guint poc_lsb;
+  guint poc_step;
+  guint frame_num_offset;
+  guint poc_offset;
+  guint last_poc_lsb;
+
+  guint8 *rbsp;
+  gsize rbsp_size;
+  guint8 *out;
+  gsize out_size;
+};
+
+void gst_nvimage_h264_init (GstNVimageH264 * h264);
+void gst_nvimage_h264_clear (GstNVimageH264 * h264);
+
+gboolean gst_nvimage_h264_set_headers (GstNVimageH264 * h264, const guint8 * data, gsize size);
+const guint8 * gst_nvimage_h264_fixup_picture (GstNVimageH264 * h264, const guint8 * data, gsize * size);
+const guint8 * gst_nvimage_h264_write_skip (GstNVimageH264 * h264, gsize * size);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGEH264_H__ */
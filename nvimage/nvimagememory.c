@@ -0,0 +1,239 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimagememory.h"
+
+typedef struct {
+  GstAllocator parent;
+} GstNVimageAllocator;
+
+typedef struct {
+  GstAllocatorClass parent_class;
+} GstNVimageAllocatorClass;
+
+GType gst_nvimage_allocator_get_type (void);
+G_DEFINE_TYPE (GstNVimageAllocator, gst_nvimage_allocator, GST_TYPE_ALLOCATOR);
+
+static GstMemory *
+gst_nvimage_allocator_alloc (GstAllocator * allocator, gsize size, GstAllocationParams * params)
+{
+        g_warning ("nvimage memory only wraps NVENC bitstreams, it can't be allocated");
+        return NULL;
+}
+
+static void
+gst_nvimage_allocator_free (GstAllocator * allocator, GstMemory * memory)
+{
+        GstNVimageMemory *mem = (GstNVimageMemory *) memory;
+
+        g_free (mem->copy);
+        /* sub-memories never use theirs */
+        if (memory->parent == NULL) {
+                g_mutex_clear (&mem->lock);
+                g_cond_clear (&mem->cond);
+        }
+        g_slice_free (GstNVimageMemory, mem);
+}
+
+/* The memory holding the bitstream: sub-memories follow their parent,
+   which may have been detached */
+static GstNVimageMemory *
+gst_nvimage_memory_root (GstNVimageMemory * mem)
+{
+        return mem->mem.parent ? (GstNVimageMemory *) mem->mem.parent : mem;
+}
+
+static gpointer
+gst_nvimage_memory_map (GstNVimageMemory * mem, gsize maxsize, GstMapFlags flags)
+{
+        GstNVimageMemory *root = gst_nvimage_memory_root (mem);
+        gpointer data;
+
+        g_mutex_lock (&root->lock);
+        data = root->data;
+        if (root->copy == NULL)
+                root->maps++;
+        g_mutex_unlock (&root->lock);
+
+        return data;
+}
+
+static void
+gst_nvimage_memory_unmap (GstNVimageMemory * mem, GstMapInfo * info)
+{
+        GstNVimageMemory *root = gst_nvimage_memory_root (mem);
+        guint8 *data = info->data;
+
+        g_mutex_lock (&root->lock);
+        /* mappings of the copy were not counted */
+        if (root->copy == NULL || data < (guint8 *) root->copy ||
+            data >= (guint8 *) root->copy + root->mem.maxsize) {
+                if (--root->maps == 0)
+                        g_cond_broadcast (&root->cond);
+        }
+        g_mutex_unlock (&root->lock);
+}
+
+static GstNVimageMemory *
+gst_nvimage_memory_share (GstNVimageMemory * mem, gssize offset, gssize size)
+{
+        GstNVimageMemory *sub;
+        GstMemory *parent;
+
+        if ((parent = mem->mem.parent) == NULL)
+                parent = (GstMemory *) mem;
+
+        if (size == -1)
+                size = mem->mem.size - offset;
+
+        /* The sub-memory keeps a ref on the parent, so the bitstream stays
+           locked until both are gone */
+        sub = g_slice_new0 (GstNVimageMemory);
+        gst_memory_init (GST_MEMORY_CAST (sub),
+                        GST_MINI_OBJECT_FLAGS (parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+                        mem->mem.allocator, parent, mem->mem.maxsize, mem->mem.align,
+                        mem->mem.offset + offset, size);
+
+        return sub;
+}
+
+static void
+gst_nvimage_allocator_class_init (GstNVimageAllocatorClass * klass)
+{
+        GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+        allocator_class->alloc = gst_nvimage_allocator_alloc;
+        allocator_class->free = gst_nvimage_allocator_free;
+}
+
+static void
+gst_nvimage_allocator_init (GstNVimageAllocator * allocator)
+{
+        GstAllocator *alloc = GST_ALLOCATOR_CAST (allocator);
+
+        alloc->mem_type = GST_NVIMAGE_MEMORY_TYPE;
+        alloc->mem_map = (GstMemoryMapFunction) gst_nvimage_memory_map;
+        alloc->mem_unmap_full = (GstMemoryUnmapFullFunction) gst_nvimage_memory_unmap;
+        alloc->mem_share = (GstMemoryShareFunction) gst_nvimage_memory_share;
+
+        GST_OBJECT_FLAG_SET (allocator, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+}
+
+/* The allocator is shared by every element instance and never freed */
+GstAllocator *
+gst_nvimage_allocator_get (void)
+{
+        static GstAllocator *allocator = NULL;
+
+        if (g_once_init_enter (&allocator)) {
+                GstAllocator *_allocator = g_object_new (gst_nvimage_allocator_get_type (), NULL);
+                GST_OBJECT_FLAG_SET (_allocator, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+                g_once_init_leave (&allocator, _allocator);
+        }
+        return allocator;
+}
+
+/* Instead of being freed, a memory handed out with
+   gst_nvimage_memory_set_data() comes back to its owner with one ref and its
+   release flag raised. Whoever clears @released first, this or
+   gst_nvimage_memory_detach(), decides what happens to the memory. */
+static gboolean
+gst_nvimage_memory_dispose (GstNVimageMemory * mem)
+{
+        volatile gint *released = g_atomic_pointer_get (&mem->released);
+
+        if (released && g_atomic_pointer_compare_and_exchange (&mem->released, released, NULL)) {
+                gst_memory_ref (GST_MEMORY_CAST (mem));
+                g_atomic_int_set (released, 1);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+GstMemory *
+gst_nvimage_memory_new (void)
+{
+        GstNVimageMemory *mem;
+
+        mem = g_slice_new0 (GstNVimageMemory);
+        g_mutex_init (&mem->lock);
+        g_cond_init (&mem->cond);
+        gst_memory_init (GST_MEMORY_CAST (mem), GST_MEMORY_FLAG_READONLY,
+                        gst_nvimage_allocator_get (), NULL, 0, 0, 0, 0);
+        GST_MINI_OBJECT_CAST (mem)->dispose = (GstMiniObjectDisposeFunction) gst_nvimage_memory_dispose;
+
+        return GST_MEMORY_CAST (mem);
+}
+
+/* Points an idle @mem at @data and hands out the owner's ref. @released is
+   raised once downstream gave it back. */
+GstMemory *
+gst_nvimage_memory_set_data (GstMemory * mem, gpointer data, gsize size, volatile gint * released)
+{
+        GstNVimageMemory *nmem = (GstNVimageMemory *) mem;
+
+        nmem->data = data;
+        mem->maxsize = size;
+        mem->size = size;
+        mem->offset = 0;
+
+        g_atomic_int_set (released, 0);
+        g_atomic_pointer_set (&nmem->released, released);
+
+        return mem;
+}
+
+/* Called by the owner when it must tear down the bitstream behind a memory it
+   handed out. Returns TRUE when downstream still holds the memory: it then
+   switches to a private copy of the payload and frees itself once dropped,
+   the owner must forget it. Mappings made before the switch still point at
+   the bitstream, this waits until they are all gone. Returns FALSE when the
+   memory came back, the owner holds its ref again. */
+gboolean
+gst_nvimage_memory_detach (GstMemory * mem, volatile gint * released)
+{
+        GstNVimageMemory *nmem = (GstNVimageMemory *) mem;
+
+        if (g_atomic_pointer_compare_and_exchange (&nmem->released, released, NULL)) {
+                g_mutex_lock (&nmem->lock);
+                nmem->copy = g_memdup2 (nmem->data, mem->maxsize);
+                nmem->data = nmem->copy;
+                while (nmem->maps > 0)
+                        g_cond_wait (&nmem->cond, &nmem->lock);
+                g_mutex_unlock (&nmem->lock);
+                return TRUE;
+        }
+
+        /* dispose won the race, wait until it gave the memory back */
+        while (!g_atomic_int_get (released))
+                g_thread_yield ();
+
+        return FALSE;
+}
+
+gboolean
+gst_nvimage_is_memory (GstMemory * mem)
+{
+        return mem != NULL && mem->allocator != NULL &&
+                g_type_is_a (G_OBJECT_TYPE (mem->allocator), gst_nvimage_allocator_get_type ());
+}
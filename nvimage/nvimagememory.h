@@ -0,0 +1,71 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGEMEMORY_H__
+#define __GST_NVIMAGEMEMORY_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_NVIMAGE_MEMORY_TYPE "NVimageBitstream"
+
+typedef struct _GstNVimageMemory GstNVimageMemory;
+
+/**
+ * GstNVimageMemory:
+ * @mem: the parent #GstMemory
+ * @data: the locked NVENC bitstream, or @copy once detached
+ * @released: flag raised when downstream drops its last reference, NULL
+ * while the memory is not handed out
+ * @copy: private copy of the payload owned by a detached memory
+ * @lock: protects @data, @copy and @maps
+ * @cond: signalled when @maps drops to 0
+ * @maps: mappings of the bitstream still held, sub-memories included; those
+ * of the copy are not counted
+ *
+ * Memory wrapping a locked NVENC output bitstream without copying it.
+ *
+ * The memory is created once per bitstream buffer and recycled: when
+ * downstream drops its last reference it is not freed but returned to its
+ * bitstream, and @released tells the capture thread that the bitstream can
+ * be unlocked. NVENC calls are left to that thread since they need its GL
+ * context.
+ */
+struct _GstNVimageMemory {
+  GstMemory mem;
+
+  gpointer data;
+  volatile gint *released;
+  gpointer copy;
+
+  GMutex lock;
+  GCond cond;
+  guint maps;
+};
+
+GstAllocator * gst_nvimage_allocator_get (void);
+
+GstMemory * gst_nvimage_memory_new (void);
+GstMemory * gst_nvimage_memory_set_data (GstMemory * mem, gpointer data, gsize size, volatile gint * released);
+gboolean gst_nvimage_memory_detach (GstMemory * mem, volatile gint * released);
+gboolean gst_nvimage_is_memory (GstMemory * mem);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGEMEMORY_H__ */
@@ -0,0 +1,157 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimagepacer.h"
+
+void
+gst_nvimage_pacer_init (GstNVimagePacer * pacer)
+{
+        g_mutex_init (&pacer->lock);
+        pacer->clock_id = NULL;
+        pacer->flushing = FALSE;
+        gst_nvimage_pacer_reset (pacer);
+}
+
+void
+gst_nvimage_pacer_clear (GstNVimagePacer * pacer)
+{
+        g_mutex_clear (&pacer->lock);
+}
+
+/* Forgets the schedule and the counters, the next frame starts at once */
+void
+gst_nvimage_pacer_reset (GstNVimagePacer * pacer)
+{
+        g_mutex_lock (&pacer->lock);
+        pacer->fps_n = 0;
+        pacer->fps_d = 1;
+        pacer->last_frame_no = -1;
+        pacer->late = 0;
+        pacer->dropped = 0;
+        pacer->duplicated = 0;
+        g_mutex_unlock (&pacer->lock);
+}
+
+/* Waits on @clock for the slot of the next frame and returns its number in
+   @frame_no, missed slots are handled according to @policy. Returns
+   %GST_CLOCK_UNSCHEDULED when woken up by gst_nvimage_pacer_set_flushing(),
+   %GST_CLOCK_OK otherwise. */
+GstClockReturn
+gst_nvimage_pacer_wait (GstNVimagePacer * pacer, GstClock * clock, GstClockTime base_time,
+                        gint fps_n, gint fps_d, GstNVimagePacingPolicy policy,
+                        gint64 * frame_no)
+{
+        GstClockTime now, running_time, slot_time;
+        GstClockReturn ret;
+        GstClockID id;
+        gint64 current, next;
+
+        g_return_val_if_fail (fps_n > 0 && fps_d > 0, GST_CLOCK_BADTIME);
+
+        g_mutex_lock (&pacer->lock);
+        if (pacer->flushing)
+                goto flushing;
+
+        /* slot numbers are only meaningful for the rate they were laid out
+           with, start over after a change */
+        if (pacer->fps_n != fps_n || pacer->fps_d != fps_d) {
+                pacer->fps_n = fps_n;
+                pacer->fps_d = fps_d;
+                pacer->last_frame_no = -1;
+        }
+
+        now = gst_clock_get_time (clock);
+        running_time = now > base_time ? now - base_time : 0;
+        current = gst_util_uint64_scale (running_time, fps_n, GST_SECOND * fps_d);
+
+        if (pacer->last_frame_no < 0 || current == pacer->last_frame_no + 1) {
+                next = current;
+        } else if (current <= pacer->last_frame_no) {
+                /* ahead of schedule, sleep until the next slot begins */
+                next = pacer->last_frame_no + 1;
+                slot_time = base_time + gst_util_uint64_scale (next, GST_SECOND * fps_d, fps_n);
+
+                id = pacer->clock_id = gst_clock_new_single_shot_id (clock, slot_time);
+                g_mutex_unlock (&pacer->lock);
+
+                ret = gst_clock_id_wait (id, NULL);
+
+                g_mutex_lock (&pacer->lock);
+                gst_clock_id_unref (id);
+                pacer->clock_id = NULL;
+                if (ret == GST_CLOCK_UNSCHEDULED || pacer->flushing)
+                        goto flushing;
+        } else if (policy == GST_NVIMAGE_PACING_DUPLICATE) {
+                /* behind, fill the missed slots back to back */
+                next = pacer->last_frame_no + 1;
+                pacer->late++;
+        } else {
+                next = current;
+                pacer->dropped += current - pacer->last_frame_no - 1;
+        }
+
+        pacer->last_frame_no = next;
+        g_mutex_unlock (&pacer->lock);
+
+        *frame_no = next;
+        return GST_CLOCK_OK;
+
+flushing:
+        g_mutex_unlock (&pacer->lock);
+        return GST_CLOCK_UNSCHEDULED;
+}
+
+/* Accounts a produced frame, @repeated when the screen had not changed
+   since the previous one */
+void
+gst_nvimage_pacer_frame_done (GstNVimagePacer * pacer, gboolean repeated)
+{
+        if (!repeated)
+                return;
+
+        g_mutex_lock (&pacer->lock);
+        pacer->duplicated++;
+        g_mutex_unlock (&pacer->lock);
+}
+
+void
+gst_nvimage_pacer_set_flushing (GstNVimagePacer * pacer, gboolean flushing)
+{
+        g_mutex_lock (&pacer->lock);
+        pacer->flushing = flushing;
+        if (flushing && pacer->clock_id)
+                gst_clock_id_unschedule (pacer->clock_id);
+        g_mutex_unlock (&pacer->lock);
+}
+
+void
+gst_nvimage_pacer_get_stats (GstNVimagePacer * pacer, guint * late, guint * dropped, guint * duplicated)
+{
+        g_mutex_lock (&pacer->lock);
+        if (late)
+                *late = pacer->late;
+        if (dropped)
+                *dropped = pacer->dropped;
+        if (duplicated)
+                *duplicated = pacer->duplicated;
+        g_mutex_unlock (&pacer->lock);
+}
@@ -0,0 +1,87 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGEPACER_H__
+#define __GST_NVIMAGEPACER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GstNVimagePacingPolicy:
+ * @GST_NVIMAGE_PACING_DROP: skip the frame slots that were missed and
+ * carry on with the current one
+ * @GST_NVIMAGE_PACING_DUPLICATE: produce a frame for every missed slot,
+ * without waiting, until the schedule is met again
+ *
+ * What the pacer does when frames are produced slower than the framerate.
+ */
+typedef enum {
+  GST_NVIMAGE_PACING_DROP,
+  GST_NVIMAGE_PACING_DUPLICATE,
+} GstNVimagePacingPolicy;
+
+typedef struct _GstNVimagePacer GstNVimagePacer;
+
+/**
+ * GstNVimagePacer:
+ * @lock: protects the fields below
+ * @fps_n: framerate numerator the slots are laid out with
+ * @fps_d: framerate denominator the slots are laid out with
+ * @last_frame_no: the slot of the last frame, -1 before the first one
+ * @clock_id: the pending wait, if any
+ * @flushing: set to make waits return %GST_CLOCK_UNSCHEDULED at once
+ * @late: frames produced after their slot had passed
+ * @dropped: frame slots skipped
+ * @duplicated: frames that repeated the previous screen contents
+ *
+ * Schedules frames on the pipeline clock: the running time is divided into
+ * slots of one frame duration, and a frame is started at the beginning of
+ * the slot that follows the previous frame.
+ */
+struct _GstNVimagePacer {
+  GMutex lock;
+
+  gint fps_n;
+  gint fps_d;
+  gint64 last_frame_no;
+
+  GstClockID clock_id;
+  gboolean flushing;
+
+  guint late;
+  guint dropped;
+  guint duplicated;
+};
+
+void gst_nvimage_pacer_init (GstNVimagePacer * pacer);
+void gst_nvimage_pacer_clear (GstNVimagePacer * pacer);
+void gst_nvimage_pacer_reset (GstNVimagePacer * pacer);
+
+GstClockReturn gst_nvimage_pacer_wait (GstNVimagePacer * pacer, GstClock * clock, GstClockTime base_time,
+                                       gint fps_n, gint fps_d, GstNVimagePacingPolicy policy,
+                                       gint64 * frame_no);
+void gst_nvimage_pacer_frame_done (GstNVimagePacer * pacer, gboolean repeated);
+void gst_nvimage_pacer_set_flushing (GstNVimagePacer * pacer, gboolean flushing);
+
+void gst_nvimage_pacer_get_stats (GstNVimagePacer * pacer, guint * late, guint * dropped, guint * duplicated);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGEPACER_H__ */
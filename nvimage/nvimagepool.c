@@ -0,0 +1,221 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include "nvimagepool.h"
+#include "nvimageutil.h"
+
+G_DEFINE_TYPE (GstNVimagePool, gst_nvimage_pool, GST_TYPE_BUFFER_POOL);
+
+static GstFlowReturn
+gst_nvimage_pool_alloc_buffer (GstBufferPool * bpool, GstBuffer ** buffer, GstBufferPoolAcquireParams * params)
+{
+        GstNVimagePool *pool = GST_NVIMAGE_POOL_CAST (bpool);
+        GstMetaNVimage *meta;
+
+        *buffer = gst_buffer_new ();
+        meta = GST_META_NVIMAGE_ADD (*buffer);
+        GST_META_FLAG_SET (meta, GST_META_FLAG_POOLED);
+
+        g_atomic_int_inc (&pool->allocations);
+
+        return GST_FLOW_OK;
+}
+
+/* Buffers go back empty, the payload is owned by its memory: a recycled
+   bitstream or an arena block */
+static void
+gst_nvimage_pool_reset_buffer (GstBufferPool * bpool, GstBuffer * buffer)
+{
+        GstMetaNVimage *meta;
+
+        gst_buffer_remove_all_memory (buffer);
+
+        GST_BUFFER_POOL_CLASS (gst_nvimage_pool_parent_class)->reset_buffer (bpool, buffer);
+
+        /* we removed the memory ourselves, the buffer is fine for reuse */
+        GST_BUFFER_FLAG_UNSET (buffer, GST_BUFFER_FLAG_TAG_MEMORY);
+
+        meta = GST_META_NVIMAGE_GET (buffer);
+        if (meta) {
+                meta->offset = 0;
+                meta->size = 0;
+                meta->keyframe = FALSE;
+                meta->capture_time = 0;
+                meta->repeated = FALSE;
+                meta->codec = GST_NVIMAGE_CODEC_H264;
+        }
+}
+
+static void
+gst_nvimage_arena_clear (GstNVimageArena * arena)
+{
+        for (guint i = 0; i < arena->count; i++)
+                gst_memory_unref (arena->blocks[i]);
+        arena->count = 0;
+}
+
+static void
+gst_nvimage_pool_finalize (GObject * object)
+{
+        GstNVimagePool *pool = GST_NVIMAGE_POOL_CAST (object);
+
+        gst_nvimage_arena_clear (&pool->small);
+        gst_nvimage_arena_clear (&pool->large);
+        gst_nvimage_arena_clear (&pool->frames);
+
+        G_OBJECT_CLASS (gst_nvimage_pool_parent_class)->finalize (object);
+}
+
+static void
+gst_nvimage_pool_class_init (GstNVimagePoolClass * klass)
+{
+        GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+        GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS (klass);
+
+        gobject_class->finalize = gst_nvimage_pool_finalize;
+        pool_class->alloc_buffer = gst_nvimage_pool_alloc_buffer;
+        pool_class->reset_buffer = gst_nvimage_pool_reset_buffer;
+}
+
+static void
+gst_nvimage_pool_init (GstNVimagePool * pool)
+{
+        pool->small.block_size = NVIMAGE_POOL_SMALL_BLOCK;
+        pool->large.block_size = NVIMAGE_POOL_LARGE_BLOCK;
+        /* raw frames all have the size of the capture, sized on first use */
+        pool->frames.align = sysconf (_SC_PAGESIZE) - 1;
+        pool->frames.exact = TRUE;
+}
+
+GstBufferPool *
+gst_nvimage_pool_new (void)
+{
+        GstBufferPool *pool;
+        GstStructure *config;
+
+        pool = g_object_new (GST_TYPE_NVIMAGE_POOL, NULL);
+
+        /* Buffers carry no memory while pooled, hence the size of 0. No upper
+           bound: downstream and the producer queue decide how many are out */
+        config = gst_buffer_pool_get_config (pool);
+        gst_buffer_pool_config_set_params (config, NULL, 0, 0, 0);
+        gst_buffer_pool_set_config (pool, config);
+
+        return pool;
+}
+
+static GstMemory *
+gst_nvimage_arena_alloc (GstNVimagePool * pool, GstNVimageArena * arena, gsize size)
+{
+        GstAllocationParams params;
+
+        gst_allocation_params_init (&params);
+        params.align = arena->align;
+        g_atomic_int_inc (&pool->allocations);
+
+        return gst_allocator_alloc (NULL, size, &params);
+}
+
+static GstMemory *
+gst_nvimage_arena_get_block (GstNVimagePool * pool, GstNVimageArena * arena, gsize size)
+{
+        GstMemory *block;
+        guint i;
+
+        /* The large arena settles on the biggest IDR seen so far */
+        if (size > arena->block_size)
+                arena->block_size = arena->exact ? size : size + size / 4;
+
+        for (i = 0; i < arena->count; i++) {
+                block = arena->blocks[i];
+                if (GST_MINI_OBJECT_REFCOUNT_VALUE (block) != 1)
+                        continue;
+                if (block->maxsize >= size)
+                        return block;
+
+                /* too small for this payload, trade it for a bigger one */
+                gst_memory_unref (block);
+                break;
+        }
+
+        if (i == arena->count) {
+                if (arena->count == NVIMAGE_POOL_ARENA_BLOCKS)
+                        return NULL;
+                arena->count++;
+        }
+
+        arena->blocks[i] = gst_nvimage_arena_alloc (pool, arena, arena->block_size);
+
+        return arena->blocks[i];
+}
+
+/* Returns a memory of @arena holding a copy of @data. The arena keeps its
+   own ref on the block, so the block returns to it as soon as downstream is
+   done. */
+static GstMemory *
+gst_nvimage_arena_copy (GstNVimagePool * pool, GstNVimageArena * arena, gconstpointer data, gsize size)
+{
+        GstMemory *mem, *block;
+        GstMapInfo map;
+
+        mem = block = gst_nvimage_arena_get_block (pool, arena, size);
+        if (mem == NULL) {
+                /* every block is still held downstream */
+                mem = gst_nvimage_arena_alloc (pool, arena, size);
+        }
+
+        /* fill it while we hold the only ref, it is writable then */
+        gst_memory_resize (mem, 0, size);
+        if (gst_memory_map (mem, &map, GST_MAP_WRITE)) {
+                memcpy (map.data, data, size);
+                gst_memory_unmap (mem, &map);
+        }
+
+        if (block)
+                gst_memory_ref (block);
+
+        return mem;
+}
+
+/* Returns a memory holding a copy of the encoded picture @data */
+GstMemory *
+gst_nvimage_pool_copy_payload (GstNVimagePool * pool, gconstpointer data, gsize size)
+{
+        return gst_nvimage_arena_copy (pool, size <= NVIMAGE_POOL_SMALL_BLOCK ? &pool->small : &pool->large,
+                                       data, size);
+}
+
+/* Returns a page aligned memory holding a copy of the raw frame @data */
+GstMemory *
+gst_nvimage_pool_copy_frame (GstNVimagePool * pool, gconstpointer data, gsize size)
+{
+        return gst_nvimage_arena_copy (pool, &pool->frames, data, size);
+}
+
+guint
+gst_nvimage_pool_get_allocations (GstNVimagePool * pool)
+{
+        return g_atomic_int_get (&pool->allocations);
+}
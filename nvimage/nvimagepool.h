@@ -0,0 +1,98 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGEPOOL_H__
+#define __GST_NVIMAGEPOOL_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* Payloads up to this size come from the small arena (P-frames), larger
+   ones from the large arena (IDRs) */
+#define NVIMAGE_POOL_SMALL_BLOCK (128 * 1024)
+#define NVIMAGE_POOL_LARGE_BLOCK (1024 * 1024)
+#define NVIMAGE_POOL_ARENA_BLOCKS 16
+
+typedef struct _GstNVimageArena GstNVimageArena;
+typedef struct _GstNVimagePool GstNVimagePool;
+typedef struct _GstNVimagePoolClass GstNVimagePoolClass;
+
+/**
+ * GstNVimageArena:
+ * @block_size: size of the blocks, the large arena grows it to the largest
+ * payload seen
+ * @align: alignment mask of the blocks, as in #GstAllocationParams
+ * @exact: grow @block_size to exactly the largest payload, for payloads that
+ * all have the same size
+ * @blocks: payload memories; the arena keeps one ref on each, a block is
+ * free again once that ref is the only one left
+ * @count: number of blocks allocated so far
+ *
+ * Payload storage for one size class of frames.
+ */
+struct _GstNVimageArena {
+  gsize block_size;
+  gsize align;
+  gboolean exact;
+  GstMemory *blocks[NVIMAGE_POOL_ARENA_BLOCKS];
+  guint count;
+};
+
+/**
+ * GstNVimagePool:
+ * @small: arena for payloads up to %NVIMAGE_POOL_SMALL_BLOCK
+ * @large: arena for bigger payloads
+ * @frames: page aligned arena for raw frames
+ * @allocations: number of heap allocations made for frames, buffers and
+ * payload storage alike
+ *
+ * Buffer pool for encoded and raw frames. Buffers keep their #GstMetaNVimage across
+ * uses and drop their memory when they come back, copied payloads are
+ * recycled through the arenas. Once the pool and arenas are warm, producing
+ * a frame does not allocate.
+ *
+ * The arenas are only used from the capture thread.
+ */
+struct _GstNVimagePool {
+  GstBufferPool parent;
+
+  GstNVimageArena small;
+  GstNVimageArena large;
+  GstNVimageArena frames;
+
+  volatile gint allocations;
+};
+
+struct _GstNVimagePoolClass {
+  GstBufferPoolClass parent_class;
+};
+
+#define GST_TYPE_NVIMAGE_POOL (gst_nvimage_pool_get_type ())
+#define GST_NVIMAGE_POOL_CAST(obj) ((GstNVimagePool *) (obj))
+
+GType gst_nvimage_pool_get_type (void);
+
+GstBufferPool * gst_nvimage_pool_new (void);
+GstMemory * gst_nvimage_pool_copy_payload (GstNVimagePool * pool, gconstpointer data, gsize size);
+GstMemory * gst_nvimage_pool_copy_frame (GstNVimagePool * pool, gconstpointer data, gsize size);
+guint gst_nvimage_pool_get_allocations (GstNVimagePool * pool);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGEPOOL_H__ */
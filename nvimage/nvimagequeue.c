@@ -0,0 +1,198 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimagequeue.h"
+
+GstNVimageQueue *
+gst_nvimage_queue_new (guint size, GstNVimageQueuePolicy policy)
+{
+        GstNVimageQueue *queue;
+        guint n = 1;
+
+        /* Round up so slot lookups are a mask instead of a division */
+        while (n < size)
+                n <<= 1;
+
+        queue = g_new0 (GstNVimageQueue, 1);
+        queue->size = n;
+        queue->policy = policy;
+        queue->items = g_new0 (GstBuffer *, n);
+        g_mutex_init (&queue->lock);
+        g_cond_init (&queue->cond);
+
+        return queue;
+}
+
+/* Claims the oldest queued buffer. In drop-oldest mode the producer may claim
+   the same slot concurrently, the compare-and-exchange on tail decides who
+   owns it. Returns NULL when the queue is empty. */
+static GstBuffer *
+gst_nvimage_queue_take_oldest (GstNVimageQueue * queue)
+{
+        GstBuffer *buf;
+        gint tail;
+
+        do {
+                tail = g_atomic_int_get (&queue->tail);
+                if (g_atomic_int_get (&queue->head) == tail)
+                        return NULL;
+                buf = g_atomic_pointer_get (&queue->items[(guint) tail & (queue->size - 1)]);
+        } while (!g_atomic_int_compare_and_exchange (&queue->tail, tail, tail + 1));
+
+        return buf;
+}
+
+/* Sleeps until the other side moved @head or @tail, or the queue starts
+   flushing. The state is checked again under the lock after announcing the
+   waiter, so a wakeup sent in between cannot be lost. */
+static void
+gst_nvimage_queue_wait (GstNVimageQueue * queue, gint head, gint tail)
+{
+        g_mutex_lock (&queue->lock);
+        g_atomic_int_inc (&queue->waiting);
+        if (g_atomic_int_get (&queue->head) == head &&
+            g_atomic_int_get (&queue->tail) == tail &&
+            !g_atomic_int_get (&queue->flushing))
+                g_cond_wait (&queue->cond, &queue->lock);
+        g_atomic_int_add (&queue->waiting, -1);
+        g_mutex_unlock (&queue->lock);
+}
+
+/* Only pays for the lock when the other side is actually asleep */
+static void
+gst_nvimage_queue_wake (GstNVimageQueue * queue)
+{
+        if (g_atomic_int_get (&queue->waiting)) {
+                g_mutex_lock (&queue->lock);
+                g_cond_broadcast (&queue->cond);
+                g_mutex_unlock (&queue->lock);
+        }
+}
+
+/* Producer side. Takes ownership of @buf. Returns FALSE when the queue is
+   flushing, @buf is dropped then. @dropped is set when an older buffer had to
+   be discarded to make room. */
+gboolean
+gst_nvimage_queue_push (GstNVimageQueue * queue, GstBuffer * buf, gboolean * dropped)
+{
+        GstBuffer *old;
+        gint head, tail;
+
+        if (dropped)
+                *dropped = FALSE;
+
+        head = g_atomic_int_get (&queue->head);
+        while (TRUE) {
+                if (g_atomic_int_get (&queue->flushing))
+                        goto flushing;
+
+                tail = g_atomic_int_get (&queue->tail);
+                if ((guint) head - (guint) tail < queue->size)
+                        break;
+
+                if (queue->policy == GST_NVIMAGE_QUEUE_DROP_OLDEST) {
+                        old = gst_nvimage_queue_take_oldest (queue);
+                        if (old) {
+                                gst_buffer_unref (old);
+                                g_atomic_int_inc (&queue->dropped);
+                                g_atomic_int_set (&queue->discont, 1);
+                                if (dropped)
+                                        *dropped = TRUE;
+                        }
+                } else {
+                        gst_nvimage_queue_wait (queue, head, tail);
+                }
+        }
+
+        g_atomic_pointer_set (&queue->items[(guint) head & (queue->size - 1)], buf);
+        g_atomic_int_set (&queue->head, head + 1);
+        gst_nvimage_queue_wake (queue);
+
+        return TRUE;
+
+flushing:
+        gst_buffer_unref (buf);
+        return FALSE;
+}
+
+/* Consumer side. Blocks until a buffer is available, returns NULL when the
+   queue is flushing. The first buffer after a drop is flagged DISCONT. */
+GstBuffer *
+gst_nvimage_queue_pop (GstNVimageQueue * queue)
+{
+        GstBuffer *buf;
+        gint head, tail;
+
+        while (TRUE) {
+                if (g_atomic_int_get (&queue->flushing))
+                        return NULL;
+
+                buf = gst_nvimage_queue_take_oldest (queue);
+                if (buf)
+                        break;
+
+                tail = g_atomic_int_get (&queue->tail);
+                head = g_atomic_int_get (&queue->head);
+                if (head == tail)
+                        gst_nvimage_queue_wait (queue, head, tail);
+        }
+
+        gst_nvimage_queue_wake (queue);
+
+        if (g_atomic_int_compare_and_exchange (&queue->discont, 1, 0)) {
+                buf = gst_buffer_make_writable (buf);
+                GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
+        }
+
+        return buf;
+}
+
+void
+gst_nvimage_queue_set_flushing (GstNVimageQueue * queue, gboolean flushing)
+{
+        g_mutex_lock (&queue->lock);
+        g_atomic_int_set (&queue->flushing, flushing);
+        g_cond_broadcast (&queue->cond);
+        g_mutex_unlock (&queue->lock);
+}
+
+guint
+gst_nvimage_queue_get_dropped (GstNVimageQueue * queue)
+{
+        return g_atomic_int_get (&queue->dropped);
+}
+
+void
+gst_nvimage_queue_free (GstNVimageQueue * queue)
+{
+        GstBuffer *buf;
+
+        g_return_if_fail (queue != NULL);
+
+        while ((buf = gst_nvimage_queue_take_oldest (queue)))
+                gst_buffer_unref (buf);
+
+        g_mutex_clear (&queue->lock);
+        g_cond_clear (&queue->cond);
+        g_free (queue->items);
+        g_free (queue);
+}
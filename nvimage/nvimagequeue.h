@@ -0,0 +1,89 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGEQUEUE_H__
+#define __GST_NVIMAGEQUEUE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GstNVimageQueuePolicy:
+ * @GST_NVIMAGE_QUEUE_BLOCK: the producer waits for the consumer to make room
+ * @GST_NVIMAGE_QUEUE_DROP_OLDEST: the producer discards the oldest queued
+ * buffer to make room
+ *
+ * What the producer does when the queue is full.
+ */
+typedef enum {
+  GST_NVIMAGE_QUEUE_BLOCK,
+  GST_NVIMAGE_QUEUE_DROP_OLDEST,
+} GstNVimageQueuePolicy;
+
+typedef struct _GstNVimageQueue GstNVimageQueue;
+
+/**
+ * GstNVimageQueue:
+ * @size: number of slots, a power of two
+ * @policy: what to do when the queue is full
+ * @items: the ring of queued buffers
+ * @head: count of buffers ever pushed, only written by the producer
+ * @tail: count of buffers ever popped or dropped
+ * @waiting: set while a side sleeps on @cond
+ * @flushing: set to make both sides return immediately
+ * @discont: set when a buffer was dropped since the last pop
+ * @dropped: total number of dropped buffers
+ *
+ * Bounded single-producer/single-consumer ring of encoded frames. Pushing
+ * and popping only use atomic operations; @lock and @cond are touched only
+ * when one side has to sleep because the ring is empty or full.
+ *
+ * With %GST_NVIMAGE_QUEUE_DROP_OLDEST the producer also advances @tail, so
+ * both sides claim the oldest slot with a compare-and-exchange and only the
+ * winner owns the buffer in it.
+ */
+struct _GstNVimageQueue {
+  guint size;
+  GstNVimageQueuePolicy policy;
+  GstBuffer **items;
+
+  volatile gint head;
+  volatile gint tail;
+
+  volatile gint waiting;
+  volatile gint flushing;
+  volatile gint discont;
+  volatile gint dropped;
+
+  GMutex lock;
+  GCond cond;
+};
+
+GstNVimageQueue * gst_nvimage_queue_new (guint size, GstNVimageQueuePolicy policy);
+void gst_nvimage_queue_free (GstNVimageQueue * queue);
+
+gboolean gst_nvimage_queue_push (GstNVimageQueue * queue, GstBuffer * buf, gboolean * dropped);
+GstBuffer * gst_nvimage_queue_pop (GstNVimageQueue * queue);
+
+void gst_nvimage_queue_set_flushing (GstNVimageQueue * queue, gboolean flushing);
+guint gst_nvimage_queue_get_dropped (GstNVimageQueue * queue);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGEQUEUE_H__ */
@@ -0,0 +1,188 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimageshed.h"
+
+/* the load is measured over windows of this length, in us */
+#define NVIMAGE_SHED_WINDOW G_TIME_SPAN_SECOND
+/* fewer frames than this in a window say nothing, e.g. an idle screen */
+#define NVIMAGE_SHED_MIN_FRAMES 5
+/* windows under the low mark that take a step back, doubled up to the
+   maximum each time the load comes back right after a step back */
+#define NVIMAGE_SHED_CALM 5
+#define NVIMAGE_SHED_MAX_CALM 60
+#define NVIMAGE_SHED_RELAPSE (10 * G_TIME_SPAN_SECOND)
+
+/* What each level keeps, in percent of the framerate, capture size and
+   bitrate asked for: the framerate goes first as it costs the least to
+   look at, the bitrate last as it saves the least encoder time */
+static const struct {
+        guint fps;
+        guint scale;
+        guint bitrate;
+} ladder[] = {
+        {100, 100, 100},
+        {75, 100, 100},
+        {50, 100, 100},
+        {50, 75, 100},
+        {50, 50, 100},
+        {50, 50, 75},
+        {50, 50, 50},
+};
+
+void
+gst_nvimage_shed_reset (GstNVimageShed * shed)
+{
+        g_atomic_int_set (&shed->level, 0);
+        shed->load = 0;
+        shed->window_start = 0;
+        shed->window_frames = 0;
+        shed->window_work = 0;
+        shed->settling = FALSE;
+        shed->calm = 0;
+        shed->calm_needed = NVIMAGE_SHED_CALM;
+        shed->last_recovery = 0;
+}
+
+/* Time the capture thread spent on frames so far, in ns. A producing
+   thread waits for screen updates in the grab, so only the encoder side
+   counts then. */
+static guint64
+gst_nvimage_shed_work (GstNVimageStats * stats, gboolean producing)
+{
+        guint64 work = 0;
+        gint stage;
+
+        for (stage = GST_NVIMAGE_STAGE_MAP; stage <= GST_NVIMAGE_STAGE_UNMAP; stage++)
+                work += stats->sum[stage];
+        if (!producing)
+                work += stats->sum[GST_NVIMAGE_STAGE_GRAB];
+
+        return work;
+}
+
+static void
+gst_nvimage_shed_window (GstNVimageShed * shed, GstNVimageStats * stats, gboolean producing, gint64 now)
+{
+        shed->window_start = now;
+        shed->window_frames = stats->frames;
+        shed->window_work = gst_nvimage_shed_work (stats, producing);
+}
+
+/* Takes the stats of the capture context after a frame, @fps_n/@fps_d
+   being the framerate frames are paced at now. Once a window is over,
+   steps down when the load went over @high percent of the frame interval
+   and back up after a few windows under @low. Returns TRUE when the level
+   changed. */
+gboolean
+gst_nvimage_shed_update (GstNVimageShed * shed, GstNVimageStats * stats, gint fps_n, gint fps_d,
+                         gboolean producing, guint high, guint low, gint64 now)
+{
+        guint64 frames, work, budget;
+        gint level;
+
+        g_return_val_if_fail (fps_n > 0 && fps_d > 0, FALSE);
+
+        if (shed->window_start == 0 || stats->frames < shed->window_frames) {
+                gst_nvimage_shed_window (shed, stats, producing, now);
+                return FALSE;
+        }
+        if (now - shed->window_start < NVIMAGE_SHED_WINDOW)
+                return FALSE;
+
+        frames = stats->frames - shed->window_frames;
+        work = gst_nvimage_shed_work (stats, producing) - shed->window_work;
+        gst_nvimage_shed_window (shed, stats, producing, now);
+
+        /* the first window after a step has the rebuild in it */
+        if (shed->settling) {
+                shed->settling = FALSE;
+                return FALSE;
+        }
+        if (frames < NVIMAGE_SHED_MIN_FRAMES)
+                return FALSE;
+
+        budget = gst_util_uint64_scale_int (GST_SECOND, fps_d, fps_n);
+        shed->load = 100.0 * work / frames / budget;
+
+        level = g_atomic_int_get (&shed->level);
+        if (shed->load > high && level < (gint) G_N_ELEMENTS (ladder) - 1) {
+                if (level > 0 && now - shed->last_recovery < NVIMAGE_SHED_RELAPSE)
+                        shed->calm_needed = MIN (shed->calm_needed * 2, NVIMAGE_SHED_MAX_CALM);
+                shed->calm = 0;
+                level++;
+        } else if (shed->load < low && level > 0) {
+                if (++shed->calm < shed->calm_needed)
+                        return FALSE;
+                shed->calm = 0;
+                shed->last_recovery = now;
+                level--;
+        } else {
+                shed->calm = 0;
+                return FALSE;
+        }
+
+        g_atomic_int_set (&shed->level, level);
+        shed->settling = TRUE;
+        return TRUE;
+}
+
+/* The framerate of the current level, for @fps_n/@fps_d asked for */
+void
+gst_nvimage_shed_framerate (GstNVimageShed * shed, gint * fps_n, gint * fps_d)
+{
+        gint level = g_atomic_int_get (&shed->level);
+
+        if (ladder[level].fps != 100)
+                gst_util_fraction_multiply (*fps_n, *fps_d, ladder[level].fps, 100, fps_n, fps_d);
+}
+
+/* Scales @params down to the current level */
+void
+gst_nvimage_shed_apply (GstNVimageShed * shed, GstNVimageParams * params)
+{
+        gint level = g_atomic_int_get (&shed->level);
+        gint fps_n = params->fps_n, fps_d = params->fps_d;
+
+        gst_nvimage_shed_framerate (shed, &fps_n, &fps_d);
+        params->fps_n = fps_n;
+        params->fps_d = fps_d;
+        params->scale = ladder[level].scale;
+        params->bitrate = (guint64) params->bitrate * ladder[level].bitrate / 100;
+}
+
+/* The level and what it leaves of @fps_n/@fps_d and @bitrate */
+GstStructure *
+gst_nvimage_shed_to_structure (GstNVimageShed * shed, const gchar * name, gint fps_n, gint fps_d, guint bitrate)
+{
+        gint level = g_atomic_int_get (&shed->level);
+
+        gst_nvimage_shed_framerate (shed, &fps_n, &fps_d);
+
+        return gst_structure_new (name,
+                                  "level", G_TYPE_UINT, (guint) level,
+                                  "load", G_TYPE_DOUBLE, shed->load,
+                                  "framerate", GST_TYPE_FRACTION, fps_n, fps_d,
+                                  "scale", G_TYPE_UINT, ladder[level].scale,
+                                  "bitrate", G_TYPE_UINT, (guint) ((guint64) bitrate * ladder[level].bitrate / 100),
+                                  NULL);
+}
@@ -0,0 +1,74 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGESHED_H__
+#define __GST_NVIMAGESHED_H__
+
+#include <gst/gst.h>
+#include "nvimageutil.h"
+#include "nvimagestats.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstNVimageShed GstNVimageShed;
+
+/**
+ * GstNVimageShed:
+ * @level: the step of the ladder in use, 0 for none
+ * @load: capture thread time per frame in the last window, in percent of
+ * the frame interval
+ * @window_start: monotonic time the window started at, in us, 0 for none
+ * @window_frames: frames of the stats when the window started
+ * @window_work: capture thread time of the stats when the window started
+ * @settling: the window follows a step, its load is not taken
+ * @calm: consecutive windows under the low mark
+ * @calm_needed: windows under the low mark that take a step back
+ * @last_recovery: monotonic time of the last step back, in us
+ *
+ * Watches how long the capture thread works on a frame against the frame
+ * interval, and steps down the framerate, then the capture size, then the
+ * bitrate while it doesn't keep up. Only used from the streaming thread
+ * but for @level and @load, which are read for the stats.
+ */
+struct _GstNVimageShed {
+  volatile gint level;
+  gdouble load;
+
+  gint64 window_start;
+  guint64 window_frames;
+  guint64 window_work;
+  gboolean settling;
+
+  guint calm;
+  guint calm_needed;
+  gint64 last_recovery;
+};
+
+void gst_nvimage_shed_reset (GstNVimageShed * shed);
+
+gboolean gst_nvimage_shed_update (GstNVimageShed * shed, GstNVimageStats * stats, gint fps_n, gint fps_d,
+                                  gboolean producing, guint high, guint low, gint64 now);
+void gst_nvimage_shed_framerate (GstNVimageShed * shed, gint * fps_n, gint * fps_d);
+void gst_nvimage_shed_apply (GstNVimageShed * shed, GstNVimageParams * params);
+
+GstStructure * gst_nvimage_shed_to_structure (GstNVimageShed * shed, const gchar * name,
+                                              gint fps_n, gint fps_d, guint bitrate);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGESHED_H__ */
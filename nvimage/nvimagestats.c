@@ -0,0 +1,285 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+
+#include "nvimagestats.h"
+
+static const gchar *stage_names[GST_NVIMAGE_STAGES] = {
+        "rpc", "grab", "map", "encode", "lock", "copy", "unmap", "push"
+};
+
+GstNVimageStats *
+gst_nvimage_stats_new (void)
+{
+        return g_new0 (GstNVimageStats, 1);
+}
+
+void
+gst_nvimage_stats_free (GstNVimageStats * stats)
+{
+        g_free (stats);
+}
+
+/* Monotonic ns, 0 without @stats */
+gint64
+gst_nvimage_stats_now (GstNVimageStats * stats)
+{
+        struct timespec ts;
+
+        if (stats == NULL)
+                return 0;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The bucket of a latency of @us: the octave is the highest bit set, the
+   step the next NVIMAGE_STATS_STEPS bits below it */
+static guint
+gst_nvimage_stats_bucket (guint64 us)
+{
+        guint octave, step;
+
+        if (us == 0)
+                return 0;
+
+        octave = g_bit_storage (us) - 1;
+        if (octave >= NVIMAGE_STATS_OCTAVES)
+                return NVIMAGE_STATS_BUCKETS - 1;
+        /* 3 bits below the highest one, shifted in from the right for the
+           small octaves */
+        if (octave >= 3)
+                step = (us >> (octave - 3)) & (NVIMAGE_STATS_STEPS - 1);
+        else
+                step = (us << (3 - octave)) & (NVIMAGE_STATS_STEPS - 1);
+
+        return 1 + octave * NVIMAGE_STATS_STEPS + step;
+}
+
+/* The upper bound of @bucket in µs */
+static gdouble
+gst_nvimage_stats_bucket_limit (guint bucket)
+{
+        guint octave, step;
+
+        if (bucket == 0)
+                return 1.0;
+        if (bucket == NVIMAGE_STATS_BUCKETS - 1)
+                return G_MAXDOUBLE;
+
+        octave = (bucket - 1) / NVIMAGE_STATS_STEPS;
+        step = (bucket - 1) % NVIMAGE_STATS_STEPS;
+
+        return (gdouble) ((guint64) (NVIMAGE_STATS_STEPS + step + 1) << octave) / NVIMAGE_STATS_STEPS;
+}
+
+void
+gst_nvimage_stats_add (GstNVimageStats * stats, GstNVimageStage stage, gint64 duration)
+{
+        if (stats == NULL)
+                return;
+
+        duration = MAX (duration, 0);
+        stats->buckets[stage][gst_nvimage_stats_bucket (duration / 1000)]++;
+        stats->count[stage]++;
+        stats->sum[stage] += duration;
+        if ((guint64) duration > stats->max[stage])
+                stats->max[stage] = duration;
+}
+
+/* Adds the time since @start, from gst_nvimage_stats_now() */
+void
+gst_nvimage_stats_since (GstNVimageStats * stats, GstNVimageStage stage, gint64 start)
+{
+        if (stats == NULL || start == 0)
+                return;
+
+        gst_nvimage_stats_add (stats, stage, gst_nvimage_stats_now (stats) - start);
+}
+
+/* Counts a frame handed out, for the throughput */
+void
+gst_nvimage_stats_frame (GstNVimageStats * stats)
+{
+        if (stats == NULL)
+                return;
+
+        stats->last_frame = gst_nvimage_stats_now (stats);
+        if (stats->frames++ == 0)
+                stats->first_frame = stats->last_frame;
+}
+
+/* The latency in µs that @permille of the samples of @buckets stay under,
+   as the upper bound of its bucket but never above @max */
+static gdouble
+gst_nvimage_stats_percentile (const guint * buckets, guint64 count, guint64 max, guint permille)
+{
+        guint64 rank = (count * permille + 999) / 1000, seen = 0;
+
+        for (guint i = 0; i < NVIMAGE_STATS_BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen >= MAX (rank, 1))
+                        return MIN (gst_nvimage_stats_bucket_limit (i), max / 1000.0);
+        }
+
+        return max / 1000.0;
+}
+
+static gdouble
+gst_nvimage_stats_fps (GstNVimageStats * stats)
+{
+        gdouble seconds = (stats->last_frame - stats->first_frame) / 1e9;
+
+        return stats->frames > 1 && seconds > 0 ? (stats->frames - 1) / seconds : 0.0;
+}
+
+/* Leaves in @stats, a snapshot, only what came after the earlier snapshot
+   @base, e.g. past the warm-up of a benchmark. Taking snapshots writes
+   nothing, so it is safe from any thread. The max of a stage is that of
+   the whole run, but no higher than its last bucket still used. The first
+   frame after @base is taken to be a mean frame interval after it. */
+void
+gst_nvimage_stats_subtract (GstNVimageStats * stats, const GstNVimageStats * base)
+{
+        guint used;
+
+        for (guint i = 0; i < GST_NVIMAGE_STAGES; i++) {
+                for (guint j = 0; j < NVIMAGE_STATS_BUCKETS; j++)
+                        stats->buckets[i][j] -= base->buckets[i][j];
+                stats->count[i] -= base->count[i];
+                stats->sum[i] -= base->sum[i];
+
+                used = NVIMAGE_STATS_BUCKETS;
+                while (used > 0 && stats->buckets[i][used - 1] == 0)
+                        used--;
+                if (used == 0)
+                        stats->max[i] = 0;
+                else if (used < NVIMAGE_STATS_BUCKETS)
+                        stats->max[i] = MIN (stats->max[i], gst_nvimage_stats_bucket_limit (used - 1) * 1000);
+        }
+
+        if (base->frames > 0 && stats->frames > base->frames) {
+                stats->frames -= base->frames;
+                stats->first_frame = base->last_frame + (stats->last_frame - base->last_frame) / stats->frames;
+        } else if (base->frames > 0) {
+                stats->frames = 0;
+                stats->first_frame = stats->last_frame;
+        }
+        stats->missed -= base->missed;
+        stats->direct -= base->direct;
+        stats->recreations -= base->recreations;
+        stats->idrs -= base->idrs;
+}
+
+/* A snapshot for the stats property and messages of the element: the
+   counters, and for every stage its count, mean, p50, p99, p99.9 and max in
+   µs and the histogram, bucket counts up to the last one used */
+GstStructure *
+gst_nvimage_stats_to_structure (GstNVimageStats * stats, const gchar * name)
+{
+        GstNVimageStats snapshot = *stats;
+        GstStructure    *s;
+        GValue          histogram = G_VALUE_INIT, bucket = G_VALUE_INIT;
+        gchar           *field;
+        guint           used;
+
+        s = gst_structure_new (name,
+                               "frames", G_TYPE_UINT64, snapshot.frames,
+                               "fps", G_TYPE_DOUBLE, gst_nvimage_stats_fps (&snapshot),
+                               "missed-frames", G_TYPE_UINT64, snapshot.missed,
+                               "direct-capture", G_TYPE_BOOLEAN, snapshot.direct_active,
+                               "direct-frames", G_TYPE_UINT64, snapshot.direct,
+                               "recreations", G_TYPE_UINT, snapshot.recreations,
+                               "idr-frames", G_TYPE_UINT64, snapshot.idrs, NULL);
+
+        for (guint i = 0; i < GST_NVIMAGE_STAGES; i++) {
+                if (snapshot.count[i] == 0)
+                        continue;
+
+                field = g_strdup_printf ("%s-count", stage_names[i]);
+                gst_structure_set (s, field, G_TYPE_UINT64, snapshot.count[i], NULL);
+                g_free (field);
+                field = g_strdup_printf ("%s-mean-us", stage_names[i]);
+                gst_structure_set (s, field, G_TYPE_DOUBLE, snapshot.sum[i] / 1000.0 / snapshot.count[i], NULL);
+                g_free (field);
+                field = g_strdup_printf ("%s-p50-us", stage_names[i]);
+                gst_structure_set (s, field, G_TYPE_DOUBLE,
+                                   gst_nvimage_stats_percentile (snapshot.buckets[i], snapshot.count[i], snapshot.max[i], 500), NULL);
+                g_free (field);
+                field = g_strdup_printf ("%s-p99-us", stage_names[i]);
+                gst_structure_set (s, field, G_TYPE_DOUBLE,
+                                   gst_nvimage_stats_percentile (snapshot.buckets[i], snapshot.count[i], snapshot.max[i], 990), NULL);
+                g_free (field);
+                field = g_strdup_printf ("%s-p999-us", stage_names[i]);
+                gst_structure_set (s, field, G_TYPE_DOUBLE,
+                                   gst_nvimage_stats_percentile (snapshot.buckets[i], snapshot.count[i], snapshot.max[i], 999), NULL);
+                g_free (field);
+                field = g_strdup_printf ("%s-max-us", stage_names[i]);
+                gst_structure_set (s, field, G_TYPE_DOUBLE, snapshot.max[i] / 1000.0, NULL);
+                g_free (field);
+
+                used = NVIMAGE_STATS_BUCKETS;
+                while (used > 0 && snapshot.buckets[i][used - 1] == 0)
+                        used--;
+                g_value_init (&histogram, GST_TYPE_ARRAY);
+                for (guint j = 0; j < used; j++) {
+                        g_value_init (&bucket, G_TYPE_UINT);
+                        g_value_set_uint (&bucket, snapshot.buckets[i][j]);
+                        gst_value_array_append_and_take_value (&histogram, &bucket);
+                }
+                field = g_strdup_printf ("%s-histogram", stage_names[i]);
+                gst_structure_take_value (s, field, &histogram);
+                g_free (field);
+        }
+
+        return s;
+}
+
+/* Appends the throughput, the counters and the percentiles of every stage
+   as a JSON object. Frames are counted from the first to the last one, so
+   the rate is that of the steady state. */
+void
+gst_nvimage_stats_to_json (GstNVimageStats * stats, GString * json)
+{
+        g_string_append_printf (json, "{\"frames\": %" G_GUINT64_FORMAT ", \"seconds\": %.3f, \"fps\": %.2f, "
+                                "\"missed_frames\": %" G_GUINT64_FORMAT ", \"direct_frames\": %" G_GUINT64_FORMAT ", "
+                                "\"recreations\": %u, \"idr_frames\": %" G_GUINT64_FORMAT ", \"stages\": {",
+                                stats->frames, (stats->last_frame - stats->first_frame) / 1e9,
+                                gst_nvimage_stats_fps (stats), stats->missed, stats->direct,
+                                stats->recreations, stats->idrs);
+
+        for (guint i = 0; i < GST_NVIMAGE_STAGES; i++) {
+                g_string_append_printf (json, "%s\"%s\": {\"count\": %" G_GUINT64_FORMAT,
+                                        i ? ", " : "", stage_names[i], stats->count[i]);
+                if (stats->count[i] > 0)
+                        g_string_append_printf (json, ", \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f",
+                                                stats->sum[i] / 1000.0 / stats->count[i],
+                                                gst_nvimage_stats_percentile (stats->buckets[i], stats->count[i], stats->max[i], 500),
+                                                gst_nvimage_stats_percentile (stats->buckets[i], stats->count[i], stats->max[i], 990),
+                                                gst_nvimage_stats_percentile (stats->buckets[i], stats->count[i], stats->max[i], 999),
+                                                stats->max[i] / 1000.0);
+                g_string_append (json, "}");
+        }
+
+        g_string_append (json, "}}");
+}
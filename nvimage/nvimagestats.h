@@ -0,0 +1,111 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGESTATS_H__
+#define __GST_NVIMAGESTATS_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/**
+ * GstNVimageStage:
+ * @GST_NVIMAGE_STAGE_RPC: handing a frame request to the capture thread and
+ * its answer back, without the work in between
+ * @GST_NVIMAGE_STAGE_GRAB: grabbing the screen
+ * @GST_NVIMAGE_STAGE_MAP: making the grab an encoder input
+ * @GST_NVIMAGE_STAGE_ENCODE: submitting the picture to the encoder
+ * @GST_NVIMAGE_STAGE_LOCK: waiting for the encoded picture
+ * @GST_NVIMAGE_STAGE_COPY: copying the picture or frame out
+ * @GST_NVIMAGE_STAGE_UNMAP: releasing the encoder input
+ * @GST_NVIMAGE_STAGE_PUSH: downstream handling the buffer
+ *
+ * The steps a frame takes from the element to the screen and back.
+ */
+typedef enum {
+  GST_NVIMAGE_STAGE_RPC,
+  GST_NVIMAGE_STAGE_GRAB,
+  GST_NVIMAGE_STAGE_MAP,
+  GST_NVIMAGE_STAGE_ENCODE,
+  GST_NVIMAGE_STAGE_LOCK,
+  GST_NVIMAGE_STAGE_COPY,
+  GST_NVIMAGE_STAGE_UNMAP,
+  GST_NVIMAGE_STAGE_PUSH,
+  GST_NVIMAGE_STAGES
+} GstNVimageStage;
+
+/* Latency buckets: one below 1 µs, then 8 a doubling up to 2^24 µs, the
+   last one takes anything longer */
+#define NVIMAGE_STATS_STEPS 8
+#define NVIMAGE_STATS_OCTAVES 24
+#define NVIMAGE_STATS_BUCKETS (2 + NVIMAGE_STATS_OCTAVES * NVIMAGE_STATS_STEPS)
+
+typedef struct _GstNVimageStats GstNVimageStats;
+
+/**
+ * GstNVimageStats:
+ * @buckets: latency histogram of each stage
+ * @count: samples added to each stage
+ * @sum: total latency of each stage, in ns
+ * @max: longest latency of each stage, in ns
+ * @frames: frames produced
+ * @first_frame: monotonic ns of the first frame
+ * @last_frame: monotonic ns of the last frame
+ * @missed: frames rendered on screen that no grab saw
+ * @direct: frames NvFBC grabbed with Direct Capture
+ * @direct_active: whether the last grab was a Direct Capture
+ * @recreations: capture sessions rebuilt, whatever the reason
+ * @idrs: IDR pictures encoded
+ *
+ * Always-on timers and counters of a capture context. Every stage and
+ * counter is only written from one thread, the capture thread but for the
+ * push stage, so adding takes no lock; readers take a snapshot that may be
+ * a sample behind.
+ */
+struct _GstNVimageStats {
+  guint buckets[GST_NVIMAGE_STAGES][NVIMAGE_STATS_BUCKETS];
+  guint64 count[GST_NVIMAGE_STAGES];
+  guint64 sum[GST_NVIMAGE_STAGES];
+  guint64 max[GST_NVIMAGE_STAGES];
+
+  guint64 frames;
+  gint64 first_frame;
+  gint64 last_frame;
+
+  guint64 missed;
+  guint64 direct;
+  gboolean direct_active;
+  guint recreations;
+  guint64 idrs;
+};
+
+GstNVimageStats * gst_nvimage_stats_new (void);
+void gst_nvimage_stats_free (GstNVimageStats * stats);
+void gst_nvimage_stats_subtract (GstNVimageStats * stats, const GstNVimageStats * base);
+
+gint64 gst_nvimage_stats_now (GstNVimageStats * stats);
+void gst_nvimage_stats_add (GstNVimageStats * stats, GstNVimageStage stage, gint64 duration);
+void gst_nvimage_stats_since (GstNVimageStats * stats, GstNVimageStage stage, gint64 start);
+void gst_nvimage_stats_frame (GstNVimageStats * stats);
+
+GstStructure * gst_nvimage_stats_to_structure (GstNVimageStats * stats, const gchar * name);
+void gst_nvimage_stats_to_json (GstNVimageStats * stats, GString * json);
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGESTATS_H__ */
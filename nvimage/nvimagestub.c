@@ -0,0 +1,714 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Stand-in for libnvidia-fbc and libnvidia-encode, for running the plugin
+   without an NVIDIA GPU. The grabs are synthetic frames and the encoder
+   writes placeholder pictures of a configured size, after configured
+   delays; faults are injected on a fixed schedule, so runs are repeatable.
+   Built by "build.sh stub" into stub/, which then goes in front of
+   LD_LIBRARY_PATH. The NVIMAGE_STUB environment variable configures it as
+   comma separated key=value pairs:
+
+     width, height          screen size (1920x1080)
+     modeset-width,
+     modeset-height         the other screen size of a modeset (1280x720)
+     idr-size, frame-size   bytes of an IDR and of another picture
+                            (60000, 8000)
+     grab-latency,
+     encode-latency         µs a grab takes, µs from the submission of a
+                            picture until its bitstream can be locked (0)
+     unchanged-every        every nth grab has no new frame
+     recreate-every         every nth grab returns NVFBC_ERR_MUST_RECREATE
+     modeset-every          every nth grab switches the screen size and
+                            returns NVFBC_ERR_MUST_RECREATE
+     encode-fail-every      every nth picture fails to encode
+     subframe-readback      whether sliced pictures can be read back a
+                            slice at a time, the slices then come out
+                            spread over encode-latency (1)
+
+   A period of 0, the default, never injects the fault. Every NvFBC handle
+   counts its own grabs and every encode session its own pictures, so
+   elements capturing side by side don't shift each other's schedules. A
+   modeset only switches the screen of the calling thread: the plugin makes
+   all NvFBC calls of a capture context, which has a display connection of
+   its own, from one thread, and the new size has to outlive the handle
+   recreated after the fault. A destroyed bitstream is filled with 0xdd
+   before it is freed, so a reader left with its pointer sees garbage
+   rather than the picture. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+#include <GL/gl.h>
+
+#include "NvFBC.h"
+#include "nvEncodeAPI.h"
+
+#define NVIMAGE_STUB_EXPORT __attribute__ ((visibility ("default")))
+
+/**
+ * GstNVimageStubConfig:
+ *
+ * The settings read from NVIMAGE_STUB, see the top of the file.
+ */
+typedef struct {
+  guint width, height;
+  guint modeset_width, modeset_height;
+  guint idr_size, frame_size;
+  guint grab_latency, encode_latency;
+  guint unchanged_every, recreate_every, modeset_every, encode_fail_every;
+  guint subframe_readback;
+} GstNVimageStubConfig;
+
+/**
+ * GstNVimageStubSession:
+ * @capture_type: where the grabs go
+ * @format: the buffer format of the grabs
+ * @size: the size of a grab
+ * @frame: the system memory grabs go to, NvFBC owns it
+ * @frame_bytes: the size of @frame
+ * @textures: the textures GL grabs go to
+ * @next_texture: the texture the next GL grab goes to
+ *
+ * The capture session of a handle.
+ */
+typedef struct {
+  NVFBC_CAPTURE_TYPE capture_type;
+  NVFBC_BUFFER_FORMAT format;
+  NVFBC_SIZE size;
+  guint8 *frame;
+  gsize frame_bytes;
+  GLuint textures[2];
+  guint next_texture;
+} GstNVimageStubSession;
+
+/**
+ * GstNVimageStubHandle:
+ * @session: its capture session
+ * @grabs: grabs made through it
+ *
+ * What a NvFBC handle points to.
+ */
+typedef struct {
+  GstNVimageStubSession session;
+  guint grabs;
+} GstNVimageStubHandle;
+
+/**
+ * GstNVimageStubBitstream:
+ * @data: the picture written by the last encode
+ * @size: bytes of it
+ * @idr: whether it is an IDR
+ * @frame: the frameIdx it was submitted with
+ * @ready: monotonic µs from which it may be locked
+ * @slices: slices of the picture, 1 when not sliced
+ * @offsets: where each slice starts
+ * @encoded: monotonic µs the picture was submitted at
+ */
+typedef struct {
+  guint8 *data;
+  gsize size;
+  gboolean idr;
+  uint32_t frame;
+  gint64 ready;
+  guint slices;
+  uint32_t offsets[32];
+  gint64 encoded;
+} GstNVimageStubBitstream;
+
+/**
+ * GstNVimageStubEncoder:
+ * @gop: pictures from one IDR to the next
+ * @pictures: pictures encoded since the last IDR
+ * @slices: slices per picture, 0 when not sliced
+ * @report_slices: whether slice offsets are reported
+ * @subframe: whether slices can be locked as they come out
+ * @encodes: pictures submitted to it, for the failure schedule
+ *
+ * An encode session.
+ */
+typedef struct {
+  guint gop;
+  guint pictures;
+  guint slices;
+  gboolean report_slices;
+  gboolean subframe;
+  guint encodes;
+} GstNVimageStubEncoder;
+
+static GstNVimageStubConfig config;
+/* set in a capture thread whose screen switched to the modeset size */
+static GPrivate modeset;
+
+static void
+nvimagestub_config_init (void)
+{
+        static gsize initialized = 0;
+        gchar        **pairs, **kv;
+        guint        value;
+
+        if (!g_once_init_enter (&initialized))
+                return;
+
+        config.width = 1920;
+        config.height = 1080;
+        config.modeset_width = 1280;
+        config.modeset_height = 720;
+        config.idr_size = 60000;
+        config.frame_size = 8000;
+        config.subframe_readback = 1;
+
+        pairs = g_strsplit (g_getenv ("NVIMAGE_STUB") ? g_getenv ("NVIMAGE_STUB") : "", ",", -1);
+        for (guint i = 0; pairs[i]; i++) {
+                kv = g_strsplit (pairs[i], "=", 2);
+                if (kv[0] && kv[1]) {
+                        value = g_ascii_strtoull (kv[1], NULL, 10);
+                        if (g_str_equal (kv[0], "width"))
+                                config.width = value;
+                        else if (g_str_equal (kv[0], "height"))
+                                config.height = value;
+                        else if (g_str_equal (kv[0], "modeset-width"))
+                                config.modeset_width = value;
+                        else if (g_str_equal (kv[0], "modeset-height"))
+                                config.modeset_height = value;
+                        else if (g_str_equal (kv[0], "idr-size"))
+                                config.idr_size = value;
+                        else if (g_str_equal (kv[0], "frame-size"))
+                                config.frame_size = value;
+                        else if (g_str_equal (kv[0], "grab-latency"))
+                                config.grab_latency = value;
+                        else if (g_str_equal (kv[0], "encode-latency"))
+                                config.encode_latency = value;
+                        else if (g_str_equal (kv[0], "unchanged-every"))
+                                config.unchanged_every = value;
+                        else if (g_str_equal (kv[0], "recreate-every"))
+                                config.recreate_every = value;
+                        else if (g_str_equal (kv[0], "modeset-every"))
+                                config.modeset_every = value;
+                        else if (g_str_equal (kv[0], "encode-fail-every"))
+                                config.encode_fail_every = value;
+                        else if (g_str_equal (kv[0], "subframe-readback"))
+                                config.subframe_readback = value;
+                        else
+                                g_warning ("NvFBC stub: unknown setting %s", kv[0]);
+                }
+                g_strfreev (kv);
+        }
+        g_strfreev (pairs);
+
+        /* the pictures carry a start code and a NAL header */
+        config.idr_size = MAX (config.idr_size, 5);
+        config.frame_size = MAX (config.frame_size, 5);
+
+        g_once_init_leave (&initialized, 1);
+}
+
+static gboolean
+nvimagestub_every (guint n, guint period)
+{
+        return period > 0 && n % period == 0;
+}
+
+static NVFBC_SIZE
+nvimagestub_screen_size (void)
+{
+        NVFBC_SIZE size;
+        gboolean   switched = g_private_get (&modeset) != NULL;
+
+        size.w = switched ? config.modeset_width : config.width;
+        size.h = switched ? config.modeset_height : config.height;
+
+        return size;
+}
+
+static GstNVimageStubHandle *
+nvimagestub_handle (NVFBC_SESSION_HANDLE handle)
+{
+        return (GstNVimageStubHandle *) (guintptr) handle;
+}
+
+/* ---------------------------------------------------------------- NvFBC */
+
+static const char *NVFBCAPI
+nvimagestub_get_last_error_str (const NVFBC_SESSION_HANDLE handle)
+{
+        return "NvFBC stub";
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_create_handle (NVFBC_SESSION_HANDLE * handle, NVFBC_CREATE_HANDLE_PARAMS * params)
+{
+        *handle = (NVFBC_SESSION_HANDLE) (guintptr) g_new0 (GstNVimageStubHandle, 1);
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_destroy_handle (const NVFBC_SESSION_HANDLE handle, NVFBC_DESTROY_HANDLE_PARAMS * params)
+{
+        g_free (nvimagestub_handle (handle));
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_get_status (const NVFBC_SESSION_HANDLE handle, NVFBC_GET_STATUS_PARAMS * params)
+{
+        GstNVimageStubSession *session = &nvimagestub_handle (handle)->session;
+        NVFBC_SIZE            size = nvimagestub_screen_size ();
+
+        params->bIsCapturePossible = NVFBC_TRUE;
+        params->bCurrentlyCapturing = session->capture_type != 0 || session->size.w != 0;
+        params->bCanCreateNow = NVFBC_TRUE;
+        params->screenSize = size;
+        params->bXRandRAvailable = NVFBC_TRUE;
+        params->dwOutputNum = 1;
+        params->outputs[0].dwId = 1;
+        g_strlcpy (params->outputs[0].name, "STUB-0", sizeof (params->outputs[0].name));
+        params->outputs[0].trackedBox.x = 0;
+        params->outputs[0].trackedBox.y = 0;
+        params->outputs[0].trackedBox.w = size.w;
+        params->outputs[0].trackedBox.h = size.h;
+        params->dwNvFBCVersion = NVFBC_VERSION;
+        params->bInModeset = NVFBC_FALSE;
+
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_create_capture_session (const NVFBC_SESSION_HANDLE handle, NVFBC_CREATE_CAPTURE_SESSION_PARAMS * params)
+{
+        GstNVimageStubSession *session = &nvimagestub_handle (handle)->session;
+
+        memset (session, 0, sizeof (*session));
+        session->capture_type = params->eCaptureType;
+        session->size = params->frameSize;
+        if (session->size.w == 0 || session->size.h == 0)
+                session->size = nvimagestub_screen_size ();
+
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_destroy_capture_session (const NVFBC_SESSION_HANDLE handle, NVFBC_DESTROY_CAPTURE_SESSION_PARAMS * params)
+{
+        GstNVimageStubSession *session = &nvimagestub_handle (handle)->session;
+
+        g_free (session->frame);
+        if (session->textures[0])
+                glDeleteTextures (2, session->textures);
+        memset (session, 0, sizeof (*session));
+
+        return NVFBC_SUCCESS;
+}
+
+static gsize
+nvimagestub_frame_bytes (NVFBC_BUFFER_FORMAT format, NVFBC_SIZE size)
+{
+        switch (format) {
+                case NVFBC_BUFFER_FORMAT_NV12:
+                        return (gsize) size.w * size.h * 3 / 2;
+                case NVFBC_BUFFER_FORMAT_YUV444P:
+                        return (gsize) size.w * size.h * 3;
+                default:
+                        return (gsize) size.w * size.h * 4;
+        }
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_tosys_setup (const NVFBC_SESSION_HANDLE handle, NVFBC_TOSYS_SETUP_PARAMS * params)
+{
+        GstNVimageStubSession *session = &nvimagestub_handle (handle)->session;
+
+        session->format = params->eBufferFormat;
+        session->frame_bytes = nvimagestub_frame_bytes (session->format, session->size);
+        session->frame = g_malloc0 (session->frame_bytes);
+        *params->ppBuffer = session->frame;
+
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_togl_setup (const NVFBC_SESSION_HANDLE handle, NVFBC_TOGL_SETUP_PARAMS * params)
+{
+        GstNVimageStubSession *session = &nvimagestub_handle (handle)->session;
+        gboolean              nv12 = params->eBufferFormat == NVFBC_BUFFER_FORMAT_NV12;
+
+        session->format = params->eBufferFormat;
+        session->frame_bytes = nvimagestub_frame_bytes (session->format, session->size);
+
+        /* NV12 goes in one texture, the chroma below the luma */
+        glGenTextures (2, session->textures);
+        for (guint i = 0; i < 2; i++) {
+                glBindTexture (GL_TEXTURE_2D, session->textures[i]);
+                glTexImage2D (GL_TEXTURE_2D, 0, nv12 ? GL_RED : GL_RGBA8, session->size.w,
+                              nv12 ? session->size.h * 3 / 2 : session->size.h, 0,
+                              nv12 ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                params->dwTextures[i] = session->textures[i];
+        }
+        glBindTexture (GL_TEXTURE_2D, 0);
+
+        params->dwTexTarget = GL_TEXTURE_2D;
+        params->dwTexFormat = nv12 ? GL_RED : GL_RGBA;
+        params->dwTexType = GL_UNSIGNED_BYTE;
+
+        return NVFBC_SUCCESS;
+}
+
+/* The faults and the latency of a grab, then its info. A changing row of
+   the frame is what moves on screen. */
+static NVFBCSTATUS
+nvimagestub_grab (GstNVimageStubHandle * h, NVFBC_FRAME_GRAB_INFO * info)
+{
+        GstNVimageStubSession *session = &h->session;
+        guint                 n = ++h->grabs;
+
+        if (nvimagestub_every (n, config.modeset_every)) {
+                g_debug ("NvFBC stub: modeset at grab %u", n);
+                g_private_set (&modeset, g_private_get (&modeset) ? NULL : GINT_TO_POINTER (1));
+                return NVFBC_ERR_MUST_RECREATE;
+        }
+        if (nvimagestub_every (n, config.recreate_every)) {
+                g_debug ("NvFBC stub: must recreate at grab %u", n);
+                return NVFBC_ERR_MUST_RECREATE;
+        }
+
+        if (config.grab_latency)
+                g_usleep (config.grab_latency);
+
+        if (info) {
+                memset (info, 0, sizeof (*info));
+                info->dwWidth = session->size.w;
+                info->dwHeight = session->size.h;
+                info->dwByteSize = session->frame_bytes;
+                info->dwCurrentFrame = n;
+                info->bIsNewFrame = !nvimagestub_every (n, config.unchanged_every);
+                info->ulTimestampUs = g_get_monotonic_time ();
+        }
+
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_tosys_grab_frame (const NVFBC_SESSION_HANDLE handle, NVFBC_TOSYS_GRAB_FRAME_PARAMS * params)
+{
+        GstNVimageStubHandle  *h = nvimagestub_handle (handle);
+        GstNVimageStubSession *session = &h->session;
+        NVFBCSTATUS           status;
+        gsize                 row;
+
+        status = nvimagestub_grab (h, params->pFrameGrabInfo);
+        if (status != NVFBC_SUCCESS)
+                return status;
+
+        row = session->frame_bytes / MAX (session->size.h, 1);
+        memset (session->frame + (h->grabs % session->size.h) * row, h->grabs & 0xff, row);
+
+        return NVFBC_SUCCESS;
+}
+
+static NVFBCSTATUS NVFBCAPI
+nvimagestub_togl_grab_frame (const NVFBC_SESSION_HANDLE handle, NVFBC_TOGL_GRAB_FRAME_PARAMS * params)
+{
+        GstNVimageStubHandle  *h = nvimagestub_handle (handle);
+        GstNVimageStubSession *session = &h->session;
+        NVFBCSTATUS           status;
+        guint8                *row;
+        gboolean              nv12 = session->format == NVFBC_BUFFER_FORMAT_NV12;
+
+        status = nvimagestub_grab (h, params->pFrameGrabInfo);
+        if (status != NVFBC_SUCCESS)
+                return status;
+
+        params->dwTextureIndex = session->next_texture;
+        session->next_texture = (session->next_texture + 1) % 2;
+
+        row = g_malloc (session->size.w * 4);
+        memset (row, h->grabs & 0xff, session->size.w * 4);
+        glBindTexture (GL_TEXTURE_2D, session->textures[params->dwTextureIndex]);
+        glTexSubImage2D (GL_TEXTURE_2D, 0, 0, h->grabs % session->size.h, session->size.w, 1,
+                         nv12 ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, row);
+        glBindTexture (GL_TEXTURE_2D, 0);
+        g_free (row);
+
+        return NVFBC_SUCCESS;
+}
+
+NVIMAGE_STUB_EXPORT NVFBCSTATUS NVFBCAPI
+NvFBCCreateInstance (NVFBC_API_FUNCTION_LIST * list)
+{
+        if (list == NULL)
+                return NVFBC_ERR_INVALID_PTR;
+        if (list->dwVersion != NVFBC_VERSION)
+                return NVFBC_ERR_API_VERSION;
+
+        nvimagestub_config_init ();
+
+        list->nvFBCGetLastErrorStr = nvimagestub_get_last_error_str;
+        list->nvFBCCreateHandle = nvimagestub_create_handle;
+        list->nvFBCDestroyHandle = nvimagestub_destroy_handle;
+        list->nvFBCGetStatus = nvimagestub_get_status;
+        list->nvFBCCreateCaptureSession = nvimagestub_create_capture_session;
+        list->nvFBCDestroyCaptureSession = nvimagestub_destroy_capture_session;
+        list->nvFBCToSysSetUp = nvimagestub_tosys_setup;
+        list->nvFBCToSysGrabFrame = nvimagestub_tosys_grab_frame;
+        list->nvFBCToGLSetUp = nvimagestub_togl_setup;
+        list->nvFBCToGLGrabFrame = nvimagestub_togl_grab_frame;
+
+        return NVFBC_SUCCESS;
+}
+
+/* ---------------------------------------------------------------- NVENC */
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_open_encode_session_ex (NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS * params, void **encoder)
+{
+        *encoder = g_new0 (GstNVimageStubEncoder, 1);
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_get_encode_preset_config (void *encoder, GUID encode_guid, GUID preset_guid,
+                                      NV_ENC_PRESET_CONFIG * preset)
+{
+        uint32_t version = preset->presetCfg.version;
+
+        memset (&preset->presetCfg, 0, sizeof (preset->presetCfg));
+        preset->presetCfg.version = version;
+        preset->presetCfg.gopLength = 30;
+
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_get_encode_preset_config_ex (void *encoder, GUID encode_guid, GUID preset_guid,
+                                         NV_ENC_TUNING_INFO tuning, NV_ENC_PRESET_CONFIG * preset)
+{
+        return nvimagestub_get_encode_preset_config (encoder, encode_guid, preset_guid, preset);
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_get_encode_caps (void *encoder, GUID encode_guid, NV_ENC_CAPS_PARAM * caps, int *value)
+{
+        *value = caps->capsToQuery == NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK ? config.subframe_readback != 0 : 0;
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_initialize_encoder (void *encoder, NV_ENC_INITIALIZE_PARAMS * params)
+{
+        GstNVimageStubEncoder *enc = encoder;
+        NV_ENC_CONFIG         *cfg = params->encodeConfig;
+        guint                 mode = 0, data = 0;
+
+        enc->gop = cfg ? cfg->gopLength : 30;
+        enc->pictures = 0;
+
+        if (cfg && memcmp (&params->encodeGUID, &NV_ENC_CODEC_HEVC_GUID, sizeof (GUID)) == 0) {
+                mode = cfg->encodeCodecConfig.hevcConfig.sliceMode;
+                data = cfg->encodeCodecConfig.hevcConfig.sliceModeData;
+        } else if (cfg && memcmp (&params->encodeGUID, &NV_ENC_CODEC_H264_GUID, sizeof (GUID)) == 0) {
+                mode = cfg->encodeCodecConfig.h264Config.sliceMode;
+                data = cfg->encodeCodecConfig.h264Config.sliceModeData;
+        }
+        /* only a number of slices per picture is understood */
+        enc->slices = mode == 3 ? CLAMP (data, 1, 32) : 0;
+        enc->report_slices = params->reportSliceOffsets;
+        enc->subframe = params->enableSubFrameWrite && config.subframe_readback;
+
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_reconfigure_encoder (void *encoder, NV_ENC_RECONFIGURE_PARAMS * params)
+{
+        return NV_ENC_SUCCESS;
+}
+
+/* No headers to parse, the plugin then does without repeated pictures */
+static NVENCSTATUS NVENCAPI
+nvimagestub_get_sequence_params (void *encoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD * payload)
+{
+        return NV_ENC_ERR_UNIMPLEMENTED;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_register_resource (void *encoder, NV_ENC_REGISTER_RESOURCE * params)
+{
+        NV_ENC_INPUT_RESOURCE_OPENGL_TEX *tex = params->resourceToRegister;
+
+        params->registeredResource = GUINT_TO_POINTER (tex->texture);
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_unregister_resource (void *encoder, NV_ENC_REGISTERED_PTR resource)
+{
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_map_input_resource (void *encoder, NV_ENC_MAP_INPUT_RESOURCE * params)
+{
+        params->mappedResource = params->registeredResource;
+        params->mappedBufferFmt = NV_ENC_BUFFER_FORMAT_NV12;
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_unmap_input_resource (void *encoder, NV_ENC_INPUT_PTR mapped)
+{
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_create_bitstream_buffer (void *encoder, NV_ENC_CREATE_BITSTREAM_BUFFER * params)
+{
+        GstNVimageStubBitstream *bitstream = g_new0 (GstNVimageStubBitstream, 1);
+
+        bitstream->data = g_malloc0 (MAX (config.idr_size, config.frame_size));
+        params->bitstreamBuffer = bitstream;
+
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_destroy_bitstream_buffer (void *encoder, NV_ENC_OUTPUT_PTR buffer)
+{
+        GstNVimageStubBitstream *bitstream = buffer;
+
+        memset (bitstream->data, 0xdd, MAX (config.idr_size, config.frame_size));
+        g_free (bitstream->data);
+        g_free (bitstream);
+
+        return NV_ENC_SUCCESS;
+}
+
+/* Writes a picture of the configured size: for each slice a start code,
+   the NAL header of an IDR or a non-IDR slice and filler from the frame
+   index */
+static NVENCSTATUS NVENCAPI
+nvimagestub_encode_picture (void *encoder, NV_ENC_PIC_PARAMS * params)
+{
+        GstNVimageStubEncoder   *enc = encoder;
+        GstNVimageStubBitstream *bitstream = params->outputBitstream;
+        guint                   n = ++enc->encodes;
+
+        if (nvimagestub_every (n, config.encode_fail_every)) {
+                g_debug ("NvFBC stub: encode failure at picture %u", n);
+                return NV_ENC_ERR_GENERIC;
+        }
+
+        bitstream->idr = enc->pictures == 0 || (params->encodePicFlags & NV_ENC_PIC_FLAG_FORCEIDR) ||
+                         (enc->gop > 0 && enc->pictures >= enc->gop);
+        if (bitstream->idr)
+                enc->pictures = 0;
+        enc->pictures++;
+
+        bitstream->size = bitstream->idr ? config.idr_size : config.frame_size;
+        bitstream->slices = MAX (MIN (enc->slices, bitstream->size / 5), 1);
+        memset (bitstream->data, params->frameIdx & 0xff, bitstream->size);
+        for (guint i = 0; i < bitstream->slices; i++) {
+                guint8 *slice;
+
+                bitstream->offsets[i] = bitstream->size * i / bitstream->slices;
+                slice = bitstream->data + bitstream->offsets[i];
+                slice[0] = 0;
+                slice[1] = 0;
+                slice[2] = 0;
+                slice[3] = 1;
+                slice[4] = bitstream->idr ? 0x65 : 0x41;
+        }
+        bitstream->frame = params->frameIdx;
+        bitstream->encoded = g_get_monotonic_time ();
+        bitstream->ready = bitstream->encoded + config.encode_latency;
+
+        return NV_ENC_SUCCESS;
+}
+
+/* With sub-frame readback and doNotWait, the slices done so far: the
+   slices of a picture come out evenly spread over the encode latency */
+static NVENCSTATUS NVENCAPI
+nvimagestub_lock_bitstream (void *encoder, NV_ENC_LOCK_BITSTREAM * params)
+{
+        GstNVimageStubEncoder   *enc = encoder;
+        GstNVimageStubBitstream *bitstream = params->outputBitstream;
+        gint64                  now = g_get_monotonic_time ();
+        guint                   done = bitstream->slices;
+
+        if (params->doNotWait && enc->subframe && bitstream->ready > now) {
+                done = (now - bitstream->encoded) * bitstream->slices / MAX (config.encode_latency, 1);
+                if (done == 0)
+                        return NV_ENC_ERR_LOCK_BUSY;
+        } else if (bitstream->ready > now) {
+                g_usleep (bitstream->ready - now);
+        }
+
+        params->bitstreamBufferPtr = bitstream->data;
+        params->bitstreamSizeInBytes = done < bitstream->slices ? bitstream->offsets[done] : bitstream->size;
+        params->pictureType = bitstream->idr ? NV_ENC_PIC_TYPE_IDR : NV_ENC_PIC_TYPE_P;
+        params->frameIdx = bitstream->frame;
+        params->hwEncodeStatus = done < bitstream->slices ? 1 : 2;
+        if (enc->report_slices && params->sliceOffsets) {
+                params->numSlices = done;
+                memcpy (params->sliceOffsets, bitstream->offsets, done * sizeof (uint32_t));
+        }
+
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_unlock_bitstream (void *encoder, NV_ENC_OUTPUT_PTR buffer)
+{
+        return NV_ENC_SUCCESS;
+}
+
+static NVENCSTATUS NVENCAPI
+nvimagestub_destroy_encoder (void *encoder)
+{
+        g_free (encoder);
+        return NV_ENC_SUCCESS;
+}
+
+NVIMAGE_STUB_EXPORT NVENCSTATUS NVENCAPI
+NvEncodeAPICreateInstance (NV_ENCODE_API_FUNCTION_LIST * list)
+{
+        if (list == NULL)
+                return NV_ENC_ERR_INVALID_PTR;
+
+        nvimagestub_config_init ();
+
+        list->nvEncOpenEncodeSessionEx = nvimagestub_open_encode_session_ex;
+        list->nvEncGetEncodePresetConfig = nvimagestub_get_encode_preset_config;
+        list->nvEncGetEncodePresetConfigEx = nvimagestub_get_encode_preset_config_ex;
+        list->nvEncGetEncodeCaps = nvimagestub_get_encode_caps;
+        list->nvEncInitializeEncoder = nvimagestub_initialize_encoder;
+        list->nvEncReconfigureEncoder = nvimagestub_reconfigure_encoder;
+        list->nvEncGetSequenceParams = nvimagestub_get_sequence_params;
+        list->nvEncRegisterResource = nvimagestub_register_resource;
+        list->nvEncUnregisterResource = nvimagestub_unregister_resource;
+        list->nvEncMapInputResource = nvimagestub_map_input_resource;
+        list->nvEncUnmapInputResource = nvimagestub_unmap_input_resource;
+        list->nvEncCreateBitstreamBuffer = nvimagestub_create_bitstream_buffer;
+        list->nvEncDestroyBitstreamBuffer = nvimagestub_destroy_bitstream_buffer;
+        list->nvEncEncodePicture = nvimagestub_encode_picture;
+        list->nvEncLockBitstream = nvimagestub_lock_bitstream;
+        list->nvEncUnlockBitstream = nvimagestub_unlock_bitstream;
+        list->nvEncDestroyEncoder = nvimagestub_destroy_encoder;
+
+        return NV_ENC_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* The nvimagestages tracer, run with GST_TRACERS=nvimagestages: logs
+   every tracepoint of every nvimagesrc as an nvimagesrc-stage record,
+   next to the records of the other tracers, e.g. latency or the pad
+   pushes downstream. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nvimagetrace.h"
+
+typedef struct {
+  GstTracer parent;
+} GstNVimageTracer;
+
+typedef struct {
+  GstTracerClass parent_class;
+} GstNVimageTracerClass;
+
+G_DEFINE_TYPE (GstNVimageTracer, gst_nvimage_tracer, GST_TYPE_TRACER);
+
+volatile gint gst_nvimage_tracing = 0;
+
+static GstTracerRecord *tr_stage;
+
+static const gchar *point_names[] = {
+        "grab-start", "grab-end", "encode-submit", "encode-complete", "push"
+};
+
+void
+gst_nvimage_trace_log (GstElement * element, GstNVimageTracePoint point, gint64 frame, guint64 value)
+{
+        gst_tracer_record_log (tr_stage, gst_util_get_timestamp (),
+                               element ? GST_OBJECT_NAME (element) : "", point_names[point], frame, value);
+}
+
+static void
+gst_nvimage_tracer_class_init (GstNVimageTracerClass * klass)
+{
+        tr_stage = gst_tracer_record_new ("nvimagesrc-stage.class",
+                        "ts", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+                                        "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+                                        "description", G_TYPE_STRING, "time of the tracepoint in ns",
+                                        NULL),
+                        "element", GST_TYPE_STRUCTURE, gst_structure_new ("scope",
+                                        "type", G_TYPE_GTYPE, G_TYPE_STRING,
+                                        "related-to", GST_TYPE_TRACER_VALUE_SCOPE, GST_TRACER_VALUE_SCOPE_ELEMENT,
+                                        NULL),
+                        "point", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+                                        "type", G_TYPE_GTYPE, G_TYPE_STRING,
+                                        "description", G_TYPE_STRING,
+                                        "grab-start, grab-end, encode-submit, encode-complete or push",
+                                        NULL),
+                        "frame", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+                                        "type", G_TYPE_GTYPE, G_TYPE_INT64,
+                                        "description", G_TYPE_STRING, "frame number",
+                                        NULL),
+                        "value", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+                                        "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+                                        "description", G_TYPE_STRING,
+                                        "grab status, forced IDR, encoded size or PTS, by point",
+                                        NULL),
+                        NULL);
+        GST_OBJECT_FLAG_SET (tr_stage, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+}
+
+static void
+gst_nvimage_tracer_init (GstNVimageTracer * self)
+{
+        g_atomic_int_set (&gst_nvimage_tracing, 1);
+}
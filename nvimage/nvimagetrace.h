@@ -0,0 +1,88 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_NVIMAGETRACE_H__
+#define __GST_NVIMAGETRACE_H__
+
+#include <gst/gst.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+G_BEGIN_DECLS
+
+/**
+ * GstNVimageTracePoint:
+ * @GST_NVIMAGE_TRACE_GRAB_START: a grab of the screen starts, the value is 0
+ * @GST_NVIMAGE_TRACE_GRAB_END: the grab returned, the value is its status
+ * @GST_NVIMAGE_TRACE_ENCODE_SUBMIT: the picture went to the encoder, the
+ * value is 1 for a forced IDR
+ * @GST_NVIMAGE_TRACE_ENCODE_COMPLETE: the encoded picture is out, the value
+ * is its size
+ * @GST_NVIMAGE_TRACE_PUSH: the buffer leaves the element, the value is its
+ * PTS
+ *
+ * The static tracepoints of a frame.
+ */
+typedef enum {
+  GST_NVIMAGE_TRACE_GRAB_START,
+  GST_NVIMAGE_TRACE_GRAB_END,
+  GST_NVIMAGE_TRACE_ENCODE_SUBMIT,
+  GST_NVIMAGE_TRACE_ENCODE_COMPLETE,
+  GST_NVIMAGE_TRACE_PUSH,
+} GstNVimageTracePoint;
+
+#define GST_TYPE_NVIMAGE_TRACER (gst_nvimage_tracer_get_type())
+
+GType gst_nvimage_tracer_get_type (void);
+
+/* set while an nvimagestages tracer is running */
+extern volatile gint gst_nvimage_tracing;
+
+void gst_nvimage_trace_log (GstElement * element, GstNVimageTracePoint point, gint64 frame, guint64 value);
+
+/* The USDT probes are named after the points, provider nvimagesrc, with
+   the element, the frame number and the value as arguments */
+#ifdef HAVE_SYS_SDT_H
+#define NVIMAGE_SDT(name, element, frame, value) \
+  DTRACE_PROBE3 (nvimagesrc, name, (gpointer) (element), (gint64) (frame), (guint64) (value))
+#else
+#define NVIMAGE_SDT(name, element, frame, value) G_STMT_START { } G_STMT_END
+#endif
+
+/**
+ * NVIMAGE_TRACE:
+ * @element: the element the frame is for, may be NULL
+ * @point: a #GstNVimageTracePoint
+ * @name: the USDT probe name of @point
+ * @frame: the frame number
+ * @value: what @point tells about the frame
+ *
+ * Fires the USDT probe and, while the tracer runs, logs a tracer record.
+ * Without either it costs a NOP and a load.
+ */
+#define NVIMAGE_TRACE(element, point, name, frame, value) G_STMT_START { \
+  NVIMAGE_SDT (name, element, frame, value); \
+  if (G_UNLIKELY (g_atomic_int_get (&gst_nvimage_tracing))) \
+    gst_nvimage_trace_log ((element), (point), (frame), (value)); \
+} G_STMT_END
+
+G_END_DECLS
+
+#endif /* __GST_NVIMAGETRACE_H__ */
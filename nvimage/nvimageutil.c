@@ -22,15 +22,28 @@
 #endif
 
 #include "nvimageutil.h"
+#include "nvimagememory.h"
+#include <dlfcn.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
 #include <unistd.h>
 
 static gboolean nvimageutil_fbccontext_get(GstXContext *xcontext);
 static gboolean nvimageutil_fbccontext_clear(GstXContext *xcontext);
+static gboolean nvimageutil_backend_open (GstXContext *xcontext);
+static gboolean nvimageutil_backend_close (GstXContext *xcontext);
+static gboolean nvimageutil_retrieve_frame (GstXContext *xcontext, GstMetaNVimage *meta, GstMemory **mem);
+static void nvimageutil_producer_start (GstXContext *xcontext, GstElement *parent, guint queue_size, GstNVimageQueuePolicy policy);
+static void nvimageutil_produce_frame (GstXContext *xcontext);
 static gboolean nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gchar * display_name);
+static gboolean nvimageutil_window_get (GstXContext *xcontext);
 static void nvimageutil_xcontext_clear (GstXContext * xcontext);
-static GstBuffer * gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts);
+static void nvimageutil_glx_close (GstXContext * xcontext);
+static void nvimageutil_group_quit (GstXContext * xcontext);
+static void nvimageutil_rendition_unref (GstNVimageRendition * rendition);
+static GstFlowReturn gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, const GstNVimageParams * params, gint64 frame, gint64 ts, GstBuffer ** buf);
 
 GType
 gst_meta_nvimage_api_get_type (void)
@@ -53,7 +66,11 @@ gst_meta_nvimage_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
         emeta->width = 0;
         emeta->height = 0;
         emeta->size = 0;
-        emeta->data = 0;
+        emeta->offset = 0;
+        emeta->keyframe = FALSE;
+        emeta->capture_time = 0;
+        emeta->repeated = FALSE;
+        emeta->codec = GST_NVIMAGE_CODEC_H264;
 
         return TRUE;
 }
@@ -78,9 +95,22 @@ worker_thread(void *arg) {
         GstXContext *xcontext = (GstXContext *)(arg);
         gboolean retb;
         GstBuffer *buf;
+        GstFlowReturn flow;
+        gchar name[16];
+
+        /* named after the element, profiles then tell the streams apart */
+        g_snprintf(name, sizeof(name), "nv:%s", xcontext->parent ? GST_OBJECT_NAME(xcontext->parent) : "capture");
+        prctl(PR_SET_NAME, name, 0, 0, 0);
+
         while(!xcontext->finish) {
                 pthread_mutex_lock(&xcontext->mutex_in);
                 if(! xcontext->funcdata.inputvalid) {
+                        if (g_atomic_int_get(&xcontext->producing)) {
+                                /* No call to serve, go on producing frames */
+                                pthread_mutex_unlock(&xcontext->mutex_in);
+                                nvimageutil_produce_frame(xcontext);
+                                continue;
+                        }
                         pthread_cond_wait(&xcontext->cond_in, &xcontext->mutex_in);
                 }
                 xcontext->funcdata.inputvalid = 0;                
@@ -107,15 +137,29 @@ worker_thread(void *arg) {
                                 pthread_mutex_unlock(&xcontext->mutex_in);
                                 return NULL;
                         case 3:
-                                buf = gst_nvimageutil_nvimage_new(xcontext, xcontext->funcdata.args[0].parent,
-                                                                        xcontext->funcdata.args[1].fps_n, xcontext->funcdata.args[2].fps_d,
-                                                                        xcontext->funcdata.args[3].bitrate, xcontext->funcdata.args[4].show_pointer,
-                                                                        xcontext->funcdata.args[5].forcekeyframe,
-                                                                        xcontext->funcdata.args[6].frame,
-                                                                        xcontext->funcdata.args[7].ts);
+                                buf = NULL;
+                                xcontext->funcdata.picked = gst_nvimage_stats_now(xcontext->stats);
+                                flow = gst_nvimageutil_nvimage_new(xcontext, xcontext->funcdata.args[0].parent,
+                                                                        xcontext->funcdata.args[1].params,
+                                                                        xcontext->funcdata.args[2].frame,
+                                                                        xcontext->funcdata.args[3].ts, &buf);
+                                if (flow == GST_FLOW_OK)
+                                        gst_nvimage_stats_frame(xcontext->stats);
+                                xcontext->funcdata.answered = gst_nvimage_stats_now(xcontext->stats);
                                 pthread_mutex_lock(&xcontext->mutex_out);
                                 xcontext->funcdata.retvalid = 1;
                                 xcontext->funcdata.retval.buf = buf;                                
+                                xcontext->funcdata.flow = flow;
+                                pthread_cond_broadcast(&xcontext->cond_out);
+                                pthread_mutex_unlock(&xcontext->mutex_out);
+                                break;
+                        case 4:
+                                nvimageutil_producer_start(xcontext, xcontext->funcdata.args[0].parent,
+                                                                        xcontext->funcdata.args[1].queue_size,
+                                                                        xcontext->funcdata.args[2].queue_policy);
+                                pthread_mutex_lock(&xcontext->mutex_out);
+                                xcontext->funcdata.retvalid = 1;
+                                xcontext->funcdata.retval.b = TRUE;
                                 pthread_cond_broadcast(&xcontext->cond_out);
                                 pthread_mutex_unlock(&xcontext->mutex_out);
                                 break;
@@ -132,15 +176,33 @@ worker_init(GstXContext *xcontext) {
         pthread_mutex_init(&xcontext->mutex_out, NULL);
         pthread_cond_init(&xcontext->cond_in, NULL);
         pthread_cond_init(&xcontext->cond_out, NULL);
+        pthread_mutex_init(&xcontext->params_mutex, NULL);
         pthread_create(&xcontext->worker_tid, NULL, worker_thread, xcontext);
 }
 
 
+/* Opens the display and sets up capture of @region of it, or of the whole
+   screen with a NULL @region. With a window given by @xid, or by @xname
+   when @xid is None, the window is captured instead and followed around.
+   A @monitor restricts the capture to that RandR output. */
 GstXContext *
-nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name)
+nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name, const NVFBC_BOX * region,
+                           Window xid, const gchar * xname, const gchar * monitor,
+                           GstNVimageBackendType backend)
 {
         gboolean ret;
         GstXContext * xcontext = g_new0 (GstXContext, 1);
+        xcontext->parent = parent;
+        gst_nvimage_h264_init(&xcontext->h264);
+        if (region)
+                xcontext->region = *region;
+        xcontext->xid = xid;
+        xcontext->xname = g_strdup (xname);
+        xcontext->monitor = g_strdup (monitor);
+        xcontext->backend_type = backend;
+        xcontext->stats = gst_nvimage_stats_new ();
+        xcontext->renditions = g_ptr_array_new ();
+        pthread_mutex_init(&xcontext->renditions_mutex, NULL);
         worker_init(xcontext);        
         memset(&xcontext->funcdata, 0, sizeof(GstXThreadCall));
         pthread_mutex_lock(&xcontext->mutex_in);
@@ -163,16 +225,34 @@ nvimageutil_xcontext_get_r(GstElement * parent, const gchar * display_name)
                 xcontext->finish = 1;
                 pthread_cond_signal(&xcontext->cond_in);
                 pthread_join(xcontext->worker_tid, NULL);
+                g_free(xcontext->xname);
+                g_free(xcontext->monitor);
+                g_ptr_array_free(xcontext->renditions, TRUE);
+                pthread_mutex_destroy(&xcontext->renditions_mutex);
+                gst_nvimage_stats_free(xcontext->stats);
                 return NULL;
         }
+
+        xcontext->pool = gst_nvimage_pool_new();
+        gst_buffer_pool_set_active(xcontext->pool, TRUE);
+
         return xcontext;
 }
 
 void
 nvimageutil_xcontext_clear_r (GstXContext * xcontext)
 {
-        memset(&xcontext->funcdata, 0, sizeof(GstXThreadCall));
+        GstNVimageRendition *rendition;
+        GString *json;
+
+        /* Nobody joins from now on */
+        nvimageutil_group_quit(xcontext);
+
+        /* Get a producer blocked on a full queue out of the way first */
+        nvimageutil_producer_set_flushing(xcontext, TRUE);
+
         pthread_mutex_lock(&xcontext->mutex_in);
+        memset(&xcontext->funcdata, 0, sizeof(GstXThreadCall));
         xcontext->funcdata.function = 2;
         xcontext->funcdata.inputvalid = 1;
         pthread_mutex_unlock(&xcontext->mutex_in);
@@ -182,23 +262,132 @@ nvimageutil_xcontext_clear_r (GstXContext * xcontext)
                 pthread_cond_wait(&xcontext->cond_out, &xcontext->mutex_out);
         }
         pthread_mutex_unlock(&xcontext->mutex_out);
+        pthread_join(xcontext->worker_tid, NULL);
+
+        if (xcontext->queue)
+                gst_nvimage_queue_free(xcontext->queue);
+
+        /* Buffers still downstream keep the pool alive until they return */
+        gst_buffer_pool_set_active(xcontext->pool, FALSE);
+        gst_object_unref(xcontext->pool);
+        /* The encoders went with the capture session, the elements still
+           in the group are left with an error */
+        for (guint i = 0; i < xcontext->renditions->len; i++) {
+                rendition = g_ptr_array_index(xcontext->renditions, i);
+                g_atomic_int_set(&rendition->error, 1);
+                gst_nvimage_queue_set_flushing(rendition->queue, TRUE);
+                nvimageutil_rendition_unref(rendition);
+        }
+        g_ptr_array_free(xcontext->renditions, TRUE);
+        pthread_mutex_destroy(&xcontext->renditions_mutex);
+        g_free (xcontext->group);
+
+        gst_nvimage_h264_clear(&xcontext->h264);
+        pthread_mutex_destroy(&xcontext->params_mutex);
+        /* with NVIMAGE_STATS set, the log gets the totals */
+        if (g_getenv ("NVIMAGE_STATS") && xcontext->stats->frames > 0) {
+                json = g_string_new (NULL);
+                gst_nvimage_stats_to_json (xcontext->stats, json);
+                g_message ("nvimagesrc stats: %s", json->str);
+                g_string_free (json, TRUE);
+        }
+
+        g_free (xcontext->xname);
+        g_free (xcontext->monitor);
+        g_free (xcontext->slice_offsets);
+        gst_nvimage_stats_free (xcontext->stats);
         g_free (xcontext);
 }
 
-GstBuffer *
-gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts) {
-        GstBuffer *ret;
+/* Returns %NVIMAGE_FLOW_UNCHANGED and no buffer when the screen had not
+   changed and @params asked for such grabs to be skipped. With
+   @params->slices, all slices of the picture but the last go to @slice_func
+   from this thread while the rest is encoded, the last one is returned;
+   when @slice_func fails, the picture is dropped with its flow. */
+GstFlowReturn
+gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, const GstNVimageParams * params, gint64 frame, gint64 ts,
+                               GstNVimageSliceFunc slice_func, gpointer user_data, GstBuffer ** buf) {
+        GstFlowReturn ret, slice_ret = GST_FLOW_OK;
+        GstBuffer *slice;
         memset(&xcontext->funcdata, 0, sizeof(GstXThreadCall));
         pthread_mutex_lock(&xcontext->mutex_in);
         xcontext->funcdata.function = 3;
         xcontext->funcdata.args[0].parent = parent;
-        xcontext->funcdata.args[1].fps_n = fps_n;
-        xcontext->funcdata.args[2].fps_d = fps_d;
-        xcontext->funcdata.args[3].bitrate = bitrate;
-        xcontext->funcdata.args[4].show_pointer = show_pointer;
-        xcontext->funcdata.args[5].forcekeyframe = forcekeyframe;
-        xcontext->funcdata.args[6].frame = frame;
-        xcontext->funcdata.args[7].ts = ts;
+        xcontext->funcdata.args[1].params = params;
+        xcontext->funcdata.args[2].frame = frame;
+        xcontext->funcdata.args[3].ts = ts;
+        xcontext->funcdata.retvalid = 0;
+        xcontext->funcdata.posted = gst_nvimage_stats_now(xcontext->stats);
+        xcontext->funcdata.inputvalid = 1;
+        pthread_mutex_unlock(&xcontext->mutex_in);
+        pthread_cond_signal(&xcontext->cond_in);
+        pthread_mutex_lock(&xcontext->mutex_out);
+        for (;;) {
+                /* the capture thread queues all slices before it answers */
+                while ((slice = g_queue_pop_head(&xcontext->funcdata.slices)) != NULL) {
+                        pthread_mutex_unlock(&xcontext->mutex_out);
+                        if (slice_func && slice_ret == GST_FLOW_OK)
+                                slice_ret = slice_func(slice, user_data);
+                        else
+                                gst_buffer_unref(slice);
+                        pthread_mutex_lock(&xcontext->mutex_out);
+                }
+                if (xcontext->funcdata.retvalid)
+                        break;
+                pthread_cond_wait(&xcontext->cond_out, &xcontext->mutex_out);
+        }
+        *buf = xcontext->funcdata.retval.buf;
+        ret = xcontext->funcdata.flow;
+        pthread_mutex_unlock(&xcontext->mutex_out);
+        if (slice_ret != GST_FLOW_OK && ret == GST_FLOW_OK) {
+                gst_buffer_unref(*buf);
+                *buf = NULL;
+                ret = slice_ret;
+        }
+        /* both ways through the mailbox, the frame itself left out */
+        gst_nvimage_stats_add(xcontext->stats, GST_NVIMAGE_STAGE_RPC,
+                              xcontext->funcdata.picked - xcontext->funcdata.posted +
+                              gst_nvimage_stats_now(xcontext->stats) - xcontext->funcdata.answered);
+        return ret;
+}
+
+void
+nvimageutil_producer_set_params (GstXContext * xcontext, const GstNVimageParams * params)
+{
+        pthread_mutex_lock(&xcontext->params_mutex);
+        xcontext->params.fps_n = params->fps_n;
+        xcontext->params.fps_d = params->fps_d;
+        xcontext->params.bitrate = params->bitrate;
+        xcontext->params.scale = params->scale;
+        xcontext->params.show_pointer = params->show_pointer;
+        xcontext->params.max_frames_in_flight = params->max_frames_in_flight;
+        xcontext->params.zero_copy_buffers = params->zero_copy_buffers;
+        xcontext->params.skip_unchanged = params->skip_unchanged;
+        xcontext->params.heartbeat = params->heartbeat;
+        xcontext->params.repeat_unchanged = params->repeat_unchanged;
+        xcontext->params.codec = params->codec;
+        xcontext->params.format = params->format;
+        xcontext->params.gl_context = params->gl_context;
+        xcontext->params.slices = params->slices;
+        /* A keyframe request stays pending until the producer consumed it */
+        xcontext->params.forcekeyframe |= params->forcekeyframe;
+        pthread_mutex_unlock(&xcontext->params_mutex);
+}
+
+/* Switches the worker thread to producing frames on its own, they are then
+   collected with nvimageutil_producer_pop(). The parameters must have been
+   set with nvimageutil_producer_set_params() before. */
+gboolean
+nvimageutil_producer_start_r (GstXContext * xcontext, GstElement * parent, guint queue_size, GstNVimageQueuePolicy policy)
+{
+        gboolean ret;
+
+        pthread_mutex_lock(&xcontext->mutex_in);
+        memset(&xcontext->funcdata, 0, sizeof(GstXThreadCall));
+        xcontext->funcdata.function = 4;
+        xcontext->funcdata.args[0].parent = parent;
+        xcontext->funcdata.args[1].queue_size = queue_size;
+        xcontext->funcdata.args[2].queue_policy = policy;
         xcontext->funcdata.retvalid = 0;
         xcontext->funcdata.inputvalid = 1;
         pthread_mutex_unlock(&xcontext->mutex_in);
@@ -207,11 +396,94 @@ gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guin
         if(xcontext->funcdata.retvalid == 0) {
                 pthread_cond_wait(&xcontext->cond_out, &xcontext->mutex_out);
         }
-        ret = xcontext->funcdata.retval.buf;
+        ret = xcontext->funcdata.retval.b;
         pthread_mutex_unlock(&xcontext->mutex_out);
         return ret;
 }
 
+/* Takes the oldest produced frame, blocking until there is one */
+GstFlowReturn
+nvimageutil_producer_pop (GstXContext * xcontext, GstBuffer ** buf)
+{
+        g_return_val_if_fail (xcontext->queue != NULL, GST_FLOW_ERROR);
+
+        if (g_atomic_int_get(&xcontext->producer_error))
+                return GST_FLOW_ERROR;
+
+        *buf = gst_nvimage_queue_pop(xcontext->queue);
+        if (*buf)
+                return GST_FLOW_OK;
+
+        return g_atomic_int_get(&xcontext->producer_error) ? GST_FLOW_ERROR : GST_FLOW_FLUSHING;
+}
+
+void
+nvimageutil_producer_set_flushing (GstXContext * xcontext, gboolean flushing)
+{
+        if (xcontext->queue)
+                gst_nvimage_queue_set_flushing(xcontext->queue, flushing);
+}
+
+/* Runs in the worker thread */
+static void
+nvimageutil_producer_start (GstXContext * xcontext, GstElement * parent, guint queue_size, GstNVimageQueuePolicy policy)
+{
+        xcontext->producer_parent = parent;
+        xcontext->produced = 0;
+        xcontext->queue = gst_nvimage_queue_new(queue_size, policy);
+        g_debug("Starting frame producer, queue of %u, %s", xcontext->queue->size,
+                  policy == GST_NVIMAGE_QUEUE_DROP_OLDEST ? "dropping oldest" : "blocking");
+        g_atomic_int_set(&xcontext->producing, 1);
+}
+
+/* Runs in the worker thread: grabs and encodes one frame with the latest
+   parameters and queues it for the streaming thread */
+static void
+nvimageutil_produce_frame (GstXContext * xcontext)
+{
+        GstNVimageParams params;
+        GstBuffer *buf = NULL;
+        GstFlowReturn ret;
+        gboolean dropped;
+
+        pthread_mutex_lock(&xcontext->params_mutex);
+        params = xcontext->params;
+        xcontext->params.forcekeyframe = 0;
+        pthread_mutex_unlock(&xcontext->params_mutex);
+
+        ret = gst_nvimageutil_nvimage_new(xcontext, xcontext->producer_parent, &params,
+                                            xcontext->produced, 0, &buf);
+        /* Nothing new on screen; the grab already waited a frame interval
+           for a change, so just try again */
+        if (ret == NVIMAGE_FLOW_UNCHANGED)
+                return;
+        if (ret != GST_FLOW_OK) {
+                g_warning("Frame producer failed, stopping");
+                g_atomic_int_set(&xcontext->producer_error, 1);
+                g_atomic_int_set(&xcontext->producing, 0);
+                gst_nvimage_queue_set_flushing(xcontext->queue, TRUE);
+                return;
+        }
+        xcontext->produced++;
+        gst_nvimage_stats_frame(xcontext->stats);
+
+        if (!gst_nvimage_queue_push(xcontext->queue, buf, &dropped)) {
+                /* Flushing; frames are discarded until the queue is reopened
+                   or the context cleared. Don't spin meanwhile. */
+                g_usleep(1000);
+                return;
+        }
+
+        if (dropped) {
+                /* Queued frames referencing the dropped one are broken, make
+                   the decoder recover as soon as possible */
+                g_debug("Consumer too slow, dropped oldest frame");
+                pthread_mutex_lock(&xcontext->params_mutex);
+                xcontext->params.forcekeyframe |= NVIMAGE_KEYFRAME_FORCE;
+                pthread_mutex_unlock(&xcontext->params_mutex);
+        }
+}
+
 /* This function gets the X Display and global info about it. Everything is
    stored in our object and will be cleaned when the object is disposed. Note
    here that caps for supported format are generated without any window or
@@ -219,23 +491,10 @@ gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guin
 static gboolean
 nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gchar * display_name)
 {
-        gint n;
-        GLXFBConfig *fbconfigs;
-        gint res;
-
-        int attribs[] = {
-                GLX_DRAWABLE_TYPE, GLX_PIXMAP_BIT | GLX_WINDOW_BIT,
-                GLX_BIND_TO_TEXTURE_RGBA_EXT, 1,
-                GLX_BIND_TO_TEXTURE_TARGETS_EXT, GLX_TEXTURE_2D_BIT_EXT,
-                None
-        };
-
-
         xcontext->disp = XOpenDisplay (display_name);
         GST_DEBUG_OBJECT (parent, "opened display %p", xcontext->disp);
         if (!xcontext->disp) {
-                g_free (xcontext);
-                g_error ("Cannot open display");
+                g_warning ("Cannot open display %s", XDisplayName (display_name));
                 return FALSE;
         }
         xcontext->screen = DefaultScreenOfDisplay (xcontext->disp);
@@ -243,67 +502,21 @@ nvimageutil_xcontext_get (GstXContext *xcontext, GstElement * parent, const gcha
         xcontext->width = WidthOfScreen (xcontext->screen);
         xcontext->height = HeightOfScreen (xcontext->screen);
 
-        fbconfigs = glXChooseFBConfig(xcontext->disp, DefaultScreen(xcontext->disp), attribs, &n);
-
-        if (!fbconfigs) {
-                XCloseDisplay (xcontext->disp);
-                g_error ("Cannot get fbconfigs");
-                return FALSE;
-        }
-
-        xcontext->glxctx = glXCreateNewContext(xcontext->disp, fbconfigs[0], GLX_RGBA_TYPE, None, True);
-
-        if (xcontext->glxctx == None) {
-                XFree(fbconfigs);
-                XCloseDisplay (xcontext->disp);
-                g_error ("Cannot create new glx context");
-                return FALSE;
-        }
-
-        xcontext->pixmap = XCreatePixmap(xcontext->disp, XDefaultRootWindow(xcontext->disp), 
-                                        1, 1, DisplayPlanes(xcontext->disp, XDefaultScreen(xcontext->disp)));
-
-        if (xcontext->pixmap == None) {
-                glXDestroyContext(xcontext->disp, xcontext->glxctx);
-                XFree(fbconfigs);
-                XCloseDisplay (xcontext->disp);
-                g_error ("Cannot create pixmap");
-                return FALSE;
-        }
-
-        xcontext->glxpixmap = glXCreatePixmap(xcontext->disp, fbconfigs[0], xcontext->pixmap, NULL);
-
-        if (xcontext->glxpixmap == None) {
-                XFreePixmap(xcontext->disp, xcontext->pixmap);
-                glXDestroyContext(xcontext->disp, xcontext->glxctx);
-                XFree(fbconfigs);
-                XCloseDisplay (xcontext->disp);
-                g_error ("Cannot create glx pixmap");
-                return FALSE;
-        }
-
-        res = glXMakeCurrent(xcontext->disp, xcontext->glxpixmap, xcontext->glxctx);
-        if (!res) {
-                glXDestroyPixmap(xcontext->disp, xcontext->glxpixmap);
-                XFreePixmap(xcontext->disp, xcontext->pixmap);
-                glXDestroyContext(xcontext->disp, xcontext->glxctx);
-                XFree(fbconfigs);
+        if ((xcontext->xid != None || xcontext->xname) && !nvimageutil_window_get (xcontext)) {
                 XCloseDisplay (xcontext->disp);
-                g_error ("Cannot set current context");
                 return FALSE;
         }
 
-        xcontext->fbconfig = fbconfigs[0];
-
-        XFree(fbconfigs);
-
         xcontext->fps_n = 30;
         xcontext->fps_d = 1;
         xcontext->bitrate = 2000000;
+        xcontext->scale = 100;
         xcontext->goplen = 10;
         xcontext->show_pointer = 0;
+        xcontext->max_frames_in_flight = 1;
+        xcontext->zero_copy_buffers = 0;
 
-        if (!nvimageutil_fbccontext_get(xcontext)) {
+        if (!nvimageutil_backend_open(xcontext)) {
                 nvimageutil_xcontext_clear(xcontext);
                 return FALSE;
         }
@@ -318,199 +531,955 @@ nvimageutil_xcontext_clear (GstXContext * xcontext)
 {
         g_return_if_fail (xcontext != NULL);
 
-        nvimageutil_fbccontext_clear(xcontext);
+        nvimageutil_backend_close(xcontext);
+        gst_clear_object(&xcontext->gl_context);
 
-        glXMakeCurrent(xcontext->disp, 0, NULL);
-        glXDestroyPixmap(xcontext->disp, xcontext->glxpixmap);
-        XFreePixmap(xcontext->disp, xcontext->pixmap);
-        glXDestroyContext(xcontext->disp, xcontext->glxctx);
+        nvimageutil_glx_close(xcontext);
         XCloseDisplay (xcontext->disp);
 }
 
-static gboolean
-nvimageutil_fbccontext_get(GstXContext *xcontext)
+/* X errors about windows of other clients going away under us must not
+   take the process down, they are trapped around the calls on them */
+static volatile gboolean nvimageutil_x_error;
+
+static int
+nvimageutil_x_error_handler (Display * disp, XErrorEvent * event)
 {
-        NVFBCSTATUS                             fbcStatus;
-        NVFBC_CREATE_HANDLE_PARAMS              createHandleParams;
-        NVFBC_GET_STATUS_PARAMS                 statusParams;
-        NVFBC_SIZE                              frameSize = { 0, 0};
-        NVFBC_CREATE_CAPTURE_SESSION_PARAMS     createCaptureParams;
-        NVENCSTATUS                             encStatus;
-        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS    encodeSessionParams;
-        GUID                                    encodeGuid;
-        NV_ENC_PRESET_CONFIG                    presetConfig;
-        NV_ENC_INITIALIZE_PARAMS                initParams;
-        NV_ENC_CREATE_BITSTREAM_BUFFER          bitstreamBufferParams;
+        nvimageutil_x_error = TRUE;
+        return 0;
+}
 
+static XErrorHandler
+nvimageutil_trap_errors (Display * disp)
+{
+        XSync (disp, False);
+        nvimageutil_x_error = FALSE;
+        return XSetErrorHandler (nvimageutil_x_error_handler);
+}
 
-        xcontext->pFn.dwVersion = NVFBC_VERSION;
+static gboolean
+nvimageutil_untrap_errors (Display * disp, XErrorHandler old)
+{
+        XSync (disp, False);
+        XSetErrorHandler (old);
+        return !nvimageutil_x_error;
+}
 
-        fbcStatus = NvFBCCreateInstance(&xcontext->pFn);
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot create FBC instance %d", fbcStatus);
-                return FALSE;
+/* Looks for the window titled @name below @parent, depth first */
+static Window
+nvimageutil_find_window (Display * disp, Window parent, const gchar * name)
+{
+        Window       root_return, parent_return, *children = NULL;
+        Window       found = None;
+        unsigned int nchildren = 0;
+        char         *title = NULL;
+
+        if (XFetchName (disp, parent, &title) && title) {
+                if (strcmp (title, name) == 0)
+                        found = parent;
+                XFree (title);
+                if (found != None)
+                        return found;
         }
 
-        memset(&createHandleParams, 0, sizeof(createHandleParams));
+        if (!XQueryTree (disp, parent, &root_return, &parent_return, &children, &nchildren))
+                return None;
 
-        createHandleParams.dwVersion                 = NVFBC_CREATE_HANDLE_PARAMS_VER;
-        createHandleParams.bExternallyManagedContext = NVFBC_TRUE;
-        createHandleParams.glxCtx                    = xcontext->glxctx;
-        createHandleParams.glxFBConfig               = xcontext->fbconfig;
+        for (guint i = 0; i < nchildren && found == None; i++)
+                found = nvimageutil_find_window (disp, children[i], name);
 
-        fbcStatus = xcontext->pFn.nvFBCCreateHandle(&xcontext->fbcHandle, &createHandleParams);
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot create FBC handle %d", fbcStatus);
-                return FALSE;
-        }
+        if (children)
+                XFree (children);
 
-        memset(&statusParams, 0, sizeof(statusParams));
+        return found;
+}
 
-        statusParams.dwVersion = NVFBC_GET_STATUS_PARAMS_VER;
+/* Asks for the structure events of the followed window and of the windows
+   it sits in: a window manager moves its frame, not the window itself */
+static void
+nvimageutil_watch_window (GstXContext * xcontext)
+{
+        Window       root = DefaultRootWindow (xcontext->disp);
+        Window       w = xcontext->window;
+        Window       root_return, parent, *children;
+        unsigned int nchildren;
+
+        while (w != None && w != root) {
+                XSelectInput (xcontext->disp, w, StructureNotifyMask);
+                children = NULL;
+                if (!XQueryTree (xcontext->disp, w, &root_return, &parent, &children, &nchildren))
+                        break;
+                if (children)
+                        XFree (children);
+                w = parent;
+        }
+}
 
-        fbcStatus = xcontext->pFn.nvFBCGetStatus(xcontext->fbcHandle, &statusParams);
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot get FBC status %d", fbcStatus);
+/* The area of the screen the followed window covers, cut to the screen and
+   grown to what NVENC can encode. FALSE when the window is gone. */
+static gboolean
+nvimageutil_window_box (GstXContext * xcontext, NVFBC_BOX * box)
+{
+        XWindowAttributes attrs;
+        Window            child;
+        gint              x, y, w, h;
+        gint              screen_w = WidthOfScreen (xcontext->screen);
+        gint              screen_h = HeightOfScreen (xcontext->screen);
+
+        if (!XGetWindowAttributes (xcontext->disp, xcontext->window, &attrs))
+                return FALSE;
+        if (!XTranslateCoordinates (xcontext->disp, xcontext->window, DefaultRootWindow (xcontext->disp),
+                                    0, 0, &x, &y, &child))
                 return FALSE;
-        }
 
-        frameSize.w = statusParams.screenSize.w;
-        frameSize.h = statusParams.screenSize.h;
-        frameSize.w = (frameSize.w + 3) & ~3;
+        w = attrs.width;
+        h = attrs.height;
+        /* what hangs off the screen is not captured */
+        if (x < 0) {
+                w += x;
+                x = 0;
+        }
+        if (y < 0) {
+                h += y;
+                y = 0;
+        }
+        w = MIN (w, screen_w - x);
+        h = MIN (h, screen_h - y);
 
-        xcontext->width = frameSize.w;
-        xcontext->height = frameSize.h;
+        /* a tiny window takes some of its surroundings along */
+        w = MAX (w, NVIMAGE_MIN_WIDTH);
+        h = MAX (h, NVIMAGE_MIN_HEIGHT);
+        x = CLAMP (x, 0, MAX (screen_w - w, 0));
+        y = CLAMP (y, 0, MAX (screen_h - h, 0));
 
-        memset(&createCaptureParams, 0, sizeof(createCaptureParams));
+        box->x = x;
+        box->y = y;
+        box->w = w;
+        box->h = h;
 
-        createCaptureParams.dwVersion                   = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER;
-        createCaptureParams.eCaptureType                = NVFBC_CAPTURE_TO_GL;
-        // FIX: Disable cursor to support Direct Capture
-        createCaptureParams.bWithCursor                 = NVFBC_FALSE;  // xcontext->show_pointer;
-        createCaptureParams.frameSize                   = frameSize;
-        createCaptureParams.eTrackingType               = NVFBC_TRACKING_SCREEN;
-        createCaptureParams.bDisableAutoModesetRecovery = NVFBC_TRUE;
-        // NvFBC settings for accurate framerate
-        uint32_t target_fps = (xcontext->fps_n > 0 && xcontext->fps_d > 0) ? 
-                              (xcontext->fps_n / xcontext->fps_d) : 60;
-        // FIX: Push Model is REQUIRED for Direct Capture and minimal latency!
-        uint32_t sampling_ms = (1000 / target_fps);  // Ignored when Push Model = TRUE
-        createCaptureParams.dwSamplingRateMs = sampling_ms;
-        createCaptureParams.bPushModel = NVFBC_TRUE;   // Push model for Direct Capture!
-        createCaptureParams.bAllowDirectCapture = NVFBC_TRUE;  // Direct capture for performance
-        
-        g_debug("NvFBC capture: target_fps=%d, dwSamplingRateMs=%d, bPushModel=%d", 
-                  target_fps, sampling_ms, createCaptureParams.bPushModel);
+        return TRUE;
+}
 
-        fbcStatus = xcontext->pFn.nvFBCCreateCaptureSession(xcontext->fbcHandle, &createCaptureParams);
-        
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot create FBC session %d", fbcStatus);
+/* Finds the window to capture and makes its area the region */
+static gboolean
+nvimageutil_window_get (GstXContext * xcontext)
+{
+        XErrorHandler old;
+        gboolean      ret;
+
+        old = nvimageutil_trap_errors (xcontext->disp);
+        xcontext->window = xcontext->xid;
+        if (xcontext->window == None)
+                xcontext->window = nvimageutil_find_window (xcontext->disp, DefaultRootWindow (xcontext->disp),
+                                                            xcontext->xname);
+        ret = xcontext->window != None && nvimageutil_window_box (xcontext, &xcontext->region);
+        if (ret)
+                nvimageutil_watch_window (xcontext);
+        nvimageutil_untrap_errors (xcontext->disp, old);
+
+        if (!ret) {
+                if (xcontext->xid != None)
+                        g_warning ("Cannot capture window 0x%lx, no such window", xcontext->xid);
+                else
+                        g_warning ("Cannot capture window \"%s\", no such window", xcontext->xname);
+                xcontext->window = None;
                 return FALSE;
         }
 
-        xcontext->setupParams.dwVersion     = NVFBC_TOGL_SETUP_PARAMS_VER;
-        xcontext->setupParams.eBufferFormat = NVFBC_BUFFER_FORMAT_NV12;
+        g_debug ("Following window 0x%lx at %ux%u+%u+%u", xcontext->window,
+                 xcontext->region.w, xcontext->region.h, xcontext->region.x, xcontext->region.y);
 
-        fbcStatus = xcontext->pFn.nvFBCToGLSetUp(xcontext->fbcHandle, &xcontext->setupParams);
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error ("Cannot setup FBC GL %d", fbcStatus);
-                return FALSE;
-        }
+        return TRUE;
+}
 
-        xcontext->pEncFn.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+/* Goes through the X events since the previous frame and, when the followed
+   window moved or was resized, rebuilds the capture session for its new
+   area. NvFBC can't move the capture box of a running session. */
+static gboolean
+nvimageutil_follow_window (GstXContext * xcontext)
+{
+        XErrorHandler old;
+        XEvent        event;
+        NVFBC_BOX     box;
+        gboolean      changed = FALSE, reparented = FALSE, alive;
+
+        while (XPending (xcontext->disp)) {
+                XNextEvent (xcontext->disp, &event);
+                switch (event.type) {
+                        case ReparentNotify:
+                                reparented = TRUE;
+                                changed = TRUE;
+                                break;
+                        case ConfigureNotify:
+                        case MapNotify:
+                                changed = TRUE;
+                                break;
+                        case DestroyNotify:
+                                if (event.xdestroywindow.window == xcontext->window) {
+                                        g_warning ("Captured window destroyed, keeping its last area");
+                                        xcontext->window = None;
+                                        return TRUE;
+                                }
+                                break;
+                        default:
+                                break;
+                }
+        }
 
-        encStatus = NvEncodeAPICreateInstance(&xcontext->pEncFn);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot create NVENC instance %d", encStatus);
+        if (!changed)
+                return TRUE;
+
+        old = nvimageutil_trap_errors (xcontext->disp);
+        alive = nvimageutil_window_box (xcontext, &box);
+        /* the new frame of the window is what moves from now on */
+        if (alive && reparented)
+                nvimageutil_watch_window (xcontext);
+        nvimageutil_untrap_errors (xcontext->disp, old);
+
+        if (!alive || (box.x == xcontext->region.x && box.y == xcontext->region.y &&
+                       box.w == xcontext->region.w && box.h == xcontext->region.h))
+                return TRUE;
+
+        g_debug ("Recreating %s pipeline, window moved to %ux%u+%u+%u",
+                   xcontext->backend->name, box.w, box.h, box.x, box.y);
+        xcontext->region = box;
+        xcontext->stats->recreations++;
+        if (!xcontext->backend->close(xcontext)) {
+                g_warning("Cannot clear context. Flow error.");
                 return FALSE;
         }
-
-        memset(&encodeSessionParams, 0, sizeof(encodeSessionParams));
-
-        encodeSessionParams.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
-        encodeSessionParams.apiVersion = NVENCAPI_VERSION;
-        encodeSessionParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
-
-        encStatus = xcontext->pEncFn.nvEncOpenEncodeSessionEx(&encodeSessionParams, &xcontext->encoder);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot open NVENC session %d", encStatus);
+        if (!xcontext->backend->open(xcontext)) {
+                g_warning("Cannot create new context. Flow error.");
                 return FALSE;
         }
 
-        encodeGuid = NV_ENC_CODEC_H264_GUID;
-
-        memset(&presetConfig, 0, sizeof(presetConfig));
+        return TRUE;
+}
 
-        presetConfig.version = NV_ENC_PRESET_CONFIG_VER;
-        presetConfig.presetCfg.version = NV_ENC_CONFIG_VER;
-                encStatus = xcontext->pEncFn.nvEncGetEncodePresetConfig(xcontext->encoder,
-                                                                encodeGuid,
-                                                                NV_ENC_PRESET_LOW_LATENCY_DEFAULT_GUID,
-                                                                &presetConfig);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot get NVENC preset config %d", encStatus);
-                return FALSE;
-        }
+/* GOP length for a framerate. NVENC can't change the GOP structure of a
+   running session, so a framerate moving to another bucket needs a rebuild */
+guint
+nvimageutil_gop_size (guint fps_n, guint fps_d)
+{
+        guint fps = (fps_n > 0 && fps_d > 0) ? fps_n / fps_d : 60;
 
-        presetConfig.presetCfg.rcParams.averageBitRate   = xcontext->bitrate;
-        presetConfig.presetCfg.rcParams.maxBitRate       = xcontext->bitrate;
-        presetConfig.presetCfg.rcParams.vbvBufferSize    = 0;
-        presetConfig.presetCfg.rcParams.rateControlMode  = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
-        presetConfig.presetCfg.rcParams.zeroReorderDelay = 1;
-        presetConfig.presetCfg.profileGUID               = NV_ENC_H264_PROFILE_HIGH_GUID;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.repeatSPSPPS           = 0;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.outputAUD              = 1;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.outputPictureTimingSEI = 1;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.chromaFormatIDC        = 1;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.level                  = NV_ENC_LEVEL_AUTOSELECT;
-        // SMOOTHNESS: Reduce GOP for more frequent I-frames and smoothness
-        uint32_t gop_size = (target_fps >= 60) ? 15 : (target_fps >= 30) ? 30 : 60;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.idrPeriod              = gop_size;
-	presetConfig.presetCfg.gopLength 					   = gop_size;
-        
-        // FORCE set VUI timing info for H.264 headers
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.h264VUIParameters.timingInfoPresentFlag = 1;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.h264VUIParameters.numUnitInTicks = xcontext->fps_d;
-        presetConfig.presetCfg.encodeCodecConfig.h264Config.h264VUIParameters.timeScale = xcontext->fps_n * 2;
-
-
-	memset(&initParams, 0, sizeof(initParams));
-        initParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
-        initParams.encodeGUID = encodeGuid;
-        initParams.presetGUID = NV_ENC_PRESET_LOW_LATENCY_DEFAULT_GUID;
-        initParams.encodeConfig = &presetConfig.presetCfg;
-        initParams.encodeWidth = frameSize.w;
-        initParams.encodeHeight = frameSize.h;
-        initParams.frameRateNum = xcontext->fps_n;
-        initParams.frameRateDen = xcontext->fps_d;
-        initParams.enablePTD = 1;
-        
-        g_debug("NVENC encoder: frameRateNum=%d, frameRateDen=%d, target_fps=%d", 
-                  xcontext->fps_n, xcontext->fps_d, target_fps);
-        g_debug("NVENC GOP: gopLength=%d, idrPeriod=%d", 
-                  presetConfig.presetCfg.gopLength, presetConfig.presetCfg.encodeCodecConfig.h264Config.idrPeriod);
+        return (fps >= 60) ? 15 : (fps >= 30) ? 30 : 60;
+}
 
-        encStatus = xcontext->pEncFn.nvEncInitializeEncoder(xcontext->encoder, &initParams);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot initialize NVENC encoder %d", encStatus);
-                return FALSE;
+static const gchar *
+nvimageutil_codec_name (GstNVimageCodec codec)
+{
+        switch (codec) {
+                case GST_NVIMAGE_CODEC_H265:
+                        return "H.265";
+                case GST_NVIMAGE_CODEC_AV1:
+                        return "AV1";
+                case GST_NVIMAGE_CODEC_RAW:
+                        return "raw";
+                case GST_NVIMAGE_CODEC_GL:
+                        return "GL";
+                default:
+                        return "H.264";
         }
+}
 
-        xcontext->mapParams.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
-
-        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
-                NV_ENC_REGISTER_RESOURCE         registerParams;
-                NV_ENC_INPUT_RESOURCE_OPENGL_TEX texParams;
+/* Stream timing for the framerate, in the codec's headers */
+static void
+nvimageutil_config_timing (GstXContext * xcontext, NV_ENC_CONFIG * config)
+{
+        NV_ENC_CONFIG_H264_VUI_PARAMETERS *vui;
+
+        switch (xcontext->codec) {
+                case GST_NVIMAGE_CODEC_H265:
+                        vui = &config->encodeCodecConfig.hevcConfig.hevcVUIParameters;
+                        vui->timingInfoPresentFlag = 1;
+                        vui->numUnitInTicks = xcontext->fps_d;
+                        vui->timeScale = xcontext->fps_n;
+                        break;
+                case GST_NVIMAGE_CODEC_AV1:
+                        /* taken from frameRateNum/frameRateDen */
+                        config->encodeCodecConfig.av1Config.enableTimingInfo = 1;
+                        break;
+                default:
+                        /* H.264 counts in fields */
+                        vui = &config->encodeCodecConfig.h264Config.h264VUIParameters;
+                        vui->timingInfoPresentFlag = 1;
+                        vui->numUnitInTicks = xcontext->fps_d;
+                        vui->timeScale = xcontext->fps_n * 2;
+                        break;
+        }
+}
 
-                if (!xcontext->setupParams.dwTextures[i]) {
+/* Cuts the pictures into @slices slices, or leaves them whole for 0 */
+static void
+nvimageutil_config_slices (GstNVimageCodec codec, NV_ENC_CONFIG * config, guint slices)
+{
+        switch (codec) {
+                case GST_NVIMAGE_CODEC_H264:
+                        config->encodeCodecConfig.h264Config.sliceMode = slices ? 3 : 0;
+                        config->encodeCodecConfig.h264Config.sliceModeData = slices;
                         break;
-                }
+                case GST_NVIMAGE_CODEC_H265:
+                        config->encodeCodecConfig.hevcConfig.sliceMode = slices ? 3 : 0;
+                        config->encodeCodecConfig.hevcConfig.sliceModeData = slices;
+                        break;
+                default:
+                        break;
+        }
+}
 
-                memset(&registerParams, 0, sizeof(registerParams));
+static void
+nvimageutil_config_h264 (GstXContext * xcontext, NV_ENC_CONFIG * config, guint gop_size)
+{
+        NV_ENC_CONFIG_H264 *h264 = &config->encodeCodecConfig.h264Config;
+
+        config->profileGUID    = NV_ENC_H264_PROFILE_HIGH_GUID;
+        h264->repeatSPSPPS           = 0;
+        h264->outputAUD              = 1;
+        h264->outputPictureTimingSEI = 1;
+        h264->chromaFormatIDC        = 1;
+        h264->level                  = NV_ENC_LEVEL_AUTOSELECT;
+        h264->idrPeriod              = gop_size;
+        /* A synthesized repeat stands in for the reference of the next
+           encoded picture, which only works with a single one */
+        if (xcontext->repeat_unchanged)
+                h264->maxNumRefFrames = 1;
+}
 
-                texParams.texture = xcontext->setupParams.dwTextures[i];
-                texParams.target = xcontext->setupParams.dwTexTarget;
+static void
+nvimageutil_config_h265 (GstXContext * xcontext, NV_ENC_CONFIG * config, guint gop_size)
+{
+        NV_ENC_CONFIG_HEVC *hevc = &config->encodeCodecConfig.hevcConfig;
+
+        config->profileGUID    = NV_ENC_HEVC_PROFILE_MAIN_GUID;
+        hevc->repeatSPSPPS           = 0;
+        hevc->outputAUD              = 1;
+        hevc->outputPictureTimingSEI = 1;
+        hevc->chromaFormatIDC        = 1;
+        hevc->level                  = NV_ENC_LEVEL_AUTOSELECT;
+        hevc->idrPeriod              = gop_size;
+}
+
+static void
+nvimageutil_config_av1 (GstXContext * xcontext, NV_ENC_CONFIG * config, guint gop_size)
+{
+        NV_ENC_CONFIG_AV1 *av1 = &config->encodeCodecConfig.av1Config;
+
+        config->profileGUID    = NV_ENC_AV1_PROFILE_MAIN_GUID;
+        /* low overhead OBUs, the sequence header leads every key frame
+           only on request like SPS/PPS do */
+        av1->outputAnnexBFormat = 0;
+        av1->repeatSeqHdr       = 0;
+        av1->chromaFormatIDC    = 1;
+        av1->level              = NV_ENC_LEVEL_AV1_AUTOSELECT;
+        av1->idrPeriod          = gop_size;
+}
+
+/* Fills the encoder config for the codec from its low latency preset */
+static gboolean
+nvimageutil_config (GstXContext * xcontext, GUID * encodeGuid, GUID * presetGuid)
+{
+        NV_ENC_CONFIG *config = &xcontext->presetConfig.presetCfg;
+        NVENCSTATUS   encStatus;
+        guint         gop_size;
+
+        memset(&xcontext->presetConfig, 0, sizeof(xcontext->presetConfig));
+        xcontext->presetConfig.version = NV_ENC_PRESET_CONFIG_VER;
+        config->version = NV_ENC_CONFIG_VER;
+
+        switch (xcontext->codec) {
+                case GST_NVIMAGE_CODEC_H265:
+                        *encodeGuid = NV_ENC_CODEC_HEVC_GUID;
+                        break;
+                case GST_NVIMAGE_CODEC_AV1:
+                        *encodeGuid = NV_ENC_CODEC_AV1_GUID;
+                        break;
+                default:
+                        *encodeGuid = NV_ENC_CODEC_H264_GUID;
+                        break;
+        }
+
+        if (xcontext->codec == GST_NVIMAGE_CODEC_AV1) {
+                /* AV1 only comes with the tuned presets */
+                *presetGuid = NV_ENC_PRESET_P4_GUID;
+                encStatus = xcontext->pEncFn.nvEncGetEncodePresetConfigEx(xcontext->encoder, *encodeGuid, *presetGuid,
+                                                                          NV_ENC_TUNING_INFO_LOW_LATENCY,
+                                                                          &xcontext->presetConfig);
+        } else {
+                *presetGuid = NV_ENC_PRESET_LOW_LATENCY_DEFAULT_GUID;
+                encStatus = xcontext->pEncFn.nvEncGetEncodePresetConfig(xcontext->encoder, *encodeGuid, *presetGuid,
+                                                                        &xcontext->presetConfig);
+        }
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning ("Cannot get NVENC preset config %d", encStatus);
+                return FALSE;
+        }
+
+        config->rcParams.averageBitRate   = xcontext->bitrate;
+        config->rcParams.maxBitRate       = xcontext->bitrate;
+        config->rcParams.vbvBufferSize    = 0;
+        /* the tuned presets of AV1 are low delay already, the legacy
+           mode is refused with them */
+        config->rcParams.rateControlMode  = xcontext->codec == GST_NVIMAGE_CODEC_AV1 ?
+                                            NV_ENC_PARAMS_RC_CBR : NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
+        config->rcParams.zeroReorderDelay = 1;
+
+        // SMOOTHNESS: Reduce GOP for more frequent I-frames and smoothness
+        gop_size = nvimageutil_gop_size(xcontext->fps_n, xcontext->fps_d);
+        config->gopLength = gop_size;
+
+        switch (xcontext->codec) {
+                case GST_NVIMAGE_CODEC_H265:
+                        nvimageutil_config_h265(xcontext, config, gop_size);
+                        break;
+                case GST_NVIMAGE_CODEC_AV1:
+                        nvimageutil_config_av1(xcontext, config, gop_size);
+                        break;
+                default:
+                        nvimageutil_config_h264(xcontext, config, gop_size);
+                        break;
+        }
+        nvimageutil_config_slices(xcontext->codec, config, xcontext->slices);
+        nvimageutil_config_timing(xcontext, config);
+
+        g_debug("NVENC %s, GOP: gopLength=%d", nvimageutil_codec_name(xcontext->codec), gop_size);
+
+        return TRUE;
+}
+
+/* Whether NVENC writes the slices of a picture out as they are done, so
+   they can be read back before the rest is encoded */
+static gboolean
+nvimageutil_subframe_readback (GstXContext * xcontext, GUID encodeGuid)
+{
+        NV_ENC_CAPS_PARAM capsParams;
+        int               supported = 0;
+
+        if (xcontext->pEncFn.nvEncGetEncodeCaps == NULL)
+                return FALSE;
+
+        memset(&capsParams, 0, sizeof(capsParams));
+        capsParams.version = NV_ENC_CAPS_PARAM_VER;
+        capsParams.capsToQuery = NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK;
+
+        if (xcontext->pEncFn.nvEncGetEncodeCaps(xcontext->encoder, encodeGuid, &capsParams, &supported) != NV_ENC_SUCCESS)
+                return FALSE;
+
+        return supported != 0;
+}
+
+/* Hands the SPS and PPS of a new encoder session to the writer of
+   repeated pictures */
+static void
+nvimageutil_h264_headers (GstXContext * xcontext)
+{
+        NV_ENC_SEQUENCE_PARAM_PAYLOAD payload;
+        guint8                       headers[1024];
+        uint32_t                     size = 0;
+        NVENCSTATUS                  encStatus;
+
+        memset(&payload, 0, sizeof(payload));
+        payload.version = NV_ENC_SEQUENCE_PARAM_PAYLOAD_VER;
+        payload.inBufferSize = sizeof(headers);
+        payload.spsppsBuffer = headers;
+        payload.outSPSPPSPayloadSize = &size;
+
+        encStatus = xcontext->pEncFn.nvEncGetSequenceParams(xcontext->encoder, &payload);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot get sequence parameters %d, unchanged frames won't be repeated", encStatus);
+                return;
+        }
+
+        if (!gst_nvimage_h264_set_headers(&xcontext->h264, headers, size))
+                g_warning("Unsupported sequence parameters, unchanged frames won't be repeated");
+}
+
+/* Finds the RandR output @monitor names among those NvFBC tracks, either
+   by its name or by its index in the list */
+static const NVFBC_RANDR_OUTPUT_INFO *
+nvimageutil_find_output (const NVFBC_GET_STATUS_PARAMS * status, const gchar * monitor)
+{
+        gchar  *end;
+        guint64 index;
+
+        for (guint i = 0; i < status->dwOutputNum && i < NVFBC_OUTPUT_MAX; i++) {
+                if (strcmp (status->outputs[i].name, monitor) == 0)
+                        return &status->outputs[i];
+        }
+
+        index = g_ascii_strtoull (monitor, &end, 10);
+        if (end != monitor && *end == '\0' && index < MIN (status->dwOutputNum, NVFBC_OUTPUT_MAX))
+                return &status->outputs[index];
+
+        return NULL;
+}
+
+static NVFBC_BUFFER_FORMAT
+nvimageutil_buffer_format (GstVideoFormat format)
+{
+        switch (format) {
+                case GST_VIDEO_FORMAT_BGRA:
+                        return NVFBC_BUFFER_FORMAT_BGRA;
+                case GST_VIDEO_FORMAT_RGBA:
+                        return NVFBC_BUFFER_FORMAT_RGBA;
+                case GST_VIDEO_FORMAT_Y444:
+                        return NVFBC_BUFFER_FORMAT_YUV444P;
+                default:
+                        return NVFBC_BUFFER_FORMAT_NV12;
+        }
+}
+
+/* Has NvFBC convert the grabs of a raw capture session to the negotiated
+   format in system memory, there is no encoder to set up */
+static gboolean
+nvimageutil_sys_setup (GstXContext * xcontext, const NVFBC_SIZE * frameSize)
+{
+        NVFBC_TOSYS_SETUP_PARAMS setupParams;
+        NVFBCSTATUS              fbcStatus;
+
+        memset(&setupParams, 0, sizeof(setupParams));
+        setupParams.dwVersion     = NVFBC_TOSYS_SETUP_PARAMS_VER;
+        setupParams.eBufferFormat = nvimageutil_buffer_format(xcontext->format);
+        setupParams.ppBuffer      = &xcontext->frame;
+
+        fbcStatus = xcontext->pFn.nvFBCToSysSetUp(xcontext->fbcHandle, &setupParams);
+        if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning ("Cannot setup FBC system memory %d", fbcStatus);
+                return FALSE;
+        }
+
+        /* NvFBC packs the planes without padding, which is the default
+           layout of these formats for a width that is a multiple of 4 */
+        gst_video_info_set_format(&xcontext->info, xcontext->format, frameSize->w, frameSize->h);
+
+        g_debug("NvFBC raw capture: %s %ux%u, %" G_GSIZE_FORMAT " bytes a frame",
+                  gst_video_format_to_string(xcontext->format), frameSize->w, frameSize->h,
+                  GST_VIDEO_INFO_SIZE (&xcontext->info));
+
+        /* nothing is in flight, frames are read right after their grab */
+        xcontext->frames_in_flight = 0;
+        xcontext->slot_head = 0;
+        xcontext->slot_pending = 0;
+        xcontext->last_encode = 0;
+
+        return TRUE;
+}
+
+/* Wraps the textures of a GL capture session for GstGL and sets up the
+   textures the grabs are copied to, there is no encoder to set up */
+static gboolean
+nvimageutil_gl_setup (GstXContext * xcontext, const NVFBC_SIZE * frameSize)
+{
+        GstGLBaseMemoryAllocator   *allocator;
+        GstGLVideoAllocationParams *params;
+        GstGLTextureTarget         target;
+        GstStructure               *config;
+        GstCaps                    *caps;
+        gboolean                   ret;
+
+        if (xcontext->gl_context == NULL) {
+                g_warning("No GL context to output textures in");
+                return FALSE;
+        }
+
+        gst_video_info_set_format(&xcontext->info, GST_VIDEO_FORMAT_RGBA, frameSize->w, frameSize->h);
+        target = gst_gl_texture_target_from_gl(xcontext->setupParams.dwTexTarget);
+
+        allocator = GST_GL_BASE_MEMORY_ALLOCATOR (gst_gl_memory_allocator_get_default(xcontext->gl_context));
+        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX && xcontext->setupParams.dwTextures[i]; i++) {
+                /* wrapped, GstGL leaves the texture to NvFBC */
+                params = gst_gl_video_allocation_params_new_wrapped_texture(xcontext->gl_context, NULL,
+                                &xcontext->info, 0, NULL, target, GST_GL_RGBA8,
+                                xcontext->setupParams.dwTextures[i], NULL, NULL);
+                xcontext->gl_textures[i] = (GstMemory *) gst_gl_base_memory_alloc(allocator,
+                                (GstGLAllocationParams *) params);
+                gst_gl_allocation_params_free((GstGLAllocationParams *) params);
+                if (xcontext->gl_textures[i] == NULL) {
+                        g_warning("Cannot wrap capture texture %u", xcontext->setupParams.dwTextures[i]);
+                        gst_object_unref(allocator);
+                        return FALSE;
+                }
+        }
+        gst_object_unref(allocator);
+
+        /* No upper bound: a texture is only reused once downstream dropped
+           the buffer holding it */
+        caps = gst_video_info_to_caps(&xcontext->info);
+        gst_caps_set_features(caps, 0, gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_GL_MEMORY, NULL));
+        xcontext->gl_pool = gst_gl_buffer_pool_new(xcontext->gl_context);
+        config = gst_buffer_pool_get_config(xcontext->gl_pool);
+        gst_buffer_pool_config_set_params(config, caps, GST_VIDEO_INFO_SIZE (&xcontext->info), 2, 0);
+        gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+        gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_GL_SYNC_META);
+        gst_caps_unref(caps);
+
+        ret = gst_buffer_pool_set_config(xcontext->gl_pool, config) &&
+              gst_buffer_pool_set_active(xcontext->gl_pool, TRUE);
+        if (!ret) {
+                g_warning("Cannot set up the GL buffer pool");
+                return FALSE;
+        }
+
+        g_debug("NvFBC GL capture: %ux%u, %u texture(s) wrapped", frameSize->w, frameSize->h,
+                  xcontext->setupParams.dwTextures[1] ? 2 : 1);
+
+        /* nothing is in flight, frames are copied right after their grab */
+        xcontext->frames_in_flight = 0;
+        xcontext->slot_head = 0;
+        xcontext->slot_pending = 0;
+        xcontext->last_encode = 0;
+
+        return TRUE;
+}
+
+static void
+nvimageutil_gl_clear (GstXContext * xcontext)
+{
+        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++)
+                g_clear_pointer(&xcontext->gl_textures[i], gst_memory_unref);
+
+        /* the textures downstream still holds stay with their buffers */
+        if (xcontext->gl_pool) {
+                gst_buffer_pool_set_active(xcontext->gl_pool, FALSE);
+                gst_clear_object(&xcontext->gl_pool);
+        }
+}
+
+/* Sets up the GLX context NvFBC grabs into. It is made current in the
+   capture thread and kept until the display closes, GL frames share its
+   textures across rebuilds of the capture session. */
+static gboolean
+nvimageutil_glx_open (GstXContext * xcontext)
+{
+        GLXFBConfig *fbconfigs;
+        gint n = 0;
+
+        int attribs[] = {
+                GLX_DRAWABLE_TYPE, GLX_PIXMAP_BIT | GLX_WINDOW_BIT,
+                GLX_BIND_TO_TEXTURE_RGBA_EXT, 1,
+                GLX_BIND_TO_TEXTURE_TARGETS_EXT, GLX_TEXTURE_2D_BIT_EXT,
+                None
+        };
+
+        fbconfigs = glXChooseFBConfig(xcontext->disp, DefaultScreen(xcontext->disp), attribs, &n);
+        if (!fbconfigs || n == 0) {
+                if (fbconfigs)
+                        XFree(fbconfigs);
+                g_warning ("Cannot get fbconfigs");
+                return FALSE;
+        }
+        xcontext->fbconfig = fbconfigs[0];
+        XFree(fbconfigs);
+
+        xcontext->glxctx = glXCreateNewContext(xcontext->disp, xcontext->fbconfig, GLX_RGBA_TYPE, None, True);
+        if (xcontext->glxctx == None) {
+                g_warning ("Cannot create new glx context");
+                goto failed;
+        }
+
+        xcontext->pixmap = XCreatePixmap(xcontext->disp, XDefaultRootWindow(xcontext->disp),
+                                        1, 1, DisplayPlanes(xcontext->disp, XDefaultScreen(xcontext->disp)));
+        if (xcontext->pixmap == None) {
+                g_warning ("Cannot create pixmap");
+                goto failed;
+        }
+
+        xcontext->glxpixmap = glXCreatePixmap(xcontext->disp, xcontext->fbconfig, xcontext->pixmap, NULL);
+        if (xcontext->glxpixmap == None) {
+                g_warning ("Cannot create glx pixmap");
+                goto failed;
+        }
+
+        if (!glXMakeCurrent(xcontext->disp, xcontext->glxpixmap, xcontext->glxctx)) {
+                g_warning ("Cannot set current context");
+                goto failed;
+        }
+
+        return TRUE;
+
+failed:
+        nvimageutil_glx_close(xcontext);
+        return FALSE;
+}
+
+/* Releases what nvimageutil_glx_open() set up, also halfway */
+static void
+nvimageutil_glx_close (GstXContext * xcontext)
+{
+        if (xcontext->glxctx == None)
+                return;
+
+        glXMakeCurrent(xcontext->disp, None, NULL);
+        if (xcontext->glxpixmap != None)
+                glXDestroyPixmap(xcontext->disp, xcontext->glxpixmap);
+        if (xcontext->pixmap != None)
+                XFreePixmap(xcontext->disp, xcontext->pixmap);
+        glXDestroyContext(xcontext->disp, xcontext->glxctx);
+        xcontext->glxpixmap = None;
+        xcontext->pixmap = None;
+        xcontext->glxctx = None;
+}
+
+typedef NVENCSTATUS (NVENCAPI * PNVENCODEAPICREATEINSTANCE) (NV_ENCODE_API_FUNCTION_LIST *functionList);
+
+static PNVFBCCREATEINSTANCE nvimageutil_fbc_create_instance;
+static PNVENCODEAPICREATEINSTANCE nvimageutil_enc_create_instance;
+
+/* The driver libraries are looked up on first use rather than linked, so
+   the plugin loads on machines without them and picks another backend */
+static gboolean
+nvimageutil_nvfbc_load (void)
+{
+        static gsize loaded = 0;
+        static gboolean available = FALSE;
+        void *fbc, *enc;
+
+        if (g_once_init_enter (&loaded)) {
+                fbc = dlopen("libnvidia-fbc.so.1", RTLD_NOW | RTLD_LOCAL);
+                enc = dlopen("libnvidia-encode.so.1", RTLD_NOW | RTLD_LOCAL);
+                if (fbc)
+                        nvimageutil_fbc_create_instance = (PNVFBCCREATEINSTANCE) dlsym(fbc, "NvFBCCreateInstance");
+                if (enc)
+                        nvimageutil_enc_create_instance = (PNVENCODEAPICREATEINSTANCE) dlsym(enc, "NvEncodeAPICreateInstance");
+                available = nvimageutil_fbc_create_instance && nvimageutil_enc_create_instance;
+                if (!available)
+                        g_debug("NvFBC or NVENC library not found: %s", dlerror());
+                g_once_init_leave (&loaded, 1);
+        }
+
+        return available;
+}
+
+static gboolean
+nvimageutil_fbccontext_get(GstXContext *xcontext)
+{
+        NVFBCSTATUS                             fbcStatus;
+        NVFBC_CREATE_HANDLE_PARAMS              createHandleParams;
+        NVFBC_DESTROY_HANDLE_PARAMS             destroyHandleParams;
+        NVFBC_GET_STATUS_PARAMS                 statusParams;
+        const NVFBC_RANDR_OUTPUT_INFO           *output = NULL;
+        NVFBC_SIZE                              tracked;
+        NVFBC_SIZE                              frameSize = { 0, 0};
+        NVFBC_CREATE_CAPTURE_SESSION_PARAMS     createCaptureParams;
+        NVENCSTATUS                             encStatus;
+        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS    encodeSessionParams;
+        GUID                                    encodeGuid;
+        GUID                                    presetGuid;
+        NV_ENC_CREATE_BITSTREAM_BUFFER          bitstreamBufferParams;
+
+
+        xcontext->pFn.dwVersion = NVFBC_VERSION;
+
+        /* no NVIDIA GPU behind the display, another backend may do */
+        fbcStatus = nvimageutil_fbc_create_instance(&xcontext->pFn);
+        if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning ("Cannot create FBC instance %d", fbcStatus);
+                return FALSE;
+        }
+
+        memset(&createHandleParams, 0, sizeof(createHandleParams));
+
+        createHandleParams.dwVersion                 = NVFBC_CREATE_HANDLE_PARAMS_VER;
+        createHandleParams.bExternallyManagedContext = NVFBC_TRUE;
+        createHandleParams.glxCtx                    = xcontext->glxctx;
+        createHandleParams.glxFBConfig               = xcontext->fbconfig;
+
+        fbcStatus = xcontext->pFn.nvFBCCreateHandle(&xcontext->fbcHandle, &createHandleParams);
+        if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning ("Cannot create FBC handle %d", fbcStatus);
+                xcontext->fbcHandle = 0;
+                return FALSE;
+        }
+
+        memset(&statusParams, 0, sizeof(statusParams));
+
+        statusParams.dwVersion = NVFBC_GET_STATUS_PARAMS_VER;
+
+        fbcStatus = xcontext->pFn.nvFBCGetStatus(xcontext->fbcHandle, &statusParams);
+        if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning ("Cannot get FBC status %d", fbcStatus);
+                return FALSE;
+        }
+
+        for (guint i = 0; i < statusParams.dwOutputNum && i < NVFBC_OUTPUT_MAX; i++)
+                g_debug("NvFBC output %u: %s (id %u) %ux%u+%u+%u", i, statusParams.outputs[i].name,
+                          statusParams.outputs[i].dwId,
+                          statusParams.outputs[i].trackedBox.w, statusParams.outputs[i].trackedBox.h,
+                          statusParams.outputs[i].trackedBox.x, statusParams.outputs[i].trackedBox.y);
+
+        tracked = statusParams.screenSize;
+        if (xcontext->monitor) {
+                if (!statusParams.bXRandRAvailable) {
+                        g_warning("Cannot capture monitor %s, XRandR is not available", xcontext->monitor);
+                        goto no_output;
+                }
+                output = nvimageutil_find_output(&statusParams, xcontext->monitor);
+                if (output == NULL) {
+                        g_warning("Cannot capture monitor %s, no such output", xcontext->monitor);
+                        goto no_output;
+                }
+                tracked.w = output->trackedBox.w;
+                tracked.h = output->trackedBox.h;
+        }
+
+        /* Only the region is captured and encoded, clipped to what is
+           tracked: the screen or the monitor */
+        xcontext->capture_box.x = MIN (xcontext->region.x, tracked.w - 1);
+        xcontext->capture_box.y = MIN (xcontext->region.y, tracked.h - 1);
+        xcontext->capture_box.w = tracked.w - xcontext->capture_box.x;
+        xcontext->capture_box.h = tracked.h - xcontext->capture_box.y;
+        if (xcontext->region.w)
+                xcontext->capture_box.w = MIN (xcontext->region.w, xcontext->capture_box.w);
+        if (xcontext->region.h)
+                xcontext->capture_box.h = MIN (xcontext->region.h, xcontext->capture_box.h);
+
+        /* NvFBC scales to the frame size for free, but not below what
+           the encoders take */
+        frameSize.w = MAX (xcontext->capture_box.w * xcontext->scale / 100, MIN (xcontext->capture_box.w, 256));
+        frameSize.h = MAX (xcontext->capture_box.h * xcontext->scale / 100, MIN (xcontext->capture_box.h, 144));
+        frameSize.w = (frameSize.w + 3) & ~3;
+        /* raw NV12 has a chroma row for each pair of rows */
+        if (xcontext->codec == GST_NVIMAGE_CODEC_RAW && xcontext->format == GST_VIDEO_FORMAT_NV12)
+                frameSize.h = (frameSize.h + 1) & ~1;
+
+        xcontext->width = frameSize.w;
+        xcontext->height = frameSize.h;
+
+        memset(&createCaptureParams, 0, sizeof(createCaptureParams));
+
+        createCaptureParams.dwVersion                   = NVFBC_CREATE_CAPTURE_SESSION_PARAMS_VER;
+        createCaptureParams.eCaptureType                = xcontext->codec == GST_NVIMAGE_CODEC_RAW ?
+                                                          NVFBC_CAPTURE_TO_SYS : NVFBC_CAPTURE_TO_GL;
+        // FIX: Disable cursor to support Direct Capture
+        createCaptureParams.bWithCursor                 = NVFBC_FALSE;  // xcontext->show_pointer;
+        createCaptureParams.frameSize                   = frameSize;
+        /* an empty box captures all that is tracked */
+        if (xcontext->capture_box.w != tracked.w || xcontext->capture_box.h != tracked.h)
+                createCaptureParams.captureBox          = xcontext->capture_box;
+        if (output) {
+                createCaptureParams.eTrackingType       = NVFBC_TRACKING_OUTPUT;
+                createCaptureParams.dwOutputId          = output->dwId;
+        } else {
+                createCaptureParams.eTrackingType       = NVFBC_TRACKING_SCREEN;
+        }
+        createCaptureParams.bDisableAutoModesetRecovery = NVFBC_TRUE;
+        // NvFBC settings for accurate framerate
+        uint32_t target_fps = (xcontext->fps_n > 0 && xcontext->fps_d > 0) ? 
+                              (xcontext->fps_n / xcontext->fps_d) : 60;
+        // FIX: Push Model is REQUIRED for Direct Capture and minimal latency!
+        uint32_t sampling_ms = (1000 / target_fps);  // Ignored when Push Model = TRUE
+        createCaptureParams.dwSamplingRateMs = sampling_ms;
+        createCaptureParams.bPushModel = NVFBC_TRUE;   // Push model for Direct Capture!
+        createCaptureParams.bAllowDirectCapture = NVFBC_TRUE;  // Direct capture for performance
+        
+        g_debug("NvFBC capture: target_fps=%d, dwSamplingRateMs=%d, bPushModel=%d", 
+                  target_fps, sampling_ms, createCaptureParams.bPushModel);
+        g_debug("NvFBC capture box: %ux%u+%u+%u of %s %ux%u",
+                  xcontext->capture_box.w, xcontext->capture_box.h, xcontext->capture_box.x,
+                  xcontext->capture_box.y, output ? output->name : "screen", tracked.w, tracked.h);
+
+        fbcStatus = xcontext->pFn.nvFBCCreateCaptureSession(xcontext->fbcHandle, &createCaptureParams);
+        
+        if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning ("Cannot create FBC session %d", fbcStatus);
+                return FALSE;
+        }
+
+        if (xcontext->codec == GST_NVIMAGE_CODEC_RAW)
+                return nvimageutil_sys_setup(xcontext, &frameSize);
+
+        xcontext->setupParams.dwVersion     = NVFBC_TOGL_SETUP_PARAMS_VER;
+        xcontext->setupParams.eBufferFormat = xcontext->codec == GST_NVIMAGE_CODEC_GL ?
+                                              NVFBC_BUFFER_FORMAT_RGBA : NVFBC_BUFFER_FORMAT_NV12;
+
+        fbcStatus = xcontext->pFn.nvFBCToGLSetUp(xcontext->fbcHandle, &xcontext->setupParams);
+        if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning ("Cannot setup FBC GL %d", fbcStatus);
+                return FALSE;
+        }
+
+        if (xcontext->codec == GST_NVIMAGE_CODEC_GL)
+                return nvimageutil_gl_setup(xcontext, &frameSize);
+
+        xcontext->pEncFn.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+
+        encStatus = nvimageutil_enc_create_instance(&xcontext->pEncFn);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning ("Cannot create NVENC instance %d", encStatus);
+                return FALSE;
+        }
+
+        memset(&encodeSessionParams, 0, sizeof(encodeSessionParams));
+
+        encodeSessionParams.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+        encodeSessionParams.apiVersion = NVENCAPI_VERSION;
+        encodeSessionParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
+
+        encStatus = xcontext->pEncFn.nvEncOpenEncodeSessionEx(&encodeSessionParams, &xcontext->encoder);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning ("Cannot open NVENC session %d", encStatus);
+                return FALSE;
+        }
+
+        if (!nvimageutil_config(xcontext, &encodeGuid, &presetGuid))
+                return FALSE;
+
+	memset(&xcontext->initParams, 0, sizeof(xcontext->initParams));
+        xcontext->initParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
+        xcontext->initParams.encodeGUID = encodeGuid;
+        xcontext->initParams.presetGUID = presetGuid;
+        if (xcontext->codec == GST_NVIMAGE_CODEC_AV1)
+                xcontext->initParams.tuningInfo = NV_ENC_TUNING_INFO_LOW_LATENCY;
+        xcontext->initParams.encodeConfig = &xcontext->presetConfig.presetCfg;
+        xcontext->initParams.encodeWidth = frameSize.w;
+        xcontext->initParams.encodeHeight = frameSize.h;
+        xcontext->initParams.frameRateNum = xcontext->fps_n;
+        xcontext->initParams.frameRateDen = xcontext->fps_d;
+        xcontext->initParams.enablePTD = 1;
+        /* Sliced pictures say where each slice starts; where NVENC can, it
+           writes them out one by one, else the picture is cut up once done */
+        xcontext->subframe = FALSE;
+        if (xcontext->slices) {
+                xcontext->subframe = nvimageutil_subframe_readback(xcontext, encodeGuid);
+                xcontext->initParams.reportSliceOffsets = 1;
+                xcontext->initParams.enableSubFrameWrite = xcontext->subframe;
+                /* one entry per macroblock, the most slices there can be */
+                g_free(xcontext->slice_offsets);
+                xcontext->slice_offsets = g_new0(guint32, ((frameSize.w + 15) / 16) * ((frameSize.h + 15) / 16));
+                g_debug("NVENC %u slices per picture, sub-frame readback %s", xcontext->slices,
+                          xcontext->subframe ? "on" : "off");
+        }
+        
+        g_debug("NVENC encoder: frameRateNum=%d, frameRateDen=%d, target_fps=%d", 
+                  xcontext->fps_n, xcontext->fps_d, target_fps);
+
+        encStatus = xcontext->pEncFn.nvEncInitializeEncoder(xcontext->encoder, &xcontext->initParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning ("Cannot initialize NVENC encoder %d", encStatus);
+                return FALSE;
+        }
+
+        xcontext->h264.valid = FALSE;
+        /* renumbering the slices of a picture moves them, sliced pictures
+           are left as they are and an unchanged screen goes unrepeated */
+        if (xcontext->repeat_unchanged && !xcontext->slices && xcontext->codec == GST_NVIMAGE_CODEC_H264)
+                nvimageutil_h264_headers(xcontext);
+
+        xcontext->mapParams.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+
+        xcontext->textures = 0;
+        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+                NV_ENC_REGISTER_RESOURCE         registerParams;
+                NV_ENC_INPUT_RESOURCE_OPENGL_TEX texParams;
+
+                if (!xcontext->setupParams.dwTextures[i]) {
+                        break;
+                }
+
+                memset(&registerParams, 0, sizeof(registerParams));
+
+                texParams.texture = xcontext->setupParams.dwTextures[i];
+                texParams.target = xcontext->setupParams.dwTexTarget;
 
                 registerParams.version = NV_ENC_REGISTER_RESOURCE_VER;
                 registerParams.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_OPENGL_TEX;
@@ -520,294 +1489,1502 @@ nvimageutil_fbccontext_get(GstXContext *xcontext)
                 registerParams.resourceToRegister = &texParams;
                 registerParams.bufferFormat = NV_ENC_BUFFER_FORMAT_NV12;
 
-                encStatus = xcontext->pEncFn.nvEncRegisterResource(xcontext->encoder, &registerParams);
+                encStatus = xcontext->pEncFn.nvEncRegisterResource(xcontext->encoder, &registerParams);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning ("Cannot register NVENC resource %d", encStatus);
+                        return FALSE;
+                }
+
+                xcontext->registeredResources[i] = registerParams.registeredResource;
+                xcontext->textures++;
+        }
+
+        /* A texture must stay untouched by NvFBC until the picture encoded
+           from it has been read back, so never keep more pictures in flight
+           than there are textures to grab into */
+        xcontext->frames_in_flight = CLAMP (xcontext->max_frames_in_flight, 1, MAX (xcontext->textures, 1));
+        xcontext->slot_head = 0;
+        xcontext->slot_pending = 0;
+        /* a fresh encoder has nothing to refer to, start with a picture */
+        xcontext->last_encode = 0;
+
+        g_debug("NVENC pipeline: %u frame(s) in flight, %u texture(s)",
+                  xcontext->frames_in_flight, xcontext->textures);
+
+        /* Frames in flight each need an output buffer, and frames downstream
+           holds zero-copy keep theirs locked until released */
+        xcontext->bitstream_count = xcontext->frames_in_flight + xcontext->zero_copy_buffers;
+        xcontext->held = 0;
+
+        for (gint i = 0; i < xcontext->bitstream_count; i++) {
+                memset(&bitstreamBufferParams, 0, sizeof(bitstreamBufferParams));
+                bitstreamBufferParams.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+
+                encStatus = xcontext->pEncFn.nvEncCreateBitstreamBuffer(xcontext->encoder, &bitstreamBufferParams);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning ("Cannot create NVENC bitstream buffer %d", encStatus);
+                        return FALSE;
+                }
+
+                xcontext->bitstreams[i].buffer = bitstreamBufferParams.bitstreamBuffer;
+                xcontext->bitstreams[i].state = NVIMAGE_BITSTREAM_FREE;
+                xcontext->bitstreams[i].released = 0;
+                xcontext->bitstreams[i].mem = xcontext->zero_copy_buffers ? gst_nvimage_memory_new() : NULL;
+        }
+
+        xcontext->encParams.version = NV_ENC_PIC_PARAMS_VER;
+        xcontext->encParams.inputWidth = frameSize.w;
+        xcontext->encParams.inputHeight = frameSize.h;
+        xcontext->encParams.inputPitch = frameSize.w;
+        xcontext->encParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+
+        //xcontext->out = fopen("/tmp/output.h264", "wb");
+
+        return TRUE;
+
+no_output:
+        /* the monitor may be gone after a modeset; nothing but the handle
+           was set up, so the element errors out cleanly */
+        memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
+        destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
+        xcontext->pFn.nvFBCDestroyHandle(xcontext->fbcHandle, &destroyHandleParams);
+        xcontext->fbcHandle = 0;
+        return FALSE;
+}
+
+static void
+nvimageutil_rendition_unref (GstNVimageRendition * rendition)
+{
+        if (g_atomic_int_dec_and_test (&rendition->refcount)) {
+                gst_nvimage_queue_free (rendition->queue);
+                g_free (rendition);
+        }
+}
+
+static void
+nvimageutil_rendition_close (GstXContext * xcontext, GstNVimageRendition * rendition)
+{
+        NV_ENC_LOCK_BITSTREAM lockParams;
+
+        if (rendition->encoder == NULL)
+                return;
+
+        /* the picture in flight must complete before its input goes away */
+        if (rendition->slot.mapped) {
+                memset(&lockParams, 0, sizeof(lockParams));
+                lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
+                lockParams.outputBitstream = rendition->bitstream;
+                if (xcontext->pEncFn.nvEncLockBitstream(rendition->encoder, &lockParams) == NV_ENC_SUCCESS)
+                        xcontext->pEncFn.nvEncUnlockBitstream(rendition->encoder, rendition->bitstream);
+                xcontext->pEncFn.nvEncUnmapInputResource(rendition->encoder, rendition->slot.mapped);
+                rendition->slot.mapped = NULL;
+        }
+        if (rendition->bitstream)
+                xcontext->pEncFn.nvEncDestroyBitstreamBuffer(rendition->encoder, rendition->bitstream);
+        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+                if (rendition->registeredResources[i])
+                        xcontext->pEncFn.nvEncUnregisterResource(rendition->encoder, rendition->registeredResources[i]);
+                rendition->registeredResources[i] = NULL;
+        }
+        xcontext->pEncFn.nvEncDestroyEncoder(rendition->encoder);
+
+        rendition->bitstream = NULL;
+        rendition->encoder = NULL;
+}
+
+/* Copies the settings of the capture context's encoder, keeping the
+   rendition's bitrate */
+static void
+nvimageutil_rendition_config (GstXContext * xcontext, GstNVimageRendition * rendition)
+{
+        guint bitrate = g_atomic_int_get(&rendition->bitrate);
+
+        rendition->config = xcontext->presetConfig.presetCfg;
+        rendition->config.rcParams.averageBitRate = bitrate;
+        rendition->config.rcParams.maxBitRate = bitrate;
+        rendition->initParams = xcontext->initParams;
+        rendition->initParams.encodeConfig = &rendition->config;
+        /* the element of a rendition takes whole pictures */
+        nvimageutil_config_slices(xcontext->codec, &rendition->config, 0);
+        rendition->initParams.reportSliceOffsets = 0;
+        rendition->initParams.enableSubFrameWrite = 0;
+}
+
+/* Opens an encoder session for the rendition on the textures of the
+   capture session. A failure only costs the rendition. */
+static gboolean
+nvimageutil_rendition_open (GstXContext * xcontext, GstNVimageRendition * rendition)
+{
+        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS encodeSessionParams;
+        NV_ENC_CREATE_BITSTREAM_BUFFER       bitstreamBufferParams;
+        NVENCSTATUS                          encStatus;
+
+        memset(&encodeSessionParams, 0, sizeof(encodeSessionParams));
+        encodeSessionParams.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+        encodeSessionParams.apiVersion = NVENCAPI_VERSION;
+        encodeSessionParams.deviceType = NV_ENC_DEVICE_TYPE_OPENGL;
+
+        encStatus = xcontext->pEncFn.nvEncOpenEncodeSessionEx(&encodeSessionParams, &rendition->encoder);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot open NVENC session for rendition %d", encStatus);
+                rendition->encoder = NULL;
+                return FALSE;
+        }
+
+        nvimageutil_rendition_config(xcontext, rendition);
+        encStatus = xcontext->pEncFn.nvEncInitializeEncoder(rendition->encoder, &rendition->initParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot initialize NVENC encoder for rendition %d", encStatus);
+                goto fail;
+        }
+
+        for (gint i = 0; i < xcontext->textures; i++) {
+                NV_ENC_REGISTER_RESOURCE         registerParams;
+                NV_ENC_INPUT_RESOURCE_OPENGL_TEX texParams;
+
+                memset(&registerParams, 0, sizeof(registerParams));
+
+                texParams.texture = xcontext->setupParams.dwTextures[i];
+                texParams.target = xcontext->setupParams.dwTexTarget;
+
+                registerParams.version = NV_ENC_REGISTER_RESOURCE_VER;
+                registerParams.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_OPENGL_TEX;
+                registerParams.width = xcontext->encParams.inputWidth;
+                registerParams.height = xcontext->encParams.inputHeight;
+                registerParams.pitch = xcontext->encParams.inputPitch;
+                registerParams.resourceToRegister = &texParams;
+                registerParams.bufferFormat = NV_ENC_BUFFER_FORMAT_NV12;
+
+                encStatus = xcontext->pEncFn.nvEncRegisterResource(rendition->encoder, &registerParams);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning("Cannot register NVENC resource for rendition %d", encStatus);
+                        goto fail;
+                }
+                rendition->registeredResources[i] = registerParams.registeredResource;
+        }
+
+        memset(&bitstreamBufferParams, 0, sizeof(bitstreamBufferParams));
+        bitstreamBufferParams.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+        encStatus = xcontext->pEncFn.nvEncCreateBitstreamBuffer(rendition->encoder, &bitstreamBufferParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot create NVENC bitstream buffer for rendition %d", encStatus);
+                goto fail;
+        }
+        rendition->bitstream = bitstreamBufferParams.bitstreamBuffer;
+
+        g_debug("Rendition encoder opened, bitrate %u", rendition->config.rcParams.averageBitRate);
+
+        return TRUE;
+
+fail:
+        nvimageutil_rendition_close(xcontext, rendition);
+        return FALSE;
+}
+
+/* Reads the picture of @rendition back and queues it for its element */
+static gboolean
+nvimageutil_rendition_retrieve (GstXContext * xcontext, GstNVimageRendition * rendition)
+{
+        NV_ENC_LOCK_BITSTREAM        lockParams;
+        NVENCSTATUS                  encStatus;
+        GstBuffer                    *nvimage = NULL;
+        GstMetaNVimage               *meta;
+        GstMemory                    *mem;
+        gboolean                     dropped;
+
+        memset(&lockParams, 0, sizeof(lockParams));
+        lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
+        lockParams.outputBitstream = rendition->bitstream;
+        encStatus = xcontext->pEncFn.nvEncLockBitstream(rendition->encoder, &lockParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot lock rendition bitstream %d", encStatus);
+                return FALSE;
+        }
+
+        if (gst_buffer_pool_acquire_buffer (xcontext->pool, &nvimage, NULL) == GST_FLOW_OK) {
+                mem = gst_nvimage_pool_copy_payload(GST_NVIMAGE_POOL_CAST (xcontext->pool),
+                                                     lockParams.bitstreamBufferPtr,
+                                                     lockParams.bitstreamSizeInBytes);
+                meta = GST_META_NVIMAGE_GET (nvimage);
+                meta->offset = 0;
+                meta->size = lockParams.bitstreamSizeInBytes;
+                meta->width = xcontext->encParams.inputWidth;
+                meta->height = xcontext->encParams.inputHeight;
+                meta->keyframe = lockParams.pictureType == NV_ENC_PIC_TYPE_IDR;
+                meta->capture_time = rendition->slot.capture_time;
+                meta->repeated = rendition->slot.repeated;
+                meta->codec = xcontext->codec;
+
+                gst_buffer_append_memory (nvimage, mem);
+                if (!meta->keyframe)
+                        GST_BUFFER_FLAG_SET (nvimage, GST_BUFFER_FLAG_DELTA_UNIT);
+        }
+
+        xcontext->pEncFn.nvEncUnlockBitstream(rendition->encoder, rendition->bitstream);
+        xcontext->pEncFn.nvEncUnmapInputResource(rendition->encoder, rendition->slot.mapped);
+        rendition->slot.mapped = NULL;
+
+        if (nvimage && gst_nvimage_queue_push(rendition->queue, nvimage, &dropped) && dropped) {
+                /* the element fell behind, what is queued refers to a lost
+                   picture */
+                g_atomic_int_or(&rendition->forcekeyframe, NVIMAGE_KEYFRAME_FORCE);
+        }
+
+        return TRUE;
+}
+
+/* Submits the texture grabbed for @slot to the encoder of the rendition.
+   The picture is read back with the capture context's one, see
+   nvimageutil_retrieve_renditions(), so the encodes of the group run
+   together. */
+static gboolean
+nvimageutil_rendition_submit (GstXContext * xcontext, GstNVimageRendition * rendition,
+                              guint texture, const GstNVimageSlot * slot)
+{
+        NV_ENC_MAP_INPUT_RESOURCE    mapParams;
+        NV_ENC_PIC_PARAMS            encParams;
+        NV_ENC_RECONFIGURE_PARAMS    reconfigureParams;
+        NVENCSTATUS                  encStatus;
+        gint                         forcekeyframe;
+
+        /* One bitstream: with several pictures in flight, the previous one
+           is read back here, it had a grab's time to complete */
+        if (rendition->slot.mapped && !nvimageutil_rendition_retrieve(xcontext, rendition))
+                return FALSE;
+
+        /* follow bitrate and framerate changes like the main encoder does */
+        if (rendition->config.rcParams.averageBitRate != (guint) g_atomic_int_get(&rendition->bitrate) ||
+            rendition->initParams.frameRateNum != xcontext->initParams.frameRateNum ||
+            rendition->initParams.frameRateDen != xcontext->initParams.frameRateDen) {
+                nvimageutil_rendition_config(xcontext, rendition);
+                memset(&reconfigureParams, 0, sizeof(reconfigureParams));
+                reconfigureParams.version = NV_ENC_RECONFIGURE_PARAMS_VER;
+                reconfigureParams.reInitEncodeParams = rendition->initParams;
+                encStatus = xcontext->pEncFn.nvEncReconfigureEncoder(rendition->encoder, &reconfigureParams);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning("Cannot reconfigure rendition encoder %d", encStatus);
+                        return FALSE;
+                }
+        }
+
+        memset(&mapParams, 0, sizeof(mapParams));
+        mapParams.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+        mapParams.registeredResource = rendition->registeredResources[texture];
+        encStatus = xcontext->pEncFn.nvEncMapInputResource(rendition->encoder, &mapParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot map input resource for rendition %d", encStatus);
+                return FALSE;
+        }
+
+        encParams = xcontext->encParams;
+        encParams.inputBuffer = mapParams.mappedResource;
+        encParams.bufferFmt = mapParams.mappedBufferFmt;
+        encParams.outputBitstream = rendition->bitstream;
+        encParams.encodePicFlags = 0;
+        forcekeyframe = g_atomic_int_and(&rendition->forcekeyframe, 0);
+        if (forcekeyframe & NVIMAGE_KEYFRAME_FORCE)
+                encParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR;
+        if (forcekeyframe & NVIMAGE_KEYFRAME_HEADERS)
+                encParams.encodePicFlags |= NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+
+        encStatus = xcontext->pEncFn.nvEncEncodePicture(rendition->encoder, &encParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot encode rendition picture %d", encStatus);
+                xcontext->pEncFn.nvEncUnmapInputResource(rendition->encoder, mapParams.mappedResource);
+                return FALSE;
+        }
+
+        rendition->slot = *slot;
+        rendition->slot.bitstream = NULL;
+        rendition->slot.mapped = mapParams.mappedResource;
+
+        return TRUE;
+}
+
+/* A rendition that can't be encoded any more: its element gets an error */
+static void
+nvimageutil_rendition_fail (GstXContext * xcontext, GstNVimageRendition * rendition)
+{
+        nvimageutil_rendition_close(xcontext, rendition);
+        g_atomic_int_set(&rendition->error, 1);
+        gst_nvimage_queue_set_flushing(rendition->queue, TRUE);
+}
+
+/* Submits the grab into texture @texture for every element of the capture
+   group, opening the encoders of those that just joined and dropping those
+   that left */
+static void
+nvimageutil_submit_renditions (GstXContext * xcontext, guint texture, const GstNVimageSlot * slot)
+{
+        GstNVimageRendition *rendition;
+
+        pthread_mutex_lock(&xcontext->renditions_mutex);
+        for (guint i = 0; i < xcontext->renditions->len; i++) {
+                rendition = g_ptr_array_index(xcontext->renditions, i);
+
+                if (g_atomic_int_get(&rendition->removed)) {
+                        nvimageutil_rendition_close(xcontext, rendition);
+                        g_ptr_array_remove_index(xcontext->renditions, i--);
+                        nvimageutil_rendition_unref(rendition);
+                        continue;
+                }
+                if (g_atomic_int_get(&rendition->error))
+                        continue;
+
+                if ((rendition->encoder == NULL && !nvimageutil_rendition_open(xcontext, rendition)) ||
+                    !nvimageutil_rendition_submit(xcontext, rendition, texture, slot))
+                        nvimageutil_rendition_fail(xcontext, rendition);
+        }
+        pthread_mutex_unlock(&xcontext->renditions_mutex);
+}
+
+/* Reads back and queues the pictures of the group submitted with the grab
+   of @slot, once the capture context's own picture is in */
+static void
+nvimageutil_retrieve_renditions (GstXContext * xcontext, const GstNVimageSlot * slot)
+{
+        GstNVimageRendition *rendition;
+
+        pthread_mutex_lock(&xcontext->renditions_mutex);
+        for (guint i = 0; i < xcontext->renditions->len; i++) {
+                rendition = g_ptr_array_index(xcontext->renditions, i);
+
+                if (rendition->slot.mapped == NULL || rendition->slot.frame > slot->frame ||
+                    g_atomic_int_get(&rendition->error))
+                        continue;
+
+                if (!nvimageutil_rendition_retrieve(xcontext, rendition))
+                        nvimageutil_rendition_fail(xcontext, rendition);
+        }
+        pthread_mutex_unlock(&xcontext->renditions_mutex);
+}
+
+/* Closes the encoders of the capture group along with the capture session,
+   they are opened again on the textures of the next one */
+static void
+nvimageutil_close_renditions (GstXContext * xcontext)
+{
+        pthread_mutex_lock(&xcontext->renditions_mutex);
+        for (guint i = 0; i < xcontext->renditions->len; i++)
+                nvimageutil_rendition_close(xcontext, g_ptr_array_index(xcontext->renditions, i));
+        pthread_mutex_unlock(&xcontext->renditions_mutex);
+}
+
+/* Unlocks the bitstreams downstream is done with. NVENC is only called
+   from the capture thread, downstream merely flags the memory as released. */
+static gboolean
+nvimageutil_reclaim_bitstreams (GstXContext * xcontext)
+{
+        GstNVimageBitstream *bitstream;
+        NVENCSTATUS         encStatus;
+
+        for (gint i = 0; i < xcontext->bitstream_count && xcontext->held > 0; i++) {
+                bitstream = &xcontext->bitstreams[i];
+                if (bitstream->state != NVIMAGE_BITSTREAM_HELD || !g_atomic_int_get(&bitstream->released))
+                        continue;
+
+                encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, bitstream->buffer);
                 if (encStatus != NV_ENC_SUCCESS) {
-                        g_error ("Cannot register NVENC resource %d", encStatus);
+                        g_warning("Cannot unlock bitstream %d", encStatus);
                         return FALSE;
                 }
+                bitstream->state = NVIMAGE_BITSTREAM_FREE;
+                xcontext->held--;
+        }
 
-                xcontext->registeredResources[i] = registerParams.registeredResource;
+        return TRUE;
+}
+
+static GstNVimageBitstream *
+nvimageutil_acquire_bitstream (GstXContext * xcontext)
+{
+        if (!nvimageutil_reclaim_bitstreams(xcontext))
+                return NULL;
+
+        for (gint i = 0; i < xcontext->bitstream_count; i++) {
+                if (xcontext->bitstreams[i].state == NVIMAGE_BITSTREAM_FREE) {
+                        xcontext->bitstreams[i].state = NVIMAGE_BITSTREAM_ENCODING;
+                        return &xcontext->bitstreams[i];
+                }
+        }
+
+        /* The readback only holds a bitstream downstream while the others
+           cover the pictures in flight, so this can't happen */
+        g_warning("No free NVENC bitstream buffer");
+        return NULL;
+}
+
+static gboolean
+nvimageutil_bitstream_destroy (GstXContext * xcontext, GstNVimageBitstream * bitstream)
+{
+        NVENCSTATUS encStatus;
+
+        if (bitstream->state == NVIMAGE_BITSTREAM_HELD) {
+                /* Leave downstream a copy of what it still holds, once it
+                   stopped reading the bitstream itself */
+                if (gst_nvimage_memory_detach(bitstream->mem, &bitstream->released)) {
+                        g_warning("Encoded frame still held downstream on teardown, detached a copy");
+                        bitstream->mem = NULL;
+                }
+
+                encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, bitstream->buffer);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning("Cannot unlock bitstream %d", encStatus);
+                        return FALSE;
+                }
+                bitstream->state = NVIMAGE_BITSTREAM_FREE;
+        }
+
+        if (bitstream->mem) {
+                gst_memory_unref(bitstream->mem);
+                bitstream->mem = NULL;
+        }
+
+        if (bitstream->buffer) {
+                encStatus = xcontext->pEncFn.nvEncDestroyBitstreamBuffer(xcontext->encoder, bitstream->buffer);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning("Cannot destroy bitstream buffer %d", encStatus);
+                        return FALSE;
+                }
+                bitstream->buffer = NULL;
+        }
+
+        return TRUE;
+}
+
+/* Tears down the encoder of the capture session and what was registered
+   with it */
+static gboolean
+nvimageutil_encoder_clear (GstXContext * xcontext)
+{
+        NVENCSTATUS encStatus;
+
+        nvimageutil_close_renditions(xcontext);
+
+        /* Pictures still in flight must be completed before their input
+           textures and bitstreams go away */
+        while (xcontext->slot_pending > 0) {
+                g_debug("Dropping in-flight frame on teardown");
+                if (!nvimageutil_retrieve_frame(xcontext, NULL, NULL))
+                        return FALSE;
+        }
+
+        for (gint i = 0; i < xcontext->bitstream_count; i++) {
+                if (!nvimageutil_bitstream_destroy(xcontext, &xcontext->bitstreams[i]))
+                        return FALSE;
+        }
+        xcontext->bitstream_count = 0;
+        xcontext->held = 0;
+        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
+                if (xcontext->registeredResources[i]) {
+                        encStatus = xcontext->pEncFn.nvEncUnregisterResource(xcontext->encoder, xcontext->registeredResources[i]);
+                        if (encStatus != NV_ENC_SUCCESS) {
+                                g_warning("Cannot unregister resource %d", encStatus);
+                                return FALSE;
+                        }
+                        xcontext->registeredResources[i] = NULL;
+                }
+        }
+        encStatus = xcontext->pEncFn.nvEncDestroyEncoder(xcontext->encoder);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot destroy encoder %d", encStatus);
+                return FALSE;
+        }
+        g_clear_pointer(&xcontext->slice_offsets, g_free);
+
+        return TRUE;
+}
+
+static gboolean
+nvimageutil_fbccontext_clear(GstXContext *xcontext) {
+        NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroyCaptureParams;
+        NVFBC_DESTROY_HANDLE_PARAMS          destroyHandleParams;
+        NVFBCSTATUS                          fbcStatus;
+
+        /* a session that failed before the capture came up left nothing */
+        if (xcontext->fbcHandle == 0)
+                return TRUE;
+
+        /* raw and GL capture sessions go without one */
+        if (xcontext->encoder != NULL && !nvimageutil_encoder_clear(xcontext))
+                return FALSE;
+        nvimageutil_gl_clear(xcontext);
+
+        memset(&destroyCaptureParams, 0, sizeof(destroyCaptureParams));
+        destroyCaptureParams.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER;
+        fbcStatus = xcontext->pFn.nvFBCDestroyCaptureSession(xcontext->fbcHandle, &destroyCaptureParams);
+        /* none when the session failed to open, the handle still goes */
+        if (fbcStatus != NVFBC_SUCCESS)
+                g_warning("Cannot destroy capture session %d", fbcStatus);
+
+        memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
+        destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
+        fbcStatus = xcontext->pFn.nvFBCDestroyHandle(xcontext->fbcHandle, &destroyHandleParams);
+        /*if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning("Cannot destroy fbc handle %d", fbcStatus);
+                return FALSE;
+        }*/
+
+        if(xcontext->out)
+                fclose(xcontext->out);
+
+        memset(&xcontext->pFn, 0, sizeof(xcontext->pFn));
+        xcontext->fbcHandle = 0;
+        memset(&xcontext->pEncFn, 0, sizeof(xcontext->pEncFn));
+        xcontext->encoder = 0;
+        xcontext->frame = NULL;
+        memset(&xcontext->mapParams, 0, sizeof(xcontext->mapParams));
+        memset(&xcontext->encParams, 0, sizeof(xcontext->encParams));
+        memset(&xcontext->setupParams, 0, sizeof(xcontext->setupParams));
+        return TRUE;
+}
+
+/* Maps the NvFBC render timestamp of a grabbed frame to monotonic time.
+   The clocks are related by an offset plus the delay between render and
+   grab; the smallest difference seen is the best estimate of the offset.
+   It may creep up slowly so that drift between the clocks is followed. */
+static gint64
+nvimageutil_capture_time (GstXContext * xcontext, NVFBC_FRAME_GRAB_INFO * frameInfo)
+{
+        gint64 now = g_get_monotonic_time();
+        gint64 offset;
+
+        /* A repeated frame carries the timestamp of the original, but it is
+           shown now */
+        if (!frameInfo->bIsNewFrame || frameInfo->ulTimestampUs == 0)
+                return now;
+
+        offset = now - (gint64) frameInfo->ulTimestampUs;
+        if (!xcontext->ts_offset_valid || offset < xcontext->ts_offset) {
+                xcontext->ts_offset = offset;
+                xcontext->ts_offset_valid = TRUE;
+        } else {
+                xcontext->ts_offset += (offset - xcontext->ts_offset) / 64;
+        }
+
+        return (gint64) frameInfo->ulTimestampUs + xcontext->ts_offset;
+}
+
+/* Counts what NvFBC tells about a successful grab */
+static void
+nvimageutil_grab_stats (GstXContext * xcontext, const NVFBC_FRAME_GRAB_INFO * frameInfo)
+{
+        GstNVimageStats *stats = xcontext->stats;
+
+        if (frameInfo->bDirectCapture != stats->direct_active)
+                g_debug("Direct Capture %s", frameInfo->bDirectCapture ? "active" :
+                        "not active, check fullscreen/compositor");
+        stats->direct_active = frameInfo->bDirectCapture;
+        if (frameInfo->bDirectCapture)
+                stats->direct++;
+        stats->missed += frameInfo->dwMissedFrames;
+}
+
+/* Grabs the next frame into one of the textures of the capture session,
+   recreating the session when NvFBC asks for it */
+static gboolean
+nvimageutil_grab_texture (GstXContext * xcontext, NVFBC_TOGL_GRAB_FRAME_PARAMS * grabParams,
+                          NVFBC_FRAME_GRAB_INFO * frameInfo)
+{
+        NVFBCSTATUS                  fbcStatus;
+        gint64                       start;
+        gint                         i=0;
+
+restart:
+        memset(grabParams, 0, sizeof(*grabParams));
+        memset(frameInfo, 0, sizeof(*frameInfo));
+        
+        grabParams->dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER;
+        grabParams->pFrameGrabInfo = frameInfo;  // Add for getting Direct Capture info
+        
+        if (g_atomic_int_get(&xcontext->producing)) {
+                /* Nobody waits on us, let NvFBC wake the producer up on the
+                   next new frame and fall back to the last one after a frame
+                   interval instead of spinning on forced refreshes */
+                grabParams->dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOFLAGS;
+                grabParams->dwTimeoutMs = MAX((1000 * xcontext->fps_d) / xcontext->fps_n, 1);
+        } else {
+                /* The element paces the grabs on the clock, take whatever
+                   is on screen now. An unchanged screen just returns the
+                   last frame, no need to force a refresh. */
+                grabParams->dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT;
+        }
+
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_GRAB_START, grab_start, xcontext->next_frame, 0);
+        start = gst_nvimage_stats_now(xcontext->stats);
+        fbcStatus = xcontext->pFn.nvFBCToGLGrabFrame(xcontext->fbcHandle, grabParams);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_GRAB, start);
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_GRAB_END, grab_end, xcontext->next_frame, fbcStatus);
+        if (fbcStatus == NVFBC_SUCCESS)
+                nvimageutil_grab_stats(xcontext, frameInfo);
+
+        if (fbcStatus == NVFBC_ERR_MUST_RECREATE) {
+                g_warning ("Recreating FBCNVENC pipeline, must recreate status.");
+                xcontext->stats->recreations++;
+                if (!nvimageutil_fbccontext_clear(xcontext)) {
+                        return FALSE;
+                }
+                if (!nvimageutil_fbccontext_get(xcontext)) {
+                        return FALSE;
+                }
+                i++;
+                if(i <= 3) {
+                        goto restart;
+                } else {
+                        return FALSE;
+                }
+        } else if (fbcStatus != NVFBC_SUCCESS) {
+                g_warning("Cannot grab frame %d", fbcStatus);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Gives back the bitstream of the slot NVENC failed to fill and rebuilds
+   the session, which starts over with an IDR, unless the failures keep
+   coming. The grab is lost, the caller grabs again on
+   %NVIMAGE_FLOW_RETRY. */
+static GstFlowReturn
+nvimageutil_submit_failed (GstXContext * xcontext, GstNVimageSlot * slot, const gchar * what, NVENCSTATUS encStatus)
+{
+        slot->bitstream->state = NVIMAGE_BITSTREAM_FREE;
+        slot->bitstream = NULL;
+        if (++xcontext->encode_failures > NVIMAGE_MAX_ENCODE_FAILURES) {
+                g_warning("Cannot %s %d", what, encStatus);
+                return GST_FLOW_ERROR;
+        }
+        g_warning("Cannot %s %d, rebuilding the session", what, encStatus);
+        xcontext->stats->recreations++;
+        if (!nvimageutil_fbccontext_clear(xcontext) || !nvimageutil_fbccontext_get(xcontext))
+                return GST_FLOW_ERROR;
+
+        return NVIMAGE_FLOW_RETRY;
+}
+
+/* Grabs the next frame and submits it to NVENC into the slot at the head of
+   the ring. The picture is not read back here, see
+   nvimageutil_retrieve_frame(). With @skip_unchanged, a grab of an unchanged
+   screen is not encoded and %NVIMAGE_FLOW_UNCHANGED returned instead. */
+static GstFlowReturn
+nvimageutil_submit_frame (GstXContext * xcontext, gint forcekeyframe, gboolean skip_unchanged)
+{
+        GstNVimageSlot               *slot;
+        NVFBC_TOGL_GRAB_FRAME_PARAMS grabParams;
+        NVFBC_FRAME_GRAB_INFO        frameInfo;  // Добавляем для проверки Direct Capture
+        NVENCSTATUS                  encStatus;
+        gint64                       start;
+
+        if (!nvimageutil_grab_texture(xcontext, &grabParams, &frameInfo))
+                return GST_FLOW_ERROR;
+
+        /* The texture still holds the previous frame, the decoder already
+           has it: leave NVENC idle */
+        if (skip_unchanged && !frameInfo.bIsNewFrame)
+                return NVIMAGE_FLOW_UNCHANGED;
+
+        slot = &xcontext->slots[xcontext->slot_head];
+        slot->bitstream = nvimageutil_acquire_bitstream(xcontext);
+        if (slot->bitstream == NULL)
+                return GST_FLOW_ERROR;
+
+        xcontext->mapParams.registeredResource = xcontext->registeredResources[grabParams.dwTextureIndex];
+        start = gst_nvimage_stats_now(xcontext->stats);
+        encStatus = xcontext->pEncFn.nvEncMapInputResource(xcontext->encoder, &xcontext->mapParams);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_MAP, start);
+        if (encStatus != NV_ENC_SUCCESS)
+                return nvimageutil_submit_failed(xcontext, slot, "map input resource", encStatus);
+        slot->mapped = xcontext->mapParams.mappedResource;
+        slot->frame = xcontext->next_frame++;
+        slot->capture_time = nvimageutil_capture_time(xcontext, &frameInfo);
+        slot->repeated = !frameInfo.bIsNewFrame;
+
+        xcontext->encParams.inputBuffer = xcontext->mapParams.mappedResource;
+        xcontext->encParams.bufferFmt = xcontext->mapParams.mappedBufferFmt;
+        xcontext->encParams.outputBitstream = slot->bitstream->buffer;
+        xcontext->encParams.frameIdx = slot->frame;
+        xcontext->encParams.inputDuration = (1000000000L*xcontext->fps_d)/xcontext->fps_n; 
+        xcontext->encParams.inputTimeStamp = slot->frame*xcontext->encParams.inputDuration;
+
+        /* A keyframe request only costs an IDR on this picture */
+        xcontext->encParams.encodePicFlags = 0;
+        if (forcekeyframe & NVIMAGE_KEYFRAME_FORCE) {
+                g_debug("Forced keyframe");
+                xcontext->encParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR;
+        }
+        if (forcekeyframe & NVIMAGE_KEYFRAME_HEADERS)
+                xcontext->encParams.encodePicFlags |= NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_ENCODE_SUBMIT, encode_submit, slot->frame,
+                      (forcekeyframe & NVIMAGE_KEYFRAME_FORCE) != 0);
+        start = gst_nvimage_stats_now(xcontext->stats);
+        encStatus = xcontext->pEncFn.nvEncEncodePicture(xcontext->encoder, &xcontext->encParams);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_ENCODE, start);
+
+        if (encStatus != NV_ENC_SUCCESS) {
+                xcontext->pEncFn.nvEncUnmapInputResource(xcontext->encoder, slot->mapped);
+                slot->mapped = NULL;
+                return nvimageutil_submit_failed(xcontext, slot, "encode picture", encStatus);
+        }
+        xcontext->encode_failures = 0;
+
+        /* the elements of the capture group get the same grab, encoded
+           alongside this picture */
+        if (xcontext->renditions->len > 0)
+                nvimageutil_submit_renditions(xcontext, grabParams.dwTextureIndex, slot);
+
+        xcontext->slot_head = (xcontext->slot_head + 1) % xcontext->frames_in_flight;
+        xcontext->slot_pending++;
+        xcontext->last_encode = g_get_monotonic_time();
+
+        return GST_FLOW_OK;
+}
+
+static void
+nvimageutil_set_meta (GstXContext * xcontext, const GstNVimageSlot * slot, GstMetaNVimage * meta,
+                      gsize size, gboolean keyframe)
+{
+        meta->offset = 0;
+        meta->size = size;
+        meta->width = xcontext->encParams.inputWidth;
+        meta->height = xcontext->encParams.inputHeight;
+        meta->keyframe = keyframe;
+        meta->capture_time = slot->capture_time;
+        meta->repeated = slot->repeated;
+        meta->codec = xcontext->codec;
+}
+
+/* Copies @size bytes of a picture out into memory of the pool */
+static GstMemory *
+nvimageutil_copy_payload (GstXContext * xcontext, const guint8 * payload, gsize size)
+{
+        GstMemory                    *mem;
+        gint64                       start;
+
+        start = gst_nvimage_stats_now(xcontext->stats);
+        mem = gst_nvimage_pool_copy_payload(GST_NVIMAGE_POOL_CAST (xcontext->pool), payload, size);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_COPY, start);
+
+        return mem;
+}
+
+/* Queues a slice of the picture of @slot for the caller waiting in
+   gst_nvimageutil_nvimage_new_r() */
+static gboolean
+nvimageutil_hand_slice (GstXContext * xcontext, const GstNVimageSlot * slot, const guint8 * payload,
+                        gsize size, gboolean keyframe)
+{
+        GstBuffer                    *slice = NULL;
+        GstMemory                    *mem;
+
+        if (gst_buffer_pool_acquire_buffer (xcontext->pool, &slice, NULL) != GST_FLOW_OK) {
+                g_warning("Cannot acquire buffer from pool");
+                return FALSE;
         }
 
-        memset(&bitstreamBufferParams, 0, sizeof(bitstreamBufferParams));
-        bitstreamBufferParams.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+        mem = nvimageutil_copy_payload(xcontext, payload, size);
+        nvimageutil_set_meta(xcontext, slot, GST_META_NVIMAGE_GET (slice), size, keyframe);
+        gst_buffer_append_memory (slice, mem);
+        if (!keyframe)
+                GST_BUFFER_FLAG_SET (slice, GST_BUFFER_FLAG_DELTA_UNIT);
+
+        pthread_mutex_lock(&xcontext->mutex_out);
+        g_queue_push_tail(&xcontext->funcdata.slices, slice);
+        pthread_cond_broadcast(&xcontext->cond_out);
+        pthread_mutex_unlock(&xcontext->mutex_out);
+
+        return TRUE;
+}
+
+/* NV_ENC_LOCK_BITSTREAM.hwEncodeStatus once the whole picture is written */
+#define NVIMAGE_HW_ENCODE_COMPLETE 2
+/* µs between polls for the next slice */
+#define NVIMAGE_SLICE_POLL 100
+
+/* Reads the picture of @slot back slice by slice: every slice but the last
+   is handed out on its own, with sub-frame readback as soon as NVENC wrote
+   it, else once the whole picture is done. The parameter sets and SEI in
+   front go with the first slice, the last slice comes back as *@mem. */
+static gboolean
+nvimageutil_retrieve_slices (GstXContext * xcontext, GstNVimageSlot * slot, GstMemory ** mem,
+                             gsize * size, gboolean * keyframe)
+{
+        NV_ENC_LOCK_BITSTREAM        lockParams;
+        NVENCSTATUS                  encStatus;
+        const guint8                 *payload;
+        guint32                      start, end;
+        guint                        handed = 0, expected;
+        gboolean                     complete;
+        gint64                       begin;
+
+        /* no slice is shorter than a row of the largest blocks, smaller
+           pictures get fewer */
+        expected = MIN (xcontext->slices, (xcontext->encParams.inputHeight + 63) / 64);
+
+        /* the lock stage takes in the slices handed out meanwhile */
+        begin = gst_nvimage_stats_now(xcontext->stats);
+        for (;;) {
+                memset(&lockParams, 0, sizeof(lockParams));
+                lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
+                lockParams.outputBitstream = slot->bitstream->buffer;
+                lockParams.sliceOffsets = xcontext->slice_offsets;
+                lockParams.doNotWait = xcontext->subframe;
+
+                encStatus = xcontext->pEncFn.nvEncLockBitstream(xcontext->encoder, &lockParams);
+                if (encStatus == NV_ENC_ERR_LOCK_BUSY) {
+                        g_usleep(NVIMAGE_SLICE_POLL);
+                        continue;
+                }
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning("Cannot lock bitstream %d", encStatus);
+                        return FALSE;
+                }
+
+                complete = !xcontext->subframe || lockParams.hwEncodeStatus == NVIMAGE_HW_ENCODE_COMPLETE;
+                payload = lockParams.bitstreamBufferPtr;
+                *keyframe = lockParams.pictureType == NV_ENC_PIC_TYPE_IDR;
+
+                /* Until the picture is done, the last slice asked for waits
+                   as the one returned; fewer slices than asked for only show
+                   once the picture is done */
+                while (handed + 1 < lockParams.numSlices ||
+                       (!complete && handed < lockParams.numSlices && handed + 1 < expected)) {
+                        start = handed ? xcontext->slice_offsets[handed] : 0;
+                        end = handed + 1 < lockParams.numSlices ? xcontext->slice_offsets[handed + 1] :
+                              lockParams.bitstreamSizeInBytes;
+                        if (!nvimageutil_hand_slice(xcontext, slot, payload + start, end - start, *keyframe)) {
+                                xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, slot->bitstream->buffer);
+                                return FALSE;
+                        }
+                        handed++;
+                }
+
+                if (complete)
+                        break;
+
+                encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, slot->bitstream->buffer);
+                if (encStatus != NV_ENC_SUCCESS) {
+                        g_warning("Cannot unlock bitstream %d", encStatus);
+                        return FALSE;
+                }
+                g_usleep(NVIMAGE_SLICE_POLL);
+        }
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_LOCK, begin);
+
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_ENCODE_COMPLETE, encode_complete, slot->frame,
+                      lockParams.bitstreamSizeInBytes);
+        if (*keyframe)
+                xcontext->stats->idrs++;
+        if(xcontext->out)
+                fwrite(payload, 1, lockParams.bitstreamSizeInBytes, xcontext->out);
+
+        /* empty when NVENC still cut fewer slices than expected, all of
+           them went out already */
+        start = handed == 0 ? 0 : handed < lockParams.numSlices ? xcontext->slice_offsets[handed] :
+                lockParams.bitstreamSizeInBytes;
+        *size = lockParams.bitstreamSizeInBytes - start;
+        *mem = nvimageutil_copy_payload(xcontext, payload + start, *size);
+
+        encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, slot->bitstream->buffer);
+        if (encStatus != NV_ENC_SUCCESS) {
+                gst_memory_unref(*mem);
+                *mem = NULL;
+                g_warning("Cannot unlock bitstream %d", encStatus);
+                return FALSE;
+        }
+        slot->bitstream->state = NVIMAGE_BITSTREAM_FREE;
+
+        return TRUE;
+}
+
+/* Waits for the oldest picture in flight and releases its input texture.
+   The picture comes back as *@mem: either the locked bitstream itself, when
+   enough output buffers remain for the pictures to come, or a copy of it.
+   Sliced pictures read back for a caller come back as their last slice,
+   see nvimageutil_retrieve_slices(). With a NULL @mem the picture is just
+   dropped. */
+static gboolean
+nvimageutil_retrieve_frame (GstXContext * xcontext, GstMetaNVimage * meta, GstMemory ** mem)
+{
+        GstNVimageSlot               *slot;
+        GstNVimageBitstream          *bitstream;
+        NVENCSTATUS                  encStatus;
+        NV_ENC_LOCK_BITSTREAM        lockParams;
+        guint                        tail;
+        const guint8                 *payload;
+        gsize                        size;
+        gboolean                     keyframe;
+        gint64                       start;
+
+        g_return_val_if_fail (xcontext->slot_pending > 0, FALSE);
+
+        tail = (xcontext->slot_head + xcontext->frames_in_flight - xcontext->slot_pending) % xcontext->frames_in_flight;
+        slot = &xcontext->slots[tail];
+        bitstream = slot->bitstream;
+
+        /* only a caller waiting in gst_nvimageutil_nvimage_new_r() takes
+           slices, the producer queues whole pictures */
+        if (mem && xcontext->slices && !g_atomic_int_get(&xcontext->producing)) {
+                if (!nvimageutil_retrieve_slices(xcontext, slot, mem, &size, &keyframe))
+                        return FALSE;
+                goto done;
+        }
+
+        memset(&lockParams, 0, sizeof(lockParams));
+        lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
+        lockParams.outputBitstream = bitstream->buffer;
+
+        start = gst_nvimage_stats_now(xcontext->stats);
+        encStatus = xcontext->pEncFn.nvEncLockBitstream(xcontext->encoder, &lockParams);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_LOCK, start);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot lock bitstream %d", encStatus);
+                return FALSE;
+        }
+
+        size = lockParams.bitstreamSizeInBytes;
+        keyframe = lockParams.pictureType == NV_ENC_PIC_TYPE_IDR;
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_ENCODE_COMPLETE, encode_complete, slot->frame, size);
+        if (keyframe)
+                xcontext->stats->idrs++;
+        /* Pictures following repeated ones must be renumbered, which takes
+           a copy */
+        payload = gst_nvimage_h264_fixup_picture(&xcontext->h264, lockParams.bitstreamBufferPtr, &size);
+        if(xcontext->out)
+                fwrite(payload, 1, size, xcontext->out);
+
+        if (mem && bitstream->mem && payload == lockParams.bitstreamBufferPtr &&
+            nvimageutil_reclaim_bitstreams(xcontext) &&
+            xcontext->held < xcontext->zero_copy_buffers) {
+                /* Zero-copy: the bitstream stays locked until downstream
+                   drops the memory */
+                *mem = gst_nvimage_memory_set_data(bitstream->mem, lockParams.bitstreamBufferPtr,
+                                                    size, &bitstream->released);
+                bitstream->state = NVIMAGE_BITSTREAM_HELD;
+                xcontext->held++;
+        } else {
+                if (mem)
+                        *mem = nvimageutil_copy_payload(xcontext, payload, size);
+
+                encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, bitstream->buffer);
+
+                if (encStatus != NV_ENC_SUCCESS) {
+                        if (mem) {
+                                gst_memory_unref(*mem);
+                                *mem = NULL;
+                        }
+                        g_warning("Cannot unlock bitstream %d", encStatus);
+                        return FALSE;
+                }
+                bitstream->state = NVIMAGE_BITSTREAM_FREE;
+        }
+
+done:
+        if (meta)
+                nvimageutil_set_meta(xcontext, slot, meta, size, keyframe);
+
+        start = gst_nvimage_stats_now(xcontext->stats);
+        encStatus = xcontext->pEncFn.nvEncUnmapInputResource(xcontext->encoder, slot->mapped);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_UNMAP, start);
 
-        encStatus = xcontext->pEncFn.nvEncCreateBitstreamBuffer(xcontext->encoder, &bitstreamBufferParams);
         if (encStatus != NV_ENC_SUCCESS) {
-                g_error ("Cannot create NVENC bitstream buffer %d", encStatus);
+                if (mem) {
+                        gst_memory_unref(*mem);
+                        *mem = NULL;
+                }
+                g_warning("Cannot unmap input resource %d", encStatus);
                 return FALSE;
         }
 
-        xcontext->outputBuffer = bitstreamBufferParams.bitstreamBuffer;
-
-        xcontext->encParams.version = NV_ENC_PIC_PARAMS_VER;
-        xcontext->encParams.inputWidth = frameSize.w;
-        xcontext->encParams.inputHeight = frameSize.h;
-        xcontext->encParams.inputPitch = frameSize.w;
-        xcontext->encParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
-        xcontext->encParams.outputBitstream = bitstreamBufferParams.bitstreamBuffer;
+        if (xcontext->renditions->len > 0)
+                nvimageutil_retrieve_renditions(xcontext, slot);
 
-        //xcontext->out = fopen("/tmp/output.h264", "wb");
+        slot->mapped = NULL;
+        slot->bitstream = NULL;
+        xcontext->slot_pending--;
 
         return TRUE;
-
 }
 
+/* Applies a new bitrate and framerate to the running encoder. Returns FALSE
+   when NVENC refuses, the caller then rebuilds the session. */
 static gboolean
-nvimageutil_fbccontext_clear(GstXContext *xcontext) {
-        NVFBC_DESTROY_CAPTURE_SESSION_PARAMS destroyCaptureParams;
-        NVFBC_DESTROY_HANDLE_PARAMS          destroyHandleParams;
-        NVFBCSTATUS                          fbcStatus;
-        NVENCSTATUS                          encStatus;
+nvimageutil_encoder_reconfigure (GstXContext * xcontext)
+{
+        NV_ENC_RECONFIGURE_PARAMS    reconfigureParams;
+        NV_ENC_CONFIG                *config = &xcontext->presetConfig.presetCfg;
+        NVENCSTATUS                  encStatus;
 
-        if (xcontext->outputBuffer != NULL) {
-                encStatus = xcontext->pEncFn.nvEncDestroyBitstreamBuffer(xcontext->encoder, xcontext->outputBuffer);
-                if (encStatus != NV_ENC_SUCCESS) {
-                        g_error("Cannot destroy bitstream buffer %d", encStatus);
-                        return FALSE;
-                }
-        }
-        for (gint i = 0; i < NVFBC_TOGL_TEXTURES_MAX; i++) {
-                if (xcontext->registeredResources[i]) {
-                        encStatus = xcontext->pEncFn.nvEncUnregisterResource(xcontext->encoder, xcontext->registeredResources[i]);
-                        if (encStatus != NV_ENC_SUCCESS) {
-                                g_error("Cannot unregister resource %d", encStatus);
-                                return FALSE;
-                        }
-                        xcontext->registeredResources[i] = NULL;
-                }
-        }
-        encStatus = xcontext->pEncFn.nvEncDestroyEncoder(xcontext->encoder);
-        if (encStatus != NV_ENC_SUCCESS) {
-                g_error("Cannot destroy encoder %d", encStatus);
-                return FALSE;
-        }
+        /* raw frames: the framerate only paces the grabs */
+        if (xcontext->encoder == NULL)
+                return TRUE;
 
-        memset(&destroyCaptureParams, 0, sizeof(destroyCaptureParams));
-        destroyCaptureParams.dwVersion = NVFBC_DESTROY_CAPTURE_SESSION_PARAMS_VER;
-        fbcStatus = xcontext->pFn.nvFBCDestroyCaptureSession(xcontext->fbcHandle, &destroyCaptureParams);
-        if (fbcStatus != NVFBC_SUCCESS) {
-                g_error("Cannot destroy capture session %d", fbcStatus);
-                return FALSE;
-        }
+        config->rcParams.averageBitRate = xcontext->bitrate;
+        config->rcParams.maxBitRate = xcontext->bitrate;
+        nvimageutil_config_timing(xcontext, config);
 
-        memset(&destroyHandleParams, 0, sizeof(destroyHandleParams));
-        destroyHandleParams.dwVersion = NVFBC_DESTROY_HANDLE_PARAMS_VER;
-        fbcStatus = xcontext->pFn.nvFBCDestroyHandle(xcontext->fbcHandle, &destroyHandleParams);
-        /*if (fbcStatus != NVFBC_SUCCESS) {
-                g_error("Cannot destroy fbc handle %d", fbcStatus);
-                return FALSE;
-        }*/
+        xcontext->initParams.frameRateNum = xcontext->fps_n;
+        xcontext->initParams.frameRateDen = xcontext->fps_d;
 
-        if(xcontext->out)
-                fclose(xcontext->out);
+        memset(&reconfigureParams, 0, sizeof(reconfigureParams));
+        reconfigureParams.version = NV_ENC_RECONFIGURE_PARAMS_VER;
+        reconfigureParams.reInitEncodeParams = xcontext->initParams;
+
+        encStatus = xcontext->pEncFn.nvEncReconfigureEncoder(xcontext->encoder, &reconfigureParams);
+        if (encStatus != NV_ENC_SUCCESS) {
+                g_warning("Cannot reconfigure encoder %d, rebuilding the session", encStatus);
+                return FALSE;
+        }
 
-        memset(&xcontext->pFn, 0, sizeof(xcontext->pFn));
-        xcontext->fbcHandle = 0;
-        memset(&xcontext->pEncFn, 0, sizeof(xcontext->pEncFn));
-        xcontext->encoder = 0;
-        memset(&xcontext->mapParams, 0, sizeof(xcontext->mapParams));
-        memset(&xcontext->encParams, 0, sizeof(xcontext->encParams));
-        memset(&xcontext->setupParams, 0, sizeof(xcontext->setupParams));
         return TRUE;
 }
 
+/* Brings the session in line with @params. Bitrate and framerate are
+   applied to the running encoder; the cursor, the capture size, the GOP
+   structure, the slices and the number of buffers are baked into the
+   capture session and NVENC resources, changing them rebuilds everything. */
 static gboolean
-gst_nvimagesrc_buffer_dispose (GstBuffer * nvimage)
+nvimageutil_apply_params (GstXContext * xcontext, const GstNVimageParams * params)
 {
-        GstElement *parent;
-        GstMetaNVimage *meta;
-        gboolean ret = TRUE;
+        gboolean rebuild;
 
-        meta = GST_META_NVIMAGE_GET (nvimage);
+        if (!(xcontext->backend->codecs & (1 << params->codec))) {
+                g_warning("The %s backend can't produce %s", xcontext->backend->name,
+                          nvimageutil_codec_name(params->codec));
+                return FALSE;
+        }
 
-        parent = meta->parent;
-        if (parent == NULL) {
-                g_warning ("NVimageSrcBuffer->nvimagesrc == NULL");
-                return ret;
+        rebuild = xcontext->show_pointer != params->show_pointer ||
+                  xcontext->max_frames_in_flight != params->max_frames_in_flight ||
+                  xcontext->zero_copy_buffers != MIN (params->zero_copy_buffers, NVIMAGE_MAX_ZERO_COPY_BUFFERS) ||
+                  xcontext->repeat_unchanged != params->repeat_unchanged ||
+                  xcontext->scale != params->scale ||
+                  xcontext->slices != params->slices ||
+                  xcontext->codec != params->codec ||
+                  (params->codec == GST_NVIMAGE_CODEC_RAW && xcontext->format != params->format) ||
+                  (params->codec == GST_NVIMAGE_CODEC_GL && xcontext->gl_context != params->gl_context) ||
+                  nvimageutil_gop_size(xcontext->fps_n, xcontext->fps_d) != nvimageutil_gop_size(params->fps_n, params->fps_d);
+
+        if (!rebuild && xcontext->fps_n == params->fps_n && xcontext->fps_d == params->fps_d &&
+            xcontext->bitrate == params->bitrate)
+                return TRUE;
+
+        xcontext->fps_n = params->fps_n;
+        xcontext->fps_d = params->fps_d;
+        xcontext->bitrate = params->bitrate;
+
+        if (!rebuild) {
+                g_debug ("Reconfiguring %s: bitrate: %d, fps: %f", xcontext->backend->name,
+                           params->bitrate, ((double)params->fps_n)/params->fps_d);
+                if (xcontext->backend->reconfigure(xcontext))
+                        return TRUE;
         }
 
-        gst_object_unref (meta->parent);
-        meta->parent = NULL;
+        xcontext->show_pointer = params->show_pointer;
+        xcontext->max_frames_in_flight = params->max_frames_in_flight;
+        xcontext->zero_copy_buffers = MIN (params->zero_copy_buffers, NVIMAGE_MAX_ZERO_COPY_BUFFERS);
+        xcontext->repeat_unchanged = params->repeat_unchanged;
+        xcontext->scale = params->scale;
+        xcontext->slices = params->slices;
+        xcontext->codec = params->codec;
+        xcontext->format = params->format;
+        gst_object_replace((GstObject **) &xcontext->gl_context, (GstObject *) params->gl_context);
+        g_debug ("Recreating %s pipeline, parametres change: bitrate: %d, showpointer %d, fps: %f, in flight: %u, zero-copy: %u, scale: %u%%, slices: %u",
+                   xcontext->backend->name, params->bitrate, params->show_pointer, ((double)params->fps_n)/params->fps_d,
+                   params->max_frames_in_flight, params->zero_copy_buffers, params->scale, params->slices);
+        /* the first frame always sets the session up */
+        if (xcontext->stats->frames > 0)
+                xcontext->stats->recreations++;
+        if(!xcontext->backend->close(xcontext)) {
+                g_warning("Cannot clear context. Flow error.");
+                return FALSE;
+        }
+        if (!xcontext->backend->open(xcontext)) {
+                g_warning("Cannot create new context. Flow error.");
+                return FALSE;
+        }
 
-        g_free(meta->data);
-        meta->data = NULL;
-        meta->size = 0;
-        return ret;
+        return TRUE;
 }
 
-/* This function handles GstNVimageSrcBuffer creation depending on XShm availability */
-static GstBuffer *
-gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts) {
+/* Whether a grab of an unchanged screen may go unencoded: not when a
+   keyframe is due, nor once the heartbeat interval passed without output */
+gboolean
+nvimageutil_may_skip (GstXContext * xcontext, const GstNVimageParams * params, gint forcekeyframe)
+{
+        if (!params->skip_unchanged || forcekeyframe || xcontext->last_encode == 0)
+                return FALSE;
+
+        return params->heartbeat == 0 ||
+               g_get_monotonic_time() - xcontext->last_encode < (gint64) params->heartbeat * 1000;
+}
+
+/* Writes a picture repeating the previous one into a buffer of the pool,
+   the encoder is left alone */
+static GstFlowReturn
+nvimageutil_repeat_frame (GstXContext * xcontext, GstBuffer ** buf)
+{
         GstBuffer                    *nvimage = NULL;
         GstMetaNVimage               *meta;
-        NVFBC_TOGL_GRAB_FRAME_PARAMS grabParams;
-        NVFBC_FRAME_GRAB_INFO        frameInfo;  // Добавляем для проверки Direct Capture
-        NVFBCSTATUS                  fbcStatus;
-        NVENCSTATUS                  encStatus;
-        NV_ENC_LOCK_BITSTREAM        lockParams;
-        gint                         i=0;
+        GstMemory                    *mem;
+        const guint8                 *data;
+        gsize                        size;
 
-        if (xcontext->fps_n != fps_n ||
-            xcontext->fps_d != fps_d ||
-            xcontext->bitrate != bitrate ||
-	    forcekeyframe ||
-            xcontext->show_pointer != show_pointer) {
-                xcontext->fps_n = fps_n;
-                xcontext->fps_d = fps_d;
-                xcontext->bitrate = bitrate;
-                xcontext->show_pointer = show_pointer;
-                g_debug ("Recreating FBCNVENC pipeline, parametres change: bitrate: %d, showpointer %d, fps: %f", bitrate, show_pointer, ((double)fps_n)/fps_d);
-                if(!nvimageutil_fbccontext_clear(xcontext)) {
-                        g_error("Cannot clear context. Flow error.");
-                        return NULL;
-                }
-                if (!nvimageutil_fbccontext_get(xcontext)) {
-                        gst_buffer_unref (nvimage);
-                        g_error("Cannot create new context. Flow error.");
-                        return NULL;
-                }
+        data = gst_nvimage_h264_write_skip(&xcontext->h264, &size);
+        if (data == NULL)
+                return NVIMAGE_FLOW_UNCHANGED;
+
+        if (gst_buffer_pool_acquire_buffer (xcontext->pool, &nvimage, NULL) != GST_FLOW_OK) {
+                g_warning("Cannot acquire buffer from pool");
+                return GST_FLOW_ERROR;
         }
 
-        nvimage = gst_buffer_new ();
-        GST_MINI_OBJECT_CAST (nvimage)->dispose =
-                (GstMiniObjectDisposeFunction) gst_nvimagesrc_buffer_dispose;
+        mem = gst_nvimage_pool_copy_payload(GST_NVIMAGE_POOL_CAST (xcontext->pool), data, size);
+        if(xcontext->out)
+                fwrite(data, 1, size, xcontext->out);
 
-        meta = GST_META_NVIMAGE_ADD (nvimage);
+        meta = GST_META_NVIMAGE_GET (nvimage);
+        meta->offset = 0;
+        meta->size = size;
+        meta->width = xcontext->encParams.inputWidth;
+        meta->height = xcontext->encParams.inputHeight;
+        meta->keyframe = FALSE;
+        meta->capture_time = g_get_monotonic_time();
+        meta->repeated = TRUE;
+        meta->codec = xcontext->codec;
+
+        gst_buffer_append_memory (nvimage, mem);
+        GST_BUFFER_FLAG_SET (nvimage, GST_BUFFER_FLAG_DELTA_UNIT);
+
+        *buf = nvimage;
+        return GST_FLOW_OK;
+}
+
+/* Grabs the next frame of a raw capture session into a buffer of the pool.
+   With @skip_unchanged, a grab of an unchanged screen is not copied and
+   %NVIMAGE_FLOW_UNCHANGED returned instead. */
+static GstFlowReturn
+nvimageutil_raw_frame (GstXContext * xcontext, gboolean skip_unchanged, GstBuffer ** buf)
+{
+        NVFBC_TOSYS_GRAB_FRAME_PARAMS grabParams;
+        NVFBC_FRAME_GRAB_INFO         frameInfo;
+        NVFBCSTATUS                   fbcStatus;
+        GstVideoInfo                  *info = &xcontext->info;
+        GstBuffer                     *nvimage = NULL;
+        GstMetaNVimage                *meta;
+        GstMemory                     *mem;
+        gint64                        start;
+        gint                          i = 0;
 
 restart:
         memset(&grabParams, 0, sizeof(grabParams));
         memset(&frameInfo, 0, sizeof(frameInfo));
-        
-        grabParams.dwVersion = NVFBC_TOGL_GRAB_FRAME_PARAMS_VER;
-        grabParams.pFrameGrabInfo = &frameInfo;  // Add for getting Direct Capture info
-        
-        // BALANCE: Performance + stability + Push Model optimization
-        grabParams.dwFlags = NVFBC_TOGL_GRAB_FLAGS_NOWAIT | 
-                             NVFBC_TOGL_GRAB_FLAGS_FORCE_REFRESH |
-                             NVFBC_TOGL_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY;  // Perfect for Push Model
 
-        fbcStatus = xcontext->pFn.nvFBCToGLGrabFrame(xcontext->fbcHandle, &grabParams);
-        
-        // CHECK: Is Direct Capture active? (verbose mode only)
-        if (fbcStatus == NVFBC_SUCCESS) {
-                if (frameInfo.bDirectCapture) {
-                        g_debug("✅ Direct Capture ACTIVE - minimal latency!");
-                } else {
-                        g_debug("⚠️  Direct Capture NOT active - check fullscreen/compositor");
-                }
-                g_debug("Frame timing info: dwWidth=%u, dwHeight=%u", 
-                          frameInfo.dwWidth, frameInfo.dwHeight);
+        grabParams.dwVersion = NVFBC_TOSYS_GRAB_FRAME_PARAMS_VER;
+        grabParams.pFrameGrabInfo = &frameInfo;
+
+        /* paced like the grabs of nvimageutil_submit_frame() */
+        if (g_atomic_int_get(&xcontext->producing)) {
+                grabParams.dwFlags = NVFBC_TOSYS_GRAB_FLAGS_NOFLAGS;
+                grabParams.dwTimeoutMs = MAX((1000 * xcontext->fps_d) / xcontext->fps_n, 1);
+        } else {
+                grabParams.dwFlags = NVFBC_TOSYS_GRAB_FLAGS_NOWAIT;
         }
 
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_GRAB_START, grab_start, xcontext->next_frame, 0);
+        start = gst_nvimage_stats_now(xcontext->stats);
+        fbcStatus = xcontext->pFn.nvFBCToSysGrabFrame(xcontext->fbcHandle, &grabParams);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_GRAB, start);
+        NVIMAGE_TRACE(xcontext->parent, GST_NVIMAGE_TRACE_GRAB_END, grab_end, xcontext->next_frame, fbcStatus);
+        if (fbcStatus == NVFBC_SUCCESS)
+                nvimageutil_grab_stats(xcontext, &frameInfo);
         if (fbcStatus == NVFBC_ERR_MUST_RECREATE) {
-                g_warning ("Recreating FBCNVENC pipeline, must recreate status.");
-                if (!nvimageutil_fbccontext_clear(xcontext)) {
-                        gst_buffer_unref (nvimage);
-                        return NULL;
-                }
-                if (!nvimageutil_fbccontext_get(xcontext)) {
-                        gst_buffer_unref (nvimage);
-                        return NULL;
-                }
-                i++;
-                if(i <= 3) {
+                g_warning ("Recreating FBC session, must recreate status.");
+                xcontext->stats->recreations++;
+                if (!nvimageutil_fbccontext_clear(xcontext) || !nvimageutil_fbccontext_get(xcontext))
+                        return GST_FLOW_ERROR;
+                if (++i <= 3)
                         goto restart;
-                } else {
-                        gst_buffer_unref (nvimage);
-                        return NULL;
-                }
+                return GST_FLOW_ERROR;
         } else if (fbcStatus != NVFBC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_error("Cannot grab frame %d", fbcStatus);
-                return NULL;
+                g_warning("Cannot grab frame %d", fbcStatus);
+                return GST_FLOW_ERROR;
         }
 
-        xcontext->mapParams.registeredResource = xcontext->registeredResources[grabParams.dwTextureIndex];
-        encStatus = xcontext->pEncFn.nvEncMapInputResource(xcontext->encoder, &xcontext->mapParams);
-        if (encStatus != NV_ENC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_error("Cannot Map input resource %d", encStatus);
-                return NULL;
+        if (frameInfo.dwByteSize < GST_VIDEO_INFO_SIZE (info)) {
+                g_warning("NvFBC frame of %u bytes, expected %" G_GSIZE_FORMAT,
+                          frameInfo.dwByteSize, GST_VIDEO_INFO_SIZE (info));
+                return GST_FLOW_ERROR;
         }
 
-        xcontext->encParams.inputBuffer = xcontext->mapParams.mappedResource;
-        xcontext->encParams.bufferFmt = xcontext->mapParams.mappedBufferFmt;
-        xcontext->encParams.frameIdx = frame;
-        xcontext->encParams.inputDuration = (1000000000L*xcontext->fps_d)/xcontext->fps_n; 
-        xcontext->encParams.inputTimeStamp = frame*xcontext->encParams.inputDuration;
-        
-        // DIAGNOSTICS: Non-blocking logging for smoothness analysis
-        static gint64 last_timestamp = 0;
-        gint64 current_time = g_get_real_time();
-        gint64 target_interval_us = xcontext->encParams.inputDuration / 1000;  // ns -> μs
-        
-        if (last_timestamp > 0) {
-            gint64 real_interval = current_time - last_timestamp;
-            // DIAGNOSTICS: frame timing (verbose mode only)
-            g_debug("Frame %ld: expected_interval=%ldμs, real_interval=%ldμs", 
-                      frame, target_interval_us, real_interval);
-        }
-        last_timestamp = current_time;
-        if(forcekeyframe) {
-                g_debug("Forced keyframe");
-                xcontext->encParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR;
-        } else {
-                xcontext->encParams.encodePicFlags = 0;
+        if (skip_unchanged && !frameInfo.bIsNewFrame) {
+                g_atomic_int_inc(&xcontext->skipped);
+                return NVIMAGE_FLOW_UNCHANGED;
         }
 
-        encStatus = xcontext->pEncFn.nvEncEncodePicture(xcontext->encoder, &xcontext->encParams);
+        if (gst_buffer_pool_acquire_buffer (xcontext->pool, &nvimage, NULL) != GST_FLOW_OK) {
+                g_warning("Cannot acquire buffer from pool");
+                return GST_FLOW_ERROR;
+        }
 
-        if (encStatus != NV_ENC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_error("Cannot encode picture %d", encStatus);
-                return NULL;
+        /* NvFBC reuses its buffer for the next grab, downstream gets a copy */
+        start = gst_nvimage_stats_now(xcontext->stats);
+        mem = gst_nvimage_pool_copy_frame(GST_NVIMAGE_POOL_CAST (xcontext->pool),
+                                          xcontext->frame, GST_VIDEO_INFO_SIZE (info));
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_COPY, start);
+
+        meta = GST_META_NVIMAGE_GET (nvimage);
+        meta->offset = 0;
+        meta->size = GST_VIDEO_INFO_SIZE (info);
+        meta->width = GST_VIDEO_INFO_WIDTH (info);
+        meta->height = GST_VIDEO_INFO_HEIGHT (info);
+        meta->keyframe = TRUE;
+        meta->capture_time = nvimageutil_capture_time(xcontext, &frameInfo);
+        meta->repeated = !frameInfo.bIsNewFrame;
+        meta->codec = xcontext->codec;
+
+        gst_buffer_append_memory (nvimage, mem);
+        gst_buffer_add_video_meta_full (nvimage, GST_VIDEO_FRAME_FLAG_NONE, GST_VIDEO_INFO_FORMAT (info),
+                                        GST_VIDEO_INFO_WIDTH (info), GST_VIDEO_INFO_HEIGHT (info),
+                                        GST_VIDEO_INFO_N_PLANES (info), info->offset, info->stride);
+        xcontext->last_encode = g_get_monotonic_time();
+
+        *buf = nvimage;
+        return GST_FLOW_OK;
+}
+
+typedef struct {
+        GstGLMemory  *texture;
+        GstBuffer    *buffer;
+        GstVideoInfo *info;
+        gboolean     copied;
+} GstNVimageGLCopy;
+
+/* Copies a capture texture into the GL buffer handed out. The wrapped
+   textures belong to the GstGL context, so the copy runs in its thread,
+   and the sync point downstream waits on fences that same context after
+   the copy. */
+static void
+nvimageutil_gl_copy (GstGLContext * context, gpointer data)
+{
+        GstNVimageGLCopy *copy = data;
+        GstMemory        *mem = gst_buffer_peek_memory(copy->buffer, 0);
+        GstGLSyncMeta    *sync;
+        GstMapInfo       map;
+
+        if (!gst_memory_map(mem, &map, GST_MAP_WRITE | GST_MAP_GL))
+                return;
+        copy->copied = gst_gl_memory_copy_into(copy->texture, *(guint *) map.data, GST_GL_TEXTURE_TARGET_2D,
+                                               GST_GL_RGBA8, GST_VIDEO_INFO_WIDTH (copy->info),
+                                               GST_VIDEO_INFO_HEIGHT (copy->info));
+        gst_memory_unmap(mem, &map);
+
+        sync = gst_buffer_get_gl_sync_meta(copy->buffer);
+        if (copy->copied && sync)
+                gst_gl_sync_meta_set_sync_point(sync, context);
+}
+
+/* Grabs the next frame and copies it to a texture downstream can keep.
+   With @skip_unchanged, a grab of an unchanged screen is not copied and
+   %NVIMAGE_FLOW_UNCHANGED returned instead. */
+static GstFlowReturn
+nvimageutil_gl_frame (GstXContext * xcontext, gboolean skip_unchanged, GstBuffer ** buf)
+{
+        NVFBC_TOGL_GRAB_FRAME_PARAMS grabParams;
+        NVFBC_FRAME_GRAB_INFO        frameInfo;
+        GstVideoInfo                 *info = &xcontext->info;
+        GstBuffer                    *nvimage = NULL;
+        GstMetaNVimage               *meta;
+        GstNVimageGLCopy             copy;
+        gint64                       start;
+
+        if (!nvimageutil_grab_texture(xcontext, &grabParams, &frameInfo))
+                return GST_FLOW_ERROR;
+
+        if (skip_unchanged && !frameInfo.bIsNewFrame) {
+                g_atomic_int_inc(&xcontext->skipped);
+                return NVIMAGE_FLOW_UNCHANGED;
         }
 
-        memset(&lockParams, 0, sizeof(lockParams));
-        lockParams.version = NV_ENC_LOCK_BITSTREAM_VER;
-        lockParams.outputBitstream = xcontext->outputBuffer;
+        if (gst_buffer_pool_acquire_buffer (xcontext->gl_pool, &nvimage, NULL) != GST_FLOW_OK) {
+                g_warning("Cannot acquire buffer from GL pool");
+                return GST_FLOW_ERROR;
+        }
 
-        encStatus = xcontext->pEncFn.nvEncLockBitstream(xcontext->encoder, &lockParams);
-        if (encStatus != NV_ENC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_error("Cannot lock bitstream %d", encStatus);
-                return NULL;
+        /* NvFBC rendered into the texture from our context, the context of
+           GstGL must only read it once that is done */
+        start = gst_nvimage_stats_now(xcontext->stats);
+        glFinish();
+
+        copy.texture = (GstGLMemory *) xcontext->gl_textures[grabParams.dwTextureIndex];
+        copy.buffer = nvimage;
+        copy.info = info;
+        copy.copied = FALSE;
+        gst_gl_context_thread_add(xcontext->gl_context, nvimageutil_gl_copy, &copy);
+        gst_nvimage_stats_since(xcontext->stats, GST_NVIMAGE_STAGE_COPY, start);
+        if (!copy.copied) {
+                g_warning("Cannot copy capture texture");
+                gst_buffer_unref(nvimage);
+                return GST_FLOW_ERROR;
         }
 
-        meta->data = g_new(char, lockParams.bitstreamSizeInBytes);
-        meta->size = lockParams.bitstreamSizeInBytes;
-        meta->width = xcontext->encParams.inputWidth;
-        meta->height = xcontext->encParams.inputHeight;
-        memcpy(meta->data, lockParams.bitstreamBufferPtr, lockParams.bitstreamSizeInBytes);
-        if(xcontext->out)
-                fwrite(meta->data, 1, meta->size, xcontext->out);
+        /* the buffer is not from our pool, the meta goes with its release */
+        meta = GST_META_NVIMAGE_ADD (nvimage);
+        meta->width = GST_VIDEO_INFO_WIDTH (info);
+        meta->height = GST_VIDEO_INFO_HEIGHT (info);
+        meta->keyframe = TRUE;
+        meta->capture_time = nvimageutil_capture_time(xcontext, &frameInfo);
+        meta->repeated = !frameInfo.bIsNewFrame;
+        meta->codec = xcontext->codec;
+        xcontext->last_encode = g_get_monotonic_time();
+
+        *buf = nvimage;
+        return GST_FLOW_OK;
+}
 
-        encStatus = xcontext->pEncFn.nvEncUnlockBitstream(xcontext->encoder, xcontext->outputBuffer);
+/* Produces the next frame of the NvFBC backend: the grab goes through
+   NVENC, or is copied out as is for raw and GL frames */
+static GstFlowReturn
+nvimageutil_nvfbc_frame (GstXContext * xcontext, const GstNVimageParams * params, gint64 frame, GstBuffer ** buf)
+{
+        GstBuffer                    *nvimage = NULL;
+        GstMetaNVimage               *meta;
+        GstMemory                    *mem = NULL;
+        gint                         forcekeyframe = params->forcekeyframe;
+        gboolean                     skip;
+        GstFlowReturn                ret;
+
+        /* Raw and GL frames have no ring to keep filled, and repeating one
+           is just another copy of the unchanged screen */
+        if (xcontext->codec == GST_NVIMAGE_CODEC_RAW || xcontext->codec == GST_NVIMAGE_CODEC_GL) {
+                skip = !params->repeat_unchanged && nvimageutil_may_skip(xcontext, params, forcekeyframe);
+                xcontext->next_frame = frame;
+                if (xcontext->codec == GST_NVIMAGE_CODEC_GL)
+                        return nvimageutil_gl_frame(xcontext, skip, buf);
+                return nvimageutil_raw_frame(xcontext, skip, buf);
+        }
 
-        if (encStatus != NV_ENC_SUCCESS) {
-                gst_buffer_unref (nvimage);
-                g_free(meta->data);
-                g_error("Cannot unlock bitstream %d", encStatus);
-                return NULL;
+        if (xcontext->slot_pending == 0)
+                xcontext->next_frame = frame;
+
+        /* Top the ring up before reading back the oldest picture, so the grab
+           and encode of the following frames overlap its readback. Grabs of
+           an unchanged screen stop the top-up, the pictures in flight then
+           drain one per call so the last change never lingers in the ring. */
+        do {
+                ret = nvimageutil_submit_frame(xcontext, forcekeyframe,
+                                               nvimageutil_may_skip(xcontext, params, forcekeyframe));
+                /* The rebuilt session has an empty ring, grab again rather
+                   than pass the lost grab on as an unchanged screen */
+                if (ret == NVIMAGE_FLOW_RETRY) {
+                        xcontext->next_frame = frame;
+                        continue;
+                }
+                if (ret == NVIMAGE_FLOW_UNCHANGED)
+                        break;
+                if (ret != GST_FLOW_OK)
+                        return ret;
+                forcekeyframe = 0;
+        } while (xcontext->slot_pending < xcontext->frames_in_flight);
+
+        if (xcontext->slot_pending == 0) {
+                g_atomic_int_inc(&xcontext->skipped);
+                /* Only with the ring drained, the repeat must follow every
+                   picture encoded so far */
+                if (params->repeat_unchanged)
+                        return nvimageutil_repeat_frame(xcontext, buf);
+                return NVIMAGE_FLOW_UNCHANGED;
         }
 
-        encStatus = xcontext->pEncFn.nvEncUnmapInputResource(xcontext->encoder, xcontext->encParams.inputBuffer);
+        if (gst_buffer_pool_acquire_buffer (xcontext->pool, &nvimage, NULL) != GST_FLOW_OK) {
+                g_warning("Cannot acquire buffer from pool");
+                return GST_FLOW_ERROR;
+        }
 
-        if (encStatus != NV_ENC_SUCCESS) {
+        meta = GST_META_NVIMAGE_GET (nvimage);
+
+        if (!nvimageutil_retrieve_frame(xcontext, meta, &mem)) {
                 gst_buffer_unref (nvimage);
-                g_free(meta->data);
-                g_error("Cannot unmap input resource %d", encStatus);
-                return NULL;
+                return GST_FLOW_ERROR;
+        }
+
+        gst_buffer_append_memory (nvimage, mem);
+        if (!meta->keyframe)
+                GST_BUFFER_FLAG_SET (nvimage, GST_BUFFER_FLAG_DELTA_UNIT);
+
+        *buf = nvimage;
+        return GST_FLOW_OK;
+}
+
+/* This function handles GstNVimageSrcBuffer creation depending on XShm availability */
+static GstFlowReturn
+gst_nvimageutil_nvimage_new (GstXContext * xcontext, GstElement * parent, const GstNVimageParams * params, gint64 frame, gint64 ts, GstBuffer ** buf) {
+        if (xcontext->window != None && !nvimageutil_follow_window(xcontext))
+                return GST_FLOW_ERROR;
+
+        if (!nvimageutil_apply_params(xcontext, params))
+                return GST_FLOW_ERROR;
+
+        return xcontext->backend->frame(xcontext, params, frame, buf);
+}
+
+/* The GLX context comes first, without the driver libraries there is no
+   use for it */
+static gboolean
+nvimageutil_nvfbc_open (GstXContext * xcontext)
+{
+        if (!nvimageutil_nvfbc_load())
+                return FALSE;
+
+        if (xcontext->glxctx == None && !nvimageutil_glx_open(xcontext))
+                return FALSE;
+
+        return nvimageutil_fbccontext_get(xcontext);
+}
+
+const GstNVimageBackend gst_nvimage_backend_nvfbc = {
+        "NvFBC",
+        (1 << GST_NVIMAGE_CODEC_H264) | (1 << GST_NVIMAGE_CODEC_H265) | (1 << GST_NVIMAGE_CODEC_AV1) |
+        (1 << GST_NVIMAGE_CODEC_RAW) | (1 << GST_NVIMAGE_CODEC_GL),
+        TRUE,
+        nvimageutil_nvfbc_open,
+        nvimageutil_nvfbc_frame,
+        nvimageutil_encoder_reconfigure,
+        nvimageutil_fbccontext_clear,
+};
+
+/* Opens the backend asked for; the automatic choice falls back to the CPU
+   when the driver has no NvFBC or NVENC for us */
+static gboolean
+nvimageutil_backend_open (GstXContext * xcontext)
+{
+        if (xcontext->backend_type != GST_NVIMAGE_BACKEND_CPU) {
+                xcontext->backend = &gst_nvimage_backend_nvfbc;
+                if (xcontext->backend->open(xcontext))
+                        goto opened;
+                xcontext->backend->close(xcontext);
+                nvimageutil_glx_close(xcontext);
+                if (xcontext->backend_type == GST_NVIMAGE_BACKEND_NVFBC)
+                        return FALSE;
+                g_warning("NvFBC is not available, capturing and encoding on the CPU");
         }
 
-        gst_buffer_append_memory (nvimage, gst_memory_new_wrapped (GST_MEMORY_FLAG_NO_SHARE, meta->data,
-                                        meta->size, 0, meta->size, NULL, NULL));
+        xcontext->backend = &gst_nvimage_backend_cpu;
+        if (!xcontext->backend->open(xcontext))
+                return FALSE;
+
+opened:
+        g_debug("Capturing with the %s backend", xcontext->backend->name);
+        return TRUE;
+}
 
-        /* Keep a ref to our src */
-        meta->parent = gst_object_ref (parent);
+static gboolean
+nvimageutil_backend_close (GstXContext * xcontext)
+{
+        if (xcontext->backend == NULL)
+                return TRUE;
 
-        return nvimage;
+        return xcontext->backend->close(xcontext);
 }
 
 /* This function destroys a GstNVimageBuffer handling XShm availability */
@@ -824,15 +3001,154 @@ gst_nvimageutil_nvimage_destroy (GstXContext * xcontext, GstBuffer * nvimage)
 
         g_return_if_fail (nvimage != NULL);
 
-        g_free(meta->data);
-        meta->data = NULL;
+        meta->offset = 0;
         meta->size = 0;
 beach:
-        if (meta->parent) {
-                /* Release the ref to our parent */
-                gst_object_unref (meta->parent);
-                meta->parent = NULL;
+        return;
+}
+
+guint
+nvimageutil_get_allocations (GstXContext * xcontext)
+{
+        return gst_nvimage_pool_get_allocations(GST_NVIMAGE_POOL_CAST (xcontext->pool));
+}
+
+guint
+nvimageutil_get_skipped (GstXContext * xcontext)
+{
+        return g_atomic_int_get(&xcontext->skipped);
+}
+
+/* The #GstNVimageCodec values the backend of @xcontext produces, as
+   1 << codec flags */
+guint
+nvimageutil_get_codecs (GstXContext * xcontext)
+{
+        return xcontext->backend->codecs;
+}
+
+/* Whether the backend of @xcontext hands out the slices of a picture as
+   they are read back */
+gboolean
+nvimageutil_get_slices (GstXContext * xcontext)
+{
+        return xcontext->backend->slices;
+}
+
+/* The timers and counters of @xcontext */
+GstNVimageStats *
+nvimageutil_get_stats (GstXContext * xcontext)
+{
+        return xcontext->stats;
+}
+
+/* Capture groups by name, each led by the capture context of the element
+   that started first */
+static GMutex groups_lock;
+static GHashTable *groups;
+
+/* Makes @xcontext the leader of @group. FALSE when another one leads it,
+   or when its backend has no NVENC to encode the renditions with. */
+gboolean
+nvimageutil_group_lead (GstXContext * xcontext, const gchar * group)
+{
+        gboolean ret = FALSE;
+
+        if (xcontext->backend != &gst_nvimage_backend_nvfbc)
+                return FALSE;
+
+        g_mutex_lock(&groups_lock);
+        if (groups == NULL)
+                groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        if (!g_hash_table_contains(groups, group)) {
+                xcontext->group = g_strdup(group);
+                g_hash_table_insert(groups, g_strdup(group), xcontext);
+                ret = TRUE;
         }
+        g_mutex_unlock(&groups_lock);
 
-        return;
+        return ret;
+}
+
+static void
+nvimageutil_group_quit (GstXContext * xcontext)
+{
+        g_mutex_lock(&groups_lock);
+        if (xcontext->group && groups && g_hash_table_lookup(groups, xcontext->group) == xcontext)
+                g_hash_table_remove(groups, xcontext->group);
+        g_mutex_unlock(&groups_lock);
+}
+
+/* Joins the capture group @group, its pictures are then popped with
+   nvimageutil_rendition_pop(). NULL when nobody leads the group yet. The
+   grabs are encoded as they are, at the size of the leader returned in
+   @width and @height: only the bitrate of a rendition is its own. */
+GstNVimageRendition *
+nvimageutil_group_join (const gchar * group, guint bitrate, guint queue_size,
+                        gint * width, gint * height, GstNVimageCodec * codec)
+{
+        GstXContext         *xcontext;
+        GstNVimageRendition *rendition = NULL;
+
+        g_mutex_lock(&groups_lock);
+        xcontext = groups ? g_hash_table_lookup(groups, group) : NULL;
+        if (xcontext) {
+                rendition = g_new0 (GstNVimageRendition, 1);
+                rendition->refcount = 2;
+                rendition->bitrate = bitrate;
+                rendition->forcekeyframe = NVIMAGE_KEYFRAME_FORCE;
+                /* never hold up the capture for a slow element */
+                rendition->queue = gst_nvimage_queue_new(queue_size, GST_NVIMAGE_QUEUE_DROP_OLDEST);
+
+                pthread_mutex_lock(&xcontext->renditions_mutex);
+                g_ptr_array_add(xcontext->renditions, rendition);
+                pthread_mutex_unlock(&xcontext->renditions_mutex);
+
+                *width = xcontext->width;
+                *height = xcontext->height;
+                *codec = xcontext->codec;
+        }
+        g_mutex_unlock(&groups_lock);
+
+        return rendition;
+}
+
+/* Leaves the capture group, the capture thread closes the encoder on its
+   next grab */
+void
+nvimageutil_group_leave (GstNVimageRendition * rendition)
+{
+        g_atomic_int_set(&rendition->removed, 1);
+        gst_nvimage_queue_set_flushing(rendition->queue, TRUE);
+        nvimageutil_rendition_unref(rendition);
+}
+
+void
+nvimageutil_rendition_set_params (GstNVimageRendition * rendition, const GstNVimageParams * params)
+{
+        g_atomic_int_set(&rendition->bitrate, params->bitrate);
+        g_atomic_int_or(&rendition->forcekeyframe, params->forcekeyframe);
+}
+
+/* Takes the oldest picture of the rendition, blocking until there is one */
+GstFlowReturn
+nvimageutil_rendition_pop (GstNVimageRendition * rendition, GstBuffer ** buf)
+{
+        if (g_atomic_int_get(&rendition->error))
+                return GST_FLOW_ERROR;
+
+        *buf = gst_nvimage_queue_pop(rendition->queue);
+        if (*buf)
+                return GST_FLOW_OK;
+
+        return g_atomic_int_get(&rendition->error) ? GST_FLOW_ERROR : GST_FLOW_FLUSHING;
+}
+
+void
+nvimageutil_rendition_set_flushing (GstNVimageRendition * rendition, gboolean flushing)
+{
+        /* a rendition in error stays flushing */
+        if (!flushing && g_atomic_int_get(&rendition->error))
+                return;
+        gst_nvimage_queue_set_flushing(rendition->queue, flushing);
 }
@@ -23,6 +23,8 @@
 #include <stdio.h>
 
 #include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/gl/gl.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -34,6 +36,11 @@
 #include "NvFBC.h"
 #include "NvFBCUtils.h"
 #include "nvEncodeAPI.h"
+#include "nvimagequeue.h"
+#include "nvimagepool.h"
+#include "nvimageh264.h"
+#include "nvimagestats.h"
+#include "nvimagetrace.h"
 
 G_BEGIN_DECLS
 
@@ -41,68 +48,314 @@ typedef struct _GstXContext GstXContext;
 typedef struct _GstNVimage GstNVimage;
 typedef struct _GstMetaNVimage GstMetaNVimage;
 
+/**
+ * GstNVimageCodec:
+ * @GST_NVIMAGE_CODEC_H264: H.264 byte-stream
+ * @GST_NVIMAGE_CODEC_H265: H.265 byte-stream
+ * @GST_NVIMAGE_CODEC_AV1: AV1 low overhead OBUs
+ * @GST_NVIMAGE_CODEC_RAW: raw frames in system memory, NVENC is not used
+ * @GST_NVIMAGE_CODEC_GL: RGBA textures in GL memory, NVENC is not used
+ *
+ * What the grabs are encoded to.
+ */
+typedef enum {
+  GST_NVIMAGE_CODEC_H264,
+  GST_NVIMAGE_CODEC_H265,
+  GST_NVIMAGE_CODEC_AV1,
+  GST_NVIMAGE_CODEC_RAW,
+  GST_NVIMAGE_CODEC_GL,
+} GstNVimageCodec;
+
+/**
+ * GstNVimageParams:
+ * @fps_n: the capture framerate numerator
+ * @fps_d: the capture framerate denominator
+ * @bitrate: the target bitrate in bits per second
+ * @scale: percent of the captured size NvFBC scales the frames to, 100
+ * for none; the CPU backend always captures at full size
+ * @show_pointer: whether the cursor is composited into the capture
+ * @forcekeyframe: %NVIMAGE_KEYFRAME_FORCE when the next picture must be an
+ * IDR, with %NVIMAGE_KEYFRAME_HEADERS to repeat SPS/PPS in front of it
+ * @max_frames_in_flight: pictures kept in flight between grab and readback
+ * @zero_copy_buffers: encoded frames downstream may hold without a copy
+ * @skip_unchanged: don't encode grabs where the screen had not changed
+ * @heartbeat: with @skip_unchanged, still encode a frame when none went out
+ * for this many ms, 0 to never do so
+ * @repeat_unchanged: with @skip_unchanged, send synthesized pictures that
+ * repeat the previous one instead of nothing, H.264 only
+ * @codec: what to encode to
+ * @format: with %GST_NVIMAGE_CODEC_RAW, the pixel format NvFBC converts to
+ * @gl_context: with %GST_NVIMAGE_CODEC_GL, the context sharing the textures
+ * of the capture that frames are copied in
+ * @slices: cut H.264 and H.265 pictures into this many slices and hand
+ * each one out as soon as it is read back, 0 for whole pictures
+ *
+ * The settings the element hands to the capture and encode pipeline.
+ */
+/* GstNVimageParams.forcekeyframe flags */
+#define NVIMAGE_KEYFRAME_FORCE   (1 << 0)
+#define NVIMAGE_KEYFRAME_HEADERS (1 << 1)
+
+typedef struct {
+  guint fps_n;
+  guint fps_d;
+  gint bitrate;
+  guint scale;
+  gboolean show_pointer;
+  gint forcekeyframe;
+  guint max_frames_in_flight;
+  guint zero_copy_buffers;
+  gboolean skip_unchanged;
+  guint heartbeat;
+  gboolean repeat_unchanged;
+  GstNVimageCodec codec;
+  GstVideoFormat format;
+  GstGLContext *gl_context;
+  guint slices;
+} GstNVimageParams;
+
+/* Returned instead of a frame when the screen had not changed and nothing
+   was encoded */
+#define NVIMAGE_FLOW_UNCHANGED GST_FLOW_CUSTOM_SUCCESS
+
+/* Returned by the steps of a frame, never by a backend, when the session
+   was rebuilt under the grab and the frame must be grabbed again */
+#define NVIMAGE_FLOW_RETRY GST_FLOW_CUSTOM_SUCCESS_1
+
+/* Most slices a picture is cut into for sliced output */
+#define NVIMAGE_MAX_SLICES 32
+
+/* Takes a slice of the picture being read back, called from the thread
+   waiting for the picture while the capture thread reads the rest */
+typedef GstFlowReturn (*GstNVimageSliceFunc) (GstBuffer * slice, gpointer user_data);
+
+/**
+ * GstNVimageBackendType:
+ * @GST_NVIMAGE_BACKEND_AUTO: NvFBC and NVENC, or the CPU when the driver
+ * does not provide them
+ * @GST_NVIMAGE_BACKEND_NVFBC: NvFBC capture and NVENC encode
+ * @GST_NVIMAGE_BACKEND_CPU: XShm capture and x264 encode
+ *
+ * The backend a capture context is opened with.
+ */
+typedef enum {
+  GST_NVIMAGE_BACKEND_AUTO,
+  GST_NVIMAGE_BACKEND_NVFBC,
+  GST_NVIMAGE_BACKEND_CPU,
+} GstNVimageBackendType;
+
+/**
+ * GstNVimageBackend:
+ * @name: what the logs call it
+ * @codecs: the #GstNVimageCodec values it produces, as 1 << codec flags
+ * @slices: whether @frame hands the slices of a picture out one by one when
+ * #GstNVimageParams.slices asks for them
+ * @open: sets up capture of the region and encode with the settings of the
+ * context, FALSE when that is not possible here
+ * @frame: grabs the next frame and encodes it with @params, or returns
+ * %NVIMAGE_FLOW_UNCHANGED when the grab may be skipped
+ * @reconfigure: applies the bitrate and framerate of the context to the
+ * running session, FALSE when it must be rebuilt instead
+ * @close: tears down what @open set up, also after @open failed halfway
+ *
+ * Where the frames of a capture context come from and what encodes them.
+ * Only the capture thread calls into it.
+ */
+typedef struct {
+  const gchar *name;
+  guint codecs;
+  gboolean slices;
+  gboolean (*open) (GstXContext * xcontext);
+  GstFlowReturn (*frame) (GstXContext * xcontext, const GstNVimageParams * params, gint64 frame, GstBuffer ** buf);
+  gboolean (*reconfigure) (GstXContext * xcontext);
+  gboolean (*close) (GstXContext * xcontext);
+} GstNVimageBackend;
+
+extern const GstNVimageBackend gst_nvimage_backend_nvfbc;
+extern const GstNVimageBackend gst_nvimage_backend_cpu;
+
 typedef struct {
         int function;
         union {
           GstElement * parent;
           const gchar * display_name;
-          uint fps_n; 
-          guint fps_d; 
-          gint bitrate;
-          gboolean show_pointer;
-          gint forcekeyframe;
+          const GstNVimageParams * params;
           gint64 frame; 
           gint64 ts;
+          guint queue_size;
+          GstNVimageQueuePolicy queue_policy;
         } args[10];       
         union {
            gboolean b;
            GstBuffer *buf;
         } retval;
+        GstFlowReturn flow;
         gboolean retvalid;
         gboolean inputvalid;
+        /* slices of the picture read back so far, for the caller to take
+           while it waits for the rest */
+        GQueue slices;
+        /* for the stats: when the call was posted, picked up and answered */
+        gint64 posted;
+        gint64 picked;
+        gint64 answered;
 } GstXThreadCall;
 
+/* Number of frames that can be grabbed and encoded ahead of the one being
+   read back; bounded by the textures NvFBC rotates the capture through */
+#define NVIMAGE_MAX_FRAMES_IN_FLIGHT NVFBC_TOGL_TEXTURES_MAX
+
+/* Sessions rebuilt in a row for pictures NVENC failed to encode, before
+   the failure is passed on */
+#define NVIMAGE_MAX_ENCODE_FAILURES 3
+
+/* Bitstreams downstream may keep locked, on top of those in flight */
+#define NVIMAGE_MAX_ZERO_COPY_BUFFERS 12
+#define NVIMAGE_MAX_BITSTREAMS (NVIMAGE_MAX_FRAMES_IN_FLIGHT + NVIMAGE_MAX_ZERO_COPY_BUFFERS)
+
+typedef enum {
+  NVIMAGE_BITSTREAM_FREE,
+  NVIMAGE_BITSTREAM_ENCODING,
+  NVIMAGE_BITSTREAM_HELD,
+} GstNVimageBitstreamState;
+
+/**
+ * GstNVimageBitstream:
+ * @buffer: the NVENC output bitstream buffer
+ * @state: whether the buffer is idle, being encoded into, or locked and
+ * handed downstream
+ * @released: raised by downstream when a held buffer can be unlocked
+ * @mem: the recycled zero-copy memory wrapping the locked buffer
+ *
+ * One NVENC output buffer. Only the capture thread changes @state.
+ */
+typedef struct {
+  NV_ENC_OUTPUT_PTR buffer;
+  GstNVimageBitstreamState state;
+  volatile gint released;
+  GstMemory *mem;
+} GstNVimageBitstream;
+
+/**
+ * GstNVimageSlot:
+ * @bitstream: the bitstream the picture is encoded into
+ * @mapped: the input texture mapped for the picture encoded into @bitstream,
+ * or NULL when the slot is idle
+ * @frame: the frame index the picture was submitted with
+ * @capture_time: monotonic time in µs the display server rendered the frame
+ * @repeated: whether NvFBC had no new frame and returned the previous one
+ *
+ * One entry of the ring of pictures submitted to NVENC but not read back yet.
+ */
+typedef struct {
+  GstNVimageBitstream *bitstream;
+  NV_ENC_INPUT_PTR mapped;
+  gint64 frame;
+  gint64 capture_time;
+  gboolean repeated;
+} GstNVimageSlot;
+
+/**
+ * GstNVimageRendition:
+ * @refcount: one for the element reading the rendition, one for the capture
+ * context encoding it
+ * @bitrate: the bitrate the element asks for
+ * @forcekeyframe: %NVIMAGE_KEYFRAME_FORCE flags for the next picture
+ * @removed: the element left the group, the capture context drops it
+ * @error: the rendition can't be encoded, or the capture context went away
+ * @queue: the encoded pictures waiting for the element
+ * @encoder: the NVENC session, opened by the capture thread on the first
+ * grab it sees, NULL while closed
+ * @initParams: the settings of the capture context's encoder, with the
+ * rendition's bitrate
+ * @config: the encode config @initParams points to
+ * @registeredResources: the capture textures, registered with @encoder
+ * @bitstream: the output buffer, pictures are read back one at a time
+ * @slot: the picture encoded into @bitstream, read back along with the
+ * capture context's picture of the same grab; @slot.mapped is NULL when
+ * there is none
+ *
+ * Another encode of the grabs of a capture context, for another element of
+ * the same capture group. Only the capture thread touches @encoder and the
+ * fields after it.
+ */
+typedef struct {
+  volatile gint refcount;
+  volatile gint bitrate;
+  volatile gint forcekeyframe;
+  volatile gint removed;
+  volatile gint error;
+  GstNVimageQueue *queue;
+
+  void *encoder;
+  NV_ENC_INITIALIZE_PARAMS initParams;
+  NV_ENC_CONFIG config;
+  NV_ENC_REGISTERED_PTR registeredResources[NVFBC_TOGL_TEXTURES_MAX];
+  NV_ENC_OUTPUT_PTR bitstream;
+  GstNVimageSlot slot;
+} GstNVimageRendition;
+
 /* Global X Context stuff */
 /**
  * GstXContext:
- * @disp: the X11 Display of this context
- * @screen: the default Screen of Display @disp
- * @visual: the default Visual of Screen @screen
- * @root: the root Window of Display @disp
- * @white: the value of a white pixel on Screen @screen
- * @black: the value of a black pixel on Screen @screen
- * @depth: the color depth of Display @disp
- * @bpp: the number of bits per pixel on Display @disp
- * @endianness: the endianness of image bytes on Display @disp
- * @width: the width in pixels of Display @disp
- * @height: the height in pixels of Display @disp
- * @widthmm: the width in millimeters of Display @disp
- * @heightmm: the height in millimeters of Display @disp
- * @par_n: the pixel aspect ratio numerator calculated from @width, @widthmm
- * and @height,
- * @par_d: the pixel aspect ratio denumerator calculated from @width, @widthmm
- * and @height,
- * @heightmm ratio
- * @use_xshm: used to known wether of not XShm extension is usable or not even
- * if the Extension is present
- * @caps: the #GstCaps that Display @disp can accept
  *
- * Structure used to store various information collected/calculated for a
- * Display.
+ * A capture of one X display: the backend that grabs and encodes it, the
+ * ring of pictures in flight, the capture thread and its mailbox, the
+ * stats and the capture group it leads. The fields are described where
+ * they are declared.
  */
 struct _GstXContext {
+  /* the element capturing, unreffed, for the tracepoints and the name of
+     the capture thread; NULL outside of an element */
+  GstElement *parent;
+
   Display *disp;
 
   Screen *screen;
 
   gint width, height;
 
+  /* part of the screen to capture, a width or height of 0 extends it to
+     the screen edge; @capture_box is what is captured of it */
+  NVFBC_BOX region;
+  NVFBC_BOX capture_box;
+
+  /* window the region follows, None for a fixed region; @xid or else the
+     title @xname tell which one to capture */
+  Window xid;
+  gchar *xname;
+  Window window;
+
+  /* RandR output to capture instead of the whole screen, by name or index
+     among the outputs NvFBC reports; the region is relative to it */
+  gchar *monitor;
+
+  /* what captures and encodes, and its private state */
+  GstNVimageBackendType backend_type;
+  const GstNVimageBackend *backend;
+  gpointer backend_data;
+
   guint fps_n;                  
   guint fps_d;                 
   gint goplen;
   guint bitrate;
+  /* percent of the captured size that is encoded */
+  guint scale;
+  GstNVimageCodec codec;
   gboolean show_pointer;
 
+  /* raw frames: NvFBC converts each grab to @format into @frame, which it
+     owns; @info is the layout of a frame */
+  GstVideoFormat format;
+  GstVideoInfo info;
+  void *frame;
+
+  /* GL frames: the capture textures wrapped for GstGL, each grab is copied
+     to a texture of @gl_pool that downstream keeps as long as it likes */
+  GstGLContext *gl_context;
+  GstMemory *gl_textures[NVFBC_TOGL_TEXTURES_MAX];
+  GstBufferPool *gl_pool;
+
   GLXContext glxctx;
   Pixmap pixmap;
   GLXPixmap glxpixmap;
@@ -114,10 +367,59 @@ struct _GstXContext {
   void *encoder;
 
   NV_ENC_MAP_INPUT_RESOURCE mapParams;
-  NV_ENC_OUTPUT_PTR outputBuffer;
   NV_ENC_PIC_PARAMS encParams;
+  /* kept for nvEncReconfigureEncoder */
+  NV_ENC_INITIALIZE_PARAMS initParams;
+  NV_ENC_PRESET_CONFIG presetConfig;
   NVFBC_TOGL_SETUP_PARAMS setupParams;
   NV_ENC_REGISTERED_PTR registeredResources[NVFBC_TOGL_TEXTURES_MAX];
+  guint textures;
+
+  /* pipelined encode: ring of submitted pictures, oldest read back first */
+  guint max_frames_in_flight;
+  guint frames_in_flight;
+  GstNVimageSlot slots[NVIMAGE_MAX_FRAMES_IN_FLIGHT];
+  guint slot_head;
+  guint slot_pending;
+  gint64 next_frame;
+  /* encode failures in a row, each rebuilds the session */
+  guint encode_failures;
+
+  /* NvFBC timestamps to monotonic time, smallest observed capture delay */
+  gint64 ts_offset;
+  gboolean ts_offset_valid;
+
+  /* output buffers, the extra ones cover frames held downstream zero-copy */
+  guint zero_copy_buffers;
+  GstNVimageBitstream bitstreams[NVIMAGE_MAX_BITSTREAMS];
+  guint bitstream_count;
+  guint held;
+
+  /* damage tracking: when a picture was last encoded, in monotonic µs,
+     0 to encode the next grab whatever it holds; grabs left unencoded */
+  gint64 last_encode;
+  volatile gint skipped;
+  /* pictures cut into @slices slices, read back as NVENC writes them out
+     with @subframe; @slice_offsets receives where they start */
+  guint slices;
+  gboolean subframe;
+  guint32 *slice_offsets;
+
+  /* pictures repeating the previous one, written without the encoder */
+  gboolean repeat_unchanged;
+  GstNVimageH264 h264;
+
+  /* stage timers and counters, for the stats property of the element */
+  GstNVimageStats *stats;
+
+  /* recycled output buffers and copied payloads */
+  GstBufferPool *pool;
+
+  /* capture group this context leads: the elements that joined it get
+     their own encode of every grab */
+  gchar *group;
+  pthread_mutex_t renditions_mutex;
+  GPtrArray *renditions;
 
   pthread_t worker_tid;
   gboolean finish;
@@ -127,32 +429,55 @@ struct _GstXContext {
   pthread_cond_t cond_out;
   GstXThreadCall funcdata;
 
+  /* autonomous producer: the worker grabs and encodes on its own and hands
+     the frames over through @queue instead of the funcdata mailbox */
+  GstElement *producer_parent;
+  GstNVimageQueue *queue;
+  volatile gint producing;
+  volatile gint producer_error;
+  gint64 produced;
+  pthread_mutex_t params_mutex;
+  GstNVimageParams params;
+
   FILE *out;
 };
 
-GstXContext *nvimageutil_xcontext_get_r (GstElement *parent, const gchar *display_name);
+/* The smallest picture NVENC encodes to H.264 */
+#define NVIMAGE_MIN_WIDTH 145
+#define NVIMAGE_MIN_HEIGHT 49
+
+GstXContext *nvimageutil_xcontext_get_r (GstElement *parent, const gchar *display_name, const NVFBC_BOX *region,
+                                         Window xid, const gchar *xname, const gchar *monitor,
+                                         GstNVimageBackendType backend);
 void nvimageutil_xcontext_clear_r (GstXContext *xcontext);
 
 /* custom nvimagesrc buffer, copied from nvimagesink */
 
 /**
  * GstMetaNVimage:
- * @parent: a reference to the element we belong to
  * @nvimage: the NVimage of this buffer
+ * @offset: where the picture starts in the memory of the buffer; it is
+ * read by mapping the buffer, the meta keeps no pointer into it
  * @width: the width in pixels of NVimage @nvimage
  * @height: the height in pixels of NVimage @nvimage
  * @size: the size in bytes of NVimage @nvimage
+ * @keyframe: whether the picture is an IDR
+ * @capture_time: monotonic time in µs the frame was rendered
+ * @repeated: whether the screen had not changed since the previous frame
+ * @codec: what the picture is encoded with
  *
  * Extra data attached to buffers containing additional information about an NVimage.
  */
 struct _GstMetaNVimage {
   GstMeta meta;
 
-  /* Reference to the nvimagesrc we belong to */
-  GstElement *parent;
-  void *data;
+  gsize offset;
   gint width, height;
   size_t size;
+  gboolean keyframe;
+  gint64 capture_time;
+  gboolean repeated;
+  GstNVimageCodec codec;
 };
 
 GType gst_meta_nvimage_api_get_type (void);
@@ -160,10 +485,34 @@ const GstMetaInfo * gst_meta_nvimage_get_info (void);
 #define GST_META_NVIMAGE_GET(buf) ((GstMetaNVimage *)gst_buffer_get_meta(buf,gst_meta_nvimage_api_get_type()))
 #define GST_META_NVIMAGE_ADD(buf) ((GstMetaNVimage *)gst_buffer_add_meta(buf,gst_meta_nvimage_get_info(),NULL))
 
-GstBuffer * gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, guint fps_n, guint fps_d, gint bitrate, gboolean show_pointer, gint forcekeyframe, gint64 frame, gint64 ts);
+GstFlowReturn gst_nvimageutil_nvimage_new_r (GstXContext * xcontext, GstElement * parent, const GstNVimageParams * params, gint64 frame, gint64 ts,
+                                             GstNVimageSliceFunc slice_func, gpointer user_data, GstBuffer ** buf);
+
+void nvimageutil_producer_set_params (GstXContext * xcontext, const GstNVimageParams * params);
+gboolean nvimageutil_producer_start_r (GstXContext * xcontext, GstElement * parent, guint queue_size, GstNVimageQueuePolicy policy);
+GstFlowReturn nvimageutil_producer_pop (GstXContext * xcontext, GstBuffer ** buf);
+void nvimageutil_producer_set_flushing (GstXContext * xcontext, gboolean flushing);
 
 void gst_nvimageutil_nvimage_destroy (GstXContext * xcontext, GstBuffer * nvimage);
 
+gboolean nvimageutil_group_lead (GstXContext * xcontext, const gchar * group);
+GstNVimageRendition *nvimageutil_group_join (const gchar * group, guint bitrate, guint queue_size,
+                                             gint * width, gint * height, GstNVimageCodec * codec);
+void nvimageutil_group_leave (GstNVimageRendition * rendition);
+void nvimageutil_rendition_set_params (GstNVimageRendition * rendition, const GstNVimageParams * params);
+GstFlowReturn nvimageutil_rendition_pop (GstNVimageRendition * rendition, GstBuffer ** buf);
+void nvimageutil_rendition_set_flushing (GstNVimageRendition * rendition, gboolean flushing);
+
+guint nvimageutil_get_allocations (GstXContext * xcontext);
+guint nvimageutil_get_skipped (GstXContext * xcontext);
+guint nvimageutil_get_codecs (GstXContext * xcontext);
+gboolean nvimageutil_get_slices (GstXContext * xcontext);
+GstNVimageStats *nvimageutil_get_stats (GstXContext * xcontext);
+
+/* for the backends */
+guint nvimageutil_gop_size (guint fps_n, guint fps_d);
+gboolean nvimageutil_may_skip (GstXContext * xcontext, const GstNVimageParams * params, gint forcekeyframe);
+
 
 G_END_DECLS 
 
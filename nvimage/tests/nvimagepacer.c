@@ -0,0 +1,290 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Frame pacing on a GstTestClock, built and run by "build.sh check" */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gsttestclock.h>
+
+#include "nvimagepacer.h"
+
+#define BASE_TIME (10 * GST_SECOND)
+
+/* The start of frame slot @n at @fps_n/@fps_d */
+static GstClockTime
+slot_time (gint64 n, gint fps_n, gint fps_d)
+{
+        return BASE_TIME + gst_util_uint64_scale (n, GST_SECOND * fps_d, fps_n);
+}
+
+/* Waits for the next slot at 30 fps */
+static GstClockReturn
+pace (GstNVimagePacer * pacer, GstClock * clock, GstNVimagePacingPolicy policy, gint64 * frame_no)
+{
+        return gst_nvimage_pacer_wait (pacer, clock, BASE_TIME, 30, 1, policy, frame_no);
+}
+
+typedef struct {
+        GstNVimagePacer        *pacer;
+        GstClock               *clock;
+        gint                   fps_n;
+        gint                   fps_d;
+        GstNVimagePacingPolicy policy;
+        gint                   frames;
+        GstClockReturn         ret;
+        GAsyncQueue            *out;
+} Producer;
+
+/* Takes @frames slots one after the other, as a producer that is always
+   done in time would, and hands each frame number to the test. Stops at
+   the first wait that is not %GST_CLOCK_OK. */
+static gpointer
+producer_thread (gpointer data)
+{
+        Producer *p = data;
+        gint64   frame_no;
+
+        for (gint i = 0; i < p->frames; i++) {
+                p->ret = gst_nvimage_pacer_wait (p->pacer, p->clock, BASE_TIME, p->fps_n, p->fps_d,
+                                                 p->policy, &frame_no);
+                if (p->ret != GST_CLOCK_OK)
+                        break;
+                g_async_queue_push (p->out, GSIZE_TO_POINTER (frame_no + 1));
+        }
+
+        return NULL;
+}
+
+static GThread *
+producer_start (Producer * p, GstNVimagePacer * pacer, GstClock * clock, gint fps_n, gint fps_d, gint frames)
+{
+        p->pacer = pacer;
+        p->clock = clock;
+        p->fps_n = fps_n;
+        p->fps_d = fps_d;
+        p->policy = GST_NVIMAGE_PACING_DROP;
+        p->frames = frames;
+        p->ret = GST_CLOCK_OK;
+        p->out = g_async_queue_new ();
+
+        return g_thread_new ("producer", producer_thread, p);
+}
+
+static gint64
+producer_pop (Producer * p)
+{
+        return GPOINTER_TO_SIZE (g_async_queue_pop (p->out)) - 1;
+}
+
+/* Lets the wait of the producer end at the start of slot @n */
+static void
+crank_to (GstClock * clock, gint64 n, gint fps_n, gint fps_d)
+{
+        GstClockID id;
+
+        gst_test_clock_wait_for_next_pending_id (GST_TEST_CLOCK (clock), &id);
+        fail_unless_equals_uint64 (gst_clock_id_get_time (id), slot_time (n, fps_n, fps_d));
+        gst_clock_id_unref (id);
+        fail_unless (gst_test_clock_crank (GST_TEST_CLOCK (clock)));
+}
+
+/* Runs @frames frames of a producer that is never late at @fps_n/@fps_d:
+   every wait after the first must be for the exact start of the next
+   slot, however long the run */
+static void
+check_on_time (gint fps_n, gint fps_d, gint frames)
+{
+        GstNVimagePacer pacer;
+        GstClock        *clock;
+        GThread         *thread;
+        Producer        p;
+        guint           late, dropped, duplicated;
+
+        gst_nvimage_pacer_init (&pacer);
+        clock = gst_test_clock_new_with_start_time (BASE_TIME);
+        thread = producer_start (&p, &pacer, clock, fps_n, fps_d, frames);
+
+        /* the first frame goes at once */
+        fail_unless_equals_int64 (producer_pop (&p), 0);
+        for (gint64 n = 1; n < frames; n++) {
+                crank_to (clock, n, fps_n, fps_d);
+                fail_unless_equals_int64 (producer_pop (&p), n);
+        }
+        g_thread_join (thread);
+        fail_unless_equals_int (p.ret, GST_CLOCK_OK);
+
+        gst_nvimage_pacer_get_stats (&pacer, &late, &dropped, &duplicated);
+        fail_unless_equals_int (late, 0);
+        fail_unless_equals_int (dropped, 0);
+        fail_unless_equals_int (duplicated, 0);
+
+        g_async_queue_unref (p.out);
+        gst_object_unref (clock);
+        gst_nvimage_pacer_clear (&pacer);
+}
+
+GST_START_TEST (test_on_time)
+{
+        check_on_time (30, 1, 90);
+}
+GST_END_TEST;
+
+/* Ten minutes at 59.94 fps: the slots are laid out from the frame number,
+   a rounded frame duration summed up would be 12 µs off by the end */
+GST_START_TEST (test_ntsc_no_drift)
+{
+        check_on_time (60000, 1001, 35964);
+}
+GST_END_TEST;
+
+/* After frame 0, the producer stalls until 15 ms into slot 3. With
+   duplicates, the missed slots are filled back to back, then the schedule
+   holds. */
+GST_START_TEST (test_late)
+{
+        GstNVimagePacer pacer;
+        GstClock        *clock;
+        gint64          frame_no;
+        guint           late, dropped;
+
+        gst_nvimage_pacer_init (&pacer);
+        clock = gst_test_clock_new_with_start_time (BASE_TIME);
+
+        fail_unless_equals_int (pace (&pacer, clock, GST_NVIMAGE_PACING_DUPLICATE, &frame_no), GST_CLOCK_OK);
+        fail_unless_equals_int64 (frame_no, 0);
+        gst_test_clock_set_time (GST_TEST_CLOCK (clock), slot_time (3, 30, 1) + 15 * GST_MSECOND);
+        for (gint64 n = 1; n <= 3; n++) {
+                fail_unless_equals_int (pace (&pacer, clock, GST_NVIMAGE_PACING_DUPLICATE, &frame_no), GST_CLOCK_OK);
+                fail_unless_equals_int64 (frame_no, n);
+        }
+
+        gst_nvimage_pacer_get_stats (&pacer, &late, &dropped, NULL);
+        fail_unless_equals_int (late, 2);
+        fail_unless_equals_int (dropped, 0);
+
+        gst_object_unref (clock);
+        gst_nvimage_pacer_clear (&pacer);
+}
+GST_END_TEST;
+
+/* The same stall with drops: the missed slots are skipped, the next frame
+   takes the current one and the one after waits for its slot */
+GST_START_TEST (test_dropped)
+{
+        GstNVimagePacer pacer;
+        GstClock        *clock;
+        GThread         *thread;
+        Producer        p;
+        gint64          frame_no;
+        guint           late, dropped;
+
+        gst_nvimage_pacer_init (&pacer);
+        clock = gst_test_clock_new_with_start_time (BASE_TIME);
+
+        fail_unless_equals_int (pace (&pacer, clock, GST_NVIMAGE_PACING_DROP, &frame_no), GST_CLOCK_OK);
+        fail_unless_equals_int64 (frame_no, 0);
+        gst_test_clock_set_time (GST_TEST_CLOCK (clock), slot_time (3, 30, 1) + 15 * GST_MSECOND);
+        fail_unless_equals_int (pace (&pacer, clock, GST_NVIMAGE_PACING_DROP, &frame_no), GST_CLOCK_OK);
+        fail_unless_equals_int64 (frame_no, 3);
+
+        thread = producer_start (&p, &pacer, clock, 30, 1, 1);
+        crank_to (clock, 4, 30, 1);
+        fail_unless_equals_int64 (producer_pop (&p), 4);
+        g_thread_join (thread);
+
+        gst_nvimage_pacer_get_stats (&pacer, &late, &dropped, NULL);
+        fail_unless_equals_int (late, 0);
+        fail_unless_equals_int (dropped, 2);
+
+        g_async_queue_unref (p.out);
+        gst_object_unref (clock);
+        gst_nvimage_pacer_clear (&pacer);
+}
+GST_END_TEST;
+
+/* frames of an unchanged screen are counted as duplicates */
+GST_START_TEST (test_duplicated)
+{
+        GstNVimagePacer pacer;
+        guint           duplicated;
+
+        gst_nvimage_pacer_init (&pacer);
+        gst_nvimage_pacer_frame_done (&pacer, FALSE);
+        gst_nvimage_pacer_frame_done (&pacer, TRUE);
+        gst_nvimage_pacer_frame_done (&pacer, TRUE);
+        gst_nvimage_pacer_get_stats (&pacer, NULL, NULL, &duplicated);
+        fail_unless_equals_int (duplicated, 2);
+
+        /* a reset starts the counters over */
+        gst_nvimage_pacer_reset (&pacer);
+        gst_nvimage_pacer_get_stats (&pacer, NULL, NULL, &duplicated);
+        fail_unless_equals_int (duplicated, 0);
+
+        gst_nvimage_pacer_clear (&pacer);
+}
+GST_END_TEST;
+
+/* a flush wakes the pending wait up */
+GST_START_TEST (test_flushing)
+{
+        GstNVimagePacer pacer;
+        GstClock        *clock;
+        GstClockID      id;
+        GThread         *thread;
+        Producer        p;
+        gint64          frame_no;
+
+        gst_nvimage_pacer_init (&pacer);
+        clock = gst_test_clock_new_with_start_time (BASE_TIME);
+        fail_unless_equals_int (pace (&pacer, clock, GST_NVIMAGE_PACING_DROP, &frame_no), GST_CLOCK_OK);
+
+        thread = producer_start (&p, &pacer, clock, 30, 1, 1);
+        gst_test_clock_wait_for_next_pending_id (GST_TEST_CLOCK (clock), &id);
+        gst_clock_id_unref (id);
+        gst_nvimage_pacer_set_flushing (&pacer, TRUE);
+        g_thread_join (thread);
+        fail_unless_equals_int (p.ret, GST_CLOCK_UNSCHEDULED);
+
+        g_async_queue_unref (p.out);
+        gst_object_unref (clock);
+        gst_nvimage_pacer_clear (&pacer);
+}
+GST_END_TEST;
+
+static Suite *
+nvimagepacer_suite (void)
+{
+        Suite *s = suite_create ("nvimagepacer");
+        TCase *tc_chain = tcase_create ("general");
+
+        suite_add_tcase (s, tc_chain);
+        tcase_add_test (tc_chain, test_on_time);
+        tcase_add_test (tc_chain, test_ntsc_no_drift);
+        tcase_add_test (tc_chain, test_late);
+        tcase_add_test (tc_chain, test_dropped);
+        tcase_add_test (tc_chain, test_duplicated);
+        tcase_add_test (tc_chain, test_flushing);
+
+        return s;
+}
+
+GST_CHECK_MAIN (nvimagepacer);
@@ -0,0 +1,373 @@
+/* GStreamer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Element tests, built and run by "build.sh check" against the stub
+   libraries of "build.sh stub" and an X server with GLX, such as Xvfb.
+   Without a DISPLAY they are left out. Every test sets up the stub in
+   NVIMAGE_STUB before the stub is loaded, which takes the process
+   per test that check forks by default. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/check/gstcheck.h>
+
+#include "gstnvimagesrc.h"
+#include "nvimagememory.h"
+
+/* from GST_PLUGIN_DEFINE in gstnvimagesrc.c */
+const GstPluginDesc *gst_plugin_nvimagesrc_get_desc (void);
+
+typedef struct {
+        guint buffers;
+        guint caps;
+        guint gaps;
+} Received;
+
+static GstPadProbeReturn
+count_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+        Received *received = user_data;
+
+        if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER)
+                received->buffers++;
+        else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+                received->caps++;
+        else if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_GAP)
+                received->gaps++;
+
+        return GST_PAD_PROBE_OK;
+}
+
+/* Runs @description until EOS, with @stub in NVIMAGE_STUB. When @probe is
+   given, it sees the buffers and events reaching the element named "sink".
+   The pipeline is left at EOS so the counters of the capture can still be
+   read. */
+static GstElement *
+run_pipeline (const gchar * stub, const gchar * description, GstPadProbeCallback probe, gpointer user_data)
+{
+        GstElement *pipeline, *sink;
+        GstPad     *pad;
+        GstBus     *bus;
+        GstMessage *msg;
+
+        g_setenv ("NVIMAGE_STUB", stub, TRUE);
+        pipeline = gst_parse_launch (description, NULL);
+        fail_unless (pipeline != NULL);
+
+        if (probe) {
+                sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+                pad = gst_element_get_static_pad (sink, "sink");
+                gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                                   probe, user_data, NULL);
+                gst_object_unref (pad);
+                gst_object_unref (sink);
+        }
+
+        fail_unless (gst_element_set_state (pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+        bus = gst_element_get_bus (pipeline);
+        msg = gst_bus_timed_pop_filtered (bus, 60 * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+        fail_unless (msg != NULL, "no EOS within a minute");
+        fail_unless (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS, "pipeline failed");
+        gst_message_unref (msg);
+        gst_object_unref (bus);
+
+        return pipeline;
+}
+
+/* Runs @frames H.264 frames out of a nvimagesrc named "src" with @props
+   into a fakesink, counting what reaches it into @received */
+static GstElement *
+run_frames (const gchar * stub, const gchar * props, gint frames, Received * received)
+{
+        GstElement *pipeline;
+        gchar      *description;
+
+        description = g_strdup_printf ("nvimagesrc name=src backend=nvfbc num-buffers=%d %s ! "
+                                       "video/x-h264,framerate=120/1 ! fakesink name=sink sync=false",
+                                       frames, props);
+        memset (received, 0, sizeof (*received));
+        pipeline = run_pipeline (stub, description, count_probe, received);
+        g_free (description);
+
+        return pipeline;
+}
+
+static guint
+get_recreations (GstElement * pipeline, const gchar * name)
+{
+        GstElement   *src;
+        GstStructure *stats = NULL;
+        guint        recreations = 0;
+
+        src = gst_bin_get_by_name (GST_BIN (pipeline), name);
+        g_object_get (src, "stats", &stats, NULL);
+        fail_unless (stats != NULL);
+        fail_unless (gst_structure_get_uint (stats, "recreations", &recreations));
+        gst_structure_free (stats);
+        gst_object_unref (src);
+
+        return recreations;
+}
+
+static void
+stop_pipeline (GstElement * pipeline)
+{
+        gst_element_set_state (pipeline, GST_STATE_NULL);
+        gst_object_unref (pipeline);
+}
+
+/* With one picture in flight, each grab is a frame: a session does nine
+   grabs before the tenth fails, the rebuilt one starts counting over */
+GST_START_TEST (test_must_recreate)
+{
+        GstElement *pipeline;
+        Received   received;
+
+        pipeline = run_frames ("recreate-every=10", "", 60, &received);
+        fail_unless_equals_int (received.buffers, 60);
+        fail_unless_equals_int (get_recreations (pipeline, "src"), 6);
+        stop_pipeline (pipeline);
+}
+GST_END_TEST;
+
+/* a failed picture is lost, the rebuilt session grabs again without
+   leaving a gap */
+GST_START_TEST (test_encode_failure)
+{
+        GstElement *pipeline;
+        Received   received;
+
+        pipeline = run_frames ("encode-fail-every=10", "", 60, &received);
+        fail_unless_equals_int (received.buffers, 60);
+        fail_unless_equals_int (received.gaps, 0);
+        fail_unless_equals_int (get_recreations (pipeline, "src"), 6);
+        stop_pipeline (pipeline);
+}
+GST_END_TEST;
+
+/* the screen switches size, the stream goes on with new caps */
+GST_START_TEST (test_modeset)
+{
+        GstElement *pipeline;
+        Received   received;
+
+        pipeline = run_frames ("modeset-every=20", "", 60, &received);
+        fail_unless_equals_int (received.buffers, 60);
+        fail_unless_equals_int (get_recreations (pipeline, "src"), 3);
+        fail_unless (received.caps >= 2);
+        stop_pipeline (pipeline);
+}
+GST_END_TEST;
+
+/* Two captures in one process: however their grabs interleave, each one
+   fails on its own schedule */
+GST_START_TEST (test_two_captures)
+{
+        GstElement *pipeline;
+
+        pipeline = run_pipeline ("recreate-every=10",
+                                 "nvimagesrc name=first backend=nvfbc num-buffers=40 ! "
+                                 "video/x-h264,framerate=120/1 ! fakesink sync=false "
+                                 "nvimagesrc name=second backend=nvfbc num-buffers=40 ! "
+                                 "video/x-h264,framerate=120/1 ! fakesink sync=false", NULL, NULL);
+        fail_unless_equals_int (get_recreations (pipeline, "first"), 4);
+        fail_unless_equals_int (get_recreations (pipeline, "second"), 4);
+        stop_pipeline (pipeline);
+}
+GST_END_TEST;
+
+typedef struct {
+        GstElement *src;
+        guint      buffers;
+        guint      warmup;
+        guint      allocations;
+} Warm;
+
+/* Notes the allocations once @warmup buffers went through */
+static GstPadProbeReturn
+warm_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+        Warm *warm = user_data;
+
+        if (!(GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER))
+                return GST_PAD_PROBE_OK;
+
+        if (++warm->buffers == warm->warmup) {
+                warm->src = gst_bin_get_by_name (GST_BIN (GST_OBJECT_PARENT (GST_OBJECT_PARENT (pad))), "src");
+                g_object_get (warm->src, "allocations", &warm->allocations, NULL);
+        }
+
+        return GST_PAD_PROBE_OK;
+}
+
+/* Runs 150 frames with @props and checks that none allocated once the pool
+   and arenas were warm. IDRs, every 15th picture at 120 fps, are larger
+   than a block of the small arena. */
+static void
+check_steady_state (const gchar * props)
+{
+        GstElement *pipeline;
+        gchar      *description;
+        Warm       warm = { NULL, 0, 30, 0 };
+        guint      allocations = 0;
+
+        description = g_strdup_printf ("nvimagesrc name=src backend=nvfbc num-buffers=150 %s ! "
+                                       "video/x-h264,framerate=120/1 ! fakesink name=sink sync=false", props);
+        pipeline = run_pipeline ("idr-size=200000,frame-size=20000", description, warm_probe, &warm);
+        g_free (description);
+
+        fail_unless_equals_int (warm.buffers, 150);
+        fail_unless (warm.src != NULL);
+        g_object_get (warm.src, "allocations", &allocations, NULL);
+        fail_unless (warm.allocations > 0);
+        fail_unless_equals_int (allocations, warm.allocations);
+
+        gst_object_unref (warm.src);
+        stop_pipeline (pipeline);
+}
+
+GST_START_TEST (test_allocations_zero_copy)
+{
+        check_steady_state ("");
+}
+GST_END_TEST;
+
+GST_START_TEST (test_allocations_copied)
+{
+        check_steady_state ("zero-copy-buffers=0");
+}
+GST_END_TEST;
+
+typedef struct {
+        guint      buffers;
+        GstMemory  *mem;
+        GstMapInfo info;
+        guint8     *picture;
+        gboolean   intact;
+        GThread    *reader;
+} Held;
+
+/* Reads the mapping on while the capture rebuilds its session underneath */
+static gpointer
+held_reader (gpointer user_data)
+{
+        Held *held = user_data;
+
+        g_usleep (200 * 1000);
+        held->intact = memcmp (held->info.data, held->picture, held->info.size) == 0;
+        gst_memory_unmap (held->mem, &held->info);
+
+        return NULL;
+}
+
+/* Keeps the 5th picture mapped from another thread */
+static GstPadProbeReturn
+held_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+        Held      *held = user_data;
+        GstBuffer *buffer;
+
+        if (!(GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER) || ++held->buffers != 5)
+                return GST_PAD_PROBE_OK;
+
+        buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+        fail_unless (gst_nvimage_is_memory (gst_buffer_peek_memory (buffer, 0)));
+        held->mem = gst_memory_ref (gst_buffer_peek_memory (buffer, 0));
+        fail_unless (gst_memory_map (held->mem, &held->info, GST_MAP_READ));
+        held->picture = g_memdup2 (held->info.data, held->info.size);
+        held->reader = g_thread_new ("held", held_reader, held);
+
+        return GST_PAD_PROBE_OK;
+}
+
+/* A zero-copy picture mapped downstream while the session is rebuilt keeps
+   its bytes: the stub poisons a destroyed bitstream, so a mapping that
+   outlived it would no longer match */
+GST_START_TEST (test_mapped_across_rebuild)
+{
+        GstElement *pipeline;
+        Held       held = { 0, };
+
+        pipeline = run_pipeline ("recreate-every=10",
+                                 "nvimagesrc name=src backend=nvfbc num-buffers=40 ! "
+                                 "video/x-h264,framerate=120/1 ! fakesink name=sink sync=false",
+                                 held_probe, &held);
+        fail_unless (held.reader != NULL);
+        g_thread_join (held.reader);
+        fail_unless (held.intact);
+        fail_unless (get_recreations (pipeline, "src") >= 1);
+        stop_pipeline (pipeline);
+
+        g_free (held.picture);
+        gst_memory_unref (held.mem);
+}
+GST_END_TEST;
+
+/* The CPU backend grabs the X server through XShm and encodes with x264,
+   the stub is not involved */
+GST_START_TEST (test_cpu_backend)
+{
+        GstElement *pipeline;
+        Received   received = { 0, };
+
+        pipeline = run_pipeline ("", "nvimagesrc name=src backend=cpu num-buffers=30 ! "
+                                 "video/x-h264,framerate=30/1 ! fakesink name=sink sync=false",
+                                 count_probe, &received);
+        fail_unless_equals_int (received.buffers, 30);
+        fail_unless (received.caps >= 1);
+        fail_unless_equals_int (received.gaps, 0);
+        stop_pipeline (pipeline);
+}
+GST_END_TEST;
+
+static Suite *
+nvimagesrc_suite (void)
+{
+        const GstPluginDesc *desc;
+        Suite               *s = suite_create ("nvimagesrc");
+        TCase               *tc_stub = tcase_create ("stub");
+        TCase               *tc_cpu = tcase_create ("cpu");
+
+        /* the element linked in, not whatever the registry has */
+        desc = gst_plugin_nvimagesrc_get_desc ();
+        gst_plugin_register_static (desc->major_version, desc->minor_version, desc->name, desc->description,
+                                    desc->plugin_init, desc->version, desc->license, desc->source,
+                                    desc->package, desc->origin);
+
+        suite_add_tcase (s, tc_stub);
+        suite_add_tcase (s, tc_cpu);
+        tcase_set_timeout (tc_stub, 120);
+        tcase_set_timeout (tc_cpu, 120);
+        if (g_getenv ("DISPLAY") == NULL)
+                return s;
+
+        tcase_add_test (tc_stub, test_must_recreate);
+        tcase_add_test (tc_stub, test_encode_failure);
+        tcase_add_test (tc_stub, test_modeset);
+        tcase_add_test (tc_stub, test_two_captures);
+        tcase_add_test (tc_stub, test_allocations_zero_copy);
+        tcase_add_test (tc_stub, test_allocations_copied);
+        tcase_add_test (tc_stub, test_mapped_across_rebuild);
+        tcase_add_test (tc_cpu, test_cpu_backend);
+
+        return s;
+}
+
+GST_CHECK_MAIN (nvimagesrc);